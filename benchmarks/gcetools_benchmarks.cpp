@@ -0,0 +1,577 @@
+/* Copyright 2022 Google LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include <benchmark/benchmark.h>
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+#include "DeviceEvents.h"
+#include "DeviceNameCache.h"
+#include "DeviceResolver.h"
+#include "DeviceWatcher.h"
+#include "DiskLayout.h"
+#include "DiskSnapshot.h"
+#include "DiskSnapshotDiff.h"
+#include "gcetools_api.h"
+#include "GoogleStorageDevice.h"
+#include "NvmeHealthCollector.h"
+#include "OperationMetrics.h"
+#include "ResolutionWriter.h"
+#include "SimulatedDeviceBackend.h"
+#include "SimulatedLinuxDevices.h"
+#include "StorageTypes.h"
+#include "VolumeCatalog.h"
+
+// Benchmarks for the paths every run of gcetools goes through, against the
+// simulated devices, so they can be run and compared anywhere. Pass
+// --benchmark_out=results.json --benchmark_out_format=json to keep the
+// results.
+
+namespace {
+
+// Disk 0 of a simulated set is attached over NVMe and disk 1 over SCSI.
+constexpr size_t NvmeDisk = 0;
+constexpr size_t ScsiDisk = 1;
+
+std::unique_ptr<DeviceBackend> OpenSimulatedDisk(size_t index) {
+	static const SimulatedDeviceSet devices(2, std::chrono::microseconds(0));
+	return std::make_unique<SimulatedDeviceBackend>(devices.GetDisks()[index], devices.GetControllers()[index]);
+}
+
+// One driver query through IssueIoctlHelper, sized from what the device
+// answered before.
+void BM_IssueIoctl(benchmark::State& state) {
+	GoogleStorageDevice device(OpenSimulatedDisk(NvmeDisk));
+	for (auto _ : state) {
+		StorageQueryResult<STORAGE_DEVICE_ID_DESCRIPTOR> descriptor = device.GetStorageDeviceIdDescriptor();
+		benchmark::DoNotOptimize(descriptor.Get());
+	}
+}
+BENCHMARK(BM_IssueIoctl);
+
+// The same query the way it used to be issued: the STORAGE_DESCRIPTOR_HEADER
+// first, to learn the size, and then the whole response.
+void BM_IssueIoctlWithHeaderProbe(benchmark::State& state) {
+	std::unique_ptr<DeviceBackend> backend = OpenSimulatedDisk(NvmeDisk);
+	STORAGE_PROPERTY_QUERY query = {};
+	query.PropertyId = STORAGE_PROPERTY_ID::StorageDeviceIdProperty;
+	query.QueryType = STORAGE_QUERY_TYPE::PropertyStandardQuery;
+	std::vector<BYTE> response;
+	for (auto _ : state) {
+		STORAGE_DESCRIPTOR_HEADER header = {};
+		DWORD written = 0;
+		backend->QueryProperty(&query, sizeof(query), &header, sizeof(header), &written);
+		response.resize(header.Size);
+		backend->QueryProperty(&query, sizeof(query), response.data(), header.Size, &written);
+		benchmark::DoNotOptimize(response.data());
+	}
+}
+BENCHMARK(BM_IssueIoctlWithHeaderProbe);
+
+// BM_IssueIoctl with OperationMetrics recording the query for the process and
+// the device. The difference is the cost of the instrumentation, since the
+// simulated query itself takes no time.
+void BM_IssueIoctlWithMetrics(benchmark::State& state) {
+	OperationMetrics::SetEnabled(true);
+	GoogleStorageDevice device(OpenSimulatedDisk(NvmeDisk));
+	device.SetMetrics(OperationMetrics::ForDevice(L"\\\\.\\PHYSICALDRIVE0"));
+	for (auto _ : state) {
+		StorageQueryResult<STORAGE_DEVICE_ID_DESCRIPTOR> descriptor = device.GetStorageDeviceIdDescriptor();
+		benchmark::DoNotOptimize(descriptor.Get());
+	}
+	OperationMetrics::SetEnabled(false);
+}
+BENCHMARK(BM_IssueIoctlWithMetrics);
+
+// One operation timed and recorded, from as many threads as a resolver
+// uses, all updating the same histograms.
+void BM_RecordOperation(benchmark::State& state) {
+	static OperationStats device;
+	if (state.thread_index() == 0) {
+		OperationMetrics::SetEnabled(true);
+	}
+	for (auto _ : state) {
+		OperationMetrics::Scope metrics(DeviceOperation::OtherQuery, &device);
+	}
+	if (state.thread_index() == 0) {
+		OperationMetrics::SetEnabled(false);
+	}
+}
+BENCHMARK(BM_RecordOperation)->Threads(1)->Threads(16);
+
+void BM_NvmeIdentifyController(benchmark::State& state) {
+	GoogleStorageDevice device(OpenSimulatedDisk(NvmeDisk));
+	for (auto _ : state) {
+		StorageQueryResult<NVME_IDENTIFY_CONTROLLER_DATA> controllerData = device.GetNvmeControllerData();
+		benchmark::DoNotOptimize(controllerData.Get());
+	}
+}
+BENCHMARK(BM_NvmeIdentifyController);
+
+void BM_NvmeIdentifyNamespace(benchmark::State& state) {
+	GoogleStorageDevice device(OpenSimulatedDisk(NvmeDisk));
+	for (auto _ : state) {
+		StorageQueryResult<NVME_IDENTIFY_NAMESPACE_DATA> namespaceData = device.GetNvmeNamespaceData(1);
+		benchmark::DoNotOptimize(namespaceData.Get());
+	}
+}
+BENCHMARK(BM_NvmeIdentifyNamespace);
+
+// Reading the disk name out of Identify Namespace data already in memory.
+void BM_ParseNvmeMetadata(benchmark::State& state) {
+	GoogleStorageDevice device(OpenSimulatedDisk(NvmeDisk));
+	StorageQueryResult<NVME_IDENTIFY_NAMESPACE_DATA> namespaceData = device.GetNvmeNamespaceData(1);
+	std::string name;
+	for (auto _ : state) {
+		GoogleStorageDevice::VisitNvmeMetadata(*namespaceData, [&name](const NvmeVendorMetadata& metadata) {
+			name.assign(metadata.DeviceName);
+		});
+		benchmark::DoNotOptimize(name.data());
+	}
+}
+BENCHMARK(BM_ParseNvmeMetadata);
+
+// The extraction the parser replaced, for comparison: a search for the
+// packed "device_name" key in a copy of the metadata.
+void BM_FindNvmeDeviceName(benchmark::State& state) {
+	GoogleStorageDevice device(OpenSimulatedDisk(NvmeDisk));
+	StorageQueryResult<NVME_IDENTIFY_NAMESPACE_DATA> namespaceData = device.GetNvmeNamespaceData(1);
+	std::string name;
+	for (auto _ : state) {
+		const char* vendorSpecificBytes = (const char*)namespaceData->VS;
+		std::string_view vendorSpecificData(vendorSpecificBytes, strnlen(vendorSpecificBytes, sizeof(namespaceData->VS)));
+		constexpr std::string_view deviceNameKey("\"device_name\":\"");
+		size_t deviceNameStart = vendorSpecificData.find(deviceNameKey, 0);
+		size_t deviceNameEnd = vendorSpecificData.find("\"", deviceNameStart + deviceNameKey.size());
+		name.assign(vendorSpecificData.substr(deviceNameStart + deviceNameKey.size(), deviceNameEnd - (deviceNameStart + deviceNameKey.size())));
+		benchmark::DoNotOptimize(name.data());
+	}
+}
+BENCHMARK(BM_FindNvmeDeviceName);
+
+// GetDeviceName() on an open device: the queries and the extraction.
+void BM_GetNvmeDeviceName(benchmark::State& state) {
+	GoogleStorageDevice device(OpenSimulatedDisk(NvmeDisk));
+	std::string name;
+	for (auto _ : state) {
+		device.GetDeviceName(name);
+		benchmark::DoNotOptimize(name.data());
+	}
+}
+BENCHMARK(BM_GetNvmeDeviceName);
+
+void BM_GetScsiDeviceName(benchmark::State& state) {
+	GoogleStorageDevice device(OpenSimulatedDisk(ScsiDisk));
+	std::string name;
+	for (auto _ : state) {
+		device.GetDeviceName(name);
+		benchmark::DoNotOptimize(name.data());
+	}
+}
+BENCHMARK(BM_GetScsiDeviceName);
+
+void BM_ParseNvmeNamespaceId(benchmark::State& state) {
+	std::byte field[4];
+	memcpy(field, "12  ", sizeof(field));
+	for (auto _ : state) {
+		benchmark::DoNotOptimize(field);
+		benchmark::DoNotOptimize(GoogleStorageDevice::ParseNamespaceId(field, sizeof(field)));
+	}
+}
+BENCHMARK(BM_ParseNvmeNamespaceId);
+
+// The controller and namespace of an NVMe disk, read from its SCSI name
+// string.
+void BM_GetNvmeLocation(benchmark::State& state) {
+	GoogleStorageDevice device(OpenSimulatedDisk(NvmeDisk));
+	NvmeLocation location;
+	for (auto _ : state) {
+		device.GetNvmeLocation(location);
+		benchmark::DoNotOptimize(location.NamespaceId);
+	}
+}
+BENCHMARK(BM_GetNvmeLocation);
+
+// A whole run: every device opened and named by the resolver's worker pool.
+void BM_ResolveDevices(benchmark::State& state) {
+	SimulatedDeviceSet devices((size_t)state.range(0), std::chrono::microseconds(0));
+	std::vector<std::wstring> deviceIds = devices.GetDeviceIds();
+	DeviceResolver resolver(devices.GetBackendFactory());
+	for (auto _ : state) {
+		size_t resolved = 0;
+		resolver.Resolve(deviceIds, [&resolved](const DeviceResolution& resolution) {
+			resolved += resolution.Error.empty() ? 1 : 0;
+		});
+		if (resolved != deviceIds.size()) {
+			state.SkipWithError("Not every device was resolved.");
+			break;
+		}
+	}
+	state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK(BM_ResolveDevices)->Arg(1)->Arg(16)->Arg(128)->Arg(1024)->UseRealTime()->Unit(benchmark::kMicrosecond);
+
+// A run with --cache-file, each query taking 50 us as a driver round trip
+// does: with warm false, the cache file is missing and every disk is
+// resolved, and with it true, every disk was named by the run before.
+void ResolveWithNameCache(benchmark::State& state, bool warm) {
+	SimulatedDeviceSet devices((size_t)state.range(0), std::chrono::microseconds(50));
+	std::vector<std::wstring> deviceIds = devices.GetDeviceIds();
+	std::filesystem::path path = std::filesystem::temp_directory_path() /
+		("gcetools-bench-cache-" + std::to_string(std::chrono::steady_clock::now().time_since_epoch().count()));
+	DeviceResolver resolver(devices.GetBackendFactory());
+	if (warm) {
+		DeviceNameCache cache(path);
+		resolver.SetNameCache(&cache);
+		resolver.Resolve(deviceIds, [](const DeviceResolution&) {});
+		cache.Save();
+	}
+	for (auto _ : state) {
+		if (!warm) {
+			DeviceNameCache::Invalidate(path);
+		}
+		DeviceNameCache cache(path);
+		resolver.SetNameCache(&cache);
+		size_t resolved = 0;
+		resolver.Resolve(deviceIds, [&resolved](const DeviceResolution& resolution) {
+			resolved += resolution.Error.empty() ? 1 : 0;
+		});
+		cache.Save();
+		resolver.SetNameCache(nullptr);
+		if (resolved != deviceIds.size()) {
+			state.SkipWithError("Not every device was resolved.");
+			break;
+		}
+	}
+	DeviceNameCache::Invalidate(path);
+	state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+
+void BM_ResolveWithColdNameCache(benchmark::State& state) {
+	ResolveWithNameCache(state, /*warm=*/ false);
+}
+BENCHMARK(BM_ResolveWithColdNameCache)->Arg(16)->Arg(128)->UseRealTime()->Unit(benchmark::kMicrosecond);
+
+void BM_ResolveWithWarmNameCache(benchmark::State& state) {
+	ResolveWithNameCache(state, /*warm=*/ true);
+}
+BENCHMARK(BM_ResolveWithWarmNameCache)->Arg(16)->Arg(128)->UseRealTime()->Unit(benchmark::kMicrosecond);
+
+// A disk detached and attached again while n disks are watched, from the
+// events being seen to both changes being reported. Compare with
+// BM_ResolveDevices for the same n, which is what refreshing every disk costs.
+void BM_WatchReattach(benchmark::State& state) {
+	SimulatedDeviceSet devices((size_t)state.range(0), std::chrono::microseconds(0));
+	DeviceResolver resolver(devices.GetBackendFactory());
+	DeviceEventQueue events;
+	DeviceWatcher watcher(devices, resolver, events);
+
+	std::mutex mutex;
+	std::condition_variable changed;
+	size_t changeCount = 0;
+	std::thread watching([&]() {
+		watcher.Run([&](const DeviceChange&) {
+			std::lock_guard<std::mutex> lock(mutex);
+			changeCount++;
+			changed.notify_one();
+		});
+	});
+
+	std::wstring deviceId = devices.GetDeviceIds()[0];
+	size_t expected = devices.GetDisks().size();
+	for (auto _ : state) {
+		events.Push(DeviceEventKind::Removed, deviceId);
+		events.Push(DeviceEventKind::Arrived, deviceId);
+		expected += 2;
+		std::unique_lock<std::mutex> lock(mutex);
+		changed.wait(lock, [&]() { return changeCount == expected; });
+	}
+	events.Stop();
+	watching.join();
+}
+BENCHMARK(BM_WatchReattach)->Arg(16)->Arg(128)->Arg(1024)->UseRealTime()->Unit(benchmark::kMicrosecond);
+
+void BM_GetNvmeHealthInfo(benchmark::State& state) {
+	GoogleStorageDevice device(OpenSimulatedDisk(NvmeDisk));
+	NvmeHealthCounters counters;
+	for (auto _ : state) {
+		NvmeHealthCollector::ReadCounters(device, counters);
+		benchmark::DoNotOptimize(counters.HostReadCommands);
+	}
+}
+BENCHMARK(BM_GetNvmeHealthInfo);
+
+// One sample of the health collector: the log of every NVMe namespace read,
+// compared against the previous sample and formatted. At one sample a
+// second, the time per sample is the collector's share of a CPU.
+void BM_SampleNvmeHealth(benchmark::State& state) {
+	size_t namespaceCount = (size_t)state.range(0);
+	// Every other simulated disk is NVMe.
+	SimulatedDeviceSet devices(namespaceCount * 2, std::chrono::microseconds(0), namespaceCount);
+	NvmeHealthCollector collector(devices.GetBackendFactory(), devices.GetDeviceIds());
+	std::string records;
+	collector.Sample(records);
+	for (auto _ : state) {
+		records.clear();
+		collector.Sample(records);
+		benchmark::DoNotOptimize(records.data());
+	}
+	state.SetItemsProcessed(state.iterations() * collector.GetDiskCount());
+}
+BENCHMARK(BM_SampleNvmeHealth)->Arg(1)->Arg(24)->Unit(benchmark::kMicrosecond);
+
+// A fleet of synthetic machines with four disks each, snapshotted twice. On
+// every tenth machine a disk was renamed between the snapshots, and on the
+// next, two disks were reattached as other devices.
+struct SyntheticFleet {
+	static constexpr size_t DisksPerMachine = 4;
+
+	std::vector<std::vector<BYTE>> Before;
+	std::vector<std::vector<BYTE>> After;
+	size_t ExpectedDifferences = 0;
+
+	explicit SyntheticFleet(size_t machineCount) {
+		for (size_t i = 0; i < machineCount; i++) {
+			std::string host = "vm-" + std::to_string(i);
+			std::vector<DiskSnapshotEntry> entries;
+			for (size_t j = 0; j < DisksPerMachine; j++) {
+				DiskSnapshotEntry entry;
+				entry.DeviceId = "\\\\.\\PHYSICALDRIVE" + std::to_string(j);
+				entry.Name = host + "-disk-" + std::to_string(j);
+				entry.BusType = j == 0 ? STORAGE_BUS_TYPE::BusTypeNvme : STORAGE_BUS_TYPE::BusTypeScsi;
+				entry.SerialNumber = "sim-" + std::to_string(i) + "-" + std::to_string(j);
+				entry.NamespaceId = j == 0 ? 1 : 0;
+				entry.Vendor = "Google";
+				entry.Product = "PersistentDisk";
+				entry.Revision = "1";
+				entries.push_back(std::move(entry));
+			}
+			Before.push_back(DiskSnapshot::Serialize(host, 0, entries));
+			if (i % 10 == 0) {
+				entries[1].Name += "-renamed";
+				ExpectedDifferences++;
+			}
+			else if (i % 10 == 1) {
+				entries[2].DeviceId = "\\\\.\\PHYSICALDRIVE" + std::to_string(DisksPerMachine + 2);
+				entries[3].DeviceId = "\\\\.\\PHYSICALDRIVE" + std::to_string(DisksPerMachine + 3);
+				ExpectedDifferences += 2;
+			}
+			After.push_back(DiskSnapshot::Serialize(host, 0, entries));
+		}
+	}
+};
+
+// Every machine's two snapshots compared, on n threads, as
+// gcetools --diff-snapshots does for two directories of them, without the
+// file I/O. items_per_second is snapshot pairs per second.
+void BM_DiffSnapshots(benchmark::State& state) {
+	static const SyntheticFleet fleet(100000);
+	std::atomic<size_t> differenceCount{ 0 };
+	for (auto _ : state) {
+		differenceCount = 0;
+		DiskSnapshotDiff::DiffAll(fleet.Before.size(), (unsigned int)state.range(0),
+			[](size_t index, DiskSnapshot& before, DiskSnapshot& after) {
+				return before.Attach(fleet.Before[index].data(), fleet.Before[index].size()) &&
+					after.Attach(fleet.After[index].data(), fleet.After[index].size());
+			},
+			[&differenceCount](size_t, const DiskSnapshot&, const DiskSnapshot&, const std::vector<DiskDifference>& differences) {
+				differenceCount += differences.size();
+			});
+		if (differenceCount != fleet.ExpectedDifferences) {
+			state.SkipWithError("Unexpected differences.");
+			break;
+		}
+	}
+	state.SetItemsProcessed(state.iterations() * fleet.Before.size());
+}
+BENCHMARK(BM_DiffSnapshots)->Arg(1)->Arg(4)->UseRealTime()->Unit(benchmark::kMillisecond);
+
+#ifdef _WIN32
+constexpr const char* NullDevice = "NUL";
+#else
+constexpr const char* NullDevice = "/dev/null";
+#endif
+
+// 10,000 simulated devices, resolved once with their bus and identifiers.
+const std::vector<DeviceResolution>& GetSimulatedResolutions() {
+	static const std::vector<DeviceResolution> resolutions = [] {
+		SimulatedDeviceSet devices(10000, std::chrono::microseconds(0));
+		DeviceResolver resolver(devices.GetBackendFactory());
+		resolver.SetReadDetails(true);
+		std::vector<DeviceResolution> resolved;
+		resolver.Resolve(devices.GetDeviceIds(), [&resolved](const DeviceResolution& resolution) {
+			resolved.push_back(resolution);
+		});
+		return resolved;
+	}();
+	return resolutions;
+}
+
+// Printing every result of a 10,000 device run to the null device, in each
+// --format: names, jsonl and csv.
+void BM_WriteResolutions(benchmark::State& state) {
+	const std::vector<DeviceResolution>& resolutions = GetSimulatedResolutions();
+	std::ofstream out(NullDevice, std::ios::binary);
+	OutputFormat format = (OutputFormat)state.range(0);
+	for (auto _ : state) {
+		ResolutionWriter writer(out, format);
+		for (const DeviceResolution& resolution : resolutions) {
+			writer.Write(resolution);
+		}
+		writer.Finish();
+	}
+	state.SetItemsProcessed(state.iterations() * resolutions.size());
+}
+BENCHMARK(BM_WriteResolutions)->DenseRange(0, 2)->Unit(benchmark::kMillisecond);
+
+// The same names printed as gcetools did before ResolutionWriter, with a
+// flush per line.
+void BM_WriteNamesPerLine(benchmark::State& state) {
+	const std::vector<DeviceResolution>& resolutions = GetSimulatedResolutions();
+	std::ofstream out(NullDevice, std::ios::binary);
+	for (auto _ : state) {
+		for (const DeviceResolution& resolution : resolutions) {
+			out << resolution.Name << std::endl;
+		}
+	}
+	state.SetItemsProcessed(state.iterations() * resolutions.size());
+}
+BENCHMARK(BM_WriteNamesPerLine)->Unit(benchmark::kMillisecond);
+
+#ifdef __linux__
+// What gcetools --volumes does end to end, against the simulated sysfs tree:
+// the disks listed, mountinfo read, and every disk named and mapped to its
+// partitions, volumes and mount points.
+void BM_MapDiskVolumes(benchmark::State& state) {
+	SimulatedDeviceSet simulatedDevices((size_t)state.range(0), std::chrono::microseconds(0));
+	SimulatedLinuxDeviceSet devices(simulatedDevices, std::chrono::microseconds(0));
+	DeviceBackendFactory backendFactory = devices.GetBackendFactory(true);
+	std::string records;
+	for (auto _ : state) {
+		records.clear();
+		std::vector<std::wstring> deviceIds = devices.EnumerateDeviceIds();
+		SysfsVolumeCatalog catalog(devices.GetSysfsRoot(), devices.GetMountInfoPath());
+		for (const std::wstring& deviceId : deviceIds) {
+			GoogleStorageDevice device(backendFactory(deviceId));
+			DiskLayout::Read(device, deviceId, &catalog).AppendJson(records);
+			records.push_back('\n');
+		}
+		benchmark::DoNotOptimize(records.data());
+	}
+	state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK(BM_MapDiskVolumes)->Arg(32)->UseRealTime()->Unit(benchmark::kMicrosecond);
+
+// A whole run through the Linux backend against the simulated sysfs tree,
+// with range(0) disks and range(1) threads, each ioctl taking 50 us as a
+// device round trip does: with useSysfs true, only the namespace identify
+// goes to NVMe disks, and with it false, as with --no-sysfs, everything is
+// read through passthrough commands. Sysfs reads cost CPU where passthrough
+// commands wait, so the threads only help the latter on a small machine.
+void ResolveLinuxDevices(benchmark::State& state, bool useSysfs) {
+	SimulatedDeviceSet simulatedDevices((size_t)state.range(0), std::chrono::microseconds(50));
+	SimulatedLinuxDeviceSet devices(simulatedDevices, std::chrono::microseconds(50));
+	std::vector<std::wstring> deviceIds = devices.EnumerateDeviceIds();
+	DeviceResolver resolver(devices.GetBackendFactory(useSysfs), (unsigned int)state.range(1));
+	for (auto _ : state) {
+		size_t resolved = 0;
+		resolver.Resolve(deviceIds, [&resolved](const DeviceResolution& resolution) {
+			resolved += resolution.Error.empty() ? 1 : 0;
+		});
+		if (resolved != deviceIds.size()) {
+			state.SkipWithError("Not every device was resolved.");
+			break;
+		}
+	}
+	state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+
+void BM_ResolveLinuxDevicesFromSysfs(benchmark::State& state) {
+	ResolveLinuxDevices(state, true);
+}
+BENCHMARK(BM_ResolveLinuxDevicesFromSysfs)->Args({ 128, 1 })->Args({ 128, 16 })->UseRealTime()->Unit(benchmark::kMicrosecond);
+
+void BM_ResolveLinuxDevicesByPassthrough(benchmark::State& state) {
+	ResolveLinuxDevices(state, false);
+}
+BENCHMARK(BM_ResolveLinuxDevicesByPassthrough)->Args({ 128, 1 })->Args({ 128, 16 })->UseRealTime()->Unit(benchmark::kMicrosecond);
+#endif
+
+}
+
+// Every disk listed and named through one gcetools_api context, as an agent
+// that keeps the library loaded does. items_per_second is calls per second.
+void BM_LibraryResolveAll(benchmark::State& state) {
+	gcetools_options options;
+	gcetools_init_options(&options);
+	options.simulated_device_count = (uint32_t)state.range(0);
+	gcetools_context* context = nullptr;
+	if (gcetools_open(&options, &context) != GCETOOLS_OK) {
+		state.SkipWithError("gcetools_open failed.");
+		return;
+	}
+
+	std::vector<gcetools_disk> disks(state.range(0));
+	for (auto _ : state) {
+		size_t count = 0;
+		if (gcetools_resolve_all(context, disks.data(), disks.size(), &count) != GCETOOLS_OK || disks[0].status != GCETOOLS_OK) {
+			state.SkipWithError("gcetools_resolve_all failed.");
+			break;
+		}
+	}
+	state.SetItemsProcessed(state.iterations());
+	gcetools_close(context);
+}
+BENCHMARK(BM_LibraryResolveAll)->Arg(1)->Arg(16)->UseRealTime()->Unit(benchmark::kMicrosecond);
+
+#ifdef GCETOOLS_EXECUTABLE
+#ifdef _WIN32
+#define popen _popen
+#define pclose _pclose
+#endif
+
+// The same lookup by running gcetools and reading its output, as callers
+// that cannot load the library do.
+void BM_ProcessPerLookup(benchmark::State& state) {
+	std::string command = "\"" GCETOOLS_EXECUTABLE "\" --simulate " + std::to_string(state.range(0));
+	char buffer[4096];
+	for (auto _ : state) {
+		FILE* output = popen(command.c_str(), "r");
+		if (output == nullptr) {
+			state.SkipWithError("Failed to run gcetools.");
+			break;
+		}
+		while (fread(buffer, 1, sizeof(buffer), output) > 0) {
+		}
+		if (pclose(output) != 0) {
+			state.SkipWithError("gcetools failed.");
+			break;
+		}
+	}
+	state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_ProcessPerLookup)->Arg(1)->Arg(16)->UseRealTime()->Unit(benchmark::kMicrosecond);
+#endif
+
+BENCHMARK_MAIN();
@@ -0,0 +1,115 @@
+/* Copyright 2022 Google LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#pragma once
+
+#include <chrono>
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+#include "StorageTypes.h"
+
+// Where a disk sits and how the OS spreads its I/O across CPUs, as far as the
+// OS exports it.
+struct DeviceQueueTopology {
+	// The OS's name for the adapter the disk is attached through (nvme0,
+	// host0, Scsi2). Empty if unknown.
+	std::string Adapter;
+	// The NUMA node of the adapter, or -1 if unknown.
+	int NumaNode = -1;
+	// The CPUs that submit to each hardware queue, as a kernel CPU list
+	// ("0-3,8"). Empty if unknown.
+	std::vector<std::string> QueueCpus;
+};
+
+// A partition, as the disk's partition table describes it.
+struct DevicePartition {
+	DWORD Number = 0;
+	ULONGLONG Offset = 0;
+	ULONGLONG Length = 0;
+	// The partition's own block device (sda1), where the OS gives it one.
+	std::string Device;
+};
+
+// The disk's size and partitions, and what the OS calls the disk where its
+// volumes refer to it.
+struct DevicePartitionLayout {
+	ULONGLONG Length = 0;
+	// The disk's block device (sda) on Linux, and its number (as in
+	// \\.\PHYSICALDRIVEn) on Windows.
+	std::string Device;
+	DWORD DiskNumber = 0;
+	std::vector<DevicePartition> Partitions;
+};
+
+// The transport StorageDevice uses to talk to a single device. The real
+// backend forwards IOCTL_STORAGE_QUERY_PROPERTY to the driver; other backends
+// answer the same queries without a device so the rest of the tool can be
+// exercised anywhere.
+class DeviceBackend {
+public:
+	using Clock = std::chrono::steady_clock;
+
+	virtual ~DeviceBackend() {
+	}
+
+	// Queries still waiting on the device at the deadline are cancelled and
+	// fail with ERROR_TIMEOUT, so a hung device cannot hold up its caller
+	// for longer than it was given.
+	virtual void SetDeadline(Clock::time_point deadline) {
+		deadline_ = deadline;
+	}
+
+	// Issues an IOCTL_STORAGE_QUERY_PROPERTY request. The input buffer starts
+	// with a STORAGE_PROPERTY_QUERY. Returns ERROR_SUCCESS or the Win32 error
+	// code describing the failure.
+	virtual DWORD QueryProperty(const void* inputBuffer, DWORD inputBufferSize,
+		void* outputBuffer, DWORD outputBufferSize, DWORD* bytesReturned) = 0;
+
+	// Fills in what the OS exports about the disk's adapter and queues.
+	// Returns false if it exports nothing.
+	virtual bool GetQueueTopology(DeviceQueueTopology& /*topology*/) {
+		return false;
+	}
+
+	// Fills in the disk's size and partition table. Returns false if the
+	// OS does not say.
+	virtual bool GetPartitionLayout(DevicePartitionLayout& /*layout*/) {
+		return false;
+	}
+
+	// Fills in something that differs each time a disk is attached, even
+	// when the new disk reports the same identifiers as the one it replaced
+	// (GCE reuses NVMe namespace IDs). Returns false if the OS does not say.
+	virtual bool GetAttachId(std::string& /*attachId*/) {
+		return false;
+	}
+
+protected:
+	Clock::time_point deadline_ = Clock::time_point::max();
+
+	bool HasDeadline() const {
+		return deadline_ != Clock::time_point::max();
+	}
+
+	// The time left until the deadline, never negative.
+	std::chrono::milliseconds GetTimeRemaining() const {
+		Clock::time_point now = Clock::now();
+		return deadline_ > now ? std::chrono::ceil<std::chrono::milliseconds>(deadline_ - now) : std::chrono::milliseconds(0);
+	}
+};
+
+// Opens the backend for the device with the given DeviceId.
+using DeviceBackendFactory = std::function<std::unique_ptr<DeviceBackend>(const std::wstring& deviceId)>;
@@ -0,0 +1,65 @@
+/* Copyright 2022 Google LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#pragma once
+
+#include <exception>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <vector>
+
+// Lists the DeviceIds of the disks attached to the machine, in the order they
+// should be reported.
+class DeviceEnumerator {
+public:
+	virtual ~DeviceEnumerator() {
+	}
+
+	// Shown in timing output and error messages.
+	virtual const char* GetName() const = 0;
+
+	// Throws if the disks could not be listed.
+	virtual std::vector<std::wstring> EnumerateDeviceIds() = 0;
+};
+
+// Uses the fallback when the primary enumerator fails or finds no disks.
+class FallbackDeviceEnumerator : public DeviceEnumerator {
+public:
+	FallbackDeviceEnumerator(std::unique_ptr<DeviceEnumerator> primary, std::unique_ptr<DeviceEnumerator> fallback)
+		: primary_(std::move(primary)), fallback_(std::move(fallback))
+	{
+	}
+
+	const char* GetName() const override {
+		return primary_->GetName();
+	}
+
+	std::vector<std::wstring> EnumerateDeviceIds() override {
+		try {
+			std::vector<std::wstring> deviceIds = primary_->EnumerateDeviceIds();
+			if (!deviceIds.empty()) {
+				return deviceIds;
+			}
+		}
+		catch (const std::exception& e) {
+			std::cerr << primary_->GetName() << " enumeration failed: " << e.what() << std::endl;
+		}
+		return fallback_->EnumerateDeviceIds();
+	}
+
+private:
+	std::unique_ptr<DeviceEnumerator> primary_;
+	std::unique_ptr<DeviceEnumerator> fallback_;
+};
@@ -0,0 +1,93 @@
+/* Copyright 2022 Google LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#pragma once
+
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <utility>
+
+enum class DeviceEventKind {
+	Arrived,
+	Removed,
+	// The device is still there, but what is behind it may have changed.
+	Changed,
+};
+
+struct DeviceEvent {
+	using Clock = std::chrono::steady_clock;
+
+	DeviceEventKind Kind = DeviceEventKind::Changed;
+	std::wstring DeviceId;
+	// When the OS reported the event, for measuring how long it took to act
+	// on.
+	Clock::time_point Time;
+};
+
+// Reports disks arriving and going away. Events for devices that are not
+// disks may be reported too; resolving them fails like resolving any other
+// non-GCE device.
+class DeviceEventSource {
+public:
+	virtual ~DeviceEventSource() {
+	}
+
+	// Blocks until the next event. Returns false once Stop() has been
+	// called and nothing is left to report.
+	virtual bool Wait(DeviceEvent& event) = 0;
+
+	// Makes Wait() return false, once any events already reported have been
+	// waited for. May be called from any thread.
+	virtual void Stop() = 0;
+};
+
+// An event source fed by whoever sees the events, from any thread.
+class DeviceEventQueue : public DeviceEventSource {
+public:
+	void Push(DeviceEventKind kind, std::wstring deviceId) {
+		{
+			std::lock_guard<std::mutex> lock(mutex_);
+			events_.push_back(DeviceEvent{ kind, std::move(deviceId), DeviceEvent::Clock::now() });
+		}
+		changed_.notify_one();
+	}
+
+	bool Wait(DeviceEvent& event) override {
+		std::unique_lock<std::mutex> lock(mutex_);
+		changed_.wait(lock, [this]() { return stopped_ || !events_.empty(); });
+		if (events_.empty()) {
+			return false;
+		}
+		event = std::move(events_.front());
+		events_.pop_front();
+		return true;
+	}
+
+	void Stop() override {
+		{
+			std::lock_guard<std::mutex> lock(mutex_);
+			stopped_ = true;
+		}
+		changed_.notify_all();
+	}
+
+private:
+	std::mutex mutex_;
+	std::condition_variable changed_;
+	std::deque<DeviceEvent> events_;
+	bool stopped_ = false;
+};
@@ -0,0 +1,272 @@
+/* Copyright 2022 Google LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <system_error>
+#include <vector>
+#include "MappedFile.h"
+
+// Remembers device names across runs, keyed by the identifiers the device
+// reports in its STORAGE_DEVICE_ID_DESCRIPTOR (the NVMe serial number and
+// namespace, or the SCSI VPD identifiers) together with the OS's attach ID
+// for the disk (see DeviceBackend::GetAttachId). Those take one driver query
+// to read, where resolving a name can take several.
+//
+// The cache file is mapped into memory and looked up in place:
+//
+//   CacheFileHeader
+//   CacheFileEntry[EntryCount], sorted by IdentityHash
+//   identity and name bytes referenced by the entries
+//
+// All integers are little-endian.
+class DeviceNameCache {
+public:
+	// Caches stop growing here; entries not seen in the latest run are
+	// dropped first.
+	static constexpr size_t MaxEntries = 4096;
+
+	// With an empty path, names are only remembered in memory, for as long
+	// as the cache lives.
+	DeviceNameCache(std::filesystem::path path = std::filesystem::path()) : path_(std::move(path)) {
+		if (!path_.empty()) {
+			OpenFile();
+		}
+	}
+
+	// Deletes the cache file, so the next run resolves every device again.
+	static void Invalidate(const std::filesystem::path& path) {
+		std::error_code err;
+		std::filesystem::remove(path, err);
+	}
+
+	// Safe to call from several threads at once. The file is read under the
+	// lock, since Save() unmaps it.
+	bool Lookup(std::string_view identity, std::string& name) const {
+		std::lock_guard<std::mutex> lock(mutex_);
+		auto seen = seen_.find(identity);
+		if (seen != seen_.end()) {
+			name.assign(seen->second);
+			return true;
+		}
+
+		const CacheFileEntry* entries = GetEntries();
+		uint32_t entryCount = entries == nullptr ? 0 : GetHeader()->EntryCount;
+		uint64_t hash = Hash(identity);
+
+		const CacheFileEntry* entry = std::lower_bound(entries, entries + entryCount, hash,
+			[](const CacheFileEntry& entry, uint64_t hash) { return entry.IdentityHash < hash; });
+		for (; entry != entries + entryCount && entry->IdentityHash == hash; entry++) {
+			if (GetString(entry->IdentityOffset, entry->IdentityLength) == identity) {
+				name.assign(GetString(entry->NameOffset, entry->NameLength));
+				seen_.emplace(identity, name);
+				return true;
+			}
+		}
+
+		return false;
+	}
+
+	// Safe to call from several threads at once.
+	void Insert(std::string_view identity, std::string_view name) {
+		if (identity.size() > UINT16_MAX || name.size() > UINT16_MAX) {
+			return;
+		}
+
+		std::lock_guard<std::mutex> lock(mutex_);
+		seen_.insert_or_assign(std::string(identity), std::string(name));
+		changed_ = true;
+	}
+
+	// Writes the cache back to disk if anything was added. The new file is
+	// written alongside and renamed into place, so readers never see a
+	// partial cache.
+	void Save() {
+		std::lock_guard<std::mutex> lock(mutex_);
+		if (!changed_ || path_.empty()) {
+			return;
+		}
+
+		std::vector<std::pair<std::string_view, std::string_view>> records(seen_.begin(), seen_.end());
+		const CacheFileEntry* entries = GetEntries();
+		uint32_t entryCount = entries == nullptr ? 0 : GetHeader()->EntryCount;
+		for (uint32_t i = 0; i < entryCount && records.size() < MaxEntries; i++) {
+			std::string_view identity = GetString(entries[i].IdentityOffset, entries[i].IdentityLength);
+			if (seen_.find(identity) == seen_.end()) {
+				records.emplace_back(identity, GetString(entries[i].NameOffset, entries[i].NameLength));
+			}
+		}
+		records.resize(std::min(records.size(), MaxEntries));
+
+		std::vector<BYTE> contents = Serialize(records);
+
+		std::filesystem::path tempPath = path_;
+		tempPath += ".tmp";
+		{
+			std::ofstream out(tempPath, std::ios::binary | std::ios::trunc);
+			out.write((const char*)contents.data(), contents.size());
+			if (!out) {
+				std::cerr << "Failed to write device name cache " << tempPath.string() << std::endl;
+				return;
+			}
+		}
+
+		// Windows cannot replace a file that is mapped. Whether or not the
+		// rename succeeds, the file at path_ is mapped again, so lookups and
+		// the next Save() still see the entries not in seen_.
+		file_.Close();
+		std::error_code err;
+		std::filesystem::rename(tempPath, path_, err);
+		if (err) {
+			std::cerr << "Failed to replace device name cache " << path_.string() << ": " << err.message() << std::endl;
+			std::filesystem::remove(tempPath, err);
+		} else {
+			changed_ = false;
+		}
+		OpenFile();
+	}
+
+private:
+	static constexpr uint32_t Magic = 0x43444347;  // "GCDC"
+	// Version 1 keyed names by the identifiers alone.
+	static constexpr uint16_t Version = 2;
+
+	struct CacheFileHeader {
+		uint32_t Magic;
+		uint16_t Version;
+		uint16_t HeaderSize;
+		uint32_t EntryCount;
+		uint32_t FileSize;
+	};
+
+	struct CacheFileEntry {
+		uint64_t IdentityHash;
+		uint32_t IdentityOffset;
+		uint32_t NameOffset;
+		uint16_t IdentityLength;
+		uint16_t NameLength;
+		uint32_t Reserved;
+	};
+
+	static_assert(sizeof(CacheFileHeader) == 16, "CacheFileHeader is part of the file format");
+	static_assert(sizeof(CacheFileEntry) == 24, "CacheFileEntry is part of the file format");
+
+	std::filesystem::path path_;
+	MappedFile file_;
+
+	mutable std::mutex mutex_;
+	// Everything looked up or inserted this run, so Save() keeps the devices
+	// that are still attached, and later lookups need not touch the file.
+	mutable std::map<std::string, std::string, std::less<>> seen_;
+	bool changed_ = false;
+
+	void OpenFile() {
+		if (file_.Open(path_) && !IsValid()) {
+			std::cerr << "Ignoring invalid device name cache " << path_.string() << std::endl;
+			file_.Close();
+		}
+	}
+
+	const CacheFileHeader* GetHeader() const {
+		return (const CacheFileHeader*)file_.Data();
+	}
+
+	const CacheFileEntry* GetEntries() const {
+		return file_.Data() == nullptr ? nullptr : (const CacheFileEntry*)(file_.Data() + sizeof(CacheFileHeader));
+	}
+
+	std::string_view GetString(uint32_t offset, uint16_t length) const {
+		return std::string_view((const char*)file_.Data() + offset, length);
+	}
+
+	// Checks every offset once up front so lookups can trust them.
+	bool IsValid() const {
+		if (file_.Size() < sizeof(CacheFileHeader)) {
+			return false;
+		}
+
+		const CacheFileHeader* header = GetHeader();
+		if (header->Magic != Magic || header->Version != Version || header->HeaderSize != sizeof(CacheFileHeader) ||
+			header->FileSize != file_.Size() ||
+			header->EntryCount > (file_.Size() - sizeof(CacheFileHeader)) / sizeof(CacheFileEntry)) {
+			return false;
+		}
+
+		const CacheFileEntry* entries = GetEntries();
+		for (uint32_t i = 0; i < header->EntryCount; i++) {
+			if ((uint64_t)entries[i].IdentityOffset + entries[i].IdentityLength > file_.Size() ||
+				(uint64_t)entries[i].NameOffset + entries[i].NameLength > file_.Size() ||
+				(i > 0 && entries[i - 1].IdentityHash > entries[i].IdentityHash)) {
+				return false;
+			}
+		}
+
+		return true;
+	}
+
+	static std::vector<BYTE> Serialize(std::vector<std::pair<std::string_view, std::string_view>>& records) {
+		std::sort(records.begin(), records.end(), [](const auto& a, const auto& b) {
+			return Hash(a.first) < Hash(b.first);
+		});
+
+		size_t stringsOffset = sizeof(CacheFileHeader) + records.size() * sizeof(CacheFileEntry);
+		size_t fileSize = stringsOffset;
+		for (const auto& record : records) {
+			fileSize += record.first.size() + record.second.size();
+		}
+
+		std::vector<BYTE> contents(fileSize);
+		CacheFileHeader* header = (CacheFileHeader*)contents.data();
+		header->Magic = Magic;
+		header->Version = Version;
+		header->HeaderSize = sizeof(CacheFileHeader);
+		header->EntryCount = (uint32_t)records.size();
+		header->FileSize = (uint32_t)fileSize;
+
+		CacheFileEntry* entries = (CacheFileEntry*)(contents.data() + sizeof(CacheFileHeader));
+		size_t offset = stringsOffset;
+		for (size_t i = 0; i < records.size(); i++) {
+			entries[i].IdentityHash = Hash(records[i].first);
+			entries[i].IdentityOffset = (uint32_t)offset;
+			entries[i].IdentityLength = (uint16_t)records[i].first.size();
+			memcpy(contents.data() + offset, records[i].first.data(), records[i].first.size());
+			offset += records[i].first.size();
+			entries[i].NameOffset = (uint32_t)offset;
+			entries[i].NameLength = (uint16_t)records[i].second.size();
+			memcpy(contents.data() + offset, records[i].second.data(), records[i].second.size());
+			offset += records[i].second.size();
+		}
+
+		return contents;
+	}
+
+	// 64-bit FNV-1a.
+	static uint64_t Hash(std::string_view value) {
+		uint64_t hash = 0xcbf29ce484222325ull;
+		for (char c : value) {
+			hash = (hash ^ (uint8_t)c) * 0x100000001b3ull;
+		}
+		return hash;
+	}
+};
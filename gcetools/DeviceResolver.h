@@ -0,0 +1,390 @@
+/* Copyright 2022 Google LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include "DeviceBackend.h"
+#include "DeviceNameCache.h"
+#include "GoogleStorageDevice.h"
+#include "NvmeControllerCatalog.h"
+#include "OperationMetrics.h"
+#include "PhaseTimings.h"
+
+struct DeviceResolution {
+	std::wstring DeviceId;
+	std::string Name;
+	// Empty unless the device could not be opened or queried.
+	std::string Error;
+	// Set if the device did not answer before its deadline.
+	bool TimedOut = false;
+	// From opening the device to its result.
+	std::chrono::microseconds Elapsed{ 0 };
+
+	// Only read if the resolver was asked to (see
+	// DeviceResolver::SetReadDetails()), and as far as the device got.
+	STORAGE_BUS_TYPE BusType = STORAGE_BUS_TYPE::BusTypeUnknown;
+	// The Identifiers of the device's STORAGE_DEVICE_ID_DESCRIPTOR, and how
+	// many there are (see VisitStorageIdentifiers()).
+	std::string Identity;
+	DWORD IdentifierCount = 0;
+};
+
+// Resolves the names of many devices at once. Each device costs a handle open
+// and several blocking driver round trips, so a bounded pool of workers
+// resolves devices concurrently. Results are still reported in the order of
+// the given DeviceIds, each one as soon as every device before it is done.
+//
+// Each device has a deadline, counted from when a worker starts on it. Its
+// queries are cancelled at the deadline, and if the worker is stuck somewhere
+// that cannot be cancelled (opening a detaching disk), the device is reported
+// as timed out anyway and a new worker takes the stuck one's place. Stuck
+// workers are left to finish on their own, with their own copy of everything
+// they need, and their results are discarded, so one hung disk costs at most
+// the timeout.
+class DeviceResolver {
+public:
+	using Clock = std::chrono::steady_clock;
+
+	static constexpr unsigned int DefaultThreadCount = 16;
+	static constexpr std::chrono::milliseconds DefaultDeviceTimeout{ 10000 };
+
+	using ResultCallback = std::function<void(const DeviceResolution&)>;
+	// Returns false once no more results are needed.
+	using SearchCallback = std::function<bool(const DeviceResolution&)>;
+
+	DeviceResolver(DeviceBackendFactory backendFactory, unsigned int threadCount = DefaultThreadCount)
+		: threadCount_(std::max(threadCount, 1u))
+	{
+		config_.BackendFactory = std::move(backendFactory);
+	}
+
+	void Resolve(const std::vector<std::wstring>& deviceIds, const ResultCallback& onResult) {
+		ResolveUntil(deviceIds, [&onResult](const DeviceResolution& resolution) {
+			onResult(resolution);
+			return true;
+		});
+	}
+
+	// Like Resolve(), but stops resolving devices as soon as onResult returns
+	// false. Devices that were already being resolved are finished, but not
+	// reported.
+	void ResolveUntil(const std::vector<std::wstring>& deviceIds, const SearchCallback& onResult) {
+		// Shared with the workers, which can outlive this call if they are
+		// stuck on a device.
+		std::shared_ptr<ResolveState> state = std::make_shared<ResolveState>(GetConfig(), deviceIds, onResult);
+
+		std::unique_lock<std::mutex> lock(state->Mutex);
+		size_t workerCount = std::min<size_t>(threadCount_, deviceIds.size());
+		for (size_t i = 0; i < workerCount; i++) {
+			StartWorker(state);
+		}
+
+		while (!state->Stopped && state->NextToReport < deviceIds.size()) {
+			Clock::time_point nextDeadline = GetNextDeadline(*state);
+			if (nextDeadline == Clock::time_point::max()) {
+				state->Changed.wait(lock);
+			}
+			else if (state->Changed.wait_until(lock, nextDeadline) == std::cv_status::timeout) {
+				TimeOutOverdueDevices(state);
+			}
+		}
+
+		// Workers still on a device that timed out are not waited for.
+		state->Stopped = true;
+		std::vector<std::thread> workers = std::move(state->Workers);
+		std::vector<bool> abandoned = state->Abandoned;
+		lock.unlock();
+		for (size_t i = 0; i < workers.size(); i++) {
+			if (abandoned[i]) {
+				workers[i].detach();
+			}
+			else {
+				workers[i].join();
+			}
+		}
+	}
+
+	// Look names up in the given cache before resolving them, and add the
+	// names that had to be resolved to it.
+	void SetNameCache(DeviceNameCache* nameCache) {
+		config_.NameCache = nameCache;
+	}
+
+	// Read each NVMe controller's namespaces once per run, through the first
+	// of its disks to be resolved, instead of identifying every namespace
+	// through its own disk (see NvmeControllerCatalog).
+	void SetNvmeBatching(bool batchNvme) {
+		config_.BatchNvme = batchNvme;
+	}
+
+	// Also report each device's bus type and device ID descriptor, which
+	// costs a driver query per device unless a name cache already reads it.
+	void SetReadDetails(bool readDetails) {
+		config_.ReadDetails = readDetails;
+	}
+
+	// How long each device is given to be opened and queried. 0 waits for
+	// as long as the device takes.
+	void SetDeviceTimeout(std::chrono::milliseconds deviceTimeout) {
+		config_.DeviceTimeout = deviceTimeout;
+	}
+
+	DeviceResolution ResolveOne(const std::wstring& deviceId) {
+		return ResolveOne(config_, deviceId, config_.GetDeadline(), nullptr, 0);
+	}
+
+private:
+	struct ResolveConfig {
+		DeviceBackendFactory BackendFactory;
+		DeviceNameCache* NameCache = nullptr;
+		bool BatchNvme = false;
+		bool ReadDetails = false;
+		std::chrono::milliseconds DeviceTimeout = DefaultDeviceTimeout;
+
+		Clock::time_point GetDeadline() const {
+			return DeviceTimeout.count() > 0 ? Clock::now() + DeviceTimeout : Clock::time_point::max();
+		}
+
+		std::string FormatTimeout() const {
+			return "Timed out after " + std::to_string(DeviceTimeout.count()) + " ms.";
+		}
+	};
+
+	struct ResolveState {
+		ResolveState(ResolveConfig config, const std::vector<std::wstring>& deviceIds, const SearchCallback& onResult)
+			: Config(std::move(config)), DeviceIds(deviceIds), OnResult(onResult), Results(deviceIds.size()),
+			Done(deviceIds.size(), false), Deadlines(deviceIds.size(), Clock::time_point::max()), Owners(deviceIds.size(), 0)
+		{
+		}
+
+		// Copies, since stuck workers may still read them after
+		// ResolveUntil() returns.
+		const ResolveConfig Config;
+		const std::vector<std::wstring> DeviceIds;
+		// Only called while Stopped is false.
+		const SearchCallback& OnResult;
+		NvmeControllerCatalog NvmeControllers;
+
+		// Guarded by Mutex.
+		std::mutex Mutex;
+		std::condition_variable Changed;
+		bool Stopped = false;
+		size_t NextToResolve = 0;
+		std::vector<DeviceResolution> Results;
+		std::vector<bool> Done;
+		size_t NextToReport = 0;
+		// The deadline of each device being resolved, and the worker
+		// resolving it.
+		std::vector<Clock::time_point> Deadlines;
+		std::vector<size_t> Owners;
+		std::vector<std::thread> Workers;
+		std::vector<bool> Abandoned;
+	};
+
+	ResolveConfig config_;
+	unsigned int threadCount_;
+
+	ResolveConfig GetConfig() const {
+		return config_;
+	}
+
+	// Resolves one device. When resolving devices[index] of state, the name
+	// cache is only used while the device has not been reported as timed
+	// out, since the cache may be gone by then.
+	static DeviceResolution ResolveOne(const ResolveConfig& config, const std::wstring& deviceId,
+		Clock::time_point deadline, ResolveState* state, size_t index) {
+		Clock::time_point start = Clock::now();
+		DeviceResolution resolution;
+		resolution.DeviceId = deviceId;
+		try {
+			OperationStats* metrics = OperationMetrics::ForDevice(deviceId);
+			std::unique_ptr<DeviceBackend> backend;
+			{
+				PhaseTimings::Scope phase("open");
+				OperationMetrics::Scope openMetrics(DeviceOperation::Open, metrics);
+				backend = config.BackendFactory(deviceId);
+			}
+			backend->SetDeadline(deadline);
+			GoogleStorageDevice device(std::move(backend));
+			device.SetMetrics(metrics);
+			NvmeControllerCatalog* nvmeControllers = state != nullptr && config.BatchNvme ? &state->NvmeControllers : nullptr;
+			if (config.ReadDetails) {
+				resolution.BusType = device.GetBusType();
+			}
+			if (config.NameCache == nullptr) {
+				GetDeviceName(device, nvmeControllers, resolution.Name);
+				if (config.ReadDetails) {
+					device.GetDeviceIdentity(resolution.Identity, &resolution.IdentifierCount);
+				}
+				resolution.Elapsed = GetElapsed(start);
+				return resolution;
+			}
+
+			std::string identity;
+			DWORD identifierCount = 0;
+			device.GetDeviceIdentity(identity, &identifierCount);
+			// A disk attached in place of another can report the same
+			// identifiers, so names are cached per attach, and not at all
+			// where the OS cannot tell attaches apart.
+			std::string cacheKey;
+			bool cached = false;
+			if (!identity.empty() && device.GetAttachId(cacheKey)) {
+				cacheKey.push_back('\0');
+				cacheKey.append(identity);
+				UseNameCache(config, state, index, [&](DeviceNameCache& nameCache) {
+					cached = nameCache.Lookup(cacheKey, resolution.Name);
+				});
+			}
+			if (!cached) {
+				GetDeviceName(device, nvmeControllers, resolution.Name);
+				if (!cacheKey.empty() && !resolution.Name.empty()) {
+					UseNameCache(config, state, index, [&](DeviceNameCache& nameCache) {
+						nameCache.Insert(cacheKey, resolution.Name);
+					});
+				}
+			}
+			if (config.ReadDetails) {
+				resolution.Identity = std::move(identity);
+				resolution.IdentifierCount = identifierCount;
+			}
+		}
+		catch (const std::exception& e) {
+			resolution.TimedOut = Clock::now() >= deadline;
+			resolution.Error = resolution.TimedOut ? config.FormatTimeout() : e.what();
+		}
+		resolution.Elapsed = GetElapsed(start);
+		return resolution;
+	}
+
+	static std::chrono::microseconds GetElapsed(Clock::time_point start) {
+		return std::chrono::duration_cast<std::chrono::microseconds>(Clock::now() - start);
+	}
+
+	template<typename TCallback>
+	static void UseNameCache(const ResolveConfig& config, ResolveState* state, size_t index, TCallback&& callback) {
+		if (state == nullptr) {
+			callback(*config.NameCache);
+			return;
+		}
+		std::lock_guard<std::mutex> lock(state->Mutex);
+		if (!state->Done[index]) {
+			callback(*config.NameCache);
+		}
+	}
+
+	static void GetDeviceName(GoogleStorageDevice& device, NvmeControllerCatalog* nvmeControllers, std::string& name) {
+		NvmeLocation location;
+		if (nvmeControllers != nullptr && device.GetNvmeLocation(location) &&
+			nvmeControllers->Lookup(location, device, name)) {
+			return;
+		}
+		device.GetDeviceName(name);
+	}
+
+	// Called with state->Mutex held.
+	static void StartWorker(const std::shared_ptr<ResolveState>& state) {
+		size_t worker = state->Workers.size();
+		state->Abandoned.push_back(false);
+		state->Workers.emplace_back(&DeviceResolver::Work, state, worker);
+	}
+
+	// The earliest deadline of the devices still being resolved. Called with
+	// state.Mutex held.
+	static Clock::time_point GetNextDeadline(const ResolveState& state) {
+		Clock::time_point nextDeadline = Clock::time_point::max();
+		for (size_t i = state.NextToReport; i < state.Done.size(); i++) {
+			if (!state.Done[i]) {
+				nextDeadline = std::min(nextDeadline, state.Deadlines[i]);
+			}
+		}
+		return nextDeadline;
+	}
+
+	// Reports the devices whose deadline has passed as timed out, and
+	// replaces the workers stuck on them. Called with state->Mutex held.
+	static void TimeOutOverdueDevices(const std::shared_ptr<ResolveState>& state) {
+		Clock::time_point now = Clock::now();
+		for (size_t i = state->NextToReport; i < state->Done.size(); i++) {
+			if (state->Done[i] || state->Deadlines[i] > now) {
+				continue;
+			}
+
+			state->Results[i].DeviceId = state->DeviceIds[i];
+			state->Results[i].Error = state->Config.FormatTimeout();
+			state->Results[i].TimedOut = true;
+			state->Results[i].Elapsed = state->Config.DeviceTimeout;
+			state->Done[i] = true;
+			state->Abandoned[state->Owners[i]] = true;
+			if (state->NextToResolve < state->DeviceIds.size()) {
+				StartWorker(state);
+			}
+		}
+		Report(*state);
+	}
+
+	// Reports every finished device that is next in order. Called with
+	// state.Mutex held.
+	static void Report(ResolveState& state) {
+		while (!state.Stopped && state.NextToReport < state.Done.size() && state.Done[state.NextToReport]) {
+			if (!state.OnResult(state.Results[state.NextToReport])) {
+				state.Stopped = true;
+			}
+			state.Results[state.NextToReport] = DeviceResolution();
+			state.NextToReport++;
+		}
+	}
+
+	static void Work(std::shared_ptr<ResolveState> state, size_t worker) {
+		for (;;) {
+			size_t index;
+			Clock::time_point deadline = state->Config.GetDeadline();
+			{
+				std::lock_guard<std::mutex> lock(state->Mutex);
+				if (state->NextToResolve >= state->DeviceIds.size() || state->Stopped) {
+					return;
+				}
+				index = state->NextToResolve++;
+				state->Deadlines[index] = deadline;
+				state->Owners[index] = worker;
+			}
+			state->Changed.notify_all();
+
+			DeviceResolution resolution = ResolveOne(state->Config, state->DeviceIds[index], deadline, state.get(), index);
+
+			// Whichever worker completes the next device in order reports it,
+			// along with any later devices that were already waiting on it.
+			{
+				std::lock_guard<std::mutex> lock(state->Mutex);
+				if (state->Done[index]) {
+					// Already reported as timed out; this worker was replaced.
+					return;
+				}
+				state->Results[index] = std::move(resolution);
+				state->Done[index] = true;
+				Report(*state);
+			}
+			state->Changed.notify_all();
+		}
+	}
+};
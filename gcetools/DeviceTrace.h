@@ -0,0 +1,230 @@
+/* Copyright 2022 Google LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iterator>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include "StorageTypes.h"
+#include "Utf8.h"
+
+// One IOCTL_STORAGE_QUERY_PROPERTY request and the driver's answer to it.
+// Input is the whole input buffer, so it carries the PropertyId and any
+// additional parameters (such as the NVMe identify CNS and namespace).
+struct TraceQuery {
+	std::vector<BYTE> Input;
+	DWORD OutputBufferSize = 0;
+	DWORD Error = ERROR_SUCCESS;
+	std::vector<BYTE> Output;
+	std::chrono::microseconds Latency{ 0 };
+};
+
+// Everything one device was asked, in the order it was asked. A device that
+// could not be opened has an OpenError and no queries.
+struct TraceDevice {
+	std::wstring DeviceId;
+	std::string OpenError;
+	std::chrono::microseconds OpenLatency{ 0 };
+	std::vector<TraceQuery> Queries;
+};
+
+// A recording of the storage queries made to a machine's devices, so a run
+// can be replayed elsewhere. The file is a header followed by the devices in
+// order:
+//
+//   TraceFileHeader
+//   for each device: TraceDeviceRecord, DeviceId (UTF-8), OpenError,
+//     then for each query: TraceQueryRecord, input bytes, output bytes
+//
+// Most of an NVMe identify response is zeros, so the zeros at the end of
+// each output are left out of the file. All integers are little-endian.
+class DeviceTrace {
+public:
+	std::vector<TraceDevice> Devices;
+
+	static DeviceTrace Load(const std::filesystem::path& path) {
+		std::ifstream in(path, std::ios::binary);
+		if (!in) {
+			throw std::runtime_error("Failed to open device trace " + path.string());
+		}
+		std::vector<BYTE> contents((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+
+		DeviceTrace trace;
+		Reader reader{ contents.data(), contents.data() + contents.size() };
+		TraceFileHeader header;
+		if (!reader.Read(&header, sizeof(header)) || header.Magic != Magic || header.Version != Version ||
+			header.HeaderSize != sizeof(TraceFileHeader)) {
+			throw std::runtime_error("Not a device trace: " + path.string());
+		}
+
+		for (uint32_t i = 0; i < header.DeviceCount; i++) {
+			TraceDeviceRecord deviceRecord;
+			std::string deviceId;
+			TraceDevice device;
+			if (!reader.Read(&deviceRecord, sizeof(deviceRecord)) ||
+				!reader.ReadString(deviceId, deviceRecord.DeviceIdLength) ||
+				!reader.ReadString(device.OpenError, deviceRecord.OpenErrorLength)) {
+				throw std::runtime_error("Truncated device trace: " + path.string());
+			}
+			device.DeviceId = FromUtf8(deviceId);
+			device.OpenLatency = std::chrono::microseconds(deviceRecord.OpenLatencyUs);
+
+			for (uint32_t j = 0; j < deviceRecord.QueryCount; j++) {
+				TraceQueryRecord queryRecord;
+				TraceQuery query;
+				if (!reader.Read(&queryRecord, sizeof(queryRecord)) || queryRecord.StoredOutputSize > queryRecord.OutputSize ||
+					!reader.ReadBytes(query.Input, queryRecord.InputSize) ||
+					!reader.ReadBytes(query.Output, queryRecord.StoredOutputSize)) {
+					throw std::runtime_error("Truncated device trace: " + path.string());
+				}
+				query.Output.resize(queryRecord.OutputSize);
+				query.OutputBufferSize = queryRecord.OutputBufferSize;
+				query.Error = queryRecord.Error;
+				query.Latency = std::chrono::microseconds(queryRecord.LatencyUs);
+				device.Queries.push_back(std::move(query));
+			}
+			trace.Devices.push_back(std::move(device));
+		}
+
+		return trace;
+	}
+
+	// The trace is written alongside and renamed into place.
+	void Save(const std::filesystem::path& path) const {
+		std::vector<BYTE> contents;
+		TraceFileHeader header = { Magic, Version, sizeof(TraceFileHeader), (uint32_t)Devices.size(), 0 };
+		Append(contents, &header, sizeof(header));
+
+		for (const TraceDevice& device : Devices) {
+			std::string deviceId = ToUtf8(device.DeviceId);
+			TraceDeviceRecord deviceRecord = {};
+			deviceRecord.OpenLatencyUs = ToMicroseconds(device.OpenLatency);
+			deviceRecord.DeviceIdLength = (uint16_t)std::min<size_t>(deviceId.size(), UINT16_MAX);
+			deviceRecord.OpenErrorLength = (uint16_t)std::min<size_t>(device.OpenError.size(), UINT16_MAX);
+			deviceRecord.QueryCount = (uint32_t)device.Queries.size();
+			Append(contents, &deviceRecord, sizeof(deviceRecord));
+			Append(contents, deviceId.data(), deviceRecord.DeviceIdLength);
+			Append(contents, device.OpenError.data(), deviceRecord.OpenErrorLength);
+
+			for (const TraceQuery& query : device.Queries) {
+				TraceQueryRecord queryRecord = {};
+				queryRecord.LatencyUs = ToMicroseconds(query.Latency);
+				queryRecord.Error = query.Error;
+				queryRecord.OutputBufferSize = query.OutputBufferSize;
+				queryRecord.InputSize = (uint32_t)query.Input.size();
+				queryRecord.OutputSize = (uint32_t)query.Output.size();
+				queryRecord.StoredOutputSize = queryRecord.OutputSize;
+				while (queryRecord.StoredOutputSize > 0 && query.Output[queryRecord.StoredOutputSize - 1] == 0) {
+					queryRecord.StoredOutputSize--;
+				}
+				Append(contents, &queryRecord, sizeof(queryRecord));
+				Append(contents, query.Input.data(), query.Input.size());
+				Append(contents, query.Output.data(), queryRecord.StoredOutputSize);
+			}
+		}
+
+		std::filesystem::path tempPath = path;
+		tempPath += ".tmp";
+		{
+			std::ofstream out(tempPath, std::ios::binary | std::ios::trunc);
+			out.write((const char*)contents.data(), contents.size());
+			if (!out) {
+				throw std::runtime_error("Failed to write device trace " + tempPath.string());
+			}
+		}
+		std::filesystem::rename(tempPath, path);
+	}
+
+private:
+	static constexpr uint32_t Magic = 0x52544347;  // "GCTR"
+	static constexpr uint16_t Version = 1;
+
+	struct TraceFileHeader {
+		uint32_t Magic;
+		uint16_t Version;
+		uint16_t HeaderSize;
+		uint32_t DeviceCount;
+		uint32_t Reserved;
+	};
+
+	struct TraceDeviceRecord {
+		uint32_t OpenLatencyUs;
+		uint16_t DeviceIdLength;
+		uint16_t OpenErrorLength;
+		uint32_t QueryCount;
+	};
+
+	struct TraceQueryRecord {
+		uint32_t LatencyUs;
+		uint32_t Error;
+		uint32_t OutputBufferSize;
+		uint32_t InputSize;
+		uint32_t OutputSize;
+		uint32_t StoredOutputSize;
+	};
+
+	static_assert(sizeof(TraceFileHeader) == 16, "TraceFileHeader is part of the file format");
+	static_assert(sizeof(TraceDeviceRecord) == 12, "TraceDeviceRecord is part of the file format");
+	static_assert(sizeof(TraceQueryRecord) == 24, "TraceQueryRecord is part of the file format");
+
+	// Reads a trace without running past its end.
+	struct Reader {
+		const BYTE* Next;
+		const BYTE* End;
+
+		bool Read(void* data, size_t size) {
+			if ((size_t)(End - Next) < size) {
+				return false;
+			}
+			memcpy(data, Next, size);
+			Next += size;
+			return true;
+		}
+
+		bool ReadBytes(std::vector<BYTE>& bytes, size_t size) {
+			if ((size_t)(End - Next) < size) {
+				return false;
+			}
+			bytes.assign(Next, Next + size);
+			Next += size;
+			return true;
+		}
+
+		bool ReadString(std::string& value, size_t size) {
+			if ((size_t)(End - Next) < size) {
+				return false;
+			}
+			value.assign((const char*)Next, size);
+			Next += size;
+			return true;
+		}
+	};
+
+	static void Append(std::vector<BYTE>& contents, const void* data, size_t size) {
+		contents.insert(contents.end(), (const BYTE*)data, (const BYTE*)data + size);
+	}
+
+	// Latencies past about an hour are clamped.
+	static uint32_t ToMicroseconds(std::chrono::microseconds latency) {
+		return (uint32_t)std::min<long long>(std::max<long long>(latency.count(), 0), UINT32_MAX);
+	}
+};
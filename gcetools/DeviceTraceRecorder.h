@@ -0,0 +1,161 @@
+/* Copyright 2022 Google LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <exception>
+#include <filesystem>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "DeviceBackend.h"
+#include "DeviceTrace.h"
+#include "StorageTypes.h"
+
+// Records every device opened through a backend factory, and every query
+// made to it, so the run can be replayed with DeviceTraceReplay. Devices
+// opened more than once are recorded as one device.
+class DeviceTraceRecorder {
+public:
+	DeviceTraceRecorder() : recording_(std::make_shared<Recording>()) {
+	}
+
+	// Returns a factory that opens devices through factory and records them.
+	// The factory and its backends only share the recording with the
+	// recorder, so they may outlive it.
+	DeviceBackendFactory Wrap(DeviceBackendFactory factory) {
+		return [recording = recording_, factory = std::move(factory)](const std::wstring& deviceId) -> std::unique_ptr<DeviceBackend> {
+			TraceDevice device;
+			device.DeviceId = deviceId;
+			auto start = Clock::now();
+			try {
+				std::unique_ptr<DeviceBackend> backend = factory(deviceId);
+				device.OpenLatency = std::chrono::duration_cast<std::chrono::microseconds>(Clock::now() - start);
+				return std::make_unique<RecordingDeviceBackend>(std::move(backend), recording, std::move(device));
+			}
+			catch (const std::exception& e) {
+				device.OpenLatency = std::chrono::duration_cast<std::chrono::microseconds>(Clock::now() - start);
+				device.OpenError = e.what();
+				recording->Add(std::move(device));
+				throw;
+			}
+		};
+	}
+
+	// Writes what has been recorded so far to path, with the devices in
+	// deviceIds first, in that order, and any others after them. Devices
+	// still open are not included.
+	void Save(const std::filesystem::path& path, const std::vector<std::wstring>& deviceIds) const {
+		DeviceTrace trace;
+		{
+			std::lock_guard<std::mutex> lock(recording_->Mutex);
+			trace.Devices = recording_->Devices;
+		}
+		std::unordered_map<std::wstring, size_t> order;
+		for (size_t i = 0; i < deviceIds.size(); i++) {
+			order.emplace(deviceIds[i], i);
+		}
+		auto position = [&order, &deviceIds](const TraceDevice& device) {
+			auto it = order.find(device.DeviceId);
+			return it == order.end() ? deviceIds.size() : it->second;
+		};
+		std::stable_sort(trace.Devices.begin(), trace.Devices.end(), [&position](const TraceDevice& a, const TraceDevice& b) {
+			return position(a) < position(b);
+		});
+		trace.Save(path);
+	}
+
+private:
+	using Clock = std::chrono::steady_clock;
+
+	struct Recording {
+		std::mutex Mutex;
+		std::vector<TraceDevice> Devices;
+
+		void Add(TraceDevice device) {
+			std::lock_guard<std::mutex> lock(Mutex);
+			auto existing = std::find_if(Devices.begin(), Devices.end(), [&device](const TraceDevice& d) {
+				return d.DeviceId == device.DeviceId;
+			});
+			if (existing == Devices.end()) {
+				Devices.push_back(std::move(device));
+				return;
+			}
+			if (device.OpenError.empty()) {
+				existing->OpenError.clear();
+			}
+			existing->Queries.insert(existing->Queries.end(),
+				std::make_move_iterator(device.Queries.begin()), std::make_move_iterator(device.Queries.end()));
+		}
+	};
+
+	// Passes every query through to the device, keeping a copy of the query,
+	// the answer and how long it took. The device is added to the recording
+	// when the backend is closed.
+	class RecordingDeviceBackend : public DeviceBackend {
+	public:
+		RecordingDeviceBackend(std::unique_ptr<DeviceBackend> backend, std::shared_ptr<Recording> recording, TraceDevice device)
+			: backend_(std::move(backend)), recording_(std::move(recording)), device_(std::move(device))
+		{
+		}
+		~RecordingDeviceBackend() {
+			recording_->Add(std::move(device_));
+		}
+
+		void SetDeadline(Clock::time_point deadline) override {
+			DeviceBackend::SetDeadline(deadline);
+			backend_->SetDeadline(deadline);
+		}
+
+		DWORD QueryProperty(const void* inputBuffer, DWORD inputBufferSize,
+			void* outputBuffer, DWORD outputBufferSize, DWORD* bytesReturned) override {
+			auto start = Clock::now();
+			DWORD err = backend_->QueryProperty(inputBuffer, inputBufferSize, outputBuffer, outputBufferSize, bytesReturned);
+
+			TraceQuery query;
+			query.Latency = std::chrono::duration_cast<std::chrono::microseconds>(Clock::now() - start);
+			query.Input.assign((const BYTE*)inputBuffer, (const BYTE*)inputBuffer + inputBufferSize);
+			query.OutputBufferSize = outputBufferSize;
+			query.Error = err;
+			query.Output.assign((const BYTE*)outputBuffer, (const BYTE*)outputBuffer + std::min(*bytesReturned, outputBufferSize));
+			device_.Queries.push_back(std::move(query));
+			return err;
+		}
+
+		// Not recorded; replayed devices export no topology, partitions or
+		// attach ID.
+		bool GetQueueTopology(DeviceQueueTopology& topology) override {
+			return backend_->GetQueueTopology(topology);
+		}
+
+		bool GetPartitionLayout(DevicePartitionLayout& layout) override {
+			return backend_->GetPartitionLayout(layout);
+		}
+
+		bool GetAttachId(std::string& attachId) override {
+			return backend_->GetAttachId(attachId);
+		}
+
+	private:
+		std::unique_ptr<DeviceBackend> backend_;
+		std::shared_ptr<Recording> recording_;
+		TraceDevice device_;
+	};
+
+	std::shared_ptr<Recording> recording_;
+};
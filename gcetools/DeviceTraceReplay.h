@@ -0,0 +1,251 @@
+/* Copyright 2022 Google LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <exception>
+#include <map>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+#include "DeviceBackend.h"
+#include "DeviceEnumerator.h"
+#include "DeviceTrace.h"
+#include "GoogleStorageDevice.h"
+#include "StorageTypes.h"
+
+// Plays a DeviceTrace back: the devices in the trace are enumerated in trace
+// order and each query is answered with what the device answered when it was
+// recorded, on any platform. Queries are matched on their whole input, so the
+// replayed run need not ask in the same order as the recorded one did.
+class DeviceTraceReplay : public DeviceEnumerator {
+public:
+	DeviceTraceReplay(DeviceTrace trace) : trace_(std::make_shared<const DeviceTrace>(std::move(trace))) {
+		auto devices = std::make_shared<DeviceMap>();
+		for (const TraceDevice& device : trace_->Devices) {
+			ReplayDevice& replayDevice = (*devices)[device.DeviceId];
+			replayDevice.Device = &device;
+			for (const TraceQuery& query : device.Queries) {
+				const TraceQuery*& answer = replayDevice.Answers[std::string(query.Input.begin(), query.Input.end())];
+				if (answer == nullptr || IsBetterAnswer(query, *answer)) {
+					answer = &query;
+				}
+			}
+		}
+		devices_ = std::move(devices);
+	}
+
+	const char* GetName() const override {
+		return "trace";
+	}
+
+	std::vector<std::wstring> EnumerateDeviceIds() override {
+		std::vector<std::wstring> deviceIds;
+		for (const TraceDevice& device : trace_->Devices) {
+			deviceIds.push_back(device.DeviceId);
+		}
+		return deviceIds;
+	}
+
+	// With recordedLatency, every open and query takes as long as it did when
+	// it was recorded. Opens cannot be cancelled; queries give up at the
+	// deadline.
+	DeviceBackendFactory GetBackendFactory(bool recordedLatency) const {
+		return [trace = trace_, devices = devices_, recordedLatency](const std::wstring& deviceId) -> std::unique_ptr<DeviceBackend> {
+			auto device = devices->find(deviceId);
+			if (device == devices->end()) {
+				throw std::runtime_error("Failed to get device handle. Error code: " + std::to_string(ERROR_FILE_NOT_FOUND));
+			}
+			if (recordedLatency && device->second.Device->OpenLatency.count() > 0) {
+				std::this_thread::sleep_for(device->second.Device->OpenLatency);
+			}
+			if (!device->second.Device->OpenError.empty()) {
+				throw std::runtime_error(device->second.Device->OpenError);
+			}
+			return std::make_unique<ReplayDeviceBackend>(trace, devices, &device->second, recordedLatency);
+		};
+	}
+
+	// Builds a trace of deviceCount disks from the devices in templates, taken
+	// in turn. Each copy answers exactly as its template does, except that
+	// the disk name and serial number are replaced, wherever they appear,
+	// with same-length variants unique to the copy, so the copies stay
+	// byte-for-byte valid responses. The copies are \\.\PHYSICALDRIVE0
+	// upwards. Templates should be recorded without --batch-nvme, whose
+	// answers also carry the names of the other disks on the controller.
+	static DeviceTrace Synthesize(const DeviceTrace& templates, size_t deviceCount) {
+		if (templates.Devices.empty()) {
+			throw std::runtime_error("The template trace has no devices.");
+		}
+
+		std::vector<TemplateIdentity> identities = ReadIdentities(templates);
+		size_t suffixLength = 1;
+		for (size_t n = deviceCount; n > 36; n = (n + 35) / 36) {
+			suffixLength++;
+		}
+
+		DeviceTrace trace;
+		for (size_t i = 0; i < deviceCount; i++) {
+			const TraceDevice& source = templates.Devices[i % templates.Devices.size()];
+			const TemplateIdentity& identity = identities[i % templates.Devices.size()];
+			TraceDevice device = source;
+			device.DeviceId = L"\\\\.\\PHYSICALDRIVE" + std::to_wstring(i);
+
+			std::vector<std::pair<std::string, std::string>> replacements;
+			if (!identity.Name.empty()) {
+				if (identity.Name.size() <= suffixLength) {
+					throw std::runtime_error("Disk name " + identity.Name + " is too short to make " +
+						std::to_string(deviceCount) + " distinct copies.");
+				}
+				replacements.emplace_back(identity.Name, MakeVariant(identity.Name, i, suffixLength));
+			}
+			// Short serial numbers would match unrelated bytes.
+			if (identity.SerialNumber.size() >= MinSerialNumberLength && identity.SerialNumber.size() > suffixLength &&
+				identity.SerialNumber != identity.Name) {
+				replacements.emplace_back(identity.SerialNumber, MakeVariant(identity.SerialNumber, i, suffixLength));
+			}
+			for (TraceQuery& query : device.Queries) {
+				for (const auto& replacement : replacements) {
+					ReplaceAll(query.Output, replacement.first, replacement.second);
+				}
+			}
+			trace.Devices.push_back(std::move(device));
+		}
+		return trace;
+	}
+
+private:
+	static constexpr size_t MinSerialNumberLength = 4;
+
+	struct ReplayDevice {
+		const TraceDevice* Device = nullptr;
+		// The answer to each distinct query, keyed by its input bytes.
+		std::map<std::string, const TraceQuery*, std::less<>> Answers;
+	};
+
+	using DeviceMap = std::unordered_map<std::wstring, ReplayDevice>;
+
+	struct TemplateIdentity {
+		std::string Name;
+		std::string SerialNumber;
+	};
+
+	// Answers each query from the trace. A query that was never recorded
+	// fails as an unsupported one would.
+	class ReplayDeviceBackend : public DeviceBackend {
+	public:
+		ReplayDeviceBackend(std::shared_ptr<const DeviceTrace> trace, std::shared_ptr<const DeviceMap> devices,
+			const ReplayDevice* device, bool recordedLatency)
+			: trace_(std::move(trace)), devices_(std::move(devices)), device_(device), recordedLatency_(recordedLatency)
+		{
+		}
+
+		DWORD QueryProperty(const void* inputBuffer, DWORD inputBufferSize,
+			void* outputBuffer, DWORD outputBufferSize, DWORD* bytesReturned) override {
+			*bytesReturned = 0;
+			auto answer = device_->Answers.find(std::string_view((const char*)inputBuffer, inputBufferSize));
+			if (answer == device_->Answers.end()) {
+				return ERROR_NOT_SUPPORTED;
+			}
+
+			const TraceQuery& query = *answer->second;
+			if (recordedLatency_ && query.Latency.count() > 0) {
+				if (HasDeadline() && GetTimeRemaining() < query.Latency) {
+					std::this_thread::sleep_for(GetTimeRemaining());
+					return ERROR_TIMEOUT;
+				}
+				std::this_thread::sleep_for(query.Latency);
+			}
+
+			if (query.Error == ERROR_SUCCESS && outputBufferSize < sizeof(STORAGE_DESCRIPTOR_HEADER)) {
+				return ERROR_INSUFFICIENT_BUFFER;
+			}
+			// Like the driver, a response that does not fit is truncated, and
+			// its header says how big it is.
+			*bytesReturned = (DWORD)std::min<size_t>(query.Output.size(), outputBufferSize);
+			memcpy(outputBuffer, query.Output.data(), *bytesReturned);
+			return query.Error;
+		}
+
+	private:
+		// Keep the answers alive.
+		std::shared_ptr<const DeviceTrace> trace_;
+		std::shared_ptr<const DeviceMap> devices_;
+		const ReplayDevice* device_;
+		bool recordedLatency_;
+	};
+
+	std::shared_ptr<const DeviceTrace> trace_;
+	std::shared_ptr<const DeviceMap> devices_;
+
+	// A query may have been asked more than once, with a buffer that was too
+	// small the first time. The complete answer is the one to replay.
+	static bool IsBetterAnswer(const TraceQuery& query, const TraceQuery& current) {
+		if ((query.Error == ERROR_SUCCESS) != (current.Error == ERROR_SUCCESS)) {
+			return query.Error == ERROR_SUCCESS;
+		}
+		return query.Output.size() > current.Output.size();
+	}
+
+	// Resolves each template device from the trace itself to find the name
+	// and serial number its answers carry.
+	static std::vector<TemplateIdentity> ReadIdentities(const DeviceTrace& templates) {
+		DeviceTraceReplay replay(templates);
+		DeviceBackendFactory factory = replay.GetBackendFactory(false);
+		std::vector<TemplateIdentity> identities(templates.Devices.size());
+		for (size_t i = 0; i < templates.Devices.size(); i++) {
+			try {
+				GoogleStorageDevice device(factory(templates.Devices[i].DeviceId));
+				StorageQueryResult<STORAGE_DEVICE_DESCRIPTOR> descriptor = device.GetStorageDeviceDescriptor();
+				if (descriptor->SerialNumberOffset != 0 && descriptor->SerialNumberOffset < descriptor.Size()) {
+					const char* serialNumber = (const char*)descriptor.Get() + descriptor->SerialNumberOffset;
+					identities[i].SerialNumber.assign(serialNumber, strnlen(serialNumber, descriptor.Size() - descriptor->SerialNumberOffset));
+				}
+				identities[i].Name = device.GetDeviceName();
+			}
+			catch (const std::exception&) {
+				// Copied unchanged.
+			}
+		}
+		return identities;
+	}
+
+	// Replaces the end of value with index in base 36.
+	static std::string MakeVariant(const std::string& value, size_t index, size_t suffixLength) {
+		std::string variant = value;
+		for (size_t i = 0; i < suffixLength; i++, index /= 36) {
+			variant[variant.size() - 1 - i] = "0123456789abcdefghijklmnopqrstuvwxyz"[index % 36];
+		}
+		return variant;
+	}
+
+	static void ReplaceAll(std::vector<BYTE>& bytes, std::string_view from, std::string_view to) {
+		auto next = bytes.begin();
+		for (;;) {
+			next = std::search(next, bytes.end(), from.begin(), from.end(),
+				[](BYTE a, char b) { return a == (BYTE)b; });
+			if (next == bytes.end()) {
+				return;
+			}
+			next = std::copy(to.begin(), to.end(), next);
+		}
+	}
+};
@@ -0,0 +1,123 @@
+/* Copyright 2022 Google LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#pragma once
+
+#include <chrono>
+#include <functional>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "DeviceEnumerator.h"
+#include "DeviceEvents.h"
+#include "DeviceResolver.h"
+
+enum class DeviceChangeKind {
+	Added,
+	Removed,
+	// The device is still there, but now has a different disk behind it.
+	Renamed,
+};
+
+struct DeviceChange {
+	DeviceChangeKind Kind = DeviceChangeKind::Added;
+	std::wstring DeviceId;
+	// The name the device had before, when Renamed or Removed.
+	std::string OldName;
+	// The name the device has now, when Added or Renamed.
+	std::string Name;
+};
+
+// Keeps track of the name of every attached device, reporting each change.
+// Every device is resolved once to begin with; after that, only the device
+// named by each event is resolved again. Devices that cannot be resolved
+// (those that are not GCE disks, or are already gone again) are not tracked.
+class DeviceWatcher {
+public:
+	using ChangeCallback = std::function<void(const DeviceChange&)>;
+
+	// Subscribe events before creating the watcher, so no change made while
+	// the devices are enumerated is missed.
+	DeviceWatcher(DeviceEnumerator& enumerator, DeviceResolver& resolver, DeviceEventSource& events)
+		: enumerator_(enumerator), resolver_(resolver), events_(events)
+	{
+	}
+
+	// Reports every attached device as Added, then each change as it is
+	// seen, until the event source is stopped. Throws if the devices could
+	// not be enumerated.
+	void Run(const ChangeCallback& onChange) {
+		std::vector<std::wstring> deviceIds = enumerator_.EnumerateDeviceIds();
+		resolver_.Resolve(deviceIds, [&](const DeviceResolution& resolution) {
+			if (resolution.Error.empty()) {
+				names_[resolution.DeviceId] = resolution.Name;
+				onChange(DeviceChange{ DeviceChangeKind::Added, resolution.DeviceId, std::string(), resolution.Name });
+			}
+		});
+
+		DeviceEvent event;
+		while (events_.Wait(event)) {
+			if (Apply(event, onChange)) {
+				latencies_.push_back(DeviceEvent::Clock::now() - event.Time);
+			}
+		}
+	}
+
+	// How long each reported change took to report, from when its event
+	// was seen, in the order they were reported.
+	const std::vector<DeviceEvent::Clock::duration>& GetLatencies() const {
+		return latencies_;
+	}
+
+private:
+	DeviceEnumerator& enumerator_;
+	DeviceResolver& resolver_;
+	DeviceEventSource& events_;
+	std::unordered_map<std::wstring, std::string> names_;
+	std::vector<DeviceEvent::Clock::duration> latencies_;
+
+	// Returns whether a change was reported.
+	bool Apply(const DeviceEvent& event, const ChangeCallback& onChange) {
+		auto known = names_.find(event.DeviceId);
+		if (event.Kind == DeviceEventKind::Removed) {
+			return known != names_.end() && Remove(known, onChange);
+		}
+
+		// An arrival can be reported for a device that is already known, if
+		// its removal was missed.
+		DeviceResolution resolution = resolver_.ResolveOne(event.DeviceId);
+		if (!resolution.Error.empty()) {
+			return known != names_.end() && Remove(known, onChange);
+		}
+		if (known == names_.end()) {
+			names_[event.DeviceId] = resolution.Name;
+			onChange(DeviceChange{ DeviceChangeKind::Added, event.DeviceId, std::string(), resolution.Name });
+			return true;
+		}
+		if (known->second == resolution.Name) {
+			return false;
+		}
+		DeviceChange change{ DeviceChangeKind::Renamed, event.DeviceId, known->second, resolution.Name };
+		known->second = resolution.Name;
+		onChange(change);
+		return true;
+	}
+
+	bool Remove(std::unordered_map<std::wstring, std::string>::iterator known, const ChangeCallback& onChange) {
+		DeviceChange change{ DeviceChangeKind::Removed, known->first, std::move(known->second), std::string() };
+		names_.erase(known);
+		onChange(change);
+		return true;
+	}
+};
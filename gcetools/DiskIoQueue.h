@@ -0,0 +1,69 @@
+/* Copyright 2022 Google LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <vector>
+#include "StorageTypes.h"
+
+// A queue of asynchronous, unbuffered reads and writes to one disk or file,
+// for measuring what the disk itself delivers. Each request uses one of the
+// queue's buffers, numbered 0 to the queue depth less one, which are aligned
+// for unbuffered I/O. Implementations throw std::runtime_error on failure.
+class DiskIoQueue {
+public:
+	// Unbuffered I/O must be aligned to the sector size; 4096 covers 512e and
+	// 4Kn disks.
+	static constexpr size_t BufferAlignment = 4096;
+
+	DiskIoQueue(size_t queueDepth, size_t blockSize)
+		: blockSize_(blockSize), storage_(queueDepth * blockSize + BufferAlignment)
+	{
+		// Writes carry data that does not compress or deduplicate.
+		uint64_t state = 0x9E3779B97F4A7C15ull;
+		for (size_t i = 0; i < storage_.size(); i++) {
+			state ^= state << 13;
+			state ^= state >> 7;
+			state ^= state << 17;
+			storage_[i] = (BYTE)state;
+		}
+	}
+	virtual ~DiskIoQueue() {
+	}
+
+	// The size of the disk or file, in bytes.
+	virtual uint64_t GetSize() = 0;
+
+	// Whether requests bypass the OS cache. Some file systems (tmpfs) cannot.
+	virtual bool IsUnbuffered() const = 0;
+
+	// Starts reading or writing one block at offset, into or from buffer.
+	virtual void Submit(size_t buffer, bool write, uint64_t offset) = 0;
+
+	// Waits for a request to complete and returns its buffer.
+	virtual size_t WaitForCompletion() = 0;
+
+protected:
+	size_t blockSize_;
+
+	BYTE* GetBuffer(size_t buffer) {
+		uintptr_t start = ((uintptr_t)storage_.data() + BufferAlignment - 1) & ~(uintptr_t)(BufferAlignment - 1);
+		return (BYTE*)start + buffer * blockSize_;
+	}
+
+private:
+	std::vector<BYTE> storage_;
+};
@@ -0,0 +1,132 @@
+/* Copyright 2022 Google LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#pragma once
+
+#include <string>
+#include <string_view>
+#include <vector>
+#include "DeviceBackend.h"
+#include "GoogleStorageDevice.h"
+#include "JsonText.h"
+#include "Utf8.h"
+#include "VolumeCatalog.h"
+
+// Everything a mount script needs to find a disk's file systems by the
+// disk's name: its partitions, the volumes on each and where those are
+// mounted, with their sizes.
+struct DiskLayout {
+	struct Partition {
+		DevicePartition Layout;
+		std::vector<DiskVolume> Volumes;
+	};
+
+	std::wstring DeviceId;
+	std::string Name;
+	// False if the OS would not give the disk's size and partition table.
+	bool HasLayout = false;
+	ULONGLONG Length = 0;
+	std::vector<Partition> Partitions;
+	// Volumes on the disk itself rather than on one of its partitions.
+	std::vector<DiskVolume> Volumes;
+
+	// With no catalog, only the partitions are read.
+	static DiskLayout Read(GoogleStorageDevice& device, const std::wstring& deviceId, const VolumeCatalog* catalog) {
+		DiskLayout layout;
+		layout.DeviceId = deviceId;
+		device.GetDeviceName(layout.Name);
+		DevicePartitionLayout partitions;
+		layout.HasLayout = device.GetPartitionLayout(partitions);
+		if (!layout.HasLayout) {
+			return layout;
+		}
+		layout.Length = partitions.Length;
+		for (const DevicePartition& partition : partitions.Partitions) {
+			layout.Partitions.push_back(Partition{ partition,
+				catalog != nullptr ? catalog->FindVolumes(partitions, &partition) : std::vector<DiskVolume>() });
+		}
+		if (catalog != nullptr) {
+			layout.Volumes = catalog->FindVolumes(partitions, nullptr);
+		}
+		return layout;
+	}
+
+	// One JSON object on a single line. Unknown values are null.
+	void AppendJson(std::string& out) const {
+		out.append("{\"device\":");
+		AppendJsonString(out, ToUtf8(DeviceId));
+		out.append(",\"name\":");
+		AppendJsonString(out, Name);
+		if (!HasLayout) {
+			out.append(",\"size_bytes\":null,\"partitions\":null,\"volumes\":null}");
+			return;
+		}
+		out.append(",\"size_bytes\":").append(std::to_string(Length));
+		out.append(",\"partitions\":[");
+		for (size_t i = 0; i < Partitions.size(); i++) {
+			const DevicePartition& partition = Partitions[i].Layout;
+			if (i > 0) {
+				out.push_back(',');
+			}
+			out.append("{\"number\":").append(std::to_string(partition.Number));
+			out.append(",\"offset_bytes\":").append(std::to_string(partition.Offset));
+			out.append(",\"size_bytes\":").append(std::to_string(partition.Length));
+			out.append(",\"volumes\":");
+			AppendVolumes(out, Partitions[i].Volumes);
+			out.push_back('}');
+		}
+		out.append("],\"volumes\":");
+		AppendVolumes(out, Volumes);
+		out.push_back('}');
+	}
+
+	// The record for a device that could not be read.
+	static void AppendErrorJson(std::string& out, const std::wstring& deviceId, std::string_view error) {
+		out.append("{\"device\":");
+		AppendJsonString(out, ToUtf8(deviceId));
+		out.append(",\"error\":");
+		AppendJsonString(out, error);
+		out.push_back('}');
+	}
+
+private:
+	static void AppendVolumes(std::string& out, const std::vector<DiskVolume>& volumes) {
+		out.push_back('[');
+		for (size_t i = 0; i < volumes.size(); i++) {
+			const DiskVolume& volume = volumes[i];
+			if (i > 0) {
+				out.push_back(',');
+			}
+			out.append("{\"volume\":");
+			AppendJsonString(out, volume.Volume);
+			out.append(",\"size_bytes\":").append(std::to_string(volume.Length));
+			out.append(",\"file_system\":");
+			if (volume.FileSystem.empty()) {
+				out.append("null");
+			}
+			else {
+				AppendJsonString(out, volume.FileSystem);
+			}
+			out.append(",\"mount_points\":[");
+			for (size_t j = 0; j < volume.MountPoints.size(); j++) {
+				if (j > 0) {
+					out.push_back(',');
+				}
+				AppendJsonString(out, volume.MountPoints[j]);
+			}
+			out.append("]}");
+		}
+		out.push_back(']');
+	}
+};
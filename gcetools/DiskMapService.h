@@ -0,0 +1,374 @@
+/* Copyright 2022 Google LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <exception>
+#include <iostream>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+#include "DeviceEnumerator.h"
+#include "DeviceEvents.h"
+#include "DeviceResolver.h"
+#include "LocalSocket.h"
+#include "OperationMetrics.h"
+#include "Utf8.h"
+
+// The name of every known device and the device behind every name. DeviceIds
+// are kept as UTF-8, the form they take on the wire.
+class DiskMapIndex {
+public:
+	// Replaces every entry.
+	void Reset(std::vector<std::pair<std::string, std::string>> entries) {
+		std::unordered_map<std::string, std::string> namesByDevice;
+		std::unordered_map<std::string, std::string> devicesByName;
+		for (auto& [deviceId, name] : entries) {
+			if (!name.empty()) {
+				devicesByName[name] = deviceId;
+			}
+			namesByDevice[deviceId] = std::move(name);
+		}
+
+		std::unique_lock<std::shared_mutex> lock(mutex_);
+		namesByDevice_.swap(namesByDevice);
+		devicesByName_.swap(devicesByName);
+	}
+
+	void Set(const std::string& deviceId, const std::string& name) {
+		std::unique_lock<std::shared_mutex> lock(mutex_);
+		RemoveLocked(deviceId);
+		namesByDevice_[deviceId] = name;
+		if (!name.empty()) {
+			devicesByName_[name] = deviceId;
+		}
+	}
+
+	void Remove(const std::string& deviceId) {
+		std::unique_lock<std::shared_mutex> lock(mutex_);
+		RemoveLocked(deviceId);
+	}
+
+	bool FindName(const std::string& deviceId, std::string& name) const {
+		std::shared_lock<std::shared_mutex> lock(mutex_);
+		auto it = namesByDevice_.find(deviceId);
+		if (it == namesByDevice_.end() || it->second.empty()) {
+			return false;
+		}
+		name = it->second;
+		return true;
+	}
+
+	bool FindDevice(const std::string& name, std::string& deviceId) const {
+		std::shared_lock<std::shared_mutex> lock(mutex_);
+		auto it = devicesByName_.find(name);
+		if (it == devicesByName_.end()) {
+			return false;
+		}
+		deviceId = it->second;
+		return true;
+	}
+
+	std::vector<std::pair<std::string, std::string>> GetEntries() const {
+		std::shared_lock<std::shared_mutex> lock(mutex_);
+		return std::vector<std::pair<std::string, std::string>>(namesByDevice_.begin(), namesByDevice_.end());
+	}
+
+private:
+	mutable std::shared_mutex mutex_;
+	std::unordered_map<std::string, std::string> namesByDevice_;
+	std::unordered_map<std::string, std::string> devicesByName_;
+
+	void RemoveLocked(const std::string& deviceId) {
+		auto it = namesByDevice_.find(deviceId);
+		if (it == namesByDevice_.end()) {
+			return;
+		}
+		auto byName = devicesByName_.find(it->second);
+		if (byName != devicesByName_.end() && byName->second == deviceId) {
+			devicesByName_.erase(byName);
+		}
+		namesByDevice_.erase(it);
+	}
+};
+
+// Keeps a DiskMapIndex of the attached devices and answers lookups from it
+// over a local endpoint, so clients do not pay for enumerating and querying
+// the devices themselves. Follow() keeps the index current as devices come
+// and go.
+//
+// The protocol is line based. Each request is one line and gets one response
+// line, except LIST which is followed by one line per device:
+//
+//   NAME <DeviceId>      OK <name> | NOTFOUND
+//   DEVICE <name>        OK <DeviceId> | NOTFOUND
+//   LIST                 OK <count>, then <DeviceId>\t<name> per device
+//   REFRESH              OK <count>; enumerates and resolves every device again
+//   REFRESH <DeviceId>   OK <name> | NOTFOUND; resolves one (new) device again,
+//                        if the enumerator lists it, and otherwise opens nothing
+//   METRICS [json|prometheus]
+//                        OK <count>, then <count> lines of OperationMetrics
+//
+// Anything else gets ERROR <message>. Clients cannot drop devices from the
+// index: removals come from Follow(), or from a full REFRESH.
+class DiskMapService {
+public:
+	DiskMapService(DeviceEnumerator& enumerator, DeviceResolver& resolver)
+		: enumerator_(enumerator), resolver_(resolver)
+	{
+	}
+
+	~DiskMapService() {
+		Stop();
+	}
+
+	const DiskMapIndex& GetIndex() const {
+		return index_;
+	}
+
+	// Enumerates and resolves every device, replacing the whole index.
+	// Returns the number of devices found.
+	size_t Refresh() {
+		std::lock_guard<std::mutex> lock(updateMutex_);
+		std::vector<std::pair<std::string, std::string>> entries;
+		resolver_.Resolve(enumerator_.EnumerateDeviceIds(), [&entries](const DeviceResolution& resolution) {
+			if (!resolution.Error.empty()) {
+				std::cerr << "Failed to resolve device: " << resolution.Error << std::endl;
+			}
+			entries.emplace_back(ToUtf8(resolution.DeviceId), resolution.Name);
+		});
+
+		size_t count = entries.size();
+		index_.Reset(std::move(entries));
+		return count;
+	}
+
+	// Call when a device arrives or changes; only that device is queried
+	// again. Returns false if it could not be resolved, in which case it is
+	// dropped from the index.
+	bool OnDeviceArrived(const std::wstring& deviceId) {
+		std::lock_guard<std::mutex> lock(updateMutex_);
+		DeviceResolution resolution = resolver_.ResolveOne(deviceId);
+		std::string key = ToUtf8(deviceId);
+		if (!resolution.Error.empty()) {
+			index_.Remove(key);
+			return false;
+		}
+		index_.Set(key, resolution.Name);
+		return true;
+	}
+
+	void OnDeviceRemoved(const std::wstring& deviceId) {
+		std::lock_guard<std::mutex> lock(updateMutex_);
+		index_.Remove(ToUtf8(deviceId));
+	}
+
+	// Applies each event to the index until the event source is stopped.
+	// Subscribe events before the first Refresh(), so no change made while
+	// it runs is missed.
+	void Follow(DeviceEventSource& events) {
+		DeviceEvent event;
+		while (events.Wait(event)) {
+			if (event.Kind == DeviceEventKind::Removed) {
+				OnDeviceRemoved(event.DeviceId);
+			}
+			else {
+				OnDeviceArrived(event.DeviceId);
+			}
+		}
+	}
+
+	// Appends the response to a single request line.
+	void HandleRequest(std::string_view request, std::string& response) {
+		if (!request.empty() && request.back() == '\r') {
+			request.remove_suffix(1);
+		}
+		std::string_view command = request.substr(0, request.find(' '));
+		std::string argument(command.size() < request.size() ? request.substr(command.size() + 1) : std::string_view());
+		std::string value;
+
+		if (command == "NAME" && !argument.empty()) {
+			AppendResult(index_.FindName(argument, value), value, response);
+		}
+		else if (command == "DEVICE" && !argument.empty()) {
+			AppendResult(index_.FindDevice(argument, value), value, response);
+		}
+		else if (command == "LIST" && argument.empty()) {
+			auto entries = index_.GetEntries();
+			response += "OK " + std::to_string(entries.size()) + "\n";
+			for (const auto& [deviceId, name] : entries) {
+				response += deviceId + "\t" + name + "\n";
+			}
+		}
+		else if (command == "REFRESH" && argument.empty()) {
+			response += "OK " + std::to_string(Refresh()) + "\n";
+		}
+		else if (command == "REFRESH") {
+			// Clients may only have devices the enumerator lists opened.
+			std::wstring deviceId = FromUtf8(argument);
+			std::string error;
+			if (!IsEnumerated(deviceId, error)) {
+				if (error.empty()) {
+					AppendResult(false, value, response);
+				}
+				else {
+					response += "ERROR " + error + "\n";
+				}
+				return;
+			}
+			bool found = OnDeviceArrived(deviceId) && index_.FindName(argument, value);
+			AppendResult(found, value, response);
+		}
+		else if (command == "METRICS" && (argument.empty() || argument == "json" || argument == "prometheus")) {
+			AppendMetrics(argument == "prometheus", response);
+		}
+		else {
+			response += "ERROR Unknown request\n";
+		}
+	}
+
+	// Answers requests on the listener until Stop() is called. Each client
+	// gets its own thread, so a slow REFRESH does not hold up lookups.
+	void Serve(LocalListener& listener) {
+		{
+			std::lock_guard<std::mutex> lock(sessionsMutex_);
+			listener_ = &listener;
+			if (stopping_) {
+				listener.Stop();
+			}
+		}
+
+		while (std::unique_ptr<LocalConnection> connection = listener.Accept()) {
+			std::lock_guard<std::mutex> lock(sessionsMutex_);
+			ReapSessions();
+			Session& session = sessions_.emplace_back();
+			session.Connection = std::move(connection);
+			session.Thread = std::thread(&DiskMapService::RunSession, this, std::ref(session));
+		}
+
+		std::list<Session> sessions;
+		{
+			std::lock_guard<std::mutex> lock(sessionsMutex_);
+			listener_ = nullptr;
+			for (Session& session : sessions_) {
+				session.Connection->Shutdown();
+			}
+			sessions.swap(sessions_);
+		}
+		for (Session& session : sessions) {
+			session.Thread.join();
+		}
+	}
+
+	// Makes Serve() disconnect every client and return, including a Serve()
+	// that has not started yet. May be called from any thread.
+	void Stop() {
+		std::lock_guard<std::mutex> lock(sessionsMutex_);
+		stopping_ = true;
+		if (listener_ != nullptr) {
+			listener_->Stop();
+		}
+	}
+
+private:
+	struct Session {
+		std::unique_ptr<LocalConnection> Connection;
+		std::thread Thread;
+		std::atomic<bool> Finished = false;
+	};
+
+	DeviceEnumerator& enumerator_;
+	DeviceResolver& resolver_;
+	DiskMapIndex index_;
+	// Serializes changes to the index, so a full refresh cannot undo an
+	// event applied while it ran. Lookups are never blocked by one.
+	std::mutex updateMutex_;
+
+	std::mutex sessionsMutex_;
+	LocalListener* listener_ = nullptr;
+	bool stopping_ = false;
+	std::list<Session> sessions_;
+
+	// Returns whether the enumerator lists deviceId. Clients may only have
+	// those devices opened. If the devices could not be enumerated, error
+	// says why.
+	bool IsEnumerated(const std::wstring& deviceId, std::string& error) {
+		std::lock_guard<std::mutex> lock(updateMutex_);
+		try {
+			std::vector<std::wstring> deviceIds = enumerator_.EnumerateDeviceIds();
+			return std::find(deviceIds.begin(), deviceIds.end(), deviceId) != deviceIds.end();
+		}
+		catch (const std::exception& e) {
+			error = e.what();
+		}
+		return false;
+	}
+
+	static void AppendResult(bool found, const std::string& value, std::string& response) {
+		if (found) {
+			response += "OK " + value + "\n";
+		}
+		else {
+			response += "NOTFOUND\n";
+		}
+	}
+
+	static void AppendMetrics(bool prometheus, std::string& response) {
+		std::string metrics;
+		if (prometheus) {
+			OperationMetrics::AppendPrometheus(metrics);
+		}
+		else {
+			OperationMetrics::AppendJson(metrics);
+			metrics.push_back('\n');
+		}
+		response += "OK " + std::to_string(std::count(metrics.begin(), metrics.end(), '\n')) + "\n";
+		response += metrics;
+	}
+
+	void RunSession(Session& session) {
+		std::string request;
+		std::string response;
+		while (session.Connection->ReadLine(request)) {
+			response.clear();
+			HandleRequest(request, response);
+			if (!session.Connection->Write(response)) {
+				break;
+			}
+		}
+		session.Finished = true;
+	}
+
+	// Called with sessionsMutex_ held.
+	void ReapSessions() {
+		for (auto it = sessions_.begin(); it != sessions_.end();) {
+			if (it->Finished) {
+				it->Thread.join();
+				it = sessions_.erase(it);
+			}
+			else {
+				++it;
+			}
+		}
+	}
+};
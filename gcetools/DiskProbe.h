@@ -0,0 +1,202 @@
+/* Copyright 2022 Google LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <exception>
+#include <filesystem>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+#include "DiskIoQueue.h"
+#include "LinuxDiskIoQueue.h"
+#include "Win32DiskIoQueue.h"
+
+struct DiskProbeOptions {
+	// Bytes per request. A multiple of the sector size.
+	size_t BlockSize = 4096;
+	// Requests kept outstanding by each thread.
+	size_t QueueDepth = 32;
+	unsigned int ThreadCount = 1;
+	// The share of requests that are reads, from 0 to 100. The rest are
+	// writes, which overwrite the probed part of the disk.
+	unsigned int ReadPercent = 100;
+	// Walk the disk in order instead of at random offsets.
+	bool Sequential = false;
+	std::chrono::milliseconds Duration{ 10000 };
+	// How much of the start of the disk to use. 0 uses all of it.
+	uint64_t Size = 0;
+};
+
+struct DiskProbeResult {
+	uint64_t Reads = 0;
+	uint64_t Writes = 0;
+	std::chrono::duration<double> Elapsed{ 0 };
+	// Whether the requests bypassed the OS cache.
+	bool Unbuffered = true;
+	// The latency of every request, sorted.
+	std::vector<std::chrono::nanoseconds> Latencies;
+
+	double GetIops(uint64_t requests) const {
+		return Elapsed.count() > 0 ? requests / Elapsed.count() : 0;
+	}
+
+	// The latency that p of the requests were at most, for p in [0, 1].
+	std::chrono::nanoseconds GetLatency(double p) const {
+		if (Latencies.empty()) {
+			return std::chrono::nanoseconds(0);
+		}
+		return Latencies[std::min(Latencies.size() - 1, (size_t)(p * Latencies.size()))];
+	}
+};
+
+// Measures the IOPS, throughput and latency a disk delivers, to check it
+// against what was provisioned. Each thread keeps QueueDepth unbuffered
+// requests outstanding on its own queue (overlapped I/O on Windows, native
+// AIO on Linux) for the given duration.
+class DiskProbe {
+public:
+	using QueueFactory = std::function<std::unique_ptr<DiskIoQueue>(size_t queueDepth, size_t blockSize, bool write)>;
+
+	static QueueFactory GetQueueFactory(const std::filesystem::path& path) {
+		return [path](size_t queueDepth, size_t blockSize, bool write) -> std::unique_ptr<DiskIoQueue> {
+#ifdef _WIN32
+			return std::make_unique<Win32DiskIoQueue>(path, queueDepth, blockSize, write);
+#elif defined(__linux__)
+			return std::make_unique<LinuxDiskIoQueue>(path, queueDepth, blockSize, write);
+#else
+			throw std::runtime_error("Disks cannot be probed on this platform.");
+#endif
+		};
+	}
+
+	static DiskProbeResult Run(const QueueFactory& openQueue, const DiskProbeOptions& options) {
+		if (options.BlockSize == 0 || options.BlockSize % 512 != 0 || options.QueueDepth == 0 ||
+			options.ThreadCount == 0 || options.ReadPercent > 100) {
+			throw std::runtime_error("Invalid probe options.");
+		}
+
+		// Every queue is opened before any I/O starts, so a target that
+		// cannot be opened fails before anything is written.
+		bool write = options.ReadPercent < 100;
+		std::vector<std::unique_ptr<DiskIoQueue>> queues;
+		for (unsigned int i = 0; i < options.ThreadCount; i++) {
+			queues.push_back(openQueue(options.QueueDepth, options.BlockSize, write));
+		}
+		uint64_t size = queues[0]->GetSize();
+		if (options.Size > 0) {
+			size = std::min(size, options.Size);
+		}
+		uint64_t blockCount = size / options.BlockSize;
+		if (blockCount < options.ThreadCount) {
+			throw std::runtime_error("The disk is too small for the block size.");
+		}
+
+		DiskProbeResult result;
+		result.Unbuffered = queues[0]->IsUnbuffered();
+		std::mutex mutex;
+		std::exception_ptr error;
+		std::vector<std::thread> threads;
+		Clock::time_point start = Clock::now();
+		Clock::time_point end = start + options.Duration;
+		for (unsigned int i = 0; i < options.ThreadCount; i++) {
+			threads.emplace_back([&, i]() {
+				ThreadResult threadResult;
+				try {
+					// Sequential threads each walk their own stretch of the disk.
+					uint64_t firstBlock = blockCount * i / options.ThreadCount;
+					uint64_t lastBlock = blockCount * (i + 1) / options.ThreadCount;
+					RunThread(*queues[i], options, firstBlock, lastBlock, end, i, threadResult);
+				}
+				catch (...) {
+					std::lock_guard<std::mutex> lock(mutex);
+					error = std::current_exception();
+				}
+				std::lock_guard<std::mutex> lock(mutex);
+				result.Reads += threadResult.Reads;
+				result.Writes += threadResult.Writes;
+				result.Latencies.insert(result.Latencies.end(), threadResult.Latencies.begin(), threadResult.Latencies.end());
+			});
+		}
+		for (std::thread& thread : threads) {
+			thread.join();
+		}
+		result.Elapsed = Clock::now() - start;
+		if (error) {
+			std::rethrow_exception(error);
+		}
+
+		std::sort(result.Latencies.begin(), result.Latencies.end());
+		return result;
+	}
+
+private:
+	using Clock = std::chrono::steady_clock;
+
+	struct ThreadResult {
+		uint64_t Reads = 0;
+		uint64_t Writes = 0;
+		std::vector<std::chrono::nanoseconds> Latencies;
+	};
+
+	static void RunThread(DiskIoQueue& queue, const DiskProbeOptions& options, uint64_t firstBlock, uint64_t lastBlock,
+		Clock::time_point end, unsigned int seed, ThreadResult& result) {
+		std::mt19937_64 random(seed);
+		uint64_t nextBlock = firstBlock;
+		auto nextOffset = [&]() {
+			uint64_t block;
+			if (options.Sequential) {
+				block = nextBlock;
+				nextBlock = nextBlock + 1 < lastBlock ? nextBlock + 1 : firstBlock;
+			}
+			else {
+				block = std::uniform_int_distribution<uint64_t>(firstBlock, lastBlock - 1)(random);
+			}
+			return block * options.BlockSize;
+		};
+
+		std::vector<Clock::time_point> started(options.QueueDepth);
+		std::vector<bool> writes(options.QueueDepth);
+		auto submit = [&](size_t buffer) {
+			writes[buffer] = random() % 100 >= options.ReadPercent;
+			started[buffer] = Clock::now();
+			queue.Submit(buffer, writes[buffer], nextOffset());
+		};
+
+		size_t outstanding = 0;
+		for (; outstanding < options.QueueDepth; outstanding++) {
+			submit(outstanding);
+		}
+		while (outstanding > 0) {
+			size_t buffer = queue.WaitForCompletion();
+			Clock::time_point now = Clock::now();
+			result.Latencies.push_back(now - started[buffer]);
+			(writes[buffer] ? result.Writes : result.Reads)++;
+			if (now < end) {
+				submit(buffer);
+			}
+			else {
+				outstanding--;
+			}
+		}
+	}
+};
@@ -0,0 +1,366 @@
+/* Copyright 2022 Google LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <system_error>
+#include <vector>
+#include "GoogleStorageDevice.h"
+#include "MappedFile.h"
+#include "NvmeV1BasedScsiNameString.h"
+#include "StorageTypes.h"
+#include "Utf8.h"
+
+// What a snapshot records about one disk.
+struct DiskSnapshotEntry {
+	std::string DeviceId;
+	std::string Name;
+	STORAGE_BUS_TYPE BusType = STORAGE_BUS_TYPE::BusTypeUnknown;
+	// The NVMe controller's serial number, from its SCSI name string, or
+	// the SCSI disk's unit serial number.
+	std::string SerialNumber;
+	// 0 for SCSI disks.
+	DWORD NamespaceId = 0;
+	// From the STORAGE_DEVICE_DESCRIPTOR, without their padding.
+	std::string Vendor;
+	std::string Product;
+	std::string Revision;
+	// Why the disk could not be read, if it could not.
+	std::string Error;
+
+	static DiskSnapshotEntry Read(GoogleStorageDevice& device, const std::wstring& deviceId) {
+		DiskSnapshotEntry entry;
+		entry.DeviceId = ToUtf8(deviceId);
+		entry.BusType = device.GetBusType();
+		device.GetDeviceName(entry.Name);
+		{
+			StorageQueryResult<STORAGE_DEVICE_DESCRIPTOR> descriptor = device.GetStorageDeviceDescriptor();
+			entry.Vendor = GetDescriptorString(descriptor, descriptor->VendorIdOffset);
+			entry.Product = GetDescriptorString(descriptor, descriptor->ProductIdOffset);
+			entry.Revision = GetDescriptorString(descriptor, descriptor->ProductRevisionOffset);
+			entry.SerialNumber = GetDescriptorString(descriptor, descriptor->SerialNumberOffset);
+		}
+		NvmeLocation location;
+		if (device.GetNvmeLocation(location)) {
+			entry.NamespaceId = location.NamespaceId;
+			entry.SerialNumber = Trim(std::string_view(location.ControllerId).substr(
+				sizeof(NvmeV1BasedScsiNameString::PciVendorId) + sizeof(NvmeV1BasedScsiNameString::ModelNumber)));
+		}
+		return entry;
+	}
+
+	// The record for a disk that could not be read.
+	static DiskSnapshotEntry FromError(const std::wstring& deviceId, std::string_view error) {
+		DiskSnapshotEntry entry;
+		entry.DeviceId = ToUtf8(deviceId);
+		entry.Error = error;
+		return entry;
+	}
+
+private:
+	static std::string GetDescriptorString(const StorageQueryResult<STORAGE_DEVICE_DESCRIPTOR>& descriptor, DWORD offset) {
+		if (offset == 0 || offset >= descriptor.Size()) {
+			return std::string();
+		}
+		const char* value = (const char*)descriptor.Get() + offset;
+		return Trim(std::string_view(value, strnlen(value, descriptor.Size() - offset)));
+	}
+
+	static std::string Trim(std::string_view value) {
+		size_t begin = value.find_first_not_of(std::string_view(" \0", 2));
+		if (begin == std::string_view::npos) {
+			return std::string();
+		}
+		return std::string(value.substr(begin, value.find_last_not_of(std::string_view(" \0", 2)) + 1 - begin));
+	}
+};
+
+// A record read from a snapshot. The strings point into the snapshot.
+struct DiskSnapshotRecord {
+	std::string_view DeviceId;
+	std::string_view Name;
+	STORAGE_BUS_TYPE BusType = STORAGE_BUS_TYPE::BusTypeUnknown;
+	std::string_view SerialNumber;
+	DWORD NamespaceId = 0;
+	std::string_view Vendor;
+	std::string_view Product;
+	std::string_view Revision;
+	std::string_view Error;
+
+	// Whether both describe the same disk in the same state, apart from
+	// where it is attached and what it is called.
+	bool SameDisk(const DiskSnapshotRecord& other) const {
+		return BusType == other.BusType && NamespaceId == other.NamespaceId && SerialNumber == other.SerialNumber &&
+			Vendor == other.Vendor && Product == other.Product && Revision == other.Revision && Error == other.Error;
+	}
+};
+
+// The disks attached to one machine at one time, for comparing inventories
+// across a fleet. A snapshot is written in one go and read in place, mapped
+// into memory:
+//
+//   SnapshotFileHeader
+//   host name bytes
+//   records, sorted by DeviceId, each:
+//     SnapshotRecordHeader
+//     FieldCount fields, each a uint16_t length and its bytes, in the order
+//     DeviceId, Name, SerialNumber, Vendor, Product, Revision, Error
+//
+// Every record starts with its own size, so fields added at the end of a
+// record in later versions are skipped by earlier readers; Version changes
+// only when existing fields do. All integers are little-endian.
+class DiskSnapshot {
+public:
+	DiskSnapshot() {
+	}
+	DiskSnapshot(const DiskSnapshot&) = delete;
+	DiskSnapshot& operator=(const DiskSnapshot&) = delete;
+
+	// Returns false if the file cannot be mapped or is not a valid snapshot.
+	bool Open(const std::filesystem::path& path) {
+		data_ = nullptr;
+		if (!file_.Open(path)) {
+			return false;
+		}
+		return Attach(file_.Data(), file_.Size());
+	}
+
+	// Reads a snapshot already in memory, which must outlive this.
+	bool Attach(const BYTE* data, size_t size) {
+		data_ = data;
+		size_ = size;
+		if (!IsValid()) {
+			data_ = nullptr;
+			return false;
+		}
+		return true;
+	}
+
+	std::string_view GetHost() const {
+		return std::string_view((const char*)data_ + sizeof(SnapshotFileHeader), GetHeader()->HostLength);
+	}
+
+	// Milliseconds since the Unix epoch.
+	uint64_t GetCreatedTime() const {
+		return GetHeader()->CreatedTime;
+	}
+
+	uint32_t GetRecordCount() const {
+		return GetHeader()->RecordCount;
+	}
+
+	// Walks the records in DeviceId order.
+	class Cursor {
+	public:
+		Cursor(const DiskSnapshot& snapshot)
+			: next_(snapshot.data_ + sizeof(SnapshotFileHeader) + snapshot.GetHeader()->HostLength),
+			end_(snapshot.data_ + snapshot.size_)
+		{
+		}
+
+		// Returns false after the last record.
+		bool Next(DiskSnapshotRecord& record) {
+			if (next_ == end_) {
+				return false;
+			}
+			next_ = ReadRecord(next_, record);
+			return true;
+		}
+
+	private:
+		const BYTE* next_;
+		const BYTE* end_;
+	};
+
+	// Lays out entries as a snapshot of host, sorting them by DeviceId and
+	// keeping one entry per DeviceId. Strings longer than 65535 bytes are
+	// truncated.
+	static std::vector<BYTE> Serialize(std::string_view host, uint64_t createdTime, std::vector<DiskSnapshotEntry>& entries) {
+		std::stable_sort(entries.begin(), entries.end(), [](const DiskSnapshotEntry& a, const DiskSnapshotEntry& b) {
+			return a.DeviceId < b.DeviceId;
+		});
+		entries.erase(std::unique(entries.begin(), entries.end(), [](const DiskSnapshotEntry& a, const DiskSnapshotEntry& b) {
+			return a.DeviceId == b.DeviceId;
+		}), entries.end());
+		host = host.substr(0, UINT16_MAX);
+
+		std::vector<BYTE> contents(sizeof(SnapshotFileHeader));
+		Append(contents, host.data(), host.size());
+		for (const DiskSnapshotEntry& entry : entries) {
+			size_t recordOffset = contents.size();
+			SnapshotRecordHeader record = {};
+			record.BusType = (uint8_t)entry.BusType;
+			record.FieldCount = FieldCount;
+			record.NamespaceId = entry.NamespaceId;
+			Append(contents, &record, sizeof(record));
+			for (const std::string* field : { &entry.DeviceId, &entry.Name, &entry.SerialNumber, &entry.Vendor,
+				&entry.Product, &entry.Revision, &entry.Error }) {
+				uint16_t length = (uint16_t)std::min<size_t>(field->size(), UINT16_MAX);
+				Append(contents, &length, sizeof(length));
+				Append(contents, field->data(), length);
+			}
+			uint32_t recordSize = (uint32_t)(contents.size() - recordOffset);
+			memcpy(contents.data() + recordOffset, &recordSize, sizeof(recordSize));
+		}
+
+		SnapshotFileHeader header = {};
+		header.Magic = Magic;
+		header.Version = Version;
+		header.HeaderSize = sizeof(SnapshotFileHeader);
+		header.RecordCount = (uint32_t)entries.size();
+		header.HostLength = (uint16_t)host.size();
+		header.FileSize = contents.size();
+		header.CreatedTime = createdTime;
+		memcpy(contents.data(), &header, sizeof(header));
+		return contents;
+	}
+
+	// Writes the snapshot alongside path and renames it into place, so
+	// readers never see a partial snapshot.
+	static void Save(const std::filesystem::path& path, const std::vector<BYTE>& contents) {
+		std::filesystem::path tempPath = path;
+		tempPath += ".tmp";
+		{
+			std::ofstream out(tempPath, std::ios::binary | std::ios::trunc);
+			out.write((const char*)contents.data(), contents.size());
+			if (!out) {
+				throw std::runtime_error("Failed to write disk snapshot " + tempPath.string());
+			}
+		}
+
+		std::error_code err;
+		std::filesystem::rename(tempPath, path, err);
+		if (err) {
+			std::filesystem::remove(tempPath, err);
+			throw std::runtime_error("Failed to replace disk snapshot " + path.string());
+		}
+	}
+
+private:
+	static constexpr uint32_t Magic = 0x53444347;  // "GCDS"
+	static constexpr uint16_t Version = 1;
+	static constexpr uint8_t FieldCount = 7;
+
+#pragma pack(push, 1)
+	struct SnapshotFileHeader {
+		uint32_t Magic;
+		uint16_t Version;
+		uint16_t HeaderSize;
+		uint32_t RecordCount;
+		uint16_t HostLength;
+		uint16_t Reserved;
+		uint64_t FileSize;
+		uint64_t CreatedTime;
+	};
+
+	struct SnapshotRecordHeader {
+		// Including this header.
+		uint32_t RecordSize;
+		uint8_t BusType;
+		uint8_t FieldCount;
+		uint16_t Reserved;
+		uint32_t NamespaceId;
+	};
+#pragma pack(pop)
+
+	static_assert(sizeof(SnapshotFileHeader) == 32, "SnapshotFileHeader is part of the file format");
+	static_assert(sizeof(SnapshotRecordHeader) == 12, "SnapshotRecordHeader is part of the file format");
+
+	MappedFile file_;
+	const BYTE* data_ = nullptr;
+	size_t size_ = 0;
+
+	const SnapshotFileHeader* GetHeader() const {
+		return (const SnapshotFileHeader*)data_;
+	}
+
+	// Records are not aligned, so they are copied out field by field.
+	static const BYTE* ReadRecord(const BYTE* data, DiskSnapshotRecord& record) {
+		SnapshotRecordHeader header;
+		memcpy(&header, data, sizeof(header));
+		record = DiskSnapshotRecord();
+		record.BusType = (STORAGE_BUS_TYPE)header.BusType;
+		record.NamespaceId = header.NamespaceId;
+		std::string_view* fields[FieldCount] = { &record.DeviceId, &record.Name, &record.SerialNumber, &record.Vendor,
+			&record.Product, &record.Revision, &record.Error };
+		const BYTE* field = data + sizeof(header);
+		for (uint8_t i = 0; i < std::min(header.FieldCount, FieldCount); i++) {
+			uint16_t length;
+			memcpy(&length, field, sizeof(length));
+			*fields[i] = std::string_view((const char*)field + sizeof(length), length);
+			field += sizeof(length) + length;
+		}
+		return data + header.RecordSize;
+	}
+
+	// Checks every record's bounds and order once up front, so that reading
+	// them can trust them.
+	bool IsValid() const {
+		if (size_ < sizeof(SnapshotFileHeader)) {
+			return false;
+		}
+		const SnapshotFileHeader* header = GetHeader();
+		if (header->Magic != Magic || header->Version != Version || header->HeaderSize != sizeof(SnapshotFileHeader) ||
+			header->FileSize != size_ || header->HostLength > size_ - sizeof(SnapshotFileHeader)) {
+			return false;
+		}
+
+		const BYTE* record = data_ + sizeof(SnapshotFileHeader) + header->HostLength;
+		const BYTE* end = data_ + size_;
+		std::string_view previousDeviceId;
+		for (uint32_t i = 0; i < header->RecordCount; i++) {
+			SnapshotRecordHeader recordHeader;
+			if ((size_t)(end - record) < sizeof(recordHeader)) {
+				return false;
+			}
+			memcpy(&recordHeader, record, sizeof(recordHeader));
+			if (recordHeader.RecordSize < sizeof(recordHeader) || recordHeader.RecordSize > (size_t)(end - record)) {
+				return false;
+			}
+			const BYTE* field = record + sizeof(recordHeader);
+			const BYTE* recordEnd = record + recordHeader.RecordSize;
+			for (uint8_t j = 0; j < std::min(recordHeader.FieldCount, FieldCount); j++) {
+				uint16_t length;
+				if ((size_t)(recordEnd - field) < sizeof(length)) {
+					return false;
+				}
+				memcpy(&length, field, sizeof(length));
+				if (length > (size_t)(recordEnd - field) - sizeof(length)) {
+					return false;
+				}
+				field += sizeof(length) + length;
+			}
+			DiskSnapshotRecord parsed;
+			ReadRecord(record, parsed);
+			if (i > 0 && parsed.DeviceId <= previousDeviceId) {
+				return false;
+			}
+			previousDeviceId = parsed.DeviceId;
+			record = recordEnd;
+		}
+		return record == end;
+	}
+
+	static void Append(std::vector<BYTE>& contents, const void* data, size_t size) {
+		contents.insert(contents.end(), (const BYTE*)data, (const BYTE*)data + size);
+	}
+};
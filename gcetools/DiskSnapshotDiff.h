@@ -0,0 +1,186 @@
+/* Copyright 2022 Google LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <string_view>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+#include "DiskSnapshot.h"
+
+enum class DiskDifferenceKind {
+	Added,
+	Removed,
+	// The device now has a disk with a different name behind it.
+	Renamed,
+	// The disk with this name is now attached as a different device.
+	Moved,
+	// The same device and name, but the disk's serial number, namespace,
+	// descriptor or error differ.
+	Changed,
+};
+
+// The strings point into the snapshots compared.
+struct DiskDifference {
+	DiskDifferenceKind Kind = DiskDifferenceKind::Added;
+	// The device now, or for Removed, the device before.
+	std::string_view DeviceId;
+	// The device before, when Moved.
+	std::string_view OldDeviceId;
+	// The name before, when Renamed or Removed.
+	std::string_view OldName;
+	// The name now, when Added, Renamed, Moved or Changed.
+	std::string_view Name;
+};
+
+// Compares snapshots of the same machine taken at different times.
+class DiskSnapshotDiff {
+public:
+	// Replaces differences with what changed from before to after, in
+	// DeviceId order, with each move where the disk now is. Both snapshots
+	// are sorted by DeviceId, so they are walked once each, side by side;
+	// only the disks that were added or removed are then matched up by name
+	// to find the moves.
+	static void Diff(const DiskSnapshot& before, const DiskSnapshot& after, std::vector<DiskDifference>& differences) {
+		differences.clear();
+		DiskSnapshot::Cursor beforeCursor(before);
+		DiskSnapshot::Cursor afterCursor(after);
+		DiskSnapshotRecord beforeRecord;
+		DiskSnapshotRecord afterRecord;
+		bool hasBefore = beforeCursor.Next(beforeRecord);
+		bool hasAfter = afterCursor.Next(afterRecord);
+		size_t added = 0;
+		size_t removed = 0;
+		while (hasBefore || hasAfter) {
+			if (!hasAfter || (hasBefore && beforeRecord.DeviceId < afterRecord.DeviceId)) {
+				differences.push_back(DiskDifference{ DiskDifferenceKind::Removed, beforeRecord.DeviceId, {}, beforeRecord.Name, {} });
+				removed++;
+				hasBefore = beforeCursor.Next(beforeRecord);
+			}
+			else if (!hasBefore || afterRecord.DeviceId < beforeRecord.DeviceId) {
+				differences.push_back(DiskDifference{ DiskDifferenceKind::Added, afterRecord.DeviceId, {}, {}, afterRecord.Name });
+				added++;
+				hasAfter = afterCursor.Next(afterRecord);
+			}
+			else {
+				if (beforeRecord.Name != afterRecord.Name) {
+					differences.push_back(DiskDifference{ DiskDifferenceKind::Renamed, afterRecord.DeviceId, {}, beforeRecord.Name, afterRecord.Name });
+				}
+				else if (!beforeRecord.SameDisk(afterRecord)) {
+					differences.push_back(DiskDifference{ DiskDifferenceKind::Changed, afterRecord.DeviceId, {}, {}, afterRecord.Name });
+				}
+				hasBefore = beforeCursor.Next(beforeRecord);
+				hasAfter = afterCursor.Next(afterRecord);
+			}
+		}
+		if (added > 0 && removed > 0) {
+			FindMoves(differences, added, removed);
+		}
+	}
+
+	// Diffs pairCount pairs of snapshots on threadCount threads. For each
+	// pair, open(index, before, after) opens or attaches its two snapshots,
+	// returning false if it could not, and then report(index, before, after,
+	// differences) is called, on whichever thread diffed it and in no
+	// particular order. Each thread reuses its own snapshots and differences,
+	// so a pair costs no allocations once they have grown.
+	template<typename TOpen, typename TReport>
+	static void DiffAll(size_t pairCount, unsigned int threadCount, TOpen&& open, TReport&& report) {
+		std::atomic<size_t> nextPair{ 0 };
+		auto worker = [&]() {
+			DiskSnapshot before;
+			DiskSnapshot after;
+			std::vector<DiskDifference> differences;
+			for (;;) {
+				size_t first = nextPair.fetch_add(PairsPerClaim);
+				if (first >= pairCount) {
+					return;
+				}
+				for (size_t i = first; i < std::min(first + PairsPerClaim, pairCount); i++) {
+					if (open(i, before, after)) {
+						Diff(before, after, differences);
+						report(i, before, after, differences);
+					}
+				}
+			}
+		};
+
+		threadCount = (unsigned int)std::min<size_t>(std::max(threadCount, 1u), (pairCount + PairsPerClaim - 1) / PairsPerClaim);
+		std::vector<std::thread> threads;
+		for (unsigned int i = 1; i < threadCount; i++) {
+			threads.emplace_back(worker);
+		}
+		worker();
+		for (std::thread& thread : threads) {
+			thread.join();
+		}
+	}
+
+private:
+	// Pairs a thread takes at a time, so that threads do not contend for
+	// every small snapshot.
+	static constexpr size_t PairsPerClaim = 64;
+	// Below this many added and removed disks, they are matched pairwise
+	// rather than through a map.
+	static constexpr size_t PairwiseMoveLimit = 64;
+
+	// Replaces each removed disk whose name was added elsewhere with a move.
+	static void FindMoves(std::vector<DiskDifference>& differences, size_t added, size_t removed) {
+		auto match = [](DiskDifference& removedDisk, DiskDifference& addedDisk) {
+			addedDisk = DiskDifference{ DiskDifferenceKind::Moved, addedDisk.DeviceId, removedDisk.DeviceId, {}, addedDisk.Name };
+			removedDisk.Kind = DiskDifferenceKind::Moved;
+		};
+
+		if (added * removed <= PairwiseMoveLimit) {
+			for (DiskDifference& removedDisk : differences) {
+				if (removedDisk.Kind != DiskDifferenceKind::Removed || removedDisk.OldName.empty()) {
+					continue;
+				}
+				for (DiskDifference& addedDisk : differences) {
+					if (addedDisk.Kind == DiskDifferenceKind::Added && addedDisk.Name == removedDisk.OldName) {
+						match(removedDisk, addedDisk);
+						break;
+					}
+				}
+			}
+		}
+		else {
+			std::unordered_map<std::string_view, DiskDifference*> removedByName;
+			for (DiskDifference& difference : differences) {
+				if (difference.Kind == DiskDifferenceKind::Removed && !difference.OldName.empty()) {
+					removedByName.emplace(difference.OldName, &difference);
+				}
+			}
+			for (DiskDifference& difference : differences) {
+				if (difference.Kind != DiskDifferenceKind::Added) {
+					continue;
+				}
+				auto removedDisk = removedByName.find(difference.Name);
+				if (removedDisk != removedByName.end()) {
+					match(*removedDisk->second, difference);
+					removedByName.erase(removedDisk);
+				}
+			}
+		}
+
+		// The removals that became moves are dropped; the moves are reported
+		// where the disk now is.
+		differences.erase(std::remove_if(differences.begin(), differences.end(), [](const DiskDifference& difference) {
+			return difference.Kind == DiskDifferenceKind::Moved && difference.OldDeviceId.empty();
+		}), differences.end());
+	}
+};
@@ -0,0 +1,133 @@
+/* Copyright 2022 Google LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#pragma once
+
+#include <string>
+#include <string_view>
+#include "DeviceBackend.h"
+#include "GoogleStorageDevice.h"
+#include "JsonText.h"
+#include "NvmeV1BasedScsiNameString.h"
+#include "StorageTypes.h"
+#include "Utf8.h"
+
+// What an I/O scheduler needs to know to place work for a disk: which
+// controller and adapter it is on, the largest and most finely aligned
+// transfer the adapter takes, and which NUMA node and CPUs its hardware
+// queues are serviced from.
+struct DiskTopology {
+	std::wstring DeviceId;
+	std::string Name;
+	STORAGE_BUS_TYPE BusType = STORAGE_BUS_TYPE::BusTypeUnknown;
+	// For NVMe disks, the controller's PCI vendor ID, model and serial
+	// number ("1AE0:nvme_card-pd:<serial>"), which every namespace on the
+	// controller shares.
+	std::string Controller;
+	DWORD MaximumTransferLength = 0;
+	DWORD MaximumPhysicalPages = 0;
+	DWORD AlignmentMask = 0;
+	// Left at its defaults where the OS exports nothing.
+	DeviceQueueTopology Queues;
+
+	static DiskTopology Read(GoogleStorageDevice& device, const std::wstring& deviceId) {
+		DiskTopology topology;
+		topology.DeviceId = deviceId;
+		topology.BusType = device.GetBusType();
+		device.GetDeviceName(topology.Name);
+		{
+			StorageQueryResult<STORAGE_ADAPTER_DESCRIPTOR> adapter = device.GetStorageAdapterDescriptor();
+			topology.MaximumTransferLength = adapter->MaximumTransferLength;
+			topology.MaximumPhysicalPages = adapter->MaximumPhysicalPages;
+			topology.AlignmentMask = adapter->AlignmentMask;
+		}
+		NvmeLocation location;
+		if (device.GetNvmeLocation(location)) {
+			topology.Controller = FormatController(location.ControllerId);
+		}
+		device.GetQueueTopology(topology.Queues);
+		return topology;
+	}
+
+	// One JSON object on a single line. Unknown values are null.
+	void AppendJson(std::string& out) const {
+		out.append("{\"device\":");
+		AppendJsonString(out, ToUtf8(DeviceId));
+		out.append(",\"name\":");
+		AppendJsonString(out, Name);
+		out.append(",\"bus\":");
+		AppendJsonString(out, BusType == STORAGE_BUS_TYPE::BusTypeNvme ? "nvme" : BusType == STORAGE_BUS_TYPE::BusTypeScsi ? "scsi" : "other");
+		out.append(",\"controller\":");
+		AppendOptionalString(out, Controller);
+		out.append(",\"adapter\":");
+		AppendOptionalString(out, Queues.Adapter);
+		out.append(",\"max_transfer_bytes\":").append(std::to_string(MaximumTransferLength));
+		out.append(",\"max_physical_pages\":").append(std::to_string(MaximumPhysicalPages));
+		out.append(",\"alignment_mask\":").append(std::to_string(AlignmentMask));
+		out.append(",\"numa_node\":").append(Queues.NumaNode >= 0 ? std::to_string(Queues.NumaNode) : "null");
+		if (Queues.QueueCpus.empty()) {
+			out.append(",\"queue_count\":null,\"queue_cpus\":null}");
+			return;
+		}
+		out.append(",\"queue_count\":").append(std::to_string(Queues.QueueCpus.size()));
+		out.append(",\"queue_cpus\":[");
+		for (size_t i = 0; i < Queues.QueueCpus.size(); i++) {
+			if (i > 0) {
+				out.push_back(',');
+			}
+			AppendJsonString(out, Queues.QueueCpus[i]);
+		}
+		out.append("]}");
+	}
+
+	// The record for a device that could not be read.
+	static void AppendErrorJson(std::string& out, const std::wstring& deviceId, std::string_view error) {
+		out.append("{\"device\":");
+		AppendJsonString(out, ToUtf8(deviceId));
+		out.append(",\"error\":");
+		AppendJsonString(out, error);
+		out.push_back('}');
+	}
+
+private:
+	static void AppendOptionalString(std::string& out, const std::string& value) {
+		if (value.empty()) {
+			out.append("null");
+		}
+		else {
+			AppendJsonString(out, value);
+		}
+	}
+
+	// The controller ID is the padded vendor, model and serial number
+	// fields of the SCSI name string.
+	static std::string FormatController(std::string_view controllerId) {
+		const size_t fieldSizes[] = {
+			sizeof(NvmeV1BasedScsiNameString::PciVendorId),
+			sizeof(NvmeV1BasedScsiNameString::ModelNumber),
+			sizeof(NvmeV1BasedScsiNameString::SerialNumber),
+		};
+		std::string formatted;
+		for (size_t fieldSize : fieldSizes) {
+			std::string_view field = controllerId.substr(0, fieldSize);
+			controllerId.remove_prefix(field.size());
+			size_t end = field.find_last_not_of(std::string_view(" \0", 2));
+			if (!formatted.empty()) {
+				formatted.push_back(':');
+			}
+			formatted.append(field.substr(0, end == std::string_view::npos ? 0 : end + 1));
+		}
+		return formatted;
+	}
+};
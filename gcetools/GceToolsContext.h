@@ -0,0 +1,121 @@
+/* Copyright 2022 Google LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#pragma once
+
+#include <memory>
+#include <string>
+#include <utility>
+#include "DeviceBackend.h"
+#include "DeviceEnumerator.h"
+#include "DeviceNameCache.h"
+#include "DeviceResolver.h"
+#include "LinuxDeviceBackend.h"
+#include "PhysicalDriveEnumerator.h"
+#include "SysBlockDeviceEnumerator.h"
+#include "Win32DeviceBackend.h"
+#include "WmiDeviceEnumerator.h"
+
+enum class EnumeratorKind {
+	// The direct enumerator, falling back to WMI on Windows.
+	Auto,
+	// SetupAPI on Windows, /sys/block elsewhere.
+	Direct,
+	Wmi,
+};
+
+inline std::unique_ptr<DeviceEnumerator> CreateDeviceEnumerator(EnumeratorKind kind) {
+#ifdef _WIN32
+	switch (kind) {
+	case EnumeratorKind::Direct:
+		return std::make_unique<PhysicalDriveEnumerator>();
+	case EnumeratorKind::Wmi:
+		return std::make_unique<WmiDeviceEnumerator>();
+	default:
+		return std::make_unique<FallbackDeviceEnumerator>(
+			std::make_unique<PhysicalDriveEnumerator>(), std::make_unique<WmiDeviceEnumerator>());
+	}
+#else
+	(void)kind;
+	return std::make_unique<SysBlockDeviceEnumerator>();
+#endif
+}
+
+// Opens the disks attached to this machine. Empty on platforms where only
+// simulated devices can be resolved. On Linux, useSysfs reads what the
+// kernel exports under /sys/block instead of querying the device where
+// possible.
+inline DeviceBackendFactory CreateDeviceBackendFactory(bool useSysfs = true) {
+#ifdef _WIN32
+	(void)useSysfs;
+	return [](const std::wstring& deviceId) {
+		return std::make_unique<Win32DeviceBackend>(deviceId.c_str());
+	};
+#elif defined(__linux__)
+	return [useSysfs](const std::wstring& deviceId) {
+		return std::make_unique<LinuxDeviceBackend>(deviceId, "/sys", useSysfs);
+	};
+#else
+	(void)useSysfs;
+	return DeviceBackendFactory();
+#endif
+}
+
+// Everything it takes to resolve disk names, kept for as long as names are
+// needed rather than rebuilt for every lookup: the enumerator, the backend
+// factory, the resolver and, optionally, a cache of the names already
+// resolved. The gcetools CLI resolves through one of these for a single run;
+// the gcetools_api library hands one out to each caller as a gcetools_context,
+// so that repeated lookups skip everything but the driver queries.
+class GceToolsContext {
+public:
+	GceToolsContext(std::unique_ptr<DeviceEnumerator> enumerator, DeviceBackendFactory backendFactory,
+		unsigned int threadCount = DeviceResolver::DefaultThreadCount)
+		: enumerator_(std::move(enumerator)), backendFactory_(backendFactory), resolver_(std::move(backendFactory), threadCount)
+	{
+	}
+	GceToolsContext(const GceToolsContext&) = delete;
+	GceToolsContext& operator=(const GceToolsContext&) = delete;
+
+	DeviceEnumerator& GetEnumerator() {
+		return *enumerator_;
+	}
+
+	const DeviceBackendFactory& GetBackendFactory() const {
+		return backendFactory_;
+	}
+
+	DeviceResolver& GetResolver() {
+		return resolver_;
+	}
+
+	// Looks names up in nameCache before resolving them, and adds the names
+	// that had to be resolved to it. A disk whose identifiers are in the
+	// cache costs one driver query.
+	void SetNameCache(std::unique_ptr<DeviceNameCache> nameCache) {
+		nameCache_ = std::move(nameCache);
+		resolver_.SetNameCache(nameCache_.get());
+	}
+
+	// Null unless SetNameCache() was called.
+	DeviceNameCache* GetNameCache() {
+		return nameCache_.get();
+	}
+
+private:
+	std::unique_ptr<DeviceEnumerator> enumerator_;
+	DeviceBackendFactory backendFactory_;
+	DeviceResolver resolver_;
+	std::unique_ptr<DeviceNameCache> nameCache_;
+};
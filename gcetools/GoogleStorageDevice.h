@@ -14,12 +14,32 @@
  */
 #pragma once
 
+#include <algorithm>
+#include <cstddef>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <string_view>
 #include "NvmeV1BasedScsiNameString.h"
+#include "NvmeVendorMetadata.h"
 #include "StorageDevice.h"
+#include "StorageIdentifiers.h"
+
+// Where an NVMe disk lives: the controller, identified by the PCI vendor ID,
+// model and serial number in its SCSI name string, and the namespace on it.
+struct NvmeLocation {
+	std::string ControllerId;
+	DWORD NamespaceId = 0;
+};
 
 class GoogleStorageDevice : public StorageDevice {
 public:
-	GoogleStorageDevice(BSTR deviceNamespace) : StorageDevice(deviceNamespace)
+#ifdef _WIN32
+	GoogleStorageDevice(LPCWSTR deviceNamespace) : StorageDevice(deviceNamespace)
+	{
+	}
+#endif
+	GoogleStorageDevice(std::unique_ptr<DeviceBackend> backend) : StorageDevice(std::move(backend))
 	{
 	}
 	~GoogleStorageDevice()
@@ -27,65 +47,175 @@ public:
 	}
 
 	std::string GetDeviceName() {
+		std::string name;
+		GetDeviceName(name);
+		return name;
+	}
+
+	// Writes the device name into name, reusing its storage, so resolving
+	// names repeatedly does not allocate once the buffers have warmed up.
+	void GetDeviceName(std::string& name) {
+		name.clear();
 		STORAGE_BUS_TYPE busType = GetBusType();
 
 		switch (busType) {
 		case STORAGE_BUS_TYPE::BusTypeNvme:
-			return GetNvmeDeviceName();
+			GetNvmeDeviceName(name);
+			return;
 		case STORAGE_BUS_TYPE::BusTypeScsi:
-			return GetScsiDeviceName();
+			GetScsiDeviceName(name);
+			return;
 		default:
 			std::cerr << "Unsupported device type. Device must be an NVMe or SCSI device." << std::endl;
-			return std::string("");
+			return;
+		}
+	}
+
+	// Writes the identifiers the device reports in its device ID descriptor
+	// into identity. These are stable for the life of the disk (the NVMe
+	// serial number and namespace, or the SCSI VPD identifiers), and take a
+	// single driver query to read. identifierCount, if given, receives how
+	// many identifiers identity holds, for VisitStorageIdentifiers().
+	void GetDeviceIdentity(std::string& identity, DWORD* identifierCount = nullptr) {
+		StorageQueryResult<STORAGE_DEVICE_ID_DESCRIPTOR> deviceIdDescriptor = GetStorageDeviceIdDescriptor();
+		identity.assign((const char*)deviceIdDescriptor->Identifiers, GetIdentifiersSize(deviceIdDescriptor));
+		if (identifierCount != nullptr) {
+			*identifierCount = identity.empty() ? 0 : deviceIdDescriptor->NumberOfIdentifiers;
+		}
+	}
+
+	// Parses the metadata Google writes to the vendor-specific (VS) section
+	// of the NVMe Identify Namespace data and passes it to callback. The
+	// metadata points into the identify response, so it is only valid for
+	// the duration of the call. Returns false, without calling callback, if
+	// the metadata could not be parsed.
+	template<typename TCallback>
+	bool VisitNvmeMetadata(TCallback&& callback) {
+		StorageQueryResult<NVME_IDENTIFY_NAMESPACE_DATA> namespaceData = GetNvmeNamespaceData(ReadNvmeNamespaceId());
+		return VisitNvmeMetadata(*namespaceData, callback);
+	}
+
+	// Like VisitNvmeMetadata() above, for Identify Namespace data that has
+	// already been read.
+	template<typename TCallback>
+	static bool VisitNvmeMetadata(const NVME_IDENTIFY_NAMESPACE_DATA& namespaceData, TCallback&& callback) {
+		std::string_view vendorSpecificData((const char*)namespaceData.VS,
+			NvmeVendorMetadataParser::BoundedLength(namespaceData.VS, sizeof(namespaceData.VS)));
+		NvmeVendorMetadata metadata;
+		if (!NvmeVendorMetadataParser::Parse(vendorSpecificData, metadata)) {
+			return false;
+		}
+
+		callback(metadata);
+		return true;
+	}
+
+	// Reads the controller and namespace of an NVMe disk from the SCSI name
+	// string StorNVMe reports for it. Returns false for other disks.
+	bool GetNvmeLocation(NvmeLocation& location) {
+		if (GetBusType() != STORAGE_BUS_TYPE::BusTypeNvme) {
+			return false;
+		}
+		ReadNvmeLocation(location);
+		return true;
+	}
+
+	// The namespace ID is a fixed-width decimal field, directly followed by
+	// the serial number, so it is parsed within its own bytes only.
+	static DWORD ParseNamespaceId(const std::byte* field, size_t size) {
+		DWORD namespaceId = 0;
+		size_t digits = 0;
+		for (; digits < size && (char)field[digits] >= '0' && (char)field[digits] <= '9'; digits++) {
+			namespaceId = namespaceId * 10 + ((char)field[digits] - '0');
+		}
+		for (size_t i = digits; i < size; i++) {
+			if ((char)field[i] != ' ' && (char)field[i] != '\0') {
+				digits = 0;
+				break;
+			}
 		}
+		if (digits == 0 || namespaceId == 0) {
+			throw std::runtime_error("Device reported a malformed NVMe namespace ID.");
+		}
+		return namespaceId;
 	}
 
 private:
-	std::string GetNvmeDeviceName() {
+	// The SCSI name string StorNVMe reports for an NVMe disk. Points into
+	// deviceIdDescriptor.
+	static const NvmeV1BasedScsiNameString& GetScsiNameString(const StorageQueryResult<STORAGE_DEVICE_ID_DESCRIPTOR>& deviceIdDescriptor) {
+		const STORAGE_IDENTIFIER* firstIdentifier = (const STORAGE_IDENTIFIER*)deviceIdDescriptor->Identifiers;
+		if (GetIdentifiersSize(deviceIdDescriptor) < FIELD_OFFSET(STORAGE_IDENTIFIER, Identifier) + sizeof(NvmeV1BasedScsiNameString) ||
+			deviceIdDescriptor->NumberOfIdentifiers == 0 ||
+			firstIdentifier->IdentifierSize < sizeof(NvmeV1BasedScsiNameString)) {
+			throw std::runtime_error("Device did not report an NVMe SCSI name string.");
+		}
+		return *(const NvmeV1BasedScsiNameString*)firstIdentifier->Identifier;
+	}
+
+	// Only the namespace ID, which is all that naming a disk needs, so the
+	// name path builds no controller ID.
+	DWORD ReadNvmeNamespaceId() {
+		StorageQueryResult<STORAGE_DEVICE_ID_DESCRIPTOR> deviceIdDescriptor = GetStorageDeviceIdDescriptor();
+		const NvmeV1BasedScsiNameString& scsiNameString = GetScsiNameString(deviceIdDescriptor);
+		return ParseNamespaceId(scsiNameString.NamespaceId, sizeof(scsiNameString.NamespaceId));
+	}
+
+	void ReadNvmeLocation(NvmeLocation& location) {
+		StorageQueryResult<STORAGE_DEVICE_ID_DESCRIPTOR> deviceIdDescriptor = GetStorageDeviceIdDescriptor();
+		const NvmeV1BasedScsiNameString& scsiNameString = GetScsiNameString(deviceIdDescriptor);
+		location.NamespaceId = ParseNamespaceId(scsiNameString.NamespaceId, sizeof(scsiNameString.NamespaceId));
+		location.ControllerId.assign((const char*)scsiNameString.PciVendorId, sizeof(scsiNameString.PciVendorId));
+		location.ControllerId.append((const char*)scsiNameString.ModelNumber, sizeof(scsiNameString.ModelNumber));
+		location.ControllerId.append((const char*)scsiNameString.SerialNumber, sizeof(scsiNameString.SerialNumber));
+	}
+
+	void GetNvmeDeviceName(std::string& name) {
 		// Google writes metadata about the disk as a JSON string to the start
 		// of the vendor-specific (VS) section of the NVMe Identify Specific
-		// Namespace response struct.
-		// 
-		// We do a simple search for the field we care about to avoid taking a
-		// dependency on a JSON library. The JSON string (and VS field) is
-		// assumed to have the following properties:
-		// - The VS field is null terminated.
-		// - The JSON is 'packed', (i.e., no spaces or newlines between the
-		//   key-value pairs, colons, brackets, and curly braces)
-		int namespaceId = GetNvmeNamespaceId();
-		NVME_IDENTIFY_NAMESPACE_DATA namespaceData = GetNvmeNamespaceData(namespaceId);
-
-		std::string vendorSpecificData((char*)(namespaceData.VS));
-		std::string deviceNameKey("\"device_name\":\"");
-		size_t deviceNameStart = vendorSpecificData.find(deviceNameKey, 0);
-		size_t deviceNameEnd = vendorSpecificData.find("\"", deviceNameStart + deviceNameKey.size());
-		return vendorSpecificData.substr(deviceNameStart + deviceNameKey.size(), deviceNameEnd - (deviceNameStart + deviceNameKey.size()));
-	}
-
-	int GetNvmeNamespaceId() {
-		STORAGE_DEVICE_ID_DESCRIPTOR* deviceIdDescriptor = GetStorageDeviceIdDescriptor();
-		STORAGE_IDENTIFIER* firstIdentifier = (STORAGE_IDENTIFIER*)deviceIdDescriptor->Identifiers;
-		NvmeV1BasedScsiNameString* scsiNameString = (NvmeV1BasedScsiNameString*)firstIdentifier->Identifier;
-		int namespaceId = std::atoi((char*)scsiNameString->NamespaceId);
-		return namespaceId;
-	}
+		// Namespace response struct. We parse it in place with a small bounded
+		// parser rather than taking a dependency on a JSON library.
+		bool parsed = VisitNvmeMetadata([&name](const NvmeVendorMetadata& metadata) {
+			name.assign(metadata.DeviceName);
+		});
 
-	std::string GetScsiDeviceName() {
-		const std::string googleScsiPrefix("Google  ");
-		STORAGE_DEVICE_ID_DESCRIPTOR* deviceIdDescriptor = GetStorageDeviceIdDescriptor();
-		STORAGE_IDENTIFIER* storageIdentifier = (STORAGE_IDENTIFIER*)deviceIdDescriptor->Identifiers;
+		if (!parsed) {
+			std::cerr << "Device has malformed Google NVMe metadata." << std::endl;
+		}
+		else if (name.empty()) {
+			std::cerr << "Device metadata does not include a device name." << std::endl;
+		}
+	}
 
-		for (DWORD i = 0; i < deviceIdDescriptor->NumberOfIdentifiers; i++) {
-			if (storageIdentifier->Type == STORAGE_IDENTIFIER_TYPE::StorageIdTypeVendorId &&
-				storageIdentifier->Association == STORAGE_ASSOCIATION_TYPE::StorageIdAssocDevice) {
-				std::string identifier((char*)storageIdentifier->Identifier);
-				if (identifier.starts_with(googleScsiPrefix)) {
-					return identifier.substr(googleScsiPrefix.size());
+	// The first Google vendor ID designator names the disk; the page lists
+	// other designators (NAA, EUI-64) before it on some disks.
+	void GetScsiDeviceName(std::string& name) {
+		constexpr std::string_view googleScsiPrefix("Google  ");
+		StorageQueryResult<STORAGE_DEVICE_ID_DESCRIPTOR> deviceIdDescriptor = GetStorageDeviceIdDescriptor();
+		bool found = false;
+		VisitStorageIdentifiers(deviceIdDescriptor->Identifiers, GetIdentifiersSize(deviceIdDescriptor), deviceIdDescriptor->NumberOfIdentifiers,
+			[&](const StorageIdentifierView& identifier) {
+				if (identifier.Type == STORAGE_IDENTIFIER_TYPE::StorageIdTypeVendorId &&
+					identifier.Association == STORAGE_ASSOCIATION_TYPE::StorageIdAssocDevice) {
+					std::string_view value = identifier.Value.substr(0, identifier.Value.find('\0'));
+					if (value.starts_with(googleScsiPrefix)) {
+						name.assign(value.substr(googleScsiPrefix.size()));
+						found = true;
+					}
 				}
-			}
+				return !found;
+			});
+
+		if (!found) {
+			std::cerr << "Device is not a Google Persistent Disk." << std::endl;
 		}
+	}
 
-		std::cerr << "Device is not a Google Persistent Disk." << std::endl;
-		return std::string("");
+	// The bytes of the descriptor's Identifiers that the driver wrote. 0 if
+	// the descriptor, as written or as it claims to be, ends before them.
+	static DWORD GetIdentifiersSize(const StorageQueryResult<STORAGE_DEVICE_ID_DESCRIPTOR>& deviceIdDescriptor) {
+		DWORD identifiersOffset = FIELD_OFFSET(STORAGE_DEVICE_ID_DESCRIPTOR, Identifiers);
+		DWORD size = std::min(deviceIdDescriptor->Size, deviceIdDescriptor.Size());
+		return size > identifiersOffset ? size - identifiersOffset : 0;
 	}
 };
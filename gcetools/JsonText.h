@@ -0,0 +1,59 @@
+/* Copyright 2022 Google LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#pragma once
+
+#include <cstdio>
+#include <string>
+#include <string_view>
+
+// Appends value to out as a quoted JSON string. Runs of characters that need
+// no escaping are appended whole.
+inline void AppendJsonString(std::string& out, std::string_view value) {
+	out.push_back('"');
+	size_t runStart = 0;
+	for (size_t i = 0; i < value.size(); i++) {
+		char c = value[i];
+		if (c != '"' && c != '\\' && (unsigned char)c >= 0x20) {
+			continue;
+		}
+		out.append(value.data() + runStart, i - runStart);
+		runStart = i + 1;
+		switch (c) {
+		case '"':
+			out.append("\\\"");
+			break;
+		case '\\':
+			out.append("\\\\");
+			break;
+		case '\n':
+			out.append("\\n");
+			break;
+		case '\r':
+			out.append("\\r");
+			break;
+		case '\t':
+			out.append("\\t");
+			break;
+		default: {
+			char escape[7];
+			snprintf(escape, sizeof(escape), "\\u%04x", (unsigned int)(unsigned char)c);
+			out.append(escape);
+			break;
+		}
+		}
+	}
+	out.append(value.data() + runStart, value.size() - runStart);
+	out.push_back('"');
+}
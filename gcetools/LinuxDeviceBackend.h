@@ -0,0 +1,630 @@
+/* Copyright 2022 Google LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#pragma once
+
+#ifdef __linux__
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <system_error>
+#include <utility>
+#include <vector>
+#include "DeviceBackend.h"
+#include "PhaseTimings.h"
+#include "StorageResponseBuilder.h"
+#include "StorageTypes.h"
+#include "Utf8.h"
+
+#include <fcntl.h>
+#include <linux/nvme_ioctl.h>
+#include <scsi/sg.h>
+#include <sys/ioctl.h>
+#include <unistd.h>
+
+// The system calls LinuxDeviceBackend makes, so it can be run against a fake
+// device.
+class LinuxDeviceIo {
+public:
+	// BLKGETDISKSEQ, which older kernel headers lack.
+	static constexpr unsigned long GetDiskSeqRequest = _IOR(0x12, 128, uint64_t);
+
+	virtual ~LinuxDeviceIo() {
+	}
+
+	// Returns a file descriptor, or -errno.
+	virtual int Open(const std::string& path) {
+		int fd = open(path.c_str(), O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+		return fd >= 0 ? fd : -errno;
+	}
+
+	// Returns what the ioctl returned (for NVMe passthrough, the NVMe status
+	// of the command), or -errno.
+	virtual int Ioctl(int fd, unsigned long request, void* argument) {
+		int result = ioctl(fd, request, argument);
+		return result >= 0 ? result : -errno;
+	}
+
+	virtual void Close(int fd) {
+		close(fd);
+	}
+};
+
+// Answers storage queries for a Linux block device (/dev/nvme0n1, /dev/sda)
+// the way the Windows storage drivers would, so GoogleStorageDevice resolves
+// names on Linux unchanged. Everything the kernel already exports under
+// /sys/block/<disk> is read from there, which needs neither a device handle
+// nor root. The rest goes to the device: NVMe Identify through
+// NVME_IOCTL_ADMIN_CMD, and SCSI INQUIRY VPD pages through SG_IO.
+class LinuxDeviceBackend : public DeviceBackend {
+public:
+	// With useSysfs false, every query goes to the device.
+	LinuxDeviceBackend(const std::wstring& deviceId, std::filesystem::path sysfsRoot = "/sys",
+		bool useSysfs = true, std::shared_ptr<LinuxDeviceIo> io = nullptr)
+		: devicePath_(ToUtf8(deviceId)), useSysfs_(useSysfs), io_(io ? std::move(io) : std::make_shared<LinuxDeviceIo>())
+	{
+		std::string diskName = std::filesystem::path(devicePath_).filename().string();
+		sysBlock_ = std::move(sysfsRoot) / "block" / diskName;
+		busType_ = diskName.starts_with("nvme") ? STORAGE_BUS_TYPE::BusTypeNvme
+			: diskName.starts_with("sd") ? STORAGE_BUS_TYPE::BusTypeScsi
+			: STORAGE_BUS_TYPE::BusTypeUnknown;
+
+		// The device is only opened once a query needs it, but a missing
+		// device fails here as it would on Windows.
+		std::error_code err;
+		if (!useSysfs_ || !std::filesystem::exists(sysBlock_, err)) {
+			int fd = GetDeviceHandle();
+			if (fd < 0) {
+				ThrowOpenError(-fd);
+			}
+		}
+	}
+	~LinuxDeviceBackend() {
+		if (fd_ >= 0) {
+			io_->Close(fd_);
+		}
+	}
+
+	DWORD QueryProperty(const void* inputBuffer, DWORD inputBufferSize,
+		void* outputBuffer, DWORD outputBufferSize, DWORD* bytesReturned) override {
+		*bytesReturned = 0;
+		if (inputBufferSize < sizeof(STORAGE_PROPERTY_QUERY) || outputBufferSize < sizeof(STORAGE_DESCRIPTOR_HEADER)) {
+			return ERROR_INSUFFICIENT_BUFFER;
+		}
+
+		const STORAGE_PROPERTY_QUERY* query = (const STORAGE_PROPERTY_QUERY*)inputBuffer;
+		DWORD responseSize = 0;
+		DWORD err = ERROR_SUCCESS;
+		response_.Reset();
+
+		switch (query->PropertyId) {
+		case STORAGE_PROPERTY_ID::StorageDeviceProperty:
+			err = BuildDeviceDescriptor(&responseSize);
+			break;
+		case STORAGE_PROPERTY_ID::StorageAdapterProperty:
+			responseSize = BuildAdapterDescriptor();
+			break;
+		case STORAGE_PROPERTY_ID::StorageDeviceIdProperty:
+			err = busType_ == STORAGE_BUS_TYPE::BusTypeNvme ? BuildNvmeDeviceIdDescriptor(&responseSize)
+				: busType_ == STORAGE_BUS_TYPE::BusTypeScsi ? BuildScsiDeviceIdDescriptor(&responseSize)
+				: ERROR_NOT_SUPPORTED;
+			break;
+		case STORAGE_PROPERTY_ID::StorageAdapterProtocolSpecificProperty:
+		case STORAGE_PROPERTY_ID::StorageDeviceProtocolSpecificProperty:
+			if (inputBufferSize < FIELD_OFFSET(STORAGE_PROPERTY_QUERY, AdditionalParameters) + sizeof(STORAGE_PROTOCOL_SPECIFIC_DATA)) {
+				return ERROR_INVALID_PARAMETER;
+			}
+			err = BuildNvmeProtocolData(query->PropertyId, *(const STORAGE_PROTOCOL_SPECIFIC_DATA*)query->AdditionalParameters, &responseSize);
+			break;
+		default:
+			err = ERROR_NOT_SUPPORTED;
+			break;
+		}
+
+		if (err != ERROR_SUCCESS) {
+			return err;
+		}
+		return response_.CopyTo(responseSize, outputBuffer, outputBufferSize, bytesReturned);
+	}
+
+	// The adapter is what the disk's device link points at (nvme0), or for
+	// SCSI disks the host above it (host0), and its NUMA node is that of the
+	// nearest device above the disk that has one. Each directory under mq is
+	// one hardware queue.
+	bool GetQueueTopology(DeviceQueueTopology& topology) override {
+		std::error_code err;
+		std::filesystem::path device = std::filesystem::canonical(sysBlock_ / "device", err);
+		if (!useSysfs_ || err) {
+			return false;
+		}
+
+		std::filesystem::path sysfsRoot = std::filesystem::canonical(sysBlock_.parent_path().parent_path(), err);
+		for (std::filesystem::path path = device; path != sysfsRoot && path.has_relative_path(); path = path.parent_path()) {
+			std::string component = path.filename().string();
+			if (topology.Adapter.empty() && (busType_ == STORAGE_BUS_TYPE::BusTypeScsi ? component.starts_with("host") : path == device)) {
+				topology.Adapter = component;
+			}
+			std::string numaNode;
+			if (topology.NumaNode < 0 && ReadAttribute(path / "numa_node", numaNode)) {
+				topology.NumaNode = (int)strtol(numaNode.c_str(), nullptr, 10);
+			}
+		}
+
+		std::vector<std::pair<unsigned long, std::string>> queues;
+		for (const std::filesystem::directory_entry& entry : std::filesystem::directory_iterator(sysBlock_ / "mq", err)) {
+			std::string cpus;
+			if (ReadAttribute(entry.path() / "cpu_list", cpus)) {
+				queues.emplace_back(strtoul(entry.path().filename().string().c_str(), nullptr, 10), std::move(cpus));
+			}
+		}
+		std::sort(queues.begin(), queues.end());
+		for (auto& queue : queues) {
+			topology.QueueCpus.push_back(std::move(queue.second));
+		}
+		return true;
+	}
+
+	// Each partition is a directory under the disk's with a partition
+	// attribute. Sizes and offsets are in 512-byte sectors, whatever the
+	// disk's block size.
+	bool GetPartitionLayout(DevicePartitionLayout& layout) override {
+		std::string size;
+		if (!ReadAttribute(sysBlock_ / "size", size)) {
+			return false;
+		}
+		layout.Length = strtoull(size.c_str(), nullptr, 10) * SectorSize;
+		layout.Device = sysBlock_.filename().string();
+
+		std::error_code err;
+		for (const std::filesystem::directory_entry& entry : std::filesystem::directory_iterator(sysBlock_, err)) {
+			std::string number;
+			std::string start;
+			if (!ReadAttribute(entry.path() / "partition", number) || !ReadAttribute(entry.path() / "start", start) ||
+				!ReadAttribute(entry.path() / "size", size)) {
+				continue;
+			}
+			DevicePartition partition;
+			partition.Number = (DWORD)strtoul(number.c_str(), nullptr, 10);
+			partition.Offset = strtoull(start.c_str(), nullptr, 10) * SectorSize;
+			partition.Length = strtoull(size.c_str(), nullptr, 10) * SectorSize;
+			partition.Device = entry.path().filename().string();
+			layout.Partitions.push_back(std::move(partition));
+		}
+		std::sort(layout.Partitions.begin(), layout.Partitions.end(),
+			[](const DevicePartition& a, const DevicePartition& b) { return a.Number < b.Number; });
+		return true;
+	}
+
+	// The kernel numbers each disk it attaches (diskseq, from Linux 5.15)
+	// and starts again each boot, which boot_id tells apart.
+	bool GetAttachId(std::string& attachId) override {
+		std::string diskSeq;
+		if (!ReadAttribute(sysBlock_ / "diskseq", diskSeq)) {
+			int fd = GetDeviceHandle();
+			uint64_t sequence = 0;
+			if (fd < 0 || io_->Ioctl(fd, LinuxDeviceIo::GetDiskSeqRequest, &sequence) < 0 || sequence == 0) {
+				return false;
+			}
+			diskSeq = std::to_string(sequence);
+		}
+
+		static const std::string bootId = ReadBootId();
+		attachId = bootId;
+		attachId.push_back('/');
+		attachId.append(diskSeq);
+		return true;
+	}
+
+private:
+	static constexpr BYTE NvmeGetLogPageOpcode = 0x02;
+	static constexpr BYTE NvmeIdentifyOpcode = 0x06;
+	static constexpr DWORD AllNamespaces = 0xFFFFFFFF;
+	static constexpr BYTE ScsiInquiryOpcode = 0x12;
+	static constexpr BYTE UnitSerialNumberVpdPage = 0x80;
+	static constexpr BYTE DeviceIdentificationVpdPage = 0x83;
+	static constexpr unsigned int PassthroughTimeoutMs = 5000;
+	static constexpr ULONGLONG SectorSize = 512;
+
+	std::string devicePath_;
+	std::filesystem::path sysBlock_;
+	bool useSysfs_;
+	std::shared_ptr<LinuxDeviceIo> io_;
+	STORAGE_BUS_TYPE busType_;
+	int fd_ = -1;
+	StorageResponseBuilder response_;
+
+	DWORD namespaceId_ = 0;
+
+	// Identify Controller data, read from the device at most once.
+	bool haveControllerData_ = false;
+	NVME_IDENTIFY_CONTROLLER_DATA controllerData_;
+
+	// Returns the open descriptor, or -errno.
+	int GetDeviceHandle() {
+		if (fd_ < 0) {
+			PhaseTimings::Scope phase("device open");
+			fd_ = io_->Open(devicePath_);
+		}
+		return fd_;
+	}
+
+	// Passthrough commands are bounded by the kernel, with the time left
+	// until the deadline if that is shorter. 0 once the deadline has passed.
+	unsigned int GetCommandTimeoutMs() const {
+		return HasDeadline() ? (unsigned int)std::min<long long>(GetTimeRemaining().count(), PassthroughTimeoutMs) : PassthroughTimeoutMs;
+	}
+
+	int Passthrough(int fd, unsigned long request, void* argument) {
+		PhaseTimings::Scope phase("passthrough ioctl");
+		return io_->Ioctl(fd, request, argument);
+	}
+
+	[[noreturn]] static void ThrowOpenError(int err) {
+		if (err == EACCES || err == EPERM) {
+			throw std::runtime_error("Access denied while attempting to get device handle. Did you run as root?");
+		}
+		throw std::runtime_error("Failed to get device handle. Error code: " + std::to_string(ToWin32Error(err)));
+	}
+
+	static DWORD ToWin32Error(int err) {
+		switch (err) {
+		case 0:
+			return ERROR_SUCCESS;
+		case EACCES:
+		case EPERM:
+			return ERROR_ACCESS_DENIED;
+		case ENOENT:
+		case ENODEV:
+		case ENXIO:
+			return ERROR_FILE_NOT_FOUND;
+		case ENOTTY:
+		case EOPNOTSUPP:
+		case EINVAL:
+			return ERROR_NOT_SUPPORTED;
+		case ETIMEDOUT:
+		// NVMe passthrough commands that time out are aborted with EINTR.
+		case EINTR:
+			return ERROR_TIMEOUT;
+		default:
+			return ERROR_GEN_FAILURE;
+		}
+	}
+
+	// Empty if the kernel does not say.
+	static std::string ReadBootId() {
+		std::string bootId;
+		std::ifstream in("/proc/sys/kernel/random/boot_id");
+		std::getline(in, bootId);
+		return bootId;
+	}
+
+	// Attributes are read with plain system calls: a stream costs as much
+	// again to set up as the read itself, several times per device.
+	bool ReadRawAttribute(const std::filesystem::path& path, std::string& value) const {
+		if (!useSysfs_) {
+			return false;
+		}
+		int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+		if (fd < 0) {
+			return false;
+		}
+		value.clear();
+		char buffer[4096];
+		ssize_t count;
+		while ((count = read(fd, buffer, sizeof(buffer))) > 0) {
+			value.append(buffer, (size_t)count);
+		}
+		close(fd);
+		return count == 0 && !value.empty();
+	}
+
+	// Reads a text attribute without its trailing newline.
+	bool ReadAttribute(const std::filesystem::path& path, std::string& value) const {
+		if (!ReadRawAttribute(path, value)) {
+			return false;
+		}
+		value.erase(value.find_last_not_of(" \n") + 1);
+		return true;
+	}
+
+	// The block layer's limits for the disk, where sysfs has them.
+	DWORD BuildAdapterDescriptor() {
+		std::filesystem::path queue = sysBlock_ / "queue";
+		std::string maxTransferKb;
+		std::string maxSegments;
+		std::string dmaAlignment;
+		if (!ReadAttribute(queue / "max_hw_sectors_kb", maxTransferKb) ||
+			!ReadAttribute(queue / "max_segments", maxSegments) ||
+			!ReadAttribute(queue / "dma_alignment", dmaAlignment)) {
+			return response_.BuildAdapterDescriptor(busType_);
+		}
+		uint64_t maxTransfer = strtoull(maxTransferKb.c_str(), nullptr, 10) * 1024;
+		return response_.BuildAdapterDescriptor(busType_, (DWORD)std::min<uint64_t>(maxTransfer, UINT32_MAX),
+			(DWORD)strtoul(maxSegments.c_str(), nullptr, 10), (DWORD)strtoul(dmaAlignment.c_str(), nullptr, 10));
+	}
+
+	DWORD BuildDeviceDescriptor(DWORD* responseSize) {
+		std::string vendorId;
+		std::string productId;
+		std::string revision;
+		std::string serialNumber;
+
+		if (busType_ == STORAGE_BUS_TYPE::BusTypeNvme) {
+			std::filesystem::path controller = sysBlock_ / "device";
+			if (!ReadAttribute(controller / "model", productId) ||
+				!ReadAttribute(controller / "serial", serialNumber) ||
+				!ReadAttribute(controller / "firmware_rev", revision)) {
+				DWORD err = ReadControllerData();
+				if (err != ERROR_SUCCESS) {
+					return err;
+				}
+				productId = Trim(controllerData_.MN, sizeof(controllerData_.MN));
+				serialNumber = Trim(controllerData_.SN, sizeof(controllerData_.SN));
+				revision = Trim(controllerData_.FR, sizeof(controllerData_.FR));
+			}
+		}
+		else if (busType_ == STORAGE_BUS_TYPE::BusTypeScsi) {
+			std::filesystem::path device = sysBlock_ / "device";
+			if (!ReadAttribute(device / "vendor", vendorId) ||
+				!ReadAttribute(device / "model", productId) ||
+				!ReadAttribute(device / "rev", revision)) {
+				BYTE inquiry[36] = {};
+				DWORD err = ScsiInquiry(false, 0, inquiry, sizeof(inquiry));
+				if (err != ERROR_SUCCESS) {
+					return err;
+				}
+				vendorId = Trim(inquiry + 8, 8);
+				productId = Trim(inquiry + 16, 16);
+				revision = Trim(inquiry + 32, 4);
+			}
+
+			// The serial number is the Unit Serial Number VPD page.
+			BYTE page[256] = {};
+			size_t pageSize = 0;
+			if (ReadVpdPage(UnitSerialNumberVpdPage, page, sizeof(page), &pageSize) == ERROR_SUCCESS && pageSize > 4) {
+				serialNumber = Trim(page + 4, std::min<size_t>(pageSize - 4, page[3]));
+			}
+		}
+
+		*responseSize = response_.BuildDeviceDescriptor(busType_, vendorId, productId, revision, serialNumber);
+		return ERROR_SUCCESS;
+	}
+
+	// StorNVMe builds the SCSI name string from the controller's PCI vendor
+	// ID, model and serial number and the namespace ID.
+	DWORD BuildNvmeDeviceIdDescriptor(DWORD* responseSize) {
+		std::string model;
+		std::string serialNumber;
+		std::string namespaceId;
+		std::string pciVendorId;
+		std::filesystem::path controller = sysBlock_ / "device";
+		if (ReadAttribute(controller / "model", model) &&
+			ReadAttribute(controller / "serial", serialNumber) &&
+			ReadAttribute(sysBlock_ / "nsid", namespaceId) &&
+			ReadAttribute(controller / "device" / "vendor", pciVendorId)) {
+			*responseSize = response_.BuildNvmeDeviceIdDescriptor(FormatPciVendorId(strtoul(pciVendorId.c_str(), nullptr, 16)),
+				model, (DWORD)strtoul(namespaceId.c_str(), nullptr, 10), serialNumber);
+			return ERROR_SUCCESS;
+		}
+
+		DWORD err = ReadControllerData();
+		if (err != ERROR_SUCCESS) {
+			return err;
+		}
+		int fd = GetDeviceHandle();
+		int result = fd < 0 ? fd : Passthrough(fd, NVME_IOCTL_ID, nullptr);
+		if (result <= 0) {
+			return result < 0 ? ToWin32Error(-result) : ERROR_NOT_SUPPORTED;
+		}
+
+		*responseSize = response_.BuildNvmeDeviceIdDescriptor(FormatPciVendorId(controllerData_.VID),
+			Trim(controllerData_.MN, sizeof(controllerData_.MN)), (DWORD)result,
+			Trim(controllerData_.SN, sizeof(controllerData_.SN)));
+		return ERROR_SUCCESS;
+	}
+
+	DWORD BuildScsiDeviceIdDescriptor(DWORD* responseSize) {
+		BYTE page[1024] = {};
+		size_t pageSize = 0;
+		DWORD err = ReadVpdPage(DeviceIdentificationVpdPage, page, sizeof(page), &pageSize);
+		if (err != ERROR_SUCCESS) {
+			return err;
+		}
+
+		*responseSize = response_.BuildDeviceIdDescriptorFromVpd(page, pageSize);
+		return *responseSize == 0 ? ERROR_GEN_FAILURE : ERROR_SUCCESS;
+	}
+
+	// Like StorNVMe, device queries address the disk's own namespace and
+	// adapter queries the controller.
+	DWORD BuildNvmeProtocolData(STORAGE_PROPERTY_ID propertyId, const STORAGE_PROTOCOL_SPECIFIC_DATA& request, DWORD* responseSize) {
+		if (busType_ != STORAGE_BUS_TYPE::BusTypeNvme || request.ProtocolType != STORAGE_PROTOCOL_TYPE::ProtocolTypeNvme) {
+			return ERROR_NOT_SUPPORTED;
+		}
+
+		BYTE* payload = response_.GetProtocolDataPayload();
+		if (request.DataType == STORAGE_PROTOCOL_NVME_DATA_TYPE::NVMeDataTypeLogPage &&
+			request.ProtocolDataRequestValue == NVME_LOG_PAGES::NVME_LOG_PAGE_HEALTH_INFO) {
+			DWORD namespaceId = AllNamespaces;
+			if (propertyId == STORAGE_PROPERTY_ID::StorageDeviceProtocolSpecificProperty) {
+				DWORD err = GetNamespaceId(&namespaceId);
+				if (err != ERROR_SUCCESS) {
+					return err;
+				}
+			}
+			DWORD err = NvmeGetLogPage(request.ProtocolDataRequestValue, namespaceId, payload, sizeof(NVME_HEALTH_INFO_LOG));
+			if (err != ERROR_SUCCESS) {
+				return err;
+			}
+			*responseSize = response_.BuildProtocolDataDescriptor(request, sizeof(NVME_HEALTH_INFO_LOG));
+			return ERROR_SUCCESS;
+		}
+		if (request.DataType != STORAGE_PROTOCOL_NVME_DATA_TYPE::NVMeDataTypeIdentify) {
+			return ERROR_NOT_SUPPORTED;
+		}
+
+		DWORD err = NvmeIdentify(request.ProtocolDataRequestValue, request.ProtocolDataRequestSubValue, payload);
+		if (err != ERROR_SUCCESS) {
+			return err;
+		}
+		if (request.ProtocolDataRequestValue == NVME_IDENTIFY_CNS_CODES::NVME_IDENTIFY_CNS_CONTROLLER) {
+			memcpy(&controllerData_, payload, sizeof(controllerData_));
+			haveControllerData_ = true;
+		}
+
+		*responseSize = response_.BuildProtocolDataDescriptor(request, NVME_MAX_LOG_SIZE);
+		return ERROR_SUCCESS;
+	}
+
+	DWORD ReadControllerData() {
+		if (haveControllerData_) {
+			return ERROR_SUCCESS;
+		}
+		DWORD err = NvmeIdentify(NVME_IDENTIFY_CNS_CODES::NVME_IDENTIFY_CNS_CONTROLLER, 0, (BYTE*)&controllerData_);
+		haveControllerData_ = err == ERROR_SUCCESS;
+		return err;
+	}
+
+	// The namespace of the disk, from sysfs or else the kernel, read once.
+	DWORD GetNamespaceId(DWORD* namespaceId) {
+		if (namespaceId_ == 0) {
+			std::string value;
+			if (ReadAttribute(sysBlock_ / "nsid", value)) {
+				namespaceId_ = (DWORD)strtoul(value.c_str(), nullptr, 10);
+			}
+			else {
+				int fd = GetDeviceHandle();
+				int result = fd < 0 ? fd : Passthrough(fd, NVME_IOCTL_ID, nullptr);
+				if (result <= 0) {
+					return result < 0 ? ToWin32Error(-result) : ERROR_NOT_SUPPORTED;
+				}
+				namespaceId_ = (DWORD)result;
+			}
+		}
+		*namespaceId = namespaceId_;
+		return namespaceId_ == 0 ? ERROR_NOT_SUPPORTED : ERROR_SUCCESS;
+	}
+
+	DWORD NvmeIdentify(DWORD cns, DWORD namespaceId, BYTE* payload) {
+		return NvmeAdminCommand(NvmeIdentifyOpcode, namespaceId, cns, payload, NVME_MAX_LOG_SIZE);
+	}
+
+	DWORD NvmeGetLogPage(DWORD logPageId, DWORD namespaceId, BYTE* payload, DWORD size) {
+		// Command Dword 10 carries the log page and the number of dwords to
+		// read, less one.
+		return NvmeAdminCommand(NvmeGetLogPageOpcode, namespaceId, ((size / 4 - 1) << 16) | logPageId, payload, size);
+	}
+
+	DWORD NvmeAdminCommand(BYTE opcode, DWORD namespaceId, DWORD cdw10, BYTE* payload, DWORD size) {
+		int fd = GetDeviceHandle();
+		if (fd < 0) {
+			return ToWin32Error(-fd);
+		}
+
+		nvme_admin_cmd command = {};
+		command.opcode = opcode;
+		command.nsid = namespaceId;
+		command.addr = (uint64_t)(uintptr_t)payload;
+		command.data_len = size;
+		command.cdw10 = cdw10;
+		command.timeout_ms = GetCommandTimeoutMs();
+		if (command.timeout_ms == 0) {
+			return ERROR_TIMEOUT;
+		}
+
+		int result = Passthrough(fd, NVME_IOCTL_ADMIN_CMD, &command);
+		if (result < 0) {
+			return ToWin32Error(-result);
+		}
+		// A positive result is the NVMe status of a failed command.
+		return result == 0 ? ERROR_SUCCESS : ERROR_INVALID_PARAMETER;
+	}
+
+	// Reads a VPD page, from sysfs (vpd_pg80, vpd_pg83) if it is exported
+	// there.
+	DWORD ReadVpdPage(BYTE pageCode, BYTE* page, size_t size, size_t* pageSize) {
+		char attribute[16];
+		snprintf(attribute, sizeof(attribute), "vpd_pg%02x", pageCode);
+		std::string contents;
+		if (ReadRawAttribute(sysBlock_ / "device" / attribute, contents)) {
+			*pageSize = std::min(size, contents.size());
+			memcpy(page, contents.data(), *pageSize);
+			return ERROR_SUCCESS;
+		}
+
+		DWORD err = ScsiInquiry(true, pageCode, page, size);
+		if (err != ERROR_SUCCESS) {
+			return err;
+		}
+		*pageSize = std::min(size, 4 + (((size_t)page[2] << 8) | page[3]));
+		return ERROR_SUCCESS;
+	}
+
+	DWORD ScsiInquiry(bool vitalProductData, BYTE pageCode, BYTE* data, size_t size) {
+		int fd = GetDeviceHandle();
+		if (fd < 0) {
+			return ToWin32Error(-fd);
+		}
+
+		size = std::min<size_t>(size, UINT16_MAX);
+		BYTE cdb[6] = { ScsiInquiryOpcode, (BYTE)(vitalProductData ? 1 : 0), pageCode, (BYTE)(size >> 8), (BYTE)size, 0 };
+		BYTE sense[32] = {};
+		sg_io_hdr_t header = {};
+		header.interface_id = 'S';
+		header.dxfer_direction = SG_DXFER_FROM_DEV;
+		header.cmd_len = sizeof(cdb);
+		header.cmdp = cdb;
+		header.dxferp = data;
+		header.dxfer_len = (unsigned int)size;
+		header.mx_sb_len = sizeof(sense);
+		header.sbp = sense;
+		header.timeout = GetCommandTimeoutMs();
+		if (header.timeout == 0) {
+			return ERROR_TIMEOUT;
+		}
+
+		int result = Passthrough(fd, SG_IO, &header);
+		if (result < 0) {
+			return ToWin32Error(-result);
+		}
+		if ((header.info & SG_INFO_OK_MASK) != SG_INFO_OK || header.status != 0) {
+			return ERROR_NOT_SUPPORTED;
+		}
+		return ERROR_SUCCESS;
+	}
+
+	static std::string FormatPciVendorId(unsigned long vendorId) {
+		char text[5];
+		snprintf(text, sizeof(text), "%04lX", vendorId & 0xFFFF);
+		return text;
+	}
+
+	// Fixed-size identify and inquiry strings are padded with spaces.
+	static std::string Trim(const void* data, size_t size) {
+		std::string_view value((const char*)data, strnlen((const char*)data, size));
+		size_t end = value.find_last_not_of(' ');
+		return std::string(value.substr(0, end == std::string_view::npos ? 0 : end + 1));
+	}
+};
+
+#endif
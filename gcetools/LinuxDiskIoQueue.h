@@ -0,0 +1,128 @@
+/* Copyright 2022 Google LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#pragma once
+
+#ifdef __linux__
+
+#include <cerrno>
+#include <cstring>
+#include <filesystem>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include "DiskIoQueue.h"
+
+#include <fcntl.h>
+#include <linux/aio_abi.h>
+#include <linux/fs.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+// Reads and writes a block device (/dev/nvme0n1) or file opened with
+// O_DIRECT, through the kernel's native asynchronous I/O. The system calls
+// are made directly, as libaio would, so nothing needs to be installed.
+// Native AIO rather than io_uring, since container runtimes commonly block
+// io_uring.
+class LinuxDiskIoQueue : public DiskIoQueue {
+public:
+	LinuxDiskIoQueue(const std::filesystem::path& path, size_t queueDepth, size_t blockSize, bool write)
+		: DiskIoQueue(queueDepth, blockSize), requests_(queueDepth)
+	{
+		int flags = (write ? O_RDWR : O_RDONLY) | O_CLOEXEC;
+		fd_ = open(path.c_str(), flags | O_DIRECT);
+		if (fd_ < 0 && errno == EINVAL) {
+			// The file system cannot bypass the page cache.
+			fd_ = open(path.c_str(), flags);
+			unbuffered_ = false;
+		}
+		if (fd_ < 0) {
+			int err = errno;
+			if (err == EACCES || err == EPERM) {
+				throw std::runtime_error("Access denied while attempting to open " + path.string() + ". Did you run as root?");
+			}
+			throw std::runtime_error("Failed to open " + path.string() + ": " + strerror(err));
+		}
+
+		if (syscall(SYS_io_setup, (unsigned int)queueDepth, &context_) < 0) {
+			int err = errno;
+			close(fd_);
+			throw std::runtime_error(std::string("Failed to set up asynchronous I/O: ") + strerror(err));
+		}
+	}
+	~LinuxDiskIoQueue() {
+		// Waits for whatever is still outstanding.
+		syscall(SYS_io_destroy, context_);
+		close(fd_);
+	}
+
+	uint64_t GetSize() override {
+		struct stat status = {};
+		if (fstat(fd_, &status) < 0) {
+			throw std::runtime_error(std::string("Failed to get the size of the disk: ") + strerror(errno));
+		}
+		if (!S_ISBLK(status.st_mode)) {
+			return (uint64_t)status.st_size;
+		}
+		uint64_t size = 0;
+		if (ioctl(fd_, BLKGETSIZE64, &size) < 0) {
+			throw std::runtime_error(std::string("Failed to get the size of the disk: ") + strerror(errno));
+		}
+		return size;
+	}
+
+	bool IsUnbuffered() const override {
+		return unbuffered_;
+	}
+
+	void Submit(size_t buffer, bool write, uint64_t offset) override {
+		iocb& request = requests_[buffer];
+		request = {};
+		request.aio_data = buffer;
+		request.aio_lio_opcode = write ? IOCB_CMD_PWRITE : IOCB_CMD_PREAD;
+		request.aio_fildes = (uint32_t)fd_;
+		request.aio_buf = (uint64_t)(uintptr_t)GetBuffer(buffer);
+		request.aio_nbytes = blockSize_;
+		request.aio_offset = (int64_t)offset;
+		iocb* requests[] = { &request };
+		if (syscall(SYS_io_submit, context_, 1L, requests) != 1) {
+			throw std::runtime_error(std::string(write ? "Write" : "Read") + " failed: " + strerror(errno));
+		}
+	}
+
+	size_t WaitForCompletion() override {
+		io_event event = {};
+		long completed;
+		do {
+			completed = syscall(SYS_io_getevents, context_, 1L, 1L, &event, nullptr);
+		} while (completed < 0 && errno == EINTR);
+		if (completed != 1) {
+			throw std::runtime_error(std::string("Failed to wait for I/O: ") + strerror(errno));
+		}
+		if (event.res != (int64_t)blockSize_) {
+			throw std::runtime_error(event.res < 0 ? std::string("I/O failed: ") + strerror((int)-event.res) : "I/O ran past the end of the disk.");
+		}
+		return (size_t)event.data;
+	}
+
+private:
+	int fd_;
+	bool unbuffered_ = true;
+	aio_context_t context_ = 0;
+	std::vector<iocb> requests_;
+};
+
+#endif
@@ -0,0 +1,348 @@
+/* Copyright 2022 Google LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstring>
+#include <filesystem>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include "StorageTypes.h"
+
+#ifdef _WIN32
+#include <sddl.h>
+#pragma comment(lib, "advapi32.lib")
+#else
+#include <cerrno>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+#endif
+
+// A local, stream-oriented IPC endpoint: a named pipe on Windows and a Unix
+// domain socket everywhere else.
+
+#ifdef _WIN32
+inline const std::filesystem::path DefaultLocalEndpoint = L"\\\\.\\pipe\\gcetools";
+#else
+inline const std::filesystem::path DefaultLocalEndpoint = "/run/gcetools.sock";
+#endif
+
+// One end of a connection, used by one thread at a time, except that
+// Shutdown() may be called from any thread to unblock a pending read.
+class LocalConnection {
+public:
+#ifdef _WIN32
+	using NativeHandle = HANDLE;
+#else
+	using NativeHandle = int;
+#endif
+
+	LocalConnection(NativeHandle handle) : handle_(handle) {
+	}
+	LocalConnection(const LocalConnection&) = delete;
+	LocalConnection& operator=(const LocalConnection&) = delete;
+	~LocalConnection() {
+#ifdef _WIN32
+		CloseHandle(handle_);
+#else
+		close(handle_);
+#endif
+	}
+
+	// Reads up to the next newline, which is not included in line. Returns
+	// false once the other end has closed the connection.
+	bool ReadLine(std::string& line) {
+		line.clear();
+		for (;;) {
+			const char* newline = (const char*)memchr(buffer_ + start_, '\n', end_ - start_);
+			if (newline != nullptr) {
+				size_t length = newline - (buffer_ + start_);
+				line.append(buffer_ + start_, length);
+				start_ += length + 1;
+				return true;
+			}
+
+			line.append(buffer_ + start_, end_ - start_);
+			start_ = end_ = 0;
+			if (line.size() > MaxLineLength) {
+				return false;
+			}
+
+			size_t read = ReadSome(buffer_, sizeof(buffer_));
+			if (read == 0) {
+				return false;
+			}
+			end_ = read;
+		}
+	}
+
+	bool Write(std::string_view data) {
+		while (!data.empty()) {
+#ifdef _WIN32
+			DWORD written = 0;
+			if (!WriteFile(handle_, data.data(), (DWORD)data.size(), &written, nullptr)) {
+				return false;
+			}
+#else
+			ssize_t written = send(handle_, data.data(), data.size(), MSG_NOSIGNAL);
+			if (written < 0 && errno == EINTR) {
+				continue;
+			}
+			if (written <= 0) {
+				return false;
+			}
+#endif
+			data.remove_prefix((size_t)written);
+		}
+		return true;
+	}
+
+	void Shutdown() {
+#ifdef _WIN32
+		CancelIoEx(handle_, nullptr);
+		DisconnectNamedPipe(handle_);
+#else
+		shutdown(handle_, SHUT_RDWR);
+#endif
+	}
+
+private:
+	static constexpr size_t MaxLineLength = 64 * 1024;
+
+	NativeHandle handle_;
+	char buffer_[4096];
+	size_t start_ = 0;
+	size_t end_ = 0;
+
+	size_t ReadSome(char* buffer, size_t size) {
+#ifdef _WIN32
+		DWORD read = 0;
+		if (!ReadFile(handle_, buffer, (DWORD)size, &read, nullptr)) {
+			return 0;
+		}
+		return read;
+#else
+		for (;;) {
+			ssize_t read = recv(handle_, buffer, size, 0);
+			if (read < 0 && errno == EINTR) {
+				continue;
+			}
+			return read < 0 ? 0 : (size_t)read;
+		}
+#endif
+	}
+};
+
+// Connects to a LocalListener. Throws if nothing is listening.
+inline std::unique_ptr<LocalConnection> ConnectLocal(const std::filesystem::path& endpoint) {
+#ifdef _WIN32
+	// Every instance of the pipe may be busy, or there may be none while the
+	// server creates the next one, so both are retried for a while.
+	auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(5);
+	for (;;) {
+		HANDLE hPipe = CreateFileW(endpoint.c_str(),
+			/*dwDesiredAccess=*/ GENERIC_READ | GENERIC_WRITE,
+			/*dwShareMode=*/ 0,
+			/*lpSecurityAttributes=*/ 0,
+			/*dwCreationDisposition=*/ OPEN_EXISTING,
+			/*dwFlagsAndAttributes=*/ 0,
+			/*hTemplateFile=*/ 0);
+		if (hPipe != INVALID_HANDLE_VALUE) {
+			return std::make_unique<LocalConnection>(hPipe);
+		}
+
+		DWORD err = GetLastError();
+		auto remaining = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - std::chrono::steady_clock::now());
+		if ((err != ERROR_PIPE_BUSY && err != ERROR_FILE_NOT_FOUND) || remaining.count() <= 0) {
+			throw std::runtime_error("Failed to connect to " + endpoint.string() + ". Error code: " + std::to_string(err));
+		}
+		if (err == ERROR_PIPE_BUSY) {
+			WaitNamedPipeW(endpoint.c_str(), (DWORD)remaining.count());
+		}
+		else {
+			Sleep(10);
+		}
+	}
+#else
+	sockaddr_un address = {};
+	address.sun_family = AF_UNIX;
+	if (endpoint.native().size() >= sizeof(address.sun_path)) {
+		throw std::runtime_error("Endpoint path is too long: " + endpoint.string());
+	}
+	strcpy(address.sun_path, endpoint.c_str());
+
+	int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd < 0 || connect(fd, (sockaddr*)&address, sizeof(address)) != 0) {
+		int err = errno;
+		if (fd >= 0) {
+			close(fd);
+		}
+		throw std::runtime_error("Failed to connect to " + endpoint.string() + ": " + strerror(err));
+	}
+	return std::make_unique<LocalConnection>(fd);
+#endif
+}
+
+// Accepts connections on a local endpoint. Only the user running the
+// listener (and, on Windows, SYSTEM and administrators) may connect.
+class LocalListener {
+public:
+	LocalListener(std::filesystem::path endpoint) : endpoint_(std::move(endpoint)) {
+#ifdef _WIN32
+		// Fails if another process already owns the pipe name, rather than
+		// sharing it with whoever created it first.
+		pending_ = CreateInstance(true);
+		if (pending_ == INVALID_HANDLE_VALUE) {
+			throw std::runtime_error("Failed to create pipe " + endpoint_.string() + ". Error code: " + std::to_string(GetLastError()));
+		}
+#else
+		sockaddr_un address = {};
+		address.sun_family = AF_UNIX;
+		if (endpoint_.native().size() >= sizeof(address.sun_path)) {
+			throw std::runtime_error("Endpoint path is too long: " + endpoint_.string());
+		}
+		strcpy(address.sun_path, endpoint_.c_str());
+
+		// A socket left behind by a previous instance would make bind fail.
+		// Anything else at the path is not ours to delete.
+		struct stat existing;
+		if (lstat(endpoint_.c_str(), &existing) == 0) {
+			if (!S_ISSOCK(existing.st_mode)) {
+				throw std::runtime_error("Failed to listen on " + endpoint_.string() + ": it exists and is not a socket");
+			}
+			unlink(endpoint_.c_str());
+		}
+
+		// The socket is restricted before listen(), so no other user can
+		// connect in between.
+		fd_ = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+		bool bound = fd_ >= 0 && bind(fd_, (sockaddr*)&address, sizeof(address)) == 0;
+		if (!bound || chmod(endpoint_.c_str(), 0600) != 0 || listen(fd_, SOMAXCONN) != 0) {
+			int err = errno;
+			if (fd_ >= 0) {
+				close(fd_);
+			}
+			if (bound) {
+				unlink(endpoint_.c_str());
+			}
+			throw std::runtime_error("Failed to listen on " + endpoint_.string() + ": " + strerror(err));
+		}
+#endif
+	}
+	LocalListener(const LocalListener&) = delete;
+	LocalListener& operator=(const LocalListener&) = delete;
+	~LocalListener() {
+#ifdef _WIN32
+		if (pending_ != INVALID_HANDLE_VALUE) {
+			CloseHandle(pending_);
+		}
+#else
+		close(fd_);
+		unlink(endpoint_.c_str());
+#endif
+	}
+
+	const std::filesystem::path& GetEndpoint() const {
+		return endpoint_;
+	}
+
+	// Blocks until a client connects. Returns nullptr once Stop() is called.
+	std::unique_ptr<LocalConnection> Accept() {
+		while (!stopping_) {
+#ifdef _WIN32
+			HANDLE hPipe = pending_;
+			pending_ = INVALID_HANDLE_VALUE;
+			if (hPipe == INVALID_HANDLE_VALUE) {
+				hPipe = CreateInstance(false);
+			}
+			if (hPipe == INVALID_HANDLE_VALUE) {
+				throw std::runtime_error("Failed to create pipe " + endpoint_.string() + ". Error code: " + std::to_string(GetLastError()));
+			}
+
+			if (!ConnectNamedPipe(hPipe, nullptr) && GetLastError() != ERROR_PIPE_CONNECTED) {
+				CloseHandle(hPipe);
+				continue;
+			}
+			auto connection = std::make_unique<LocalConnection>(hPipe);
+#else
+			int fd = accept4(fd_, nullptr, nullptr, SOCK_CLOEXEC);
+			if (fd < 0) {
+				if (errno == EINTR || errno == ECONNABORTED) {
+					continue;
+				}
+				return nullptr;
+			}
+			auto connection = std::make_unique<LocalConnection>(fd);
+#endif
+			if (stopping_) {
+				return nullptr;
+			}
+			return connection;
+		}
+		return nullptr;
+	}
+
+	// Makes a blocked Accept() return. May be called from any thread.
+	void Stop() {
+		stopping_ = true;
+#ifdef _WIN32
+		// ConnectNamedPipe only returns once a client connects.
+		try {
+			ConnectLocal(endpoint_);
+		}
+		catch (const std::exception&) {
+		}
+#else
+		shutdown(fd_, SHUT_RDWR);
+#endif
+	}
+
+private:
+	std::filesystem::path endpoint_;
+	std::atomic<bool> stopping_ = false;
+#ifdef _WIN32
+	// The instance created up front, until Accept() takes it.
+	HANDLE pending_ = INVALID_HANDLE_VALUE;
+
+	HANDLE CreateInstance(bool first) {
+		PSECURITY_DESCRIPTOR descriptor = nullptr;
+		if (!ConvertStringSecurityDescriptorToSecurityDescriptorW(L"D:P(A;;GA;;;SY)(A;;GA;;;BA)(A;;GA;;;OW)",
+			SDDL_REVISION_1, &descriptor, nullptr)) {
+			return INVALID_HANDLE_VALUE;
+		}
+		SECURITY_ATTRIBUTES attributes = { sizeof(attributes), descriptor, FALSE };
+
+		HANDLE hPipe = CreateNamedPipeW(endpoint_.c_str(),
+			/*dwOpenMode=*/ PIPE_ACCESS_DUPLEX | (first ? FILE_FLAG_FIRST_PIPE_INSTANCE : 0),
+			/*dwPipeMode=*/ PIPE_TYPE_BYTE | PIPE_READMODE_BYTE | PIPE_WAIT | PIPE_REJECT_REMOTE_CLIENTS,
+			/*nMaxInstances=*/ PIPE_UNLIMITED_INSTANCES,
+			/*nOutBufferSize=*/ 4096,
+			/*nInBufferSize=*/ 4096,
+			/*nDefaultTimeOut=*/ 0,
+			/*lpSecurityAttributes=*/ &attributes);
+		DWORD err = GetLastError();
+		LocalFree(descriptor);
+		SetLastError(err);
+		return hPipe;
+	}
+#else
+	int fd_ = -1;
+#endif
+};
@@ -0,0 +1,121 @@
+/* Copyright 2022 Google LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#pragma once
+
+#include <cstddef>
+#include <filesystem>
+#include "StorageTypes.h"
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+// A read-only memory mapping of a whole file.
+class MappedFile {
+public:
+	MappedFile() {
+	}
+	MappedFile(const MappedFile&) = delete;
+	MappedFile& operator=(const MappedFile&) = delete;
+	~MappedFile() {
+		Close();
+	}
+
+	// Returns false if the file does not exist, is empty or cannot be mapped.
+	bool Open(const std::filesystem::path& path) {
+		Close();
+
+#ifdef _WIN32
+		HANDLE hFile = CreateFileW(path.c_str(),
+			/*dwDesiredAccess=*/ GENERIC_READ,
+			/*dwShareMode=*/ FILE_SHARE_READ | FILE_SHARE_DELETE,
+			/*lpSecurityAttributes=*/ 0,
+			/*dwCreationDisposition=*/ OPEN_EXISTING,
+			/*dwFlagsAndAttributes=*/ FILE_ATTRIBUTE_NORMAL,
+			/*hTemplateFile=*/ 0);
+		if (hFile == INVALID_HANDLE_VALUE) {
+			return false;
+		}
+
+		LARGE_INTEGER fileSize;
+		if (!GetFileSizeEx(hFile, &fileSize) || fileSize.QuadPart == 0) {
+			CloseHandle(hFile);
+			return false;
+		}
+
+		HANDLE hMapping = CreateFileMappingW(hFile, 0, PAGE_READONLY, 0, 0, 0);
+		CloseHandle(hFile);
+		if (hMapping == nullptr) {
+			return false;
+		}
+
+		data_ = (const BYTE*)MapViewOfFile(hMapping, FILE_MAP_READ, 0, 0, 0);
+		CloseHandle(hMapping);
+		if (data_ == nullptr) {
+			return false;
+		}
+		size_ = (size_t)fileSize.QuadPart;
+#else
+		int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+		if (fd < 0) {
+			return false;
+		}
+
+		struct stat fileStat;
+		if (fstat(fd, &fileStat) != 0 || fileStat.st_size == 0) {
+			close(fd);
+			return false;
+		}
+
+		void* data = mmap(nullptr, (size_t)fileStat.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		close(fd);
+		if (data == MAP_FAILED) {
+			return false;
+		}
+		data_ = (const BYTE*)data;
+		size_ = (size_t)fileStat.st_size;
+#endif
+
+		return true;
+	}
+
+	void Close() {
+		if (data_ == nullptr) {
+			return;
+		}
+
+#ifdef _WIN32
+		UnmapViewOfFile(data_);
+#else
+		munmap((void*)data_, size_);
+#endif
+		data_ = nullptr;
+		size_ = 0;
+	}
+
+	const BYTE* Data() const {
+		return data_;
+	}
+	size_t Size() const {
+		return size_;
+	}
+
+private:
+	const BYTE* data_ = nullptr;
+	size_t size_ = 0;
+};
@@ -0,0 +1,25 @@
+/* Copyright 2022 Google LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#pragma once
+
+#include "StorageTypes.h"
+
+// The Identify Active Namespace ID List (CNS 0x02): the active namespace IDs
+// above the one requested, in increasing order. Unused entries are 0.
+struct NvmeActiveNamespaceList {
+	static constexpr size_t MaxNamespaceIds = NVME_MAX_LOG_SIZE / sizeof(DWORD);
+
+	DWORD NamespaceIds[MaxNamespaceIds];
+};
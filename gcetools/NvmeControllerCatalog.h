@@ -0,0 +1,113 @@
+/* Copyright 2022 Google LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#pragma once
+
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "GoogleStorageDevice.h"
+#include "NvmeActiveNamespaceList.h"
+#include "PhaseTimings.h"
+
+// The names of the namespaces on each NVMe controller, shared by everything
+// resolving disks in one run. The first disk resolved on a controller reads
+// the whole controller through its own handle: Identify Controller, the
+// Identify Active Namespace ID List (CNS 0x02), then Identify Namespace for
+// each active namespace, back to back. Every other disk on that controller
+// takes its name from here, without opening a handle of its own to identify
+// its namespace.
+class NvmeControllerCatalog {
+public:
+	// Writes the name of the namespace at location into name, reading the
+	// controller through device if no disk on it has been resolved yet.
+	// Returns false if the controller could not be read or does not list the
+	// namespace, so the caller can identify it on its own.
+	bool Lookup(const NvmeLocation& location, GoogleStorageDevice& device, std::string& name) {
+		std::shared_ptr<Controller> controller;
+		{
+			std::lock_guard<std::mutex> lock(mutex_);
+			std::shared_ptr<Controller>& entry = controllers_[location.ControllerId];
+			if (!entry) {
+				entry = std::make_shared<Controller>();
+			}
+			controller = entry;
+		}
+
+		// Disks on other controllers are not held up while this one loads.
+		std::lock_guard<std::mutex> lock(controller->Mutex);
+		if (!controller->Loaded) {
+			controller->Loaded = true;
+			try {
+				Load(device, controller->Names);
+			}
+			catch (const std::exception&) {
+				// Keep whatever was read before the failure; the rest of the
+				// disks are identified one at a time.
+			}
+		}
+
+		auto entry = controller->Names.find(location.NamespaceId);
+		if (entry == controller->Names.end()) {
+			return false;
+		}
+		name.assign(entry->second);
+		return true;
+	}
+
+private:
+	struct Controller {
+		std::mutex Mutex;
+		bool Loaded = false;
+		std::unordered_map<DWORD, std::string> Names;
+	};
+
+	std::mutex mutex_;
+	std::unordered_map<std::string, std::shared_ptr<Controller>> controllers_;
+
+	static void Load(GoogleStorageDevice& device, std::unordered_map<DWORD, std::string>& names) {
+		PhaseTimings::Scope phase("NVMe controller scan");
+
+		DWORD namespaceCount;
+		{
+			StorageQueryResult<NVME_IDENTIFY_CONTROLLER_DATA> controllerData = device.GetNvmeControllerData();
+			namespaceCount = controllerData->NN;
+		}
+
+		std::vector<DWORD> namespaceIds;
+		for (DWORD after = 0; namespaceIds.size() < namespaceCount;) {
+			StorageQueryResult<NvmeActiveNamespaceList> list = device.GetNvmeActiveNamespaces(after);
+			size_t count = 0;
+			while (count < NvmeActiveNamespaceList::MaxNamespaceIds && list->NamespaceIds[count] > after) {
+				after = list->NamespaceIds[count++];
+				namespaceIds.push_back(after);
+			}
+			if (count < NvmeActiveNamespaceList::MaxNamespaceIds) {
+				break;
+			}
+		}
+
+		for (DWORD namespaceId : namespaceIds) {
+			StorageQueryResult<NVME_IDENTIFY_NAMESPACE_DATA> namespaceData = device.GetNvmeNamespaceData(namespaceId);
+			GoogleStorageDevice::VisitNvmeMetadata(*namespaceData, [&](const NvmeVendorMetadata& metadata) {
+				if (!metadata.DeviceName.empty()) {
+					names[namespaceId].assign(metadata.DeviceName);
+				}
+			});
+		}
+	}
+};
@@ -0,0 +1,185 @@
+/* Copyright 2022 Google LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#pragma once
+
+#include <algorithm>
+#include <charconv>
+#include <chrono>
+#include <cstdint>
+#include <exception>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <vector>
+#include "DeviceBackend.h"
+#include "GoogleStorageDevice.h"
+#include "StorageTypes.h"
+#include "Utf8.h"
+
+// A disk's SMART / Health counters at one point in time.
+struct NvmeHealthCounters {
+	uint64_t DataUnitsRead = 0;
+	uint64_t DataUnitsWritten = 0;
+	uint64_t HostReadCommands = 0;
+	uint64_t HostWriteCommands = 0;
+	uint64_t MediaErrors = 0;
+	int TemperatureCelsius = 0;
+	unsigned int PercentageUsed = 0;
+	unsigned int CriticalWarning = 0;
+};
+
+// Samples the SMART / Health log of every NVMe disk in a set, for watching
+// wear and throughput on busy machines. Each disk is opened once and kept
+// open, its log is read into the disk's own query buffer, and records are
+// formatted into the caller's buffer, so once warmed up a sample costs one
+// driver query per disk and no allocations.
+//
+// Each sample after the first appends one line per disk:
+//
+//   <name> interval_ms=1000 read_bytes=<n> write_bytes=<n> read_ops=<n>
+//     write_ops=<n> read_Bps=<n> write_Bps=<n> read_iops=<n> write_iops=<n>
+//     media_errors=<n> temp_c=<n> used_pct=<n> critical_warning=<n>
+//
+// The byte and operation counts are the change since the previous sample;
+// media errors, temperature, wear and warnings are current values.
+class NvmeHealthCollector {
+public:
+	using Clock = std::chrono::steady_clock;
+
+	// Devices that are not NVMe disks, or cannot be opened, are skipped.
+	NvmeHealthCollector(const DeviceBackendFactory& backendFactory, const std::vector<std::wstring>& deviceIds) {
+		for (const std::wstring& deviceId : deviceIds) {
+			try {
+				auto device = std::make_unique<GoogleStorageDevice>(backendFactory(deviceId));
+				if (device->GetBusType() != STORAGE_BUS_TYPE::BusTypeNvme) {
+					continue;
+				}
+				std::string name = device->GetDeviceName();
+				disks_.push_back(Disk{ std::move(device), name.empty() ? ToUtf8(deviceId) : name, NvmeHealthCounters(), false });
+			}
+			catch (const std::exception& e) {
+				std::cerr << "Not sampling " << ToUtf8(deviceId) << ": " << e.what() << std::endl;
+			}
+		}
+	}
+
+	size_t GetDiskCount() const {
+		return disks_.size();
+	}
+
+	// Reads every disk's health log and appends a record per disk to out.
+	// The first sample has nothing to compare against, so it only reads the
+	// counters.
+	void Sample(std::string& out) {
+		Clock::time_point now = Clock::now();
+		std::chrono::microseconds interval = std::chrono::duration_cast<std::chrono::microseconds>(now - lastSample_);
+		for (Disk& disk : disks_) {
+			NvmeHealthCounters counters;
+			try {
+				ReadCounters(*disk.Device, counters);
+			}
+			catch (const std::exception& e) {
+				out.append(disk.Name).append(" error=\"").append(e.what()).append("\"\n");
+				disk.HaveCounters = false;
+				continue;
+			}
+			if (disk.HaveCounters && interval.count() > 0) {
+				AppendRecord(out, disk, counters, interval);
+			}
+			disk.Counters = counters;
+			disk.HaveCounters = true;
+		}
+		lastSample_ = now;
+	}
+
+	static void ReadCounters(StorageDevice& device, NvmeHealthCounters& counters) {
+		StorageQueryResult<NVME_HEALTH_INFO_LOG> log = device.GetNvmeHealthInfo();
+		counters.DataUnitsRead = ReadCounter(log->DataUnitRead);
+		counters.DataUnitsWritten = ReadCounter(log->DataUnitWritten);
+		counters.HostReadCommands = ReadCounter(log->HostReadCommands);
+		counters.HostWriteCommands = ReadCounter(log->HostWrittenCommands);
+		counters.MediaErrors = ReadCounter(log->MediaErrors);
+		counters.TemperatureCelsius = (int)(log->Temperature[0] | (log->Temperature[1] << 8)) - 273;
+		counters.PercentageUsed = log->PercentageUsed;
+		counters.CriticalWarning = log->CriticalWarning.AsUchar;
+	}
+
+private:
+	// A data unit is 1000 512-byte sectors.
+	static constexpr uint64_t BytesPerDataUnit = 512000;
+
+	struct Disk {
+		std::unique_ptr<GoogleStorageDevice> Device;
+		std::string Name;
+		NvmeHealthCounters Counters;
+		bool HaveCounters = false;
+	};
+
+	std::vector<Disk> disks_;
+	Clock::time_point lastSample_;
+
+	// The 128-bit counters are little-endian. Counters past 64 bits, which
+	// no disk gets near, are clamped.
+	static uint64_t ReadCounter(const UCHAR (&counter)[16]) {
+		for (size_t i = 8; i < sizeof(counter); i++) {
+			if (counter[i] != 0) {
+				return UINT64_MAX;
+			}
+		}
+		uint64_t value = 0;
+		for (size_t i = 8; i > 0; i--) {
+			value = (value << 8) | counter[i - 1];
+		}
+		return value;
+	}
+
+	// Counters that went backwards (the controller was reset) count as no
+	// change.
+	static uint64_t Delta(uint64_t current, uint64_t previous) {
+		return current > previous ? current - previous : 0;
+	}
+
+	static void AppendRecord(std::string& out, const Disk& disk, const NvmeHealthCounters& counters, std::chrono::microseconds interval) {
+		uint64_t readBytes = Delta(counters.DataUnitsRead, disk.Counters.DataUnitsRead) * BytesPerDataUnit;
+		uint64_t writeBytes = Delta(counters.DataUnitsWritten, disk.Counters.DataUnitsWritten) * BytesPerDataUnit;
+		uint64_t readOps = Delta(counters.HostReadCommands, disk.Counters.HostReadCommands);
+		uint64_t writeOps = Delta(counters.HostWriteCommands, disk.Counters.HostWriteCommands);
+		double seconds = interval.count() / 1e6;
+
+		char line[512];
+		char* next = line;
+		char* end = line + sizeof(line);
+		auto field = [&next, end](const char* name, auto value) {
+			for (; *name != '\0' && next < end; name++) {
+				*next++ = *name;
+			}
+			next = std::to_chars(next, end, value).ptr;
+		};
+		field(" interval_ms=", (uint64_t)(interval.count() / 1000));
+		field(" read_bytes=", readBytes);
+		field(" write_bytes=", writeBytes);
+		field(" read_ops=", readOps);
+		field(" write_ops=", writeOps);
+		field(" read_Bps=", (uint64_t)(readBytes / seconds));
+		field(" write_Bps=", (uint64_t)(writeBytes / seconds));
+		field(" read_iops=", (uint64_t)(readOps / seconds));
+		field(" write_iops=", (uint64_t)(writeOps / seconds));
+		field(" media_errors=", counters.MediaErrors);
+		field(" temp_c=", counters.TemperatureCelsius);
+		field(" used_pct=", counters.PercentageUsed);
+		field(" critical_warning=", counters.CriticalWarning);
+		out.append(disk.Name).append(line, next - line).push_back('\n');
+	}
+};
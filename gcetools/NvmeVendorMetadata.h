@@ -0,0 +1,273 @@
+/* Copyright 2022 Google LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string_view>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define GCETOOLS_HAVE_SSE2 1
+#include <emmintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+#endif
+
+struct NvmeVendorMetadataField {
+	std::string_view Key;
+	// The raw value: the contents of a string without its quotes (escape
+	// sequences are left as they are), or the text of any other value.
+	std::string_view Value;
+};
+
+// The metadata Google writes as a JSON object to the start of the
+// vendor-specific (VS) section of the NVMe Identify Namespace data. Every
+// string_view points into the VS bytes that were parsed.
+struct NvmeVendorMetadata {
+	static constexpr size_t MaxFields = 32;
+
+	std::string_view DeviceName;
+	std::string_view DiskType;
+
+	// Every top-level field, in the order they appear, including the ones
+	// above.
+	NvmeVendorMetadataField Fields[MaxFields] = {};
+	size_t FieldCount = 0;
+
+	// Returns the value of the field with the given key, or an empty view.
+	std::string_view Find(std::string_view key) const {
+		for (size_t i = 0; i < FieldCount; i++) {
+			if (Fields[i].Key == key) {
+				return Fields[i].Value;
+			}
+		}
+		return std::string_view();
+	}
+};
+
+// A bounded, single-pass parser for the VS metadata. It accepts any flat JSON
+// object (whitespace is allowed, nested objects and arrays are returned as raw
+// values), never reads past the end of the input and never allocates.
+class NvmeVendorMetadataParser {
+public:
+	// Parses the object at the start of vendorSpecificData, stopping at the
+	// first NUL. Returns false if the data is not a well-formed object or has
+	// more than MaxFields fields; metadata then holds the fields parsed so far.
+	static bool Parse(std::string_view vendorSpecificData, NvmeVendorMetadata& metadata) {
+		// Fields beyond FieldCount are never read, so they are not cleared.
+		metadata.DeviceName = std::string_view();
+		metadata.DiskType = std::string_view();
+		metadata.FieldCount = 0;
+
+		const char* p = vendorSpecificData.data();
+		const char* end = p + vendorSpecificData.size();
+
+		p = SkipWhitespace(p, end);
+		if (p == end || *p != '{') {
+			return false;
+		}
+		p = SkipWhitespace(p + 1, end);
+		if (p != end && *p == '}') {
+			return true;
+		}
+
+		for (;;) {
+			NvmeVendorMetadataField field;
+			if (p == end || *p != '"' || !ReadString(p, end, field.Key)) {
+				return false;
+			}
+
+			p = SkipWhitespace(p, end);
+			if (p == end || *p != ':') {
+				return false;
+			}
+			p = SkipWhitespace(p + 1, end);
+
+			if (!ReadValue(p, end, field.Value)) {
+				return false;
+			}
+			if (!AddField(field, metadata)) {
+				return false;
+			}
+
+			p = SkipWhitespace(p, end);
+			if (p == end) {
+				return false;
+			}
+			if (*p == '}') {
+				return true;
+			}
+			if (*p != ',') {
+				return false;
+			}
+			p = SkipWhitespace(p + 1, end);
+		}
+	}
+
+	// Returns the length of the NUL-terminated data at the start of a
+	// fixed-size field, or size if it is not terminated.
+	static size_t BoundedLength(const void* data, size_t size) {
+		const char* p = (const char*)data;
+		const char* nul = FindByte(p, p + size, '\0');
+		return nul - p;
+	}
+
+private:
+	static bool AddField(const NvmeVendorMetadataField& field, NvmeVendorMetadata& metadata) {
+		if (metadata.FieldCount == NvmeVendorMetadata::MaxFields) {
+			return false;
+		}
+		metadata.Fields[metadata.FieldCount++] = field;
+
+		if (field.Key == "device_name") {
+			metadata.DeviceName = field.Value;
+		}
+		else if (field.Key == "disk_type") {
+			metadata.DiskType = field.Value;
+		}
+		return true;
+	}
+
+	static const char* SkipWhitespace(const char* p, const char* end) {
+		while (p != end && (*p == ' ' || *p == '\t' || *p == '\n' || *p == '\r')) {
+			p++;
+		}
+		return p;
+	}
+
+	// p points at an opening quote. On success, value is the string between
+	// the quotes and p points just past the closing quote.
+	static bool ReadString(const char*& p, const char* end, std::string_view& value) {
+		const char* start = p + 1;
+		const char* q = start;
+		for (;;) {
+			q = FindQuoteOrBackslash(q, end);
+			if (q == end) {
+				return false;
+			}
+			if (*q == '"') {
+				break;
+			}
+			// Skip the escaped character.
+			if (end - q < 2) {
+				return false;
+			}
+			q += 2;
+		}
+
+		value = std::string_view(start, q - start);
+		p = q + 1;
+		return true;
+	}
+
+	static bool ReadValue(const char*& p, const char* end, std::string_view& value) {
+		if (p == end) {
+			return false;
+		}
+		if (*p == '"') {
+			return ReadString(p, end, value);
+		}
+
+		// Numbers, literals, and nested objects or arrays are kept as raw
+		// text up to the next delimiter at this level.
+		const char* start = p;
+		int depth = 0;
+		while (p != end) {
+			char c = *p;
+			if (c == '"') {
+				std::string_view ignored;
+				if (!ReadString(p, end, ignored)) {
+					return false;
+				}
+				continue;
+			}
+			if (c == '{' || c == '[') {
+				depth++;
+			}
+			else if (c == '}' || c == ']') {
+				if (depth == 0) {
+					break;
+				}
+				depth--;
+			}
+			else if (c == ',' && depth == 0) {
+				break;
+			}
+			p++;
+		}
+
+		if (depth != 0) {
+			return false;
+		}
+		const char* valueEnd = p;
+		while (valueEnd != start && (valueEnd[-1] == ' ' || valueEnd[-1] == '\t' || valueEnd[-1] == '\n' || valueEnd[-1] == '\r')) {
+			valueEnd--;
+		}
+		value = std::string_view(start, valueEnd - start);
+		return !value.empty();
+	}
+
+	// Most of the metadata is string contents, so the scan for the end of a
+	// string is done 16 bytes at a time where SSE2 is available.
+	static const char* FindQuoteOrBackslash(const char* p, const char* end) {
+#ifdef GCETOOLS_HAVE_SSE2
+		const __m128i quote = _mm_set1_epi8('"');
+		const __m128i backslash = _mm_set1_epi8('\\');
+		while (end - p >= 16) {
+			__m128i chunk = _mm_loadu_si128((const __m128i*)p);
+			int mask = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(chunk, quote), _mm_cmpeq_epi8(chunk, backslash)));
+			if (mask != 0) {
+				return p + CountTrailingZeros(mask);
+			}
+			p += 16;
+		}
+#endif
+		while (p != end && *p != '"' && *p != '\\') {
+			p++;
+		}
+		return p;
+	}
+
+	static const char* FindByte(const char* p, const char* end, char value) {
+#ifdef GCETOOLS_HAVE_SSE2
+		const __m128i needle = _mm_set1_epi8(value);
+		while (end - p >= 16) {
+			__m128i chunk = _mm_loadu_si128((const __m128i*)p);
+			int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(chunk, needle));
+			if (mask != 0) {
+				return p + CountTrailingZeros(mask);
+			}
+			p += 16;
+		}
+#endif
+		while (p != end && *p != value) {
+			p++;
+		}
+		return p;
+	}
+
+#ifdef GCETOOLS_HAVE_SSE2
+	static int CountTrailingZeros(int mask) {
+#ifdef _MSC_VER
+		unsigned long index;
+		_BitScanForward(&index, (unsigned long)mask);
+		return (int)index;
+#else
+		return __builtin_ctz((unsigned int)mask);
+#endif
+	}
+#endif
+};
@@ -0,0 +1,380 @@
+/* Copyright 2022 Google LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <bit>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <exception>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include "JsonText.h"
+#include "Utf8.h"
+
+// The steps of a run whose latency is recorded: the steps of enumerating the
+// devices, and each device's open and driver queries by what they ask for.
+enum class DeviceOperation {
+	ComInit,
+	WmiConnect,
+	WmiQuery,
+	Enumerate,
+	Open,
+	DescriptorHeader,
+	DeviceDescriptor,
+	AdapterDescriptor,
+	DeviceIdDescriptor,
+	NvmeIdentifyController,
+	NvmeIdentifyNamespace,
+	NvmeActiveNamespaces,
+	NvmeHealthLog,
+	OtherQuery,
+	Count,
+};
+
+inline const char* GetOperationName(DeviceOperation operation) {
+	static constexpr const char* Names[] = {
+		"com_init",
+		"wmi_connect",
+		"wmi_query",
+		"enumerate",
+		"open",
+		"descriptor_header",
+		"device_descriptor",
+		"adapter_descriptor",
+		"device_id_descriptor",
+		"nvme_identify_controller",
+		"nvme_identify_namespace",
+		"nvme_active_namespaces",
+		"nvme_health_log",
+		"other_query",
+	};
+	static_assert(std::size(Names) == (size_t)DeviceOperation::Count);
+	return Names[(size_t)operation];
+}
+
+// A count, error count, total and log2 histogram of the latency of one
+// operation, updated with relaxed atomics from any thread. Bucket i counts
+// operations that took less than 2^i ns (and at least 2^(i-1) ns); the last
+// bucket counts everything slower.
+class LatencyHistogram {
+public:
+	static constexpr size_t BucketCount = 36;
+
+	void Record(uint64_t nanoseconds, bool failed) {
+		size_t bucket = std::min<size_t>(std::bit_width(nanoseconds), BucketCount - 1);
+		buckets_[bucket].fetch_add(1, std::memory_order_relaxed);
+		count_.fetch_add(1, std::memory_order_relaxed);
+		totalNanoseconds_.fetch_add(nanoseconds, std::memory_order_relaxed);
+		if (failed) {
+			errors_.fetch_add(1, std::memory_order_relaxed);
+		}
+	}
+
+	uint64_t GetCount() const {
+		return count_.load(std::memory_order_relaxed);
+	}
+	uint64_t GetErrors() const {
+		return errors_.load(std::memory_order_relaxed);
+	}
+	uint64_t GetTotalNanoseconds() const {
+		return totalNanoseconds_.load(std::memory_order_relaxed);
+	}
+	uint64_t GetBucket(size_t bucket) const {
+		return buckets_[bucket].load(std::memory_order_relaxed);
+	}
+
+private:
+	std::atomic<uint64_t> count_ = 0;
+	std::atomic<uint64_t> errors_ = 0;
+	std::atomic<uint64_t> totalNanoseconds_ = 0;
+	std::array<std::atomic<uint64_t>, BucketCount> buckets_ = {};
+};
+
+// A histogram per operation, for the whole process or for one device.
+struct OperationStats {
+	std::array<LatencyHistogram, (size_t)DeviceOperation::Count> Operations;
+
+	LatencyHistogram& operator[](DeviceOperation operation) {
+		return Operations[(size_t)operation];
+	}
+	const LatencyHistogram& operator[](DeviceOperation operation) const {
+		return Operations[(size_t)operation];
+	}
+};
+
+// Counts and latency histograms of every operation, for the whole process and
+// for each device, to find which step a slow run spent its time in. Recording
+// is off unless enabled, and then costs two clock reads and a few relaxed
+// atomic adds per operation. Unlike PhaseTimings, nothing is locked on the
+// way, so it can be left on in a long-running service.
+class OperationMetrics {
+public:
+	using Clock = std::chrono::steady_clock;
+
+	// Times the enclosing scope as one occurrence of an operation, for the
+	// process and, if given, the device. The operation counts as failed if
+	// Fail() is called or the scope is left by an exception.
+	class Scope {
+	public:
+		Scope(DeviceOperation operation, OperationStats* device = nullptr) : device_(device) {
+			Start(operation);
+		}
+		Scope(const Scope&) = delete;
+		Scope& operator=(const Scope&) = delete;
+		~Scope() {
+			End();
+		}
+
+		// Ends the current operation and starts timing the next one.
+		void Next(DeviceOperation operation) {
+			End();
+			Start(operation);
+		}
+
+		void Fail() {
+			failed_ = true;
+		}
+
+	private:
+		bool enabled_ = false;
+		bool failed_ = false;
+		DeviceOperation operation_ = DeviceOperation::Count;
+		OperationStats* device_;
+		int uncaughtExceptions_ = 0;
+		Clock::time_point start_;
+
+		void Start(DeviceOperation operation) {
+			enabled_ = OperationMetrics::IsEnabled();
+			if (enabled_) {
+				operation_ = operation;
+				failed_ = false;
+				uncaughtExceptions_ = std::uncaught_exceptions();
+				start_ = Clock::now();
+			}
+		}
+
+		void End() {
+			if (enabled_) {
+				bool failed = failed_ || std::uncaught_exceptions() > uncaughtExceptions_;
+				OperationMetrics::Record(operation_, device_, Clock::now() - start_, failed);
+				enabled_ = false;
+			}
+		}
+	};
+
+	static void SetEnabled(bool enabled) {
+		enabled_.store(enabled, std::memory_order_relaxed);
+	}
+
+	static bool IsEnabled() {
+		return enabled_.load(std::memory_order_relaxed);
+	}
+
+	static void Record(DeviceOperation operation, OperationStats* device, Clock::duration elapsed, bool failed) {
+		uint64_t nanoseconds = (uint64_t)std::max<int64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count(), 0);
+		process_[operation].Record(nanoseconds, failed);
+		if (device != nullptr) {
+			(*device)[operation].Record(nanoseconds, failed);
+		}
+	}
+
+	// The histograms of one device, created the first time it is asked for
+	// and kept for the life of the process. nullptr while recording is off.
+	static OperationStats* ForDevice(const std::wstring& deviceId) {
+		if (!IsEnabled()) {
+			return nullptr;
+		}
+		std::lock_guard<std::mutex> lock(devicesMutex_);
+		std::unique_ptr<OperationStats>& stats = devices_[ToUtf8(deviceId)];
+		if (!stats) {
+			stats = std::make_unique<OperationStats>();
+		}
+		return stats.get();
+	}
+
+	// One JSON object on a single line:
+	// {"operations":{<operation>:{"count":N,"errors":N,"total_ns":N,
+	// "buckets":{<upper bound in ns>:N,...}},...},"devices":{<DeviceId>:{...}}}
+	// Operations that never ran are left out, as are empty buckets. The
+	// slowest bucket's bound is "inf".
+	static void AppendJson(std::string& out) {
+		out.append("{\"operations\":");
+		AppendJsonStats(out, process_);
+		out.append(",\"devices\":{");
+		std::lock_guard<std::mutex> lock(devicesMutex_);
+		bool first = true;
+		for (const auto& [deviceId, stats] : devices_) {
+			if (!first) {
+				out.push_back(',');
+			}
+			first = false;
+			AppendJsonString(out, deviceId);
+			out.push_back(':');
+			AppendJsonStats(out, *stats);
+		}
+		out.append("}}");
+	}
+
+	// The Prometheus text exposition format: a histogram for each operation
+	// and another for each operation on each device, and their error counts.
+	static void AppendPrometheus(std::string& out) {
+		out.append("# HELP gcetools_operation_duration_seconds Latency of each enumeration step, device open and driver query.\n");
+		out.append("# TYPE gcetools_operation_duration_seconds histogram\n");
+		AppendPrometheusHistograms(out, "gcetools_operation_duration_seconds", std::string(), process_);
+		out.append("# HELP gcetools_operation_errors_total Enumeration steps, device opens and driver queries that failed.\n");
+		out.append("# TYPE gcetools_operation_errors_total counter\n");
+		AppendPrometheusErrors(out, "gcetools_operation_errors_total", std::string(), process_);
+
+		std::lock_guard<std::mutex> lock(devicesMutex_);
+		out.append("# HELP gcetools_device_operation_duration_seconds Latency of each device's open and driver queries.\n");
+		out.append("# TYPE gcetools_device_operation_duration_seconds histogram\n");
+		for (const auto& [deviceId, stats] : devices_) {
+			AppendPrometheusHistograms(out, "gcetools_device_operation_duration_seconds", FormatDeviceLabel(deviceId), *stats);
+		}
+		out.append("# HELP gcetools_device_operation_errors_total Device opens and driver queries that failed, by device.\n");
+		out.append("# TYPE gcetools_device_operation_errors_total counter\n");
+		for (const auto& [deviceId, stats] : devices_) {
+			AppendPrometheusErrors(out, "gcetools_device_operation_errors_total", FormatDeviceLabel(deviceId), *stats);
+		}
+	}
+
+private:
+	// 2^10 ns, about 1 us.
+	static constexpr size_t FirstPrometheusBucket = 10;
+
+	static inline std::atomic<bool> enabled_ = false;
+	static inline OperationStats process_;
+	// Keyed by UTF-8 DeviceId, so the output is in DeviceId order.
+	static inline std::mutex devicesMutex_;
+	static inline std::map<std::string, std::unique_ptr<OperationStats>> devices_;
+
+	static void AppendJsonStats(std::string& out, const OperationStats& stats) {
+		out.push_back('{');
+		bool first = true;
+		for (size_t i = 0; i < (size_t)DeviceOperation::Count; i++) {
+			const LatencyHistogram& histogram = stats.Operations[i];
+			if (histogram.GetCount() == 0) {
+				continue;
+			}
+			if (!first) {
+				out.push_back(',');
+			}
+			first = false;
+			AppendJsonString(out, GetOperationName((DeviceOperation)i));
+			out.append(":{\"count\":").append(std::to_string(histogram.GetCount()));
+			out.append(",\"errors\":").append(std::to_string(histogram.GetErrors()));
+			out.append(",\"total_ns\":").append(std::to_string(histogram.GetTotalNanoseconds()));
+			out.append(",\"buckets\":{");
+			bool firstBucket = true;
+			for (size_t bucket = 0; bucket < LatencyHistogram::BucketCount; bucket++) {
+				uint64_t count = histogram.GetBucket(bucket);
+				if (count == 0) {
+					continue;
+				}
+				if (!firstBucket) {
+					out.push_back(',');
+				}
+				firstBucket = false;
+				out.push_back('"');
+				out.append(bucket + 1 < LatencyHistogram::BucketCount ? std::to_string(uint64_t(1) << bucket) : "inf");
+				out.append("\":").append(std::to_string(count));
+			}
+			out.append("}}");
+		}
+		out.push_back('}');
+	}
+
+	// Buckets are cumulative, as Prometheus expects, from 1 us (nothing
+	// timed here is faster) up to the slowest one that is not empty.
+	static void AppendPrometheusHistograms(std::string& out, std::string_view metric, const std::string& labels,
+		const OperationStats& stats) {
+		for (size_t i = 0; i < (size_t)DeviceOperation::Count; i++) {
+			const LatencyHistogram& histogram = stats.Operations[i];
+			uint64_t count = histogram.GetCount();
+			if (count == 0) {
+				continue;
+			}
+			std::string operationLabels = labels + "operation=\"" + GetOperationName((DeviceOperation)i) + "\"";
+			size_t lastBucket = FirstPrometheusBucket;
+			for (size_t bucket = FirstPrometheusBucket; bucket + 1 < LatencyHistogram::BucketCount; bucket++) {
+				if (histogram.GetBucket(bucket) != 0) {
+					lastBucket = bucket;
+				}
+			}
+			uint64_t cumulative = 0;
+			for (size_t bucket = 0; bucket <= lastBucket; bucket++) {
+				cumulative += histogram.GetBucket(bucket);
+				if (bucket < FirstPrometheusBucket) {
+					continue;
+				}
+				out.append(metric).append("_bucket{").append(operationLabels).append(",le=\"");
+				AppendSeconds(out, uint64_t(1) << bucket);
+				out.append("\"} ").append(std::to_string(cumulative)).push_back('\n');
+			}
+			out.append(metric).append("_bucket{").append(operationLabels).append(",le=\"+Inf\"} ")
+				.append(std::to_string(count)).push_back('\n');
+			out.append(metric).append("_sum{").append(operationLabels).append("} ");
+			AppendSeconds(out, histogram.GetTotalNanoseconds());
+			out.push_back('\n');
+			out.append(metric).append("_count{").append(operationLabels).append("} ").append(std::to_string(count)).push_back('\n');
+		}
+	}
+
+	static void AppendPrometheusErrors(std::string& out, std::string_view metric, const std::string& labels,
+		const OperationStats& stats) {
+		for (size_t i = 0; i < (size_t)DeviceOperation::Count; i++) {
+			const LatencyHistogram& histogram = stats.Operations[i];
+			if (histogram.GetCount() == 0) {
+				continue;
+			}
+			out.append(metric).push_back('{');
+			out.append(labels).append("operation=\"").append(GetOperationName((DeviceOperation)i)).append("\"} ")
+				.append(std::to_string(histogram.GetErrors())).push_back('\n');
+		}
+	}
+
+	static void AppendSeconds(std::string& out, uint64_t nanoseconds) {
+		char seconds[32];
+		snprintf(seconds, sizeof(seconds), "%.9g", nanoseconds / 1e9);
+		out.append(seconds);
+	}
+
+	// Label values escape backslashes, quotes and newlines, which DeviceIds
+	// like \\.\PHYSICALDRIVE0 are full of.
+	static std::string FormatDeviceLabel(std::string_view deviceId) {
+		std::string label = "device=\"";
+		for (char c : deviceId) {
+			if (c == '\\' || c == '"') {
+				label.push_back('\\');
+				label.push_back(c);
+			}
+			else if (c == '\n') {
+				label.append("\\n");
+			}
+			else {
+				label.push_back(c);
+			}
+		}
+		label.append("\",");
+		return label;
+	}
+};
@@ -0,0 +1,125 @@
+/* Copyright 2022 Google LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <iomanip>
+#include <mutex>
+#include <ostream>
+#include <vector>
+
+// Wall time spent in each phase of a run (COM initialization, enumeration,
+// device opens, driver queries, ...), for spotting cold-start regressions.
+// Recording is off unless enabled, and then costs one relaxed load per phase.
+class PhaseTimings {
+public:
+	using Clock = std::chrono::steady_clock;
+
+	// Times the enclosing scope as one occurrence of a phase. Phase names must
+	// be string literals.
+	class Scope {
+	public:
+		Scope(const char* phase) : phase_(PhaseTimings::IsEnabled() ? phase : nullptr) {
+			if (phase_ != nullptr) {
+				start_ = Clock::now();
+			}
+		}
+		Scope(const Scope&) = delete;
+		Scope& operator=(const Scope&) = delete;
+		~Scope() {
+			End();
+		}
+
+		// Ends the current phase and starts timing the next one.
+		void Next(const char* phase) {
+			End();
+			if (PhaseTimings::IsEnabled()) {
+				phase_ = phase;
+				start_ = Clock::now();
+			}
+		}
+
+	private:
+		const char* phase_;
+		Clock::time_point start_;
+
+		void End() {
+			if (phase_ != nullptr) {
+				PhaseTimings::Record(phase_, Clock::now() - start_);
+				phase_ = nullptr;
+			}
+		}
+	};
+
+	static void SetEnabled(bool enabled) {
+		enabled_.store(enabled, std::memory_order_relaxed);
+	}
+
+	static bool IsEnabled() {
+		return enabled_.load(std::memory_order_relaxed);
+	}
+
+	static void Record(const char* phase, Clock::duration elapsed) {
+		std::lock_guard<std::mutex> lock(mutex_);
+		auto it = std::find_if(phases_.begin(), phases_.end(), [phase](const Phase& p) {
+			return p.Name == phase || strcmp(p.Name, phase) == 0;
+		});
+		if (it == phases_.end()) {
+			it = phases_.insert(phases_.end(), Phase{ phase });
+		}
+		it->Count++;
+		it->Total += elapsed;
+		it->Max = std::max(it->Max, elapsed);
+	}
+
+	// Prints one line per phase, in the order each phase first ran. Phases
+	// that run concurrently (opens and queries on worker threads) add up to
+	// more than the wall time.
+	static void Print(std::ostream& out) {
+		std::lock_guard<std::mutex> lock(mutex_);
+		if (phases_.empty()) {
+			return;
+		}
+
+		out << std::left << std::setw(24) << "Phase" << std::right << std::setw(8) << "Count"
+			<< std::setw(12) << "Total ms" << std::setw(12) << "Avg us" << std::setw(12) << "Max us" << std::endl;
+		for (const Phase& phase : phases_) {
+			using Milliseconds = std::chrono::duration<double, std::milli>;
+			using Microseconds = std::chrono::duration<double, std::micro>;
+			out << std::left << std::setw(24) << phase.Name << std::right << std::setw(8) << phase.Count
+				<< std::fixed << std::setprecision(3)
+				<< std::setw(12) << Milliseconds(phase.Total).count()
+				<< std::setw(12) << Microseconds(phase.Total).count() / phase.Count
+				<< std::setw(12) << Microseconds(phase.Max).count() << std::endl;
+		}
+		out.unsetf(std::ios::floatfield);
+	}
+
+private:
+	struct Phase {
+		const char* Name;
+		uint64_t Count = 0;
+		Clock::duration Total{ 0 };
+		Clock::duration Max{ 0 };
+	};
+
+	static inline std::atomic<bool> enabled_ = false;
+	static inline std::mutex mutex_;
+	static inline std::vector<Phase> phases_;
+};
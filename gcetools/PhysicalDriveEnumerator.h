@@ -0,0 +1,144 @@
+/* Copyright 2022 Google LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#pragma once
+
+#ifdef _WIN32
+
+#include <algorithm>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+#include "DeviceEnumerator.h"
+#include "OperationMetrics.h"
+#include "PhaseTimings.h"
+#include "StorageTypes.h"
+
+#include <setupapi.h>
+
+#pragma comment(lib, "setupapi.lib")
+
+// Lists the present disk interfaces through SetupAPI and maps each one to its
+// \\.\PHYSICALDRIVEn with IOCTL_STORAGE_GET_DEVICE_NUMBER. No COM or WMI is
+// involved, so this costs one handle open per disk.
+class PhysicalDriveEnumerator : public DeviceEnumerator {
+public:
+	const char* GetName() const override {
+		return "SetupAPI";
+	}
+
+	std::vector<std::wstring> EnumerateDeviceIds() override {
+		PhaseTimings::Scope phase("SetupAPI enumerate");
+		OperationMetrics::Scope metrics(DeviceOperation::Enumerate);
+
+		std::vector<DWORD> deviceNumbers;
+		for (const auto& [devicePath, deviceNumber] : EnumerateDiskInterfaces()) {
+			deviceNumbers.push_back(deviceNumber);
+		}
+
+		std::sort(deviceNumbers.begin(), deviceNumbers.end());
+		std::vector<std::wstring> deviceIds;
+		for (DWORD deviceNumber : deviceNumbers) {
+			deviceIds.push_back(GetDeviceId(deviceNumber));
+		}
+		return deviceIds;
+	}
+
+	// The device interface path and \\.\PHYSICALDRIVE number of every
+	// present disk.
+	static std::vector<std::pair<std::wstring, DWORD>> EnumerateDiskInterfaces() {
+		HDEVINFO deviceInfo = SetupDiGetClassDevsW(&DiskInterfaceGuid, nullptr, nullptr, DIGCF_PRESENT | DIGCF_DEVICEINTERFACE);
+		if (deviceInfo == INVALID_HANDLE_VALUE) {
+			throw std::runtime_error("SetupDiGetClassDevs failed. Error code: " + std::to_string(GetLastError()));
+		}
+
+		std::vector<std::pair<std::wstring, DWORD>> interfaces;
+		std::vector<BYTE> detailBuffer;
+		SP_DEVICE_INTERFACE_DATA interfaceData = {};
+		interfaceData.cbSize = sizeof(interfaceData);
+		for (DWORD i = 0; SetupDiEnumDeviceInterfaces(deviceInfo, nullptr, &DiskInterfaceGuid, i, &interfaceData); i++) {
+			DWORD requiredSize = 0;
+			SetupDiGetDeviceInterfaceDetailW(deviceInfo, &interfaceData, nullptr, 0, &requiredSize, nullptr);
+			if (requiredSize < sizeof(SP_DEVICE_INTERFACE_DETAIL_DATA_W)) {
+				continue;
+			}
+
+			detailBuffer.assign(requiredSize, 0);
+			SP_DEVICE_INTERFACE_DETAIL_DATA_W* detail = (SP_DEVICE_INTERFACE_DETAIL_DATA_W*)detailBuffer.data();
+			detail->cbSize = sizeof(SP_DEVICE_INTERFACE_DETAIL_DATA_W);
+			if (!SetupDiGetDeviceInterfaceDetailW(deviceInfo, &interfaceData, detail, requiredSize, nullptr, nullptr)) {
+				continue;
+			}
+
+			DWORD deviceNumber;
+			if (GetDeviceNumber(detail->DevicePath, &deviceNumber)) {
+				interfaces.emplace_back(detail->DevicePath, deviceNumber);
+			}
+		}
+
+		DWORD err = GetLastError();
+		SetupDiDestroyDeviceInfoList(deviceInfo);
+		if (err != ERROR_NO_MORE_ITEMS) {
+			throw std::runtime_error("SetupDiEnumDeviceInterfaces failed. Error code: " + std::to_string(err));
+		}
+		return interfaces;
+	}
+
+	static std::wstring GetDeviceId(DWORD deviceNumber) {
+		return L"\\\\.\\PHYSICALDRIVE" + std::to_wstring(deviceNumber);
+	}
+
+	// GUID_DEVINTERFACE_DISK, spelled out so no translation unit has to
+	// instantiate the GUIDs in winioctl.h with initguid.h.
+	static constexpr GUID DiskInterfaceGuid = { 0x53f56307, 0xb6bf, 0x11d0, { 0x94, 0xf2, 0x00, 0xa0, 0xc9, 0x1e, 0xfb, 0x8b } };
+
+	// Opens a disk interface to ask for its \\.\PHYSICALDRIVE number.
+	static bool GetDeviceNumber(LPCWSTR devicePath, DWORD* deviceNumber) {
+		PhaseTimings::Scope phase("SetupAPI open");
+
+		// No access rights are needed to ask for the device number.
+		HANDLE hDevice = CreateFileW(devicePath,
+			/*dwDesiredAccess=*/ 0,
+			/*dwShareMode=*/ FILE_SHARE_READ | FILE_SHARE_WRITE,
+			/*lpSecurityAttributes=*/ 0,
+			/*dwCreationDisposition=*/ OPEN_EXISTING,
+			/*dwFlagsAndAttributes=*/ 0,
+			/*hTemplateFile=*/ 0);
+		if (hDevice == INVALID_HANDLE_VALUE) {
+			return false;
+		}
+
+		phase.Next("SetupAPI ioctl");
+		STORAGE_DEVICE_NUMBER number = {};
+		DWORD written = 0;
+		BOOL ok = DeviceIoControl(hDevice,
+			/*dwIoControlCode=*/ IOCTL_STORAGE_GET_DEVICE_NUMBER,
+			/*lpInBuffer=*/ nullptr,
+			/*nInBufferSize=*/ 0,
+			/*lpOutBuffer=*/ &number,
+			/*nOutBufferSize=*/ sizeof(number),
+			/*lpBytesReturned=*/ &written,
+			/*lpOverlapped=*/ nullptr);
+		CloseHandle(hDevice);
+
+		if (!ok || number.DeviceType != FILE_DEVICE_DISK) {
+			return false;
+		}
+		*deviceNumber = number.DeviceNumber;
+		return true;
+	}
+};
+
+#endif
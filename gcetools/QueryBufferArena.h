@@ -0,0 +1,153 @@
+/* Copyright 2022 Google LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#pragma once
+
+#include <algorithm>
+#include <cassert>
+#include <cstddef>
+#include <memory>
+#include <vector>
+#include "StorageTypes.h"
+
+// A stack allocator for driver responses. Memory is handed out in order and
+// given back by rewinding to an earlier marker, so once the blocks have grown
+// to fit the largest sequence of live responses, queries stop allocating.
+//
+// Allocations must be released in the reverse order they were made. That is
+// the natural order for StorageQueryResult values scoped to a function.
+class QueryBufferArena {
+public:
+	// Fits an NVMe identify response alongside a device ID descriptor.
+	static constexpr size_t DefaultBlockSize = 8192;
+	static constexpr size_t Alignment = 16;
+
+	struct Marker {
+		size_t Block;
+		size_t Offset;
+		size_t Depth;
+	};
+
+	QueryBufferArena() {
+		blocks_.emplace_back(DefaultBlockSize);
+	}
+
+	QueryBufferArena(const QueryBufferArena&) = delete;
+	QueryBufferArena& operator=(const QueryBufferArena&) = delete;
+
+	// Returns zeroed, suitably aligned memory, valid until the arena is
+	// rewound to a marker taken before this call.
+	void* Allocate(size_t size) {
+		size_t offset = AlignUp(offset_);
+		if (offset + size > blocks_[block_].Size) {
+			// Nothing after the current block is in use, so the next block
+			// can be reused, or replaced if it is too small.
+			size_t next = block_ + 1;
+			if (next == blocks_.size()) {
+				blocks_.emplace_back(std::max(size, DefaultBlockSize));
+			}
+			else if (blocks_[next].Size < size) {
+				blocks_[next] = Block(size);
+			}
+			block_ = next;
+			offset = 0;
+		}
+
+		offset_ = offset + size;
+		BYTE* data = blocks_[block_].Data.get() + offset;
+		ZeroMemory(data, size);
+		return data;
+	}
+
+	Marker GetMarker() {
+		return Marker{ block_, offset_, ++depth_ };
+	}
+
+	void Rewind(const Marker& marker) {
+		assert(marker.Depth == depth_ && "query results released out of order");
+		block_ = marker.Block;
+		offset_ = marker.Offset;
+		depth_ = marker.Depth - 1;
+	}
+
+private:
+	struct Block {
+		Block(size_t size) : Data(new BYTE[size]), Size(size) {
+		}
+		std::unique_ptr<BYTE[]> Data;
+		size_t Size;
+	};
+
+	std::vector<Block> blocks_;
+	size_t block_ = 0;
+	size_t offset_ = 0;
+	size_t depth_ = 0;
+
+	static size_t AlignUp(size_t value) {
+		return (value + Alignment - 1) & ~(Alignment - 1);
+	}
+};
+
+// A driver response held in a QueryBufferArena. The memory goes back to the
+// arena when the result is destroyed.
+template<typename T>
+class StorageQueryResult {
+public:
+	StorageQueryResult(QueryBufferArena* arena, QueryBufferArena::Marker marker, T* data, DWORD size)
+		: arena_(arena), marker_(marker), data_(data), size_(size)
+	{
+	}
+	StorageQueryResult(StorageQueryResult&& other) noexcept
+		: arena_(other.arena_), marker_(other.marker_), data_(other.data_), size_(other.size_)
+	{
+		other.arena_ = nullptr;
+	}
+	StorageQueryResult(const StorageQueryResult&) = delete;
+	StorageQueryResult& operator=(const StorageQueryResult&) = delete;
+	StorageQueryResult& operator=(StorageQueryResult&&) = delete;
+	~StorageQueryResult() {
+		if (arena_ != nullptr) {
+			arena_->Rewind(marker_);
+		}
+	}
+
+	T* Get() const {
+		return data_;
+	}
+	T* operator->() const {
+		return data_;
+	}
+	T& operator*() const {
+		return *data_;
+	}
+	// The number of bytes of the response available through Get().
+	DWORD Size() const {
+		return size_;
+	}
+
+	// Hands ownership of the memory to a result for the part of the response
+	// starting at offset, such as the payload following a descriptor.
+	template<typename TPart>
+	StorageQueryResult<TPart> Slice(size_t offset, DWORD size) && {
+		QueryBufferArena* arena = arena_;
+		arena_ = nullptr;
+		return StorageQueryResult<TPart>(arena, marker_, (TPart*)((BYTE*)data_ + offset), size);
+	}
+
+private:
+	QueryBufferArena* arena_;
+	QueryBufferArena::Marker marker_;
+	T* data_;
+	DWORD size_;
+};
@@ -0,0 +1,250 @@
+/* Copyright 2022 Google LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#pragma once
+
+#include <charconv>
+#include <cstdint>
+#include <ostream>
+#include <string>
+#include <string_view>
+#include "DeviceResolver.h"
+#include "JsonText.h"
+#include "StorageIdentifiers.h"
+#include "Utf8.h"
+
+enum class OutputFormat {
+	// One name per line, nothing else.
+	Names,
+	// One JSON object per device per line.
+	JsonLines,
+	// A header row, then one row per device.
+	Csv,
+};
+
+// Writes resolutions to a stream in one of the output formats, as they are
+// reported. Records are formatted into a buffer that is reused for the whole
+// run and written out whenever it fills, and the stream is flushed once, by
+// Finish(), so a run costs a few large writes rather than a write and flush
+// per device, and no allocations past the first records.
+class ResolutionWriter {
+public:
+	// The buffer is written out once it holds this much.
+	static constexpr size_t WriteThreshold = 64 * 1024;
+
+	ResolutionWriter(std::ostream& out, OutputFormat format) : out_(out), format_(format) {
+		buffer_.reserve(WriteThreshold + 4096);
+		if (format_ == OutputFormat::Csv) {
+			buffer_.append("device,bus,name,error,timed_out,elapsed_us,identifiers\n");
+		}
+	}
+
+	// Writes out, but does not flush, what a caller that never got to
+	// Finish() left buffered.
+	~ResolutionWriter() {
+		WriteBuffer();
+	}
+
+	ResolutionWriter(const ResolutionWriter&) = delete;
+	ResolutionWriter& operator=(const ResolutionWriter&) = delete;
+
+	void Write(const DeviceResolution& resolution) {
+		switch (format_) {
+		case OutputFormat::Names:
+			// Devices that could not be named leave an empty line, as they
+			// always have, so lines still match devices.
+			buffer_.append(resolution.Name);
+			break;
+		case OutputFormat::JsonLines:
+			AppendJson(resolution);
+			break;
+		case OutputFormat::Csv:
+			AppendCsv(resolution);
+			break;
+		}
+		buffer_.push_back('\n');
+		if (buffer_.size() >= WriteThreshold) {
+			WriteBuffer();
+		}
+	}
+
+	// Writes out whatever is buffered and flushes the stream.
+	void Finish() {
+		WriteBuffer();
+		out_.flush();
+	}
+
+private:
+	std::ostream& out_;
+	OutputFormat format_;
+	std::string buffer_;
+	// The current DeviceId in UTF-8, reused like buffer_.
+	std::string deviceId_;
+
+	void WriteBuffer() {
+		if (!buffer_.empty()) {
+			out_.write(buffer_.data(), (std::streamsize)buffer_.size());
+			buffer_.clear();
+		}
+	}
+
+	// {"device":"...","bus":"nvme","name":"...","error":null,"timed_out":false,
+	// "elapsed_us":123,"identifiers":[{"type":"vendor_id","association":"device",
+	// "code_set":"ascii","value":"..."}]}
+	void AppendJson(const DeviceResolution& resolution) {
+		buffer_.append("{\"device\":");
+		AppendJsonString(buffer_, GetDeviceId(resolution));
+		buffer_.append(",\"bus\":");
+		const char* bus = GetBusName(resolution.BusType);
+		if (bus == nullptr) {
+			buffer_.append("null");
+		}
+		else {
+			buffer_.push_back('"');
+			buffer_.append(bus);
+			buffer_.push_back('"');
+		}
+		buffer_.append(",\"name\":");
+		AppendJsonString(buffer_, resolution.Name);
+		buffer_.append(",\"error\":");
+		if (resolution.Error.empty()) {
+			buffer_.append("null");
+		}
+		else {
+			AppendJsonString(buffer_, resolution.Error);
+		}
+		buffer_.append(resolution.TimedOut ? ",\"timed_out\":true" : ",\"timed_out\":false");
+		buffer_.append(",\"elapsed_us\":");
+		AppendNumber(resolution.Elapsed.count());
+		buffer_.append(",\"identifiers\":[");
+		bool first = true;
+		VisitIdentifiers(resolution, [&](const StorageIdentifierView& identifier) {
+			if (!first) {
+				buffer_.push_back(',');
+			}
+			first = false;
+			buffer_.append("{\"type\":\"");
+			buffer_.append(GetStorageIdentifierTypeName(identifier.Type));
+			buffer_.append("\",\"association\":\"");
+			buffer_.append(GetStorageAssociationName(identifier.Association));
+			buffer_.append("\",\"code_set\":\"");
+			buffer_.append(GetStorageCodeSetName(identifier.CodeSet));
+			buffer_.append("\",\"value\":");
+			if (identifier.IsText()) {
+				AppendJsonString(buffer_, identifier.Value);
+			}
+			else {
+				buffer_.push_back('"');
+				AppendHex(identifier.Value);
+				buffer_.push_back('"');
+			}
+			buffer_.push_back('}');
+		});
+		buffer_.append("]}");
+	}
+
+	// RFC 4180, with every text field quoted. Identifiers are
+	// <type>:<value>, separated by semicolons.
+	void AppendCsv(const DeviceResolution& resolution) {
+		AppendCsvString(GetDeviceId(resolution));
+		buffer_.push_back(',');
+		const char* bus = GetBusName(resolution.BusType);
+		if (bus != nullptr) {
+			buffer_.append(bus);
+		}
+		buffer_.push_back(',');
+		AppendCsvString(resolution.Name);
+		buffer_.push_back(',');
+		AppendCsvString(resolution.Error);
+		buffer_.append(resolution.TimedOut ? ",true," : ",false,");
+		AppendNumber(resolution.Elapsed.count());
+		buffer_.append(",\"");
+		size_t identifiersStart = buffer_.size();
+		bool first = true;
+		VisitIdentifiers(resolution, [&](const StorageIdentifierView& identifier) {
+			if (!first) {
+				buffer_.push_back(';');
+			}
+			first = false;
+			buffer_.append(GetStorageIdentifierTypeName(identifier.Type));
+			buffer_.push_back(':');
+			if (identifier.IsText()) {
+				buffer_.append(identifier.Value);
+			}
+			else {
+				AppendHex(identifier.Value);
+			}
+		});
+		EscapeCsvQuotes(identifiersStart);
+		buffer_.push_back('"');
+	}
+
+	std::string_view GetDeviceId(const DeviceResolution& resolution) {
+		deviceId_.clear();
+		AppendUtf8(deviceId_, resolution.DeviceId);
+		return deviceId_;
+	}
+
+	template<typename TCallback>
+	static void VisitIdentifiers(const DeviceResolution& resolution, TCallback&& callback) {
+		VisitStorageIdentifiers((const BYTE*)resolution.Identity.data(), resolution.Identity.size(), resolution.IdentifierCount,
+			[&callback](const StorageIdentifierView& identifier) {
+				callback(identifier);
+				return true;
+			});
+	}
+
+	// Null if the bus type was not read.
+	static const char* GetBusName(STORAGE_BUS_TYPE busType) {
+		switch (busType) {
+		case STORAGE_BUS_TYPE::BusTypeUnknown:
+			return nullptr;
+		case STORAGE_BUS_TYPE::BusTypeNvme:
+			return "nvme";
+		case STORAGE_BUS_TYPE::BusTypeScsi:
+			return "scsi";
+		default:
+			return "other";
+		}
+	}
+
+	void AppendCsvString(std::string_view value) {
+		buffer_.push_back('"');
+		size_t start = buffer_.size();
+		buffer_.append(value);
+		EscapeCsvQuotes(start);
+		buffer_.push_back('"');
+	}
+
+	// Doubles the quotes in buffer_ from start on, in place.
+	void EscapeCsvQuotes(size_t start) {
+		for (size_t i = buffer_.find('"', start); i != std::string::npos; i = buffer_.find('"', i + 2)) {
+			buffer_.insert(i, 1, '"');
+		}
+	}
+
+	void AppendNumber(int64_t value) {
+		char digits[24];
+		std::to_chars_result result = std::to_chars(digits, digits + sizeof(digits), value);
+		buffer_.append(digits, result.ptr);
+	}
+
+	void AppendHex(std::string_view bytes) {
+		constexpr char hexDigits[] = "0123456789abcdef";
+		for (char c : bytes) {
+			buffer_.push_back(hexDigits[(BYTE)c >> 4]);
+			buffer_.push_back(hexDigits[(BYTE)c & 0x0F]);
+		}
+	}
+};
@@ -0,0 +1,419 @@
+/* Copyright 2022 Google LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <cwchar>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+#include "DeviceBackend.h"
+#include "DeviceEnumerator.h"
+#include "NvmeVersion.h"
+#include "StorageResponseBuilder.h"
+#include "StorageTypes.h"
+
+// A disk as it would be presented to a GCE VM. NVMe disks with the same
+// serial number are namespaces of one controller.
+struct SimulatedDisk {
+	STORAGE_BUS_TYPE BusType;
+	std::string Name;
+	DWORD NamespaceId;
+	std::string SerialNumber;
+	// How long the disk takes to answer each query. HungLatency never
+	// answers, until the query is cancelled.
+	std::chrono::microseconds Latency{ 0 };
+	// Numbers each disk attached, as the OS does; never 0.
+	uint64_t AttachSequence = 1;
+
+	static constexpr std::chrono::microseconds HungLatency = std::chrono::microseconds::max();
+};
+
+// The namespaces of one simulated NVMe controller, in namespace ID order. A
+// SCSI disk is its own controller.
+using SimulatedController = std::vector<SimulatedDisk>;
+
+// Answers storage queries the way the GCE NVMe and SCSI drivers do for the
+// given disk, optionally sleeping for a fixed latency on every query to stand
+// in for the round trip to the driver. NVMe Identify commands reach the
+// disk's controller, so they can address any of its namespaces. A query still
+// waiting at the deadline is cancelled.
+class SimulatedDeviceBackend : public DeviceBackend {
+public:
+	SimulatedDeviceBackend(const SimulatedDisk& disk, std::shared_ptr<const SimulatedController> controller)
+		: disk_(disk), controller_(std::move(controller))
+	{
+	}
+
+	DWORD QueryProperty(const void* inputBuffer, DWORD inputBufferSize,
+		void* outputBuffer, DWORD outputBufferSize, DWORD* bytesReturned) override {
+		*bytesReturned = 0;
+		if (!WaitForDisk()) {
+			return ERROR_TIMEOUT;
+		}
+
+		if (inputBufferSize < sizeof(STORAGE_PROPERTY_QUERY) || outputBufferSize < sizeof(STORAGE_DESCRIPTOR_HEADER)) {
+			return ERROR_INSUFFICIENT_BUFFER;
+		}
+
+		DWORD responseSize = 0;
+		DWORD err = BuildResponse((const STORAGE_PROPERTY_QUERY*)inputBuffer, inputBufferSize, &responseSize);
+		if (err != ERROR_SUCCESS) {
+			return err;
+		}
+		return response_.CopyTo(responseSize, outputBuffer, outputBufferSize, bytesReturned);
+	}
+
+	bool GetAttachId(std::string& attachId) override {
+		attachId = std::to_string(disk_.AttachSequence);
+		return true;
+	}
+
+	// Writes the NVME_MAX_LOG_SIZE bytes of Identify data the controller
+	// returns for the given CNS and namespace.
+	static DWORD BuildNvmeIdentifyData(const SimulatedController& controller, DWORD cns, DWORD namespaceId, BYTE* payload) {
+		switch (cns) {
+		case NVME_IDENTIFY_CNS_CODES::NVME_IDENTIFY_CNS_SPECIFIC_NAMESPACE: {
+			auto disk = std::find_if(controller.begin(), controller.end(), [namespaceId](const SimulatedDisk& disk) {
+				return disk.NamespaceId == namespaceId;
+			});
+			if (disk == controller.end()) {
+				return ERROR_INVALID_PARAMETER;
+			}
+			NVME_IDENTIFY_NAMESPACE_DATA* namespaceData = (NVME_IDENTIFY_NAMESPACE_DATA*)payload;
+			namespaceData->NSZE = namespaceData->NCAP = namespaceData->NUSE = 20971520;
+			snprintf((char*)namespaceData->VS, sizeof(namespaceData->VS),
+				"{\"device_name\":\"%s\",\"disk_type\":\"PERSISTENT\"}", disk->Name.c_str());
+			return ERROR_SUCCESS;
+		}
+		case NVME_IDENTIFY_CNS_CODES::NVME_IDENTIFY_CNS_CONTROLLER: {
+			NVME_IDENTIFY_CONTROLLER_DATA* controllerData = (NVME_IDENTIFY_CONTROLLER_DATA*)payload;
+			controllerData->VID = PciVendorId;
+			controllerData->SSVID = PciVendorId;
+			StorageResponseBuilder::CopyPadded(controllerData->SN, sizeof(controllerData->SN), controller.front().SerialNumber);
+			StorageResponseBuilder::CopyPadded(controllerData->MN, sizeof(controllerData->MN), NvmeModelNumber);
+			StorageResponseBuilder::CopyPadded(controllerData->FR, sizeof(controllerData->FR), "2");
+			controllerData->VER = NvmeVersion::Version_1_3;
+			controllerData->NN = controller.back().NamespaceId;
+			return ERROR_SUCCESS;
+		}
+		case NVME_IDENTIFY_CNS_CODES::NVME_IDENTIFY_CNS_ACTIVE_NAMESPACES: {
+			// The active namespace IDs above namespaceId, in increasing order.
+			DWORD* namespaceIds = (DWORD*)payload;
+			size_t count = 0;
+			for (const SimulatedDisk& disk : controller) {
+				if (disk.NamespaceId > namespaceId && count < NVME_MAX_LOG_SIZE / sizeof(DWORD)) {
+					namespaceIds[count++] = disk.NamespaceId;
+				}
+			}
+			return ERROR_SUCCESS;
+		}
+		default:
+			return ERROR_NOT_SUPPORTED;
+		}
+	}
+
+	// Writes the SMART / Health Information log of the namespace, or with
+	// AllNamespaces, of the whole controller. Each namespace reads and writes
+	// at its own steady rate, so successive logs differ as a busy disk's do.
+	static DWORD BuildNvmeHealthLog(const SimulatedController& controller, DWORD namespaceId, BYTE* payload) {
+		static const Clock::time_point start = Clock::now();
+		uint64_t elapsedUs = (uint64_t)std::chrono::duration_cast<std::chrono::microseconds>(Clock::now() - start).count();
+
+		uint64_t readCommands = 0;
+		uint64_t writeCommands = 0;
+		bool found = false;
+		for (const SimulatedDisk& disk : controller) {
+			if (namespaceId == AllNamespaces || disk.NamespaceId == namespaceId) {
+				uint64_t readIops = 200 * disk.NamespaceId;
+				uint64_t writeIops = 100 * disk.NamespaceId + 50;
+				readCommands += 1000000 + elapsedUs * readIops / 1000000;
+				writeCommands += 1000000 + elapsedUs * writeIops / 1000000;
+				found = true;
+			}
+		}
+		if (!found) {
+			return ERROR_INVALID_PARAMETER;
+		}
+
+		// 64 KiB per command; a data unit is 1000 512-byte sectors.
+		NVME_HEALTH_INFO_LOG* log = (NVME_HEALTH_INFO_LOG*)payload;
+		WORD temperatureKelvin = (WORD)(308 + namespaceId % 4);
+		log->Temperature[0] = (UCHAR)temperatureKelvin;
+		log->Temperature[1] = (UCHAR)(temperatureKelvin >> 8);
+		log->AvailableSpare = 100;
+		log->AvailableSpareThreshold = 10;
+		log->PercentageUsed = (UCHAR)(namespaceId % 10);
+		WriteCounter(log->DataUnitRead, readCommands * 128 / 1000);
+		WriteCounter(log->DataUnitWritten, writeCommands * 128 / 1000);
+		WriteCounter(log->HostReadCommands, readCommands);
+		WriteCounter(log->HostWrittenCommands, writeCommands);
+		return ERROR_SUCCESS;
+	}
+
+	// Writes the Device Identification VPD page (0x83) a GCE SCSI persistent
+	// disk reports: a binary NAA designator derived from the serial number,
+	// then a T10 vendor ID designator of "Google  <name>". Returns the size
+	// of the page.
+	static size_t BuildDeviceIdentificationPage(const SimulatedDisk& disk, BYTE* page, size_t size) {
+		constexpr size_t naaLength = 8;
+		constexpr std::string_view googlePrefix("Google  ");
+		size_t designatorLength = std::min<size_t>(googlePrefix.size() + disk.Name.size(),
+			std::min<size_t>(size, 255 + 4) - 4 - (4 + naaLength) - 4);
+		page[0] = 0;
+		page[1] = 0x83;
+		page[2] = 0;
+		page[3] = (BYTE)(4 + naaLength + 4 + designatorLength);
+
+		// NAA 6 (IEEE Registered Extended), FNV-1a of the serial number
+		// standing in for the company and vendor-specific IDs.
+		BYTE* naa = page + 4;
+		naa[0] = (BYTE)STORAGE_IDENTIFIER_CODE_SET::StorageIdCodeSetBinary;
+		naa[1] = (BYTE)STORAGE_IDENTIFIER_TYPE::StorageIdTypeFCPHName;
+		naa[2] = 0;
+		naa[3] = (BYTE)naaLength;
+		uint64_t hash = 14695981039346656037ull;
+		for (char c : disk.SerialNumber) {
+			hash = (hash ^ (BYTE)c) * 1099511628211ull;
+		}
+		hash = (hash >> 4) | (6ull << 60);
+		for (size_t i = 0; i < naaLength; i++) {
+			naa[4 + i] = (BYTE)(hash >> (8 * (naaLength - 1 - i)));
+		}
+
+		BYTE* vendorId = naa + 4 + naaLength;
+		vendorId[0] = (BYTE)STORAGE_IDENTIFIER_CODE_SET::StorageIdCodeSetAscii;
+		vendorId[1] = (BYTE)STORAGE_IDENTIFIER_TYPE::StorageIdTypeVendorId;
+		vendorId[2] = 0;
+		vendorId[3] = (BYTE)designatorLength;
+		// Written in place, so that answering the query does not allocate.
+		size_t prefixLength = std::min(googlePrefix.size(), designatorLength);
+		memcpy(vendorId + 4, googlePrefix.data(), prefixLength);
+		memcpy(vendorId + 4 + prefixLength, disk.Name.data(), designatorLength - prefixLength);
+		return 4 + 4 + naaLength + 4 + designatorLength;
+	}
+
+	static constexpr WORD PciVendorId = 0x1AE0;
+	// The namespace ID that addresses every namespace of a controller.
+	static constexpr DWORD AllNamespaces = 0xFFFFFFFF;
+	static constexpr const char* NvmeModelNumber = "nvme_card-pd";
+
+private:
+	SimulatedDisk disk_;
+	std::shared_ptr<const SimulatedController> controller_;
+	StorageResponseBuilder response_;
+
+	static void WriteCounter(UCHAR (&counter)[16], uint64_t value) {
+		for (size_t i = 0; i < sizeof(counter); i++, value >>= 8) {
+			counter[i] = (UCHAR)value;
+		}
+	}
+
+	// Sleeps for the disk's latency, or until the deadline if that comes
+	// first. Returns false if the deadline passed.
+	bool WaitForDisk() const {
+		if (disk_.Latency.count() <= 0) {
+			return true;
+		}
+		Clock::time_point now = Clock::now();
+		if (disk_.Latency != SimulatedDisk::HungLatency && disk_.Latency <= deadline_ - now) {
+			std::this_thread::sleep_for(disk_.Latency);
+			return true;
+		}
+		if (!HasDeadline()) {
+			// Hung for good, as a request to a detaching disk can be.
+			for (;;) {
+				std::this_thread::sleep_for(std::chrono::hours(1));
+			}
+		}
+		std::this_thread::sleep_until(deadline_);
+		return false;
+	}
+
+	DWORD BuildResponse(const STORAGE_PROPERTY_QUERY* query, DWORD inputBufferSize, DWORD* responseSize) {
+		response_.Reset();
+
+		switch (query->PropertyId) {
+		case STORAGE_PROPERTY_ID::StorageDeviceProperty:
+			*responseSize = response_.BuildDeviceDescriptor(disk_.BusType, "Google",
+				disk_.BusType == STORAGE_BUS_TYPE::BusTypeNvme ? NvmeModelNumber : "PersistentDisk", "1", disk_.SerialNumber);
+			return ERROR_SUCCESS;
+		case STORAGE_PROPERTY_ID::StorageAdapterProperty:
+			*responseSize = response_.BuildAdapterDescriptor(disk_.BusType);
+			return ERROR_SUCCESS;
+		case STORAGE_PROPERTY_ID::StorageDeviceIdProperty:
+			*responseSize = BuildDeviceIdDescriptor();
+			return ERROR_SUCCESS;
+		case STORAGE_PROPERTY_ID::StorageAdapterProtocolSpecificProperty:
+		case STORAGE_PROPERTY_ID::StorageDeviceProtocolSpecificProperty:
+			if (inputBufferSize < FIELD_OFFSET(STORAGE_PROPERTY_QUERY, AdditionalParameters) + sizeof(STORAGE_PROTOCOL_SPECIFIC_DATA)) {
+				return ERROR_INVALID_PARAMETER;
+			}
+			return BuildProtocolData(query->PropertyId, (const STORAGE_PROTOCOL_SPECIFIC_DATA*)query->AdditionalParameters, responseSize);
+		default:
+			return ERROR_NOT_SUPPORTED;
+		}
+	}
+
+	DWORD BuildDeviceIdDescriptor() {
+		if (disk_.BusType == STORAGE_BUS_TYPE::BusTypeNvme) {
+			return response_.BuildNvmeDeviceIdDescriptor("1AE0", NvmeModelNumber, disk_.NamespaceId, disk_.SerialNumber);
+		}
+
+		BYTE page[256];
+		size_t pageSize = BuildDeviceIdentificationPage(disk_, page, sizeof(page));
+		return response_.BuildDeviceIdDescriptorFromVpd(page, pageSize);
+	}
+
+	// Device queries address the disk's own namespace, adapter queries the
+	// controller.
+	DWORD BuildProtocolData(STORAGE_PROPERTY_ID propertyId, const STORAGE_PROTOCOL_SPECIFIC_DATA* request, DWORD* responseSize) {
+		if (disk_.BusType != STORAGE_BUS_TYPE::BusTypeNvme || request->ProtocolType != STORAGE_PROTOCOL_TYPE::ProtocolTypeNvme) {
+			return ERROR_NOT_SUPPORTED;
+		}
+
+		if (request->DataType == STORAGE_PROTOCOL_NVME_DATA_TYPE::NVMeDataTypeLogPage &&
+			request->ProtocolDataRequestValue == NVME_LOG_PAGES::NVME_LOG_PAGE_HEALTH_INFO) {
+			DWORD namespaceId = propertyId == STORAGE_PROPERTY_ID::StorageDeviceProtocolSpecificProperty ? disk_.NamespaceId : AllNamespaces;
+			DWORD err = BuildNvmeHealthLog(*controller_, namespaceId, response_.GetProtocolDataPayload());
+			if (err != ERROR_SUCCESS) {
+				return err;
+			}
+			*responseSize = response_.BuildProtocolDataDescriptor(*request, sizeof(NVME_HEALTH_INFO_LOG));
+			return ERROR_SUCCESS;
+		}
+		if (request->DataType != STORAGE_PROTOCOL_NVME_DATA_TYPE::NVMeDataTypeIdentify) {
+			return ERROR_NOT_SUPPORTED;
+		}
+
+		DWORD err = BuildNvmeIdentifyData(*controller_, request->ProtocolDataRequestValue,
+			request->ProtocolDataRequestSubValue, response_.GetProtocolDataPayload());
+		if (err != ERROR_SUCCESS) {
+			return err;
+		}
+		*responseSize = response_.BuildProtocolDataDescriptor(*request, NVME_MAX_LOG_SIZE);
+		return ERROR_SUCCESS;
+	}
+};
+
+// A VM's worth of simulated disks, addressed by the same DeviceIds that WMI
+// reports for physical drives. Even-numbered disks are attached over NVMe and
+// odd-numbered disks over SCSI. The NVMe disks are namespaces of controllers
+// with namespacesPerController namespaces each, as local SSDs are.
+class SimulatedDeviceSet : public DeviceEnumerator {
+public:
+	SimulatedDeviceSet(size_t diskCount, std::chrono::microseconds queryLatency, size_t namespacesPerController = 1)
+		: queryLatency_(queryLatency)
+	{
+		namespacesPerController = std::max<size_t>(namespacesPerController, 1);
+		std::shared_ptr<SimulatedController> controller;
+		for (size_t i = 0; i < diskCount; i++) {
+			std::string name = "persistent-disk-" + std::to_string(i);
+			if (i % 2 != 0) {
+				disks_.push_back(SimulatedDisk{ STORAGE_BUS_TYPE::BusTypeScsi, name, 1, "sim-" + std::to_string(i), queryLatency, i + 1 });
+				controllers_.push_back(std::make_shared<SimulatedController>(1, disks_.back()));
+				continue;
+			}
+
+			// Each controller is named after the disk of its first namespace.
+			size_t namespaceIndex = (i / 2) % namespacesPerController;
+			if (namespaceIndex == 0) {
+				controller = std::make_shared<SimulatedController>();
+			}
+			std::string serialNumber = "sim-" + std::to_string(i - namespaceIndex * 2);
+			disks_.push_back(SimulatedDisk{ STORAGE_BUS_TYPE::BusTypeNvme, name, (DWORD)namespaceIndex + 1, serialNumber, queryLatency, i + 1 });
+			controller->push_back(disks_.back());
+			controllers_.push_back(controller);
+		}
+	}
+
+	const char* GetName() const override {
+		return "simulated";
+	}
+
+	std::vector<std::wstring> EnumerateDeviceIds() override {
+		return GetDeviceIds();
+	}
+
+	const std::vector<SimulatedDisk>& GetDisks() const {
+		return disks_;
+	}
+
+	// Makes the disk at index take latency to open and to answer each query,
+	// as a throttled disk does, or with SimulatedDisk::HungLatency, never
+	// answer a query, as a detaching disk can. Only factories obtained
+	// afterwards are affected.
+	void SetDiskLatency(size_t index, std::chrono::microseconds latency) {
+		disks_.at(index).Latency = latency;
+	}
+
+	// The controller each disk in GetDisks() is attached to.
+	const std::vector<std::shared_ptr<const SimulatedController>>& GetControllers() const {
+		return controllers_;
+	}
+
+	std::vector<std::wstring> GetDeviceIds() const {
+		std::vector<std::wstring> deviceIds;
+		for (size_t i = 0; i < disks_.size(); i++) {
+			deviceIds.push_back(DevicePrefix + std::to_wstring(i));
+		}
+		return deviceIds;
+	}
+
+	// The index of the disk a DeviceId addresses, of diskCount disks. Fails
+	// the way opening a missing \\.\PHYSICALDRIVEn does.
+	static size_t GetDiskIndex(const std::wstring& deviceId, size_t diskCount) {
+		size_t prefixLength = wcslen(DevicePrefix);
+		wchar_t* end = nullptr;
+		size_t index = deviceId.compare(0, prefixLength, DevicePrefix) == 0 && deviceId.size() > prefixLength
+			? wcstoul(deviceId.c_str() + prefixLength, &end, 10) : diskCount;
+		if (index >= diskCount || *end != L'\0') {
+			throw std::runtime_error("Failed to get device handle. Error code: " + std::to_string(ERROR_FILE_NOT_FOUND));
+		}
+		return index;
+	}
+
+	// DeviceIds are this followed by the disk's index.
+	static constexpr const wchar_t* DevicePrefix = L"\\\\.\\PHYSICALDRIVE";
+
+	// The factory holds its own copy of the disks, so a backend can still be
+	// opened by a thread that outlives the set.
+	DeviceBackendFactory GetBackendFactory() const {
+		std::shared_ptr<const std::vector<SimulatedDisk>> disks = std::make_shared<const std::vector<SimulatedDisk>>(disks_);
+		return [disks, controllers = controllers_, queryLatency = queryLatency_](const std::wstring& deviceId) -> std::unique_ptr<DeviceBackend> {
+			// Opening a handle costs about as much as a query, and like
+			// CreateFile, cannot be cancelled. A hung disk still opens.
+			size_t index = GetDiskIndex(deviceId, disks->size());
+			const SimulatedDisk& disk = (*disks)[index];
+			std::chrono::microseconds openLatency = disk.Latency == SimulatedDisk::HungLatency ? queryLatency : disk.Latency;
+			if (openLatency.count() > 0) {
+				std::this_thread::sleep_for(openLatency);
+			}
+			return std::make_unique<SimulatedDeviceBackend>(disk, controllers[index]);
+		};
+	}
+
+private:
+	std::vector<SimulatedDisk> disks_;
+	std::vector<std::shared_ptr<const SimulatedController>> controllers_;
+	std::chrono::microseconds queryLatency_;
+};
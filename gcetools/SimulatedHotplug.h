@@ -0,0 +1,179 @@
+/* Copyright 2022 Google LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+#include "DeviceEnumerator.h"
+#include "DeviceEvents.h"
+#include "SimulatedDeviceBackend.h"
+#include "StorageTypes.h"
+
+// Attaches and detaches simulated disks while they are being watched, the way
+// disks are hot-plugged into a running VM, and reports each change as an
+// event. Disks occupy numbered slots, addressed by the same DeviceIds as
+// SimulatedDeviceSet; a detached disk's slot is reused by the next disk to be
+// attached, as Windows reuses drive numbers. Changes are made in a fixed,
+// seeded order, so every run sees the same ones.
+class SimulatedHotplug : public DeviceEnumerator {
+public:
+	SimulatedHotplug(const SimulatedDeviceSet& devices, std::chrono::microseconds queryLatency)
+		: state_(std::make_shared<State>()), queryLatency_(queryLatency)
+	{
+		const std::vector<SimulatedDisk>& disks = devices.GetDisks();
+		for (size_t i = 0; i < disks.size(); i++) {
+			state_->Slots.emplace_back(std::in_place, disks[i], devices.GetControllers()[i]);
+			nextAttachSequence_ = std::max(nextAttachSequence_, disks[i].AttachSequence + 1);
+		}
+	}
+	SimulatedHotplug(const SimulatedHotplug&) = delete;
+	SimulatedHotplug& operator=(const SimulatedHotplug&) = delete;
+	~SimulatedHotplug() {
+		if (thread_.joinable()) {
+			thread_.join();
+		}
+	}
+
+	const char* GetName() const override {
+		return "simulated hotplug";
+	}
+
+	// The disks attached right now.
+	std::vector<std::wstring> EnumerateDeviceIds() override {
+		std::lock_guard<std::mutex> lock(state_->Mutex);
+		std::vector<std::wstring> deviceIds;
+		for (size_t i = 0; i < state_->Slots.size(); i++) {
+			if (state_->Slots[i]) {
+				deviceIds.push_back(SimulatedDeviceSet::DevicePrefix + std::to_wstring(i));
+			}
+		}
+		return deviceIds;
+	}
+
+	// Opens whatever disk is in the slot at the time, and fails like a
+	// missing disk if the slot is empty.
+	DeviceBackendFactory GetBackendFactory() const {
+		return [state = state_, queryLatency = queryLatency_](const std::wstring& deviceId) -> std::unique_ptr<DeviceBackend> {
+			std::optional<Slot> slot;
+			{
+				std::lock_guard<std::mutex> lock(state->Mutex);
+				slot = state->Slots[SimulatedDeviceSet::GetDiskIndex(deviceId, state->Slots.size())];
+			}
+			if (!slot) {
+				throw std::runtime_error("Failed to get device handle. Error code: " + std::to_string(ERROR_FILE_NOT_FOUND));
+			}
+			const SimulatedDisk& disk = slot->first;
+			std::chrono::microseconds openLatency = disk.Latency == SimulatedDisk::HungLatency ? queryLatency : disk.Latency;
+			if (openLatency.count() > 0) {
+				std::this_thread::sleep_for(openLatency);
+			}
+			return std::make_unique<SimulatedDeviceBackend>(disk, slot->second);
+		};
+	}
+
+	// Reports each change made by Start(), and stops once they are all
+	// reported.
+	DeviceEventSource& GetEvents() {
+		return events_;
+	}
+
+	// Makes changeCount changes, one every interval, on a thread of its
+	// own. In turn, a disk is detached, a new disk is attached, and the disk
+	// in a slot is swapped for a new one without the slot ever being empty
+	// (which only a Changed event reports, as when a disk is resized or its
+	// media replaced).
+	void Start(size_t changeCount, std::chrono::milliseconds interval) {
+		thread_ = std::thread([this, changeCount, interval]() {
+			std::mt19937 random(changeCount);
+			auto next = std::chrono::steady_clock::now();
+			for (size_t change = 0; change < changeCount; change++) {
+				next += interval;
+				std::this_thread::sleep_until(next);
+				MakeChange(change % 3, random);
+			}
+			events_.Stop();
+		});
+	}
+
+private:
+	// A disk and the controller it is attached to.
+	using Slot = std::pair<SimulatedDisk, std::shared_ptr<const SimulatedController>>;
+
+	// Shared with the backend factory, which can outlive this.
+	struct State {
+		std::mutex Mutex;
+		std::vector<std::optional<Slot>> Slots;
+	};
+
+	std::shared_ptr<State> state_;
+	std::chrono::microseconds queryLatency_;
+	DeviceEventQueue events_;
+	std::thread thread_;
+	size_t attachedCount_ = 0;
+	uint64_t nextAttachSequence_ = 1;
+
+	void MakeChange(size_t action, std::mt19937& random) {
+		std::unique_lock<std::mutex> lock(state_->Mutex);
+		std::vector<size_t> attached;
+		size_t firstFree = state_->Slots.size();
+		for (size_t i = 0; i < state_->Slots.size(); i++) {
+			if (state_->Slots[i]) {
+				attached.push_back(i);
+			}
+			else if (firstFree == state_->Slots.size()) {
+				firstFree = i;
+			}
+		}
+
+		// With nothing attached, there is nothing to detach or swap.
+		size_t slot = firstFree;
+		DeviceEventKind kind = DeviceEventKind::Arrived;
+		if (action != 1 && !attached.empty()) {
+			slot = attached[std::uniform_int_distribution<size_t>(0, attached.size() - 1)(random)];
+			kind = action == 0 ? DeviceEventKind::Removed : DeviceEventKind::Changed;
+		}
+
+		if (kind == DeviceEventKind::Removed) {
+			state_->Slots[slot].reset();
+		}
+		else {
+			if (slot == state_->Slots.size()) {
+				state_->Slots.emplace_back();
+			}
+			state_->Slots[slot] = CreateDisk();
+		}
+		lock.unlock();
+		events_.Push(kind, SimulatedDeviceSet::DevicePrefix + std::to_wstring(slot));
+	}
+
+	// Attaches new disks alternately over NVMe and SCSI, each on its own
+	// controller.
+	Slot CreateDisk() {
+		size_t number = attachedCount_++;
+		SimulatedDisk disk{ number % 2 == 0 ? STORAGE_BUS_TYPE::BusTypeNvme : STORAGE_BUS_TYPE::BusTypeScsi,
+			"hotplug-disk-" + std::to_string(number), 1, "hotplug-" + std::to_string(number), queryLatency_, nextAttachSequence_++ };
+		return Slot(disk, std::make_shared<const SimulatedController>(1, disk));
+	}
+};
@@ -0,0 +1,424 @@
+/* Copyright 2022 Google LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#pragma once
+
+#ifdef __linux__
+
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <memory>
+#include <string>
+#include <system_error>
+#include <thread>
+#include <vector>
+#include "DeviceEnumerator.h"
+#include "LinuxDeviceBackend.h"
+#include "SimulatedDeviceBackend.h"
+#include "SysBlockDeviceEnumerator.h"
+
+// A simulated /dev node and the disk behind it.
+struct SimulatedLinuxDevice {
+	std::string Path;
+	SimulatedDisk Disk;
+	std::shared_ptr<const SimulatedController> Controller;
+};
+
+// Answers the NVMe and SCSI passthrough ioctls LinuxDeviceBackend issues the
+// way a GCE VM's disks would, sleeping for each disk's latency on every open
+// and passthrough command. Like the kernel, a command that outlasts its
+// timeout fails with ETIMEDOUT.
+class SimulatedLinuxDeviceIo : public LinuxDeviceIo {
+public:
+	SimulatedLinuxDeviceIo(std::vector<SimulatedLinuxDevice> devices, std::chrono::microseconds latency)
+		: devices_(std::move(devices)), latency_(latency)
+	{
+	}
+
+	int Open(const std::string& path) override {
+		for (size_t i = 0; i < devices_.size(); i++) {
+			if (devices_[i].Path == path) {
+				// A hung disk still opens.
+				const SimulatedDisk& disk = devices_[i].Disk;
+				Wait(disk.Latency == SimulatedDisk::HungLatency ? latency_ : disk.Latency);
+				return FirstDescriptor + (int)i;
+			}
+		}
+		Wait(latency_);
+		return -ENOENT;
+	}
+
+	int Ioctl(int fd, unsigned long request, void* argument) override {
+		const SimulatedLinuxDevice& device = devices_.at(fd - FirstDescriptor);
+		const SimulatedDisk& disk = device.Disk;
+		bool nvme = disk.BusType == STORAGE_BUS_TYPE::BusTypeNvme;
+
+		if (request == NVME_IOCTL_ID && nvme) {
+			// Answered by the kernel, without a command to the disk.
+			Wait(latency_);
+			return (int)disk.NamespaceId;
+		}
+		if (request == GetDiskSeqRequest) {
+			Wait(latency_);
+			*(uint64_t*)argument = disk.AttachSequence;
+			return 0;
+		}
+		if (request == NVME_IOCTL_ADMIN_CMD && nvme) {
+			nvme_admin_cmd& command = *(nvme_admin_cmd*)argument;
+			if (!WaitForCommand(disk, std::chrono::milliseconds(command.timeout_ms))) {
+				return -ETIMEDOUT;
+			}
+			return NvmeAdminCommand(*device.Controller, command);
+		}
+		if (request == SG_IO && !nvme) {
+			sg_io_hdr_t& header = *(sg_io_hdr_t*)argument;
+			if (!WaitForCommand(disk, std::chrono::milliseconds(header.timeout))) {
+				return -ETIMEDOUT;
+			}
+			return ScsiCommand(disk, header);
+		}
+		Wait(latency_);
+		return -ENOTTY;
+	}
+
+	void Close(int /*fd*/) override {
+	}
+
+private:
+	static constexpr int FirstDescriptor = 1000;
+	// NVMe status codes: Invalid Field in Command, Invalid Namespace.
+	static constexpr int InvalidField = 0x2;
+	static constexpr int InvalidNamespace = 0xB;
+	static constexpr BYTE CheckCondition = 0x2;
+
+	std::vector<SimulatedLinuxDevice> devices_;
+	std::chrono::microseconds latency_;
+
+	static void Wait(std::chrono::microseconds latency) {
+		if (latency.count() > 0) {
+			std::this_thread::sleep_for(latency);
+		}
+	}
+
+	// Returns false if the command times out before the disk answers it.
+	static bool WaitForCommand(const SimulatedDisk& disk, std::chrono::milliseconds timeout) {
+		if (disk.Latency != SimulatedDisk::HungLatency && disk.Latency <= timeout) {
+			Wait(disk.Latency);
+			return true;
+		}
+		std::this_thread::sleep_for(timeout);
+		return false;
+	}
+
+	static int NvmeAdminCommand(const SimulatedController& controller, const nvme_admin_cmd& command) {
+		BYTE* payload = (BYTE*)(uintptr_t)command.addr;
+		if (command.opcode == 0x02 && (command.cdw10 & 0xFF) == NVME_LOG_PAGES::NVME_LOG_PAGE_HEALTH_INFO &&
+			command.data_len >= sizeof(NVME_HEALTH_INFO_LOG)) {
+			memset(payload, 0, command.data_len);
+			DWORD err = SimulatedDeviceBackend::BuildNvmeHealthLog(controller, command.nsid, payload);
+			return err == ERROR_SUCCESS ? 0 : InvalidNamespace;
+		}
+		if (command.opcode != 0x06 || command.data_len < NVME_MAX_LOG_SIZE) {
+			return InvalidField;
+		}
+
+		memset(payload, 0, NVME_MAX_LOG_SIZE);
+		DWORD err = SimulatedDeviceBackend::BuildNvmeIdentifyData(controller, command.cdw10 & 0xFF, command.nsid, payload);
+		return err == ERROR_SUCCESS ? 0 : err == ERROR_INVALID_PARAMETER ? InvalidNamespace : InvalidField;
+	}
+
+	static int ScsiCommand(const SimulatedDisk& disk, sg_io_hdr_t& header) {
+		const BYTE* cdb = header.cmdp;
+		BYTE* data = (BYTE*)header.dxferp;
+		BYTE response[256] = {};
+		size_t responseSize = 0;
+		header.info = 0;
+		header.status = 0;
+
+		if (header.cmd_len < 6 || cdb[0] != 0x12) {
+			header.status = CheckCondition;
+			return 0;
+		}
+
+		if ((cdb[1] & 1) == 0) {
+			// Standard INQUIRY data.
+			responseSize = 36;
+			response[4] = 31;
+			StorageResponseBuilder::CopyPadded(response + 8, 8, "Google");
+			StorageResponseBuilder::CopyPadded(response + 16, 16, "PersistentDisk");
+			StorageResponseBuilder::CopyPadded(response + 32, 4, "1");
+		}
+		else if (cdb[2] == 0x80) {
+			response[1] = 0x80;
+			response[3] = (BYTE)disk.SerialNumber.size();
+			memcpy(response + 4, disk.SerialNumber.data(), disk.SerialNumber.size());
+			responseSize = 4 + disk.SerialNumber.size();
+		}
+		else if (cdb[2] == 0x83) {
+			responseSize = SimulatedDeviceBackend::BuildDeviceIdentificationPage(disk, response, sizeof(response));
+		}
+		else {
+			header.status = CheckCondition;
+			return 0;
+		}
+
+		size_t copied = std::min<size_t>(responseSize, header.dxfer_len);
+		memcpy(data, response, copied);
+		header.resid = (int)(header.dxfer_len - copied);
+		return 0;
+	}
+};
+
+// Presents a SimulatedDeviceSet's disks as a Linux guest sees them: a sysfs
+// tree written to a temporary directory (block/nvme<c>n<ns> for NVMe
+// namespaces, linked to their controller under class/nvme/nvme<c>, and
+// block/sd<x> for SCSI disks, linked to their LUN under a virtio-scsi host in
+// devices/), with each disk's queue limits, blk-mq hardware queues and diskseq, and
+// /dev nodes served by SimulatedLinuxDeviceIo. Each disk is 100 GiB and, in
+// turn, has one mounted partition (the first disk's is "/"), two partitions of
+// which one is mounted, one partition holding a mounted device-mapper volume,
+// or no partition table and the whole disk mounted; mounts are listed in a
+// mountinfo file beside the tree. The tree is deleted with the set.
+class SimulatedLinuxDeviceSet : public DeviceEnumerator {
+public:
+	SimulatedLinuxDeviceSet(const SimulatedDeviceSet& simulatedDevices, std::chrono::microseconds latency) {
+		root_ = std::filesystem::temp_directory_path() /
+			("gcetools-sysfs-" + std::to_string(std::chrono::steady_clock::now().time_since_epoch().count()));
+
+		const std::vector<SimulatedDisk>& disks = simulatedDevices.GetDisks();
+		const std::vector<std::shared_ptr<const SimulatedController>>& controllers = simulatedDevices.GetControllers();
+		std::vector<SimulatedLinuxDevice> devices;
+		std::vector<const SimulatedController*> nvmeControllers;
+		size_t scsiCount = 0;
+		int nvmeMinor = 0;
+		std::string mountInfo =
+			"20 1 0:20 / /proc rw,nosuid,nodev,noexec,relatime shared:12 - proc proc rw\n"
+			"21 1 0:21 / /sys rw,nosuid,nodev,noexec,relatime shared:7 - sysfs sysfs rw\n";
+		for (size_t i = 0; i < disks.size(); i++) {
+			std::string name;
+			if (disks[i].BusType == STORAGE_BUS_TYPE::BusTypeNvme) {
+				size_t controllerIndex = std::find(nvmeControllers.begin(), nvmeControllers.end(), controllers[i].get()) - nvmeControllers.begin();
+				if (controllerIndex == nvmeControllers.size()) {
+					nvmeControllers.push_back(controllers[i].get());
+					WriteNvmeController("nvme" + std::to_string(controllerIndex), controllerIndex, disks[i]);
+				}
+				name = "nvme" + std::to_string(controllerIndex) + "n" + std::to_string(disks[i].NamespaceId);
+				WriteNvmeNamespace(name, "nvme" + std::to_string(controllerIndex), disks[i]);
+				WriteLayout(name, name + "p", i, disks[i], [&](int) { return "259:" + std::to_string(nvmeMinor++); }, mountInfo);
+			}
+			else {
+				name = "sd" + ScsiDiskSuffix(scsiCount);
+				int firstMinor = (int)scsiCount * 16;
+				WriteScsiDisk(name, scsiCount++, disks[i]);
+				WriteLayout(name, name, i, disks[i], [&](int partition) { return "8:" + std::to_string(firstMinor + partition); }, mountInfo);
+			}
+			devices.push_back(SimulatedLinuxDevice{ "/dev/" + name, disks[i], controllers[i] });
+		}
+		WriteFile(root_ / "mountinfo", mountInfo);
+		io_ = std::make_shared<SimulatedLinuxDeviceIo>(std::move(devices), latency);
+	}
+	~SimulatedLinuxDeviceSet() {
+		std::error_code err;
+		std::filesystem::remove_all(root_, err);
+	}
+
+	const std::filesystem::path& GetSysfsRoot() const {
+		return root_;
+	}
+
+	// What /proc/self/mountinfo would list for the simulated disks.
+	std::filesystem::path GetMountInfoPath() const {
+		return root_ / "mountinfo";
+	}
+
+	const char* GetName() const override {
+		return "simulated sysfs";
+	}
+
+	std::vector<std::wstring> EnumerateDeviceIds() override {
+		return SysBlockDeviceEnumerator(root_ / "block", "/dev").EnumerateDeviceIds();
+	}
+
+	// With useSysfs false, every query goes through the simulated ioctls.
+	DeviceBackendFactory GetBackendFactory(bool useSysfs) const {
+		return [root = root_, io = io_, useSysfs](const std::wstring& deviceId) -> std::unique_ptr<DeviceBackend> {
+			return std::make_unique<LinuxDeviceBackend>(deviceId, root, useSysfs, io);
+		};
+	}
+
+private:
+	static constexpr unsigned int SimulatedCpuCount = 16;
+	static constexpr unsigned long long DiskSectors = 100ull * 1024 * 1024 * 2;
+	static constexpr unsigned long long FirstPartitionSector = 2048;
+	static constexpr unsigned long long BootPartitionSectors = 1024 * 1024;
+
+	std::filesystem::path root_;
+	std::shared_ptr<SimulatedLinuxDeviceIo> io_;
+	int dmCount_ = 0;
+
+	// sda..sdz, sdaa..sdzz, like the kernel.
+	static std::string ScsiDiskSuffix(size_t index) {
+		std::string suffix;
+		for (index++; index > 0; index = (index - 1) / 26) {
+			suffix.insert(suffix.begin(), (char)('a' + (index - 1) % 26));
+		}
+		return suffix;
+	}
+
+	// Controllers alternate between the two NUMA nodes of the simulated
+	// machine.
+	void WriteNvmeController(const std::string& name, size_t index, const SimulatedDisk& disk) const {
+		std::filesystem::path controller = root_ / "class" / "nvme" / name;
+		std::filesystem::create_directories(controller / "device");
+		WriteFile(controller / "model", std::string(SimulatedDeviceBackend::NvmeModelNumber) + "\n");
+		WriteFile(controller / "serial", disk.SerialNumber + "\n");
+		WriteFile(controller / "firmware_rev", "2\n");
+		WriteFile(controller / "numa_node", std::to_string(index % 2) + "\n");
+		WriteFile(controller / "device" / "vendor", "0x1ae0\n");
+	}
+
+	// Like the kernel's, the namespace's device link points at its
+	// controller.
+	void WriteNvmeNamespace(const std::string& name, const std::string& controllerName, const SimulatedDisk& disk) const {
+		std::filesystem::path block = root_ / "block" / name;
+		std::filesystem::create_directories(block);
+		std::filesystem::create_directory_symlink(std::filesystem::path("..") / ".." / "class" / "nvme" / controllerName, block / "device");
+		WriteFile(block / "nsid", std::to_string(disk.NamespaceId) + "\n");
+		WriteQueues(block, 2048, 4);
+	}
+
+	// Like the kernel's, the disk's device link points at its LUN, under
+	// the virtio-scsi host adapter's PCI function.
+	void WriteScsiDisk(const std::string& name, size_t index, const SimulatedDisk& disk) const {
+		std::filesystem::path adapter = root_ / "devices" / "pci0000:00" / "0000:00:03.0";
+		std::string lun = "0:0:" + std::to_string(index + 1) + ":0";
+		std::filesystem::path device = adapter / "virtio1" / "host0" / ("target0:0:" + std::to_string(index + 1)) / lun;
+		std::filesystem::create_directories(device);
+		WriteFile(adapter / "numa_node", "0\n");
+		std::filesystem::path block = root_ / "block" / name;
+		std::filesystem::create_directories(block);
+		std::filesystem::create_directory_symlink(std::filesystem::relative(device, block), block / "device");
+		WriteQueues(block, 512, 1);
+		WriteFile(device / "vendor", "Google  \n");
+		WriteFile(device / "model", "PersistentDisk  \n");
+		WriteFile(device / "rev", "1   \n");
+
+		BYTE page[256] = {};
+		page[1] = 0x80;
+		page[3] = (BYTE)disk.SerialNumber.size();
+		memcpy(page + 4, disk.SerialNumber.data(), disk.SerialNumber.size());
+		WriteFile(device / "vpd_pg80", std::string((const char*)page, 4 + disk.SerialNumber.size()));
+
+		size_t pageSize = SimulatedDeviceBackend::BuildDeviceIdentificationPage(disk, page, sizeof(page));
+		WriteFile(device / "vpd_pg83", std::string((const char*)page, pageSize));
+	}
+
+	// Gives the disk its size, device number and, depending on its index,
+	// partitions and a device-mapper volume, adding whatever is mounted to
+	// mountInfo. deviceNumber gives the disk's (0) and each partition's
+	// major:minor.
+	template<typename DeviceNumber>
+	void WriteLayout(const std::string& name, const std::string& partitionPrefix, size_t index, const SimulatedDisk& disk,
+		DeviceNumber deviceNumber, std::string& mountInfo) {
+		std::filesystem::path block = root_ / "block" / name;
+		WriteFile(block / "size", std::to_string(DiskSectors) + "\n");
+		WriteFile(block / "diskseq", std::to_string(disk.AttachSequence) + "\n");
+		std::string diskNumber = deviceNumber(0);
+		WriteFile(block / "dev", diskNumber + "\n");
+		std::string mountPoint = index == 0 ? "/" : "/mnt/disks/" + disk.Name;
+
+		switch (index % 4) {
+		case 0: {
+			std::string partition = WritePartition(block, partitionPrefix, 1, FirstPartitionSector, DiskSectors - FirstPartitionSector * 2, deviceNumber(1));
+			AppendMount(mountInfo, partition, mountPoint, "ext4", "/dev/" + partitionPrefix + "1");
+			break;
+		}
+		case 1: {
+			std::string first = WritePartition(block, partitionPrefix, 1, FirstPartitionSector, BootPartitionSectors, deviceNumber(1));
+			WritePartition(block, partitionPrefix, 2, FirstPartitionSector + BootPartitionSectors,
+				DiskSectors - BootPartitionSectors - FirstPartitionSector * 2, deviceNumber(2));
+			AppendMount(mountInfo, first, mountPoint, "xfs", "/dev/" + partitionPrefix + "1");
+			break;
+		}
+		case 2: {
+			unsigned long long sectors = DiskSectors - FirstPartitionSector * 2;
+			WritePartition(block, partitionPrefix, 1, FirstPartitionSector, sectors, deviceNumber(1));
+			std::string dm = "dm-" + std::to_string(dmCount_);
+			std::string dmNumber = "253:" + std::to_string(dmCount_++);
+			std::string mapperName = "vg" + std::to_string(index) + "-data";
+			std::filesystem::create_directories(root_ / "block" / dm / "dm");
+			std::filesystem::create_directories(block / (partitionPrefix + "1") / "holders");
+			std::filesystem::create_directory_symlink(std::filesystem::path("..") / ".." / ".." / dm,
+				block / (partitionPrefix + "1") / "holders" / dm);
+			WriteFile(root_ / "block" / dm / "dm" / "name", mapperName + "\n");
+			WriteFile(root_ / "block" / dm / "size", std::to_string(sectors - FirstPartitionSector) + "\n");
+			WriteFile(root_ / "block" / dm / "dev", dmNumber + "\n");
+			// A space in a mount point is escaped, as the kernel does.
+			AppendMount(mountInfo, dmNumber, mountPoint + "\\040data", "ext4", "/dev/mapper/" + mapperName);
+			break;
+		}
+		default:
+			AppendMount(mountInfo, diskNumber, mountPoint, "ext4", "/dev/" + name);
+			break;
+		}
+	}
+
+	// Returns the partition's device number.
+	static std::string WritePartition(const std::filesystem::path& block, const std::string& prefix, int number,
+		unsigned long long start, unsigned long long sectors, std::string deviceNumber) {
+		std::filesystem::path partition = block / (prefix + std::to_string(number));
+		std::filesystem::create_directories(partition);
+		WriteFile(partition / "partition", std::to_string(number) + "\n");
+		WriteFile(partition / "start", std::to_string(start) + "\n");
+		WriteFile(partition / "size", std::to_string(sectors) + "\n");
+		WriteFile(partition / "dev", deviceNumber + "\n");
+		return deviceNumber;
+	}
+
+	static void AppendMount(std::string& mountInfo, const std::string& deviceNumber, const std::string& mountPoint,
+		const std::string& fileSystem, const std::string& source) {
+		size_t id = 100 + std::count(mountInfo.begin(), mountInfo.end(), '\n');
+		mountInfo += std::to_string(id) + " 1 " + deviceNumber + " / " + mountPoint + " rw,relatime shared:1 - " +
+			fileSystem + " " + source + " rw\n";
+	}
+
+	// The block layer's limits, and hardware queues spread evenly over the
+	// simulated machine's 16 CPUs.
+	static void WriteQueues(const std::filesystem::path& block, unsigned int maxTransferKb, unsigned int queueCount) {
+		std::filesystem::path queue = block / "queue";
+		std::filesystem::create_directories(queue);
+		WriteFile(queue / "max_hw_sectors_kb", std::to_string(maxTransferKb) + "\n");
+		WriteFile(queue / "max_segments", "33\n");
+		WriteFile(queue / "dma_alignment", "3\n");
+		unsigned int cpusPerQueue = SimulatedCpuCount / queueCount;
+		for (unsigned int i = 0; i < queueCount; i++) {
+			std::filesystem::path hardwareQueue = block / "mq" / std::to_string(i);
+			std::filesystem::create_directories(hardwareQueue);
+			WriteFile(hardwareQueue / "cpu_list", std::to_string(i * cpusPerQueue) + "-" + std::to_string((i + 1) * cpusPerQueue - 1) + "\n");
+		}
+	}
+
+	static void WriteFile(const std::filesystem::path& path, const std::string& contents) {
+		std::ofstream out(path, std::ios::binary | std::ios::trunc);
+		out.write(contents.data(), contents.size());
+		if (!out) {
+			throw std::runtime_error("Failed to write " + path.string());
+		}
+	}
+};
+
+#endif
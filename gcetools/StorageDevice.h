@@ -15,182 +15,320 @@
 #pragma once
 
 #include <algorithm>
-#include <errhandlingapi.h>
+#include <atomic>
+#include <cstdint>
+#include <cstring>
 #include <exception>
 #include <iostream>
-#include <nvme.h>
+#include <memory>
 #include <stdexcept>
 #include <string>
-#include <wtypes.h>
+#include <type_traits>
+#include <unordered_map>
+#include "DeviceBackend.h"
+#include "NvmeActiveNamespaceList.h"
 #include "NvmeVersion.h"
+#include "OperationMetrics.h"
+#include "PhaseTimings.h"
+#include "QueryBufferArena.h"
+#include "StorageTypes.h"
+#include "Win32DeviceBackend.h"
+
+// The size of the driver's response to a query for TResult, when it is known
+// ahead of time. Responses without a fixed size (e.g. descriptors followed by
+// strings or lists) leave this at 0 and are sized at runtime. Operation is
+// what the query's latency is recorded as.
+template<typename TResult>
+struct StorageQueryTraits {
+	static constexpr DWORD ResponseSize = 0;
+	static constexpr DeviceOperation Operation = DeviceOperation::OtherQuery;
+};
+
+template<>
+struct StorageQueryTraits<STORAGE_DESCRIPTOR_HEADER> {
+	static constexpr DWORD ResponseSize = sizeof(STORAGE_DESCRIPTOR_HEADER);
+	static constexpr DeviceOperation Operation = DeviceOperation::DescriptorHeader;
+};
+
+template<>
+struct StorageQueryTraits<STORAGE_ADAPTER_DESCRIPTOR> {
+	static constexpr DWORD ResponseSize = sizeof(STORAGE_ADAPTER_DESCRIPTOR);
+	static constexpr DeviceOperation Operation = DeviceOperation::AdapterDescriptor;
+};
+
+template<>
+struct StorageQueryTraits<STORAGE_DEVICE_DESCRIPTOR> {
+	static constexpr DWORD ResponseSize = 0;
+	static constexpr DeviceOperation Operation = DeviceOperation::DeviceDescriptor;
+};
+
+template<>
+struct StorageQueryTraits<STORAGE_DEVICE_ID_DESCRIPTOR> {
+	static constexpr DWORD ResponseSize = 0;
+	static constexpr DeviceOperation Operation = DeviceOperation::DeviceIdDescriptor;
+};
+
+// NVMe identify payloads are always a full NVME_MAX_LOG_SIZE page following
+// the STORAGE_PROTOCOL_DATA_DESCRIPTOR.
+template<>
+struct StorageQueryTraits<NVME_IDENTIFY_CONTROLLER_DATA> {
+	static constexpr DWORD ResponseSize = sizeof(STORAGE_PROTOCOL_DATA_DESCRIPTOR) + NVME_MAX_LOG_SIZE;
+	static constexpr DeviceOperation Operation = DeviceOperation::NvmeIdentifyController;
+};
+
+template<>
+struct StorageQueryTraits<NVME_IDENTIFY_NAMESPACE_DATA> {
+	static constexpr DWORD ResponseSize = sizeof(STORAGE_PROTOCOL_DATA_DESCRIPTOR) + NVME_MAX_LOG_SIZE;
+	static constexpr DeviceOperation Operation = DeviceOperation::NvmeIdentifyNamespace;
+};
+
+template<>
+struct StorageQueryTraits<NvmeActiveNamespaceList> {
+	static constexpr DWORD ResponseSize = sizeof(STORAGE_PROTOCOL_DATA_DESCRIPTOR) + NVME_MAX_LOG_SIZE;
+	static constexpr DeviceOperation Operation = DeviceOperation::NvmeActiveNamespaces;
+};
+
+template<>
+struct StorageQueryTraits<NVME_HEALTH_INFO_LOG> {
+	static constexpr DWORD ResponseSize = sizeof(STORAGE_PROTOCOL_DATA_DESCRIPTOR) + sizeof(NVME_HEALTH_INFO_LOG);
+	static constexpr DeviceOperation Operation = DeviceOperation::NvmeHealthLog;
+};
 
 class StorageDevice {
 public:
-	StorageDevice(BSTR deviceNamespace) {
-		hDevice_ = OpenDevice(deviceNamespace);
+#ifdef _WIN32
+	StorageDevice(LPCWSTR deviceNamespace) : backend_(std::make_unique<Win32DeviceBackend>(deviceNamespace)) {
+	}
+#endif
+	StorageDevice(std::unique_ptr<DeviceBackend> backend) : backend_(std::move(backend)) {
 	}
 	~StorageDevice() {
-		CloseHandle(hDevice_);
 	}
+
+	// The number of driver queries issued by every StorageDevice in this
+	// process.
+	static uint64_t GetIoctlCount() {
+		return ioctlCount_;
+	}
+
+	// Also record this device's queries in metrics, which must outlive the
+	// device. The process-wide OperationMetrics are recorded regardless.
+	void SetMetrics(OperationStats* metrics) {
+		metrics_ = metrics;
+	}
+
+	// The bus type cannot change while the device is open, so it is only
+	// queried once.
 	STORAGE_BUS_TYPE GetBusType() {
-		STORAGE_DEVICE_DESCRIPTOR* descriptor = GetStorageDeviceDescriptor();
-		STORAGE_BUS_TYPE busType = descriptor->BusType;
-		free(descriptor);
-		return busType;
+		if (busType_ == STORAGE_BUS_TYPE::BusTypeUnknown) {
+			busType_ = GetStorageDeviceDescriptor()->BusType;
+		}
+		return busType_;
+	}
+	bool GetQueueTopology(DeviceQueueTopology& topology) {
+		return backend_->GetQueueTopology(topology);
+	}
+	bool GetPartitionLayout(DevicePartitionLayout& layout) {
+		return backend_->GetPartitionLayout(layout);
+	}
+	bool GetAttachId(std::string& attachId) {
+		return backend_->GetAttachId(attachId);
 	}
-	STORAGE_ADAPTER_DESCRIPTOR* GetStorageAdapterDescriptor() {
+
+	// Query results point into a buffer arena owned by this device. They are
+	// valid until destroyed, and must be destroyed in the reverse order they
+	// were obtained, which scoping them to a function does naturally.
+	StorageQueryResult<STORAGE_ADAPTER_DESCRIPTOR> GetStorageAdapterDescriptor() {
 		return IssueIoctl<STORAGE_ADAPTER_DESCRIPTOR>(STORAGE_PROPERTY_ID::StorageAdapterProperty);
 	}
-	STORAGE_DEVICE_DESCRIPTOR* GetStorageDeviceDescriptor() {
+	StorageQueryResult<STORAGE_DEVICE_DESCRIPTOR> GetStorageDeviceDescriptor() {
 		return IssueIoctl<STORAGE_DEVICE_DESCRIPTOR>(STORAGE_PROPERTY_ID::StorageDeviceProperty);
 	}
-	STORAGE_DEVICE_ID_DESCRIPTOR* GetStorageDeviceIdDescriptor() {
+	StorageQueryResult<STORAGE_DEVICE_ID_DESCRIPTOR> GetStorageDeviceIdDescriptor() {
 		return IssueIoctl<STORAGE_DEVICE_ID_DESCRIPTOR>(STORAGE_PROPERTY_ID::StorageDeviceIdProperty);
 	}
-	NVME_IDENTIFY_CONTROLLER_DATA GetNvmeControllerData() {
+	StorageQueryResult<NVME_IDENTIFY_CONTROLLER_DATA> GetNvmeControllerData() {
 		return NvmeIdentify<NVME_IDENTIFY_CONTROLLER_DATA>(
 			STORAGE_PROPERTY_ID::StorageAdapterProtocolSpecificProperty,
 			NVME_IDENTIFY_CNS_CODES::NVME_IDENTIFY_CNS_CONTROLLER);
 	}
-	NVME_IDENTIFY_NAMESPACE_DATA GetNvmeNamespaceData(DWORD namespaceId) {
+	StorageQueryResult<NVME_IDENTIFY_NAMESPACE_DATA> GetNvmeNamespaceData(DWORD namespaceId) {
 		return NvmeIdentify<NVME_IDENTIFY_NAMESPACE_DATA>(
 			STORAGE_PROPERTY_ID::StorageAdapterProtocolSpecificProperty,
 			NVME_IDENTIFY_CNS_CODES::NVME_IDENTIFY_CNS_SPECIFIC_NAMESPACE,
 			namespaceId);
 	}
+	// Lists the active namespaces of the controller with IDs above
+	// afterNamespaceId.
+	StorageQueryResult<NvmeActiveNamespaceList> GetNvmeActiveNamespaces(DWORD afterNamespaceId = 0) {
+		return NvmeIdentify<NvmeActiveNamespaceList>(
+			STORAGE_PROPERTY_ID::StorageAdapterProtocolSpecificProperty,
+			NVME_IDENTIFY_CNS_CODES::NVME_IDENTIFY_CNS_ACTIVE_NAMESPACES,
+			afterNamespaceId);
+	}
+	// The SMART / Health Information log of this disk's namespace.
+	StorageQueryResult<NVME_HEALTH_INFO_LOG> GetNvmeHealthInfo() {
+		return NvmeProtocolQuery<NVME_HEALTH_INFO_LOG>(
+			STORAGE_PROPERTY_ID::StorageDeviceProtocolSpecificProperty,
+			STORAGE_PROTOCOL_NVME_DATA_TYPE::NVMeDataTypeLogPage,
+			NVME_LOG_PAGES::NVME_LOG_PAGE_HEALTH_INFO);
+	}
 
 protected:
 	template<typename TResult>
-	TResult* IssueIoctl(STORAGE_PROPERTY_ID propertyId) {
-		return IssueIoctlHelper<TResult>(propertyId);
+	StorageQueryResult<TResult> IssueIoctl(STORAGE_PROPERTY_ID propertyId) {
+		return IssueIoctlHelper<TResult>(propertyId, nullptr, 0, StorageQueryTraits<TResult>::ResponseSize,
+			StorageQueryTraits<TResult>::Operation);
 	}
 
 	template <typename TResult, typename TAdditionalParameters>
-	TResult* IssueIoctl(STORAGE_PROPERTY_ID propertyId, TAdditionalParameters* additionalParameters = nullptr) {
-		return IssueIoctlHelper<TResult>(propertyId, additionalParameters, sizeof(TAdditionalParameters));
+	StorageQueryResult<TResult> IssueIoctl(STORAGE_PROPERTY_ID propertyId, TAdditionalParameters* additionalParameters = nullptr) {
+		return IssueIoctlHelper<TResult>(propertyId, additionalParameters, sizeof(TAdditionalParameters), StorageQueryTraits<TResult>::ResponseSize,
+			StorageQueryTraits<TResult>::Operation);
+	}
+
+	template<typename TResult>
+	StorageQueryResult<TResult> NvmeIdentify(STORAGE_PROPERTY_ID propertyId, NVME_IDENTIFY_CNS_CODES identifyCode, DWORD subValue = 0) {
+		return NvmeProtocolQuery<TResult>(propertyId, STORAGE_PROTOCOL_NVME_DATA_TYPE::NVMeDataTypeIdentify, identifyCode, subValue);
 	}
 
+	// Issues an NVMe Identify, Get Log Page or Get Features command through
+	// the storage driver.
 	template<typename TResult>
-	TResult NvmeIdentify(STORAGE_PROPERTY_ID propertyId, NVME_IDENTIFY_CNS_CODES identifyCode, DWORD subValue = 0) {
+	StorageQueryResult<TResult> NvmeProtocolQuery(STORAGE_PROPERTY_ID propertyId, STORAGE_PROTOCOL_NVME_DATA_TYPE dataType,
+		DWORD requestValue, DWORD subValue = 0) {
 		STORAGE_PROTOCOL_SPECIFIC_DATA protocolSpecificData = {
 			.ProtocolType = STORAGE_PROTOCOL_TYPE::ProtocolTypeNvme,
-			.DataType = STORAGE_PROTOCOL_NVME_DATA_TYPE::NVMeDataTypeIdentify,
-			.ProtocolDataRequestValue = (DWORD)identifyCode,
+			.DataType = (DWORD)dataType,
+			.ProtocolDataRequestValue = requestValue,
 			.ProtocolDataRequestSubValue = subValue,
 			.ProtocolDataOffset = sizeof(STORAGE_PROTOCOL_SPECIFIC_DATA),
-			.ProtocolDataLength = NVME_MAX_LOG_SIZE
+			.ProtocolDataLength = sizeof(TResult),
+			.FixedProtocolReturnData = 0,
+			.ProtocolDataRequestSubValue2 = 0,
+			.ProtocolDataRequestSubValue3 = 0,
+			.ProtocolDataRequestSubValue4 = 0
 		};
 
-		// The bufferSize is the sum of:
-		// - the first N bytes of the STORAGE_PROPERTY_QUERY, up to but not
-		//   including the AdditionalParameters field
-		// - the size of AdditionalParameters, which varies but in this case
-		//   contains STORAGE_PROTOCOL_SPECIFIC_DATA
-		// - the maximum size of the response payload, NVME_MAX_LOG_SIZE
-		/*size_t suggestedBufferSize = FIELD_OFFSET(STORAGE_PROPERTY_QUERY, AdditionalParameters) +
-			sizeof(STORAGE_PROTOCOL_SPECIFIC_DATA) +
-			NVME_MAX_LOG_SIZE;*/
-
-		STORAGE_PROTOCOL_DATA_DESCRIPTOR* result = IssueIoctl<STORAGE_PROTOCOL_DATA_DESCRIPTOR, STORAGE_PROTOCOL_SPECIFIC_DATA>(
-			propertyId, &protocolSpecificData);
-		
-		size_t identifyDataOffset = FIELD_OFFSET(STORAGE_PROTOCOL_DATA_DESCRIPTOR, ProtocolSpecificData)
-			+ result->ProtocolSpecificData.ProtocolDataOffset;
-		
-		TResult identifyData = *((TResult*)add(result, identifyDataOffset));
+		// The response is a STORAGE_PROTOCOL_DATA_DESCRIPTOR followed by the
+		// payload, so its size is known without asking the driver.
+		static_assert(StorageQueryTraits<TResult>::ResponseSize != 0, "NvmeProtocolQuery requires a fixed-size payload");
 
-		free(result);
+		StorageQueryResult<STORAGE_PROTOCOL_DATA_DESCRIPTOR> result = IssueIoctlHelper<STORAGE_PROTOCOL_DATA_DESCRIPTOR>(
+			propertyId, &protocolSpecificData, sizeof(protocolSpecificData), StorageQueryTraits<TResult>::ResponseSize,
+			StorageQueryTraits<TResult>::Operation);
 
-		return identifyData;
-	}
+		size_t payloadOffset = FIELD_OFFSET(STORAGE_PROTOCOL_DATA_DESCRIPTOR, ProtocolSpecificData)
+			+ result->ProtocolSpecificData.ProtocolDataOffset;
 
-private:
-	HANDLE hDevice_;
-	HANDLE OpenDevice(BSTR deviceNamespace) {
-		HANDLE hDevice = CreateFile(deviceNamespace,
-			/*dwDesiredAccess=*/ GENERIC_READ | GENERIC_WRITE,
-			/*dwShareMode=*/ FILE_SHARE_READ,
-			/*lpSecurityAttributes=*/ 0,
-			/*dwCreationDisposition=*/ OPEN_EXISTING,
-			/*dwFlagsAndAttributes=*/ 0,
-			/*hTemplateFile=*/ 0);
-		
-		if (hDevice == INVALID_HANDLE_VALUE) {
-			DWORD err = GetLastError();
-
-			switch (err) {
-			case ERROR_ACCESS_DENIED:
-				throw std::runtime_error("Access denied while attempting to get device handle. Did you run as administrator?");
-			default:
-				throw std::runtime_error("Failed to get device handle. Error code: " + std::to_string(err));
-			}
+		if (result->ProtocolSpecificData.ProtocolDataLength < sizeof(TResult) ||
+			payloadOffset + sizeof(TResult) > result.Size()) {
+			throw std::runtime_error("Driver returned a truncated NVMe response.");
 		}
 
-		return hDevice;
+		// Hand out the payload in place rather than copying the page.
+		return std::move(result).template Slice<TResult>(payloadOffset, sizeof(TResult));
 	}
 
-	template<typename TResult>
-	TResult* IssueIoctlHelper(STORAGE_PROPERTY_ID propertyId, void* additionalParameters = nullptr, size_t additionalParametersSize = 0) {
-		// Prepare the buffer
-		size_t inputBufferSize = sizeof(STORAGE_PROPERTY_QUERY) + additionalParametersSize;
-		size_t outputBufferSize = 0;
-
-		// We may not always know the size of the query response, such as when it returns a list or a header with a variable sized payload as the next
-		// contiguous byte. First, query for a STORAGE_DESCRIPTOR_HEADER (always the first bytes of all storage query responses) and check for what the
-		// size of the response will be, then allocate an output buffer accordingly.
-		if (std::is_same<TResult, STORAGE_DESCRIPTOR_HEADER>::value) {
-			outputBufferSize = sizeof(STORAGE_DESCRIPTOR_HEADER);
-		}
-		else {
-			STORAGE_DESCRIPTOR_HEADER* header = IssueIoctlHelper<STORAGE_DESCRIPTOR_HEADER>(propertyId, additionalParameters, additionalParametersSize);
-			outputBufferSize = header->Size;
-			free(header);
-		}
-		
-		void* inputBuffer = malloc(inputBufferSize);
-		void* outputBuffer = malloc(outputBufferSize);
+private:
+	// Used for responses of unknown size that we have not seen before. This
+	// fits every variable-sized descriptor the GCE drivers return, so those
+	// queries normally take a single round trip too.
+	static constexpr DWORD DefaultResponseSize = 512;
+	static constexpr int MaxQueryAttempts = 3;
+	// The largest AdditionalParameters we send, a STORAGE_PROTOCOL_SPECIFIC_DATA.
+	static constexpr size_t MaxAdditionalParametersSize = sizeof(STORAGE_PROTOCOL_SPECIFIC_DATA);
 
-		if (inputBuffer == nullptr) {
-			throw std::bad_alloc("Failed to allocate an input buffer for the driver query.");
-		}
+	static inline std::atomic<uint64_t> ioctlCount_ = 0;
 
-		if (outputBuffer == nullptr) {
-			throw std::bad_alloc("Failed to allocate an output buffer for the driver response.");
-		}
+	std::unique_ptr<DeviceBackend> backend_;
+	OperationStats* metrics_ = nullptr;
+	STORAGE_BUS_TYPE busType_ = STORAGE_BUS_TYPE::BusTypeUnknown;
+	QueryBufferArena responseArena_;
+	alignas(8) BYTE queryBuffer_[FIELD_OFFSET(STORAGE_PROPERTY_QUERY, AdditionalParameters) + MaxAdditionalParametersSize];
+	// The response sizes the driver reported for queries without a fixed
+	// size, keyed by property.
+	std::unordered_map<DWORD, DWORD> learnedResponseSizes_;
 
-		ZeroMemory(inputBuffer, inputBufferSize);
-		ZeroMemory(outputBuffer, outputBufferSize);
+	template<typename TResult>
+	StorageQueryResult<TResult> IssueIoctlHelper(STORAGE_PROPERTY_ID propertyId, void* additionalParameters, size_t additionalParametersSize,
+		DWORD fixedResponseSize, DeviceOperation operation) {
+		if (additionalParametersSize > MaxAdditionalParametersSize) {
+			throw std::invalid_argument("Driver query parameters are too large.");
+		}
 
 		// Prepare the query
-		PSTORAGE_PROPERTY_QUERY query = (PSTORAGE_PROPERTY_QUERY)inputBuffer;
+		DWORD inputBufferSize = (DWORD)std::max(sizeof(STORAGE_PROPERTY_QUERY),
+			FIELD_OFFSET(STORAGE_PROPERTY_QUERY, AdditionalParameters) + additionalParametersSize);
+		ZeroMemory(queryBuffer_, sizeof(queryBuffer_));
+		PSTORAGE_PROPERTY_QUERY query = (PSTORAGE_PROPERTY_QUERY)queryBuffer_;
 		query->PropertyId = propertyId;
 		query->QueryType = STORAGE_QUERY_TYPE::PropertyStandardQuery;
 
 		if (additionalParameters != nullptr && additionalParametersSize > 0) {
-			ULONG additionalParametersOffset = FIELD_OFFSET(STORAGE_PROPERTY_QUERY, AdditionalParameters);
-			memcpy(add(query, additionalParametersOffset), additionalParameters, additionalParametersSize);
+			memcpy(query->AdditionalParameters, additionalParameters, additionalParametersSize);
 		}
 
-		DWORD written = 0;
-		BOOL ok = DeviceIoControl(hDevice_,
-			/*dwIoControlCode=*/ IOCTL_STORAGE_QUERY_PROPERTY,
-			/*lpInBuffer=*/ inputBuffer,
-			/*nInBufferSize=*/ inputBufferSize,
-			/*lpOutBuffer=*/ outputBuffer,
-			/*nOutBufferSize=*/ outputBufferSize,
-			/*lpBytesReturned=*/ &written,
-			/*lpOverlapped=*/ nullptr);
+		// Every storage query response starts with a STORAGE_DESCRIPTOR_HEADER
+		// whose Size is the full size of the response. Rather than asking for
+		// the header first and then repeating the query, we issue the query
+		// once with a buffer we expect to be big enough, and only retry if the
+		// header says the response did not fit.
+		DWORD outputBufferSize = GetExpectedResponseSize(propertyId, fixedResponseSize);
+		for (int attempt = 1; ; attempt++) {
+			QueryBufferArena::Marker marker = responseArena_.GetMarker();
+			void* outputBuffer = responseArena_.Allocate(outputBufferSize);
 
-		free(inputBuffer);
+			DWORD written = 0;
+			ioctlCount_++;
+			DWORD err;
+			{
+				PhaseTimings::Scope phase("ioctl");
+				OperationMetrics::Scope metrics(operation, metrics_);
+				err = backend_->QueryProperty(queryBuffer_, inputBufferSize, outputBuffer, outputBufferSize, &written);
+				if (err != ERROR_SUCCESS) {
+					metrics.Fail();
+				}
+			}
 
-		if (!ok) {
-			throw std::system_error("Driver query returned a not ok reponse.");
-		}
+			DWORD requiredSize = 0;
+			if ((err == ERROR_SUCCESS || err == ERROR_MORE_DATA) && written >= sizeof(STORAGE_DESCRIPTOR_HEADER)) {
+				requiredSize = ((STORAGE_DESCRIPTOR_HEADER*)outputBuffer)->Size;
+			}
 
-		return (TResult*)outputBuffer;
+			if (err == ERROR_SUCCESS && requiredSize <= outputBufferSize) {
+				if (fixedResponseSize == 0 && requiredSize >= sizeof(STORAGE_DESCRIPTOR_HEADER)) {
+					learnedResponseSizes_[propertyId] = requiredSize;
+				}
+				return StorageQueryResult<TResult>(&responseArena_, marker, (TResult*)outputBuffer, written);
+			}
+
+			responseArena_.Rewind(marker);
+
+			bool retry = err == ERROR_SUCCESS || err == ERROR_MORE_DATA || err == ERROR_INSUFFICIENT_BUFFER;
+			if (!retry) {
+				throw std::runtime_error("Driver query returned a not ok response. Error code: " + std::to_string(err));
+			}
+			if (attempt == MaxQueryAttempts) {
+				throw std::runtime_error("Driver query response did not fit after " + std::to_string(MaxQueryAttempts) +
+					" attempts. Required size: " + std::to_string(requiredSize) + ", returned size: " + std::to_string(written));
+			}
+
+			// Without a header to tell us the size, grow the buffer instead.
+			outputBufferSize = requiredSize > outputBufferSize ? requiredSize : outputBufferSize * 2;
+		}
 	}
 
-	void* add(void* ptr, ULONG offset) {
-		return ((char*)ptr) + offset;
+	DWORD GetExpectedResponseSize(STORAGE_PROPERTY_ID propertyId, DWORD fixedResponseSize) {
+		if (fixedResponseSize != 0) {
+			return fixedResponseSize;
+		}
+
+		auto learnedSize = learnedResponseSizes_.find(propertyId);
+		if (learnedSize != learnedResponseSizes_.end()) {
+			return learnedSize->second;
+		}
+
+		return DefaultResponseSize;
 	}
 };
@@ -0,0 +1,115 @@
+/* Copyright 2022 Google LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#pragma once
+
+#include <cstddef>
+#include <string_view>
+#include "StorageTypes.h"
+
+// One identifier from a STORAGE_DEVICE_ID_DESCRIPTOR. Value points into the
+// descriptor.
+struct StorageIdentifierView {
+	STORAGE_IDENTIFIER_CODE_SET CodeSet = STORAGE_IDENTIFIER_CODE_SET::StorageIdCodeSetReserved;
+	STORAGE_IDENTIFIER_TYPE Type = STORAGE_IDENTIFIER_TYPE::StorageIdTypeVendorSpecific;
+	STORAGE_ASSOCIATION_TYPE Association = STORAGE_ASSOCIATION_TYPE::StorageIdAssocDevice;
+	std::string_view Value;
+
+	// ASCII and UTF-8 identifiers are text; the rest are raw bytes.
+	bool IsText() const {
+		return CodeSet == STORAGE_IDENTIFIER_CODE_SET::StorageIdCodeSetAscii ||
+			CodeSet == STORAGE_IDENTIFIER_CODE_SET::StorageIdCodeSetUtf8;
+	}
+};
+
+// Calls callback with each of the count identifiers packed into
+// identifiers[0..size), the Identifiers of a STORAGE_DEVICE_ID_DESCRIPTOR,
+// following each one's NextOffset to the next. Stops at the first identifier
+// that would run past size. Text identifiers are passed without the NULs the
+// driver pads them with. callback returns false to stop early.
+template<typename TCallback>
+inline void VisitStorageIdentifiers(const BYTE* identifiers, size_t size, DWORD count, TCallback&& callback) {
+	constexpr size_t headerSize = FIELD_OFFSET(STORAGE_IDENTIFIER, Identifier);
+	size_t offset = 0;
+	for (DWORD i = 0; i < count && size - offset >= headerSize; i++) {
+		const STORAGE_IDENTIFIER* identifier = (const STORAGE_IDENTIFIER*)(identifiers + offset);
+		if (identifier->IdentifierSize > size - offset - headerSize) {
+			return;
+		}
+
+		StorageIdentifierView view;
+		view.CodeSet = identifier->CodeSet;
+		view.Type = identifier->Type;
+		view.Association = identifier->Association;
+		view.Value = std::string_view((const char*)identifier->Identifier, identifier->IdentifierSize);
+		if (view.IsText()) {
+			view.Value = view.Value.substr(0, view.Value.find('\0'));
+		}
+		if (!callback(view) || identifier->NextOffset < headerSize || identifier->NextOffset > size - offset) {
+			return;
+		}
+		offset += identifier->NextOffset;
+	}
+}
+
+inline const char* GetStorageIdentifierTypeName(STORAGE_IDENTIFIER_TYPE type) {
+	switch (type) {
+	case STORAGE_IDENTIFIER_TYPE::StorageIdTypeVendorSpecific:
+		return "vendor_specific";
+	case STORAGE_IDENTIFIER_TYPE::StorageIdTypeVendorId:
+		return "vendor_id";
+	case STORAGE_IDENTIFIER_TYPE::StorageIdTypeEUI64:
+		return "eui64";
+	case STORAGE_IDENTIFIER_TYPE::StorageIdTypeFCPHName:
+		return "naa";
+	case STORAGE_IDENTIFIER_TYPE::StorageIdTypePortRelative:
+		return "port_relative";
+	case STORAGE_IDENTIFIER_TYPE::StorageIdTypeTargetPortGroup:
+		return "target_port_group";
+	case STORAGE_IDENTIFIER_TYPE::StorageIdTypeLogicalUnitGroup:
+		return "logical_unit_group";
+	case STORAGE_IDENTIFIER_TYPE::StorageIdTypeMD5LogicalUnitIdentifier:
+		return "md5_logical_unit";
+	case STORAGE_IDENTIFIER_TYPE::StorageIdTypeScsiNameString:
+		return "scsi_name_string";
+	default:
+		return "other";
+	}
+}
+
+inline const char* GetStorageCodeSetName(STORAGE_IDENTIFIER_CODE_SET codeSet) {
+	switch (codeSet) {
+	case STORAGE_IDENTIFIER_CODE_SET::StorageIdCodeSetBinary:
+		return "binary";
+	case STORAGE_IDENTIFIER_CODE_SET::StorageIdCodeSetAscii:
+		return "ascii";
+	case STORAGE_IDENTIFIER_CODE_SET::StorageIdCodeSetUtf8:
+		return "utf8";
+	default:
+		return "other";
+	}
+}
+
+inline const char* GetStorageAssociationName(STORAGE_ASSOCIATION_TYPE association) {
+	switch (association) {
+	case STORAGE_ASSOCIATION_TYPE::StorageIdAssocDevice:
+		return "device";
+	case STORAGE_ASSOCIATION_TYPE::StorageIdAssocPort:
+		return "port";
+	case STORAGE_ASSOCIATION_TYPE::StorageIdAssocTarget:
+		return "target";
+	default:
+		return "other";
+	}
+}
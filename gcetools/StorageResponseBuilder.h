@@ -0,0 +1,190 @@
+/* Copyright 2022 Google LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdio>
+#include <cstring>
+#include <string_view>
+#include "NvmeV1BasedScsiNameString.h"
+#include "StorageTypes.h"
+
+// Builds IOCTL_STORAGE_QUERY_PROPERTY responses laid out the way the Windows
+// storage drivers return them, for backends that answer the queries
+// themselves rather than forwarding them to a Windows driver.
+class StorageResponseBuilder {
+public:
+	// Large enough for every response built here: an NVMe identify payload
+	// behind its protocol data descriptor.
+	static constexpr DWORD Capacity = sizeof(STORAGE_PROTOCOL_DATA_DESCRIPTOR) + NVME_MAX_LOG_SIZE;
+
+	// Clears the previous response.
+	void Reset() {
+		ZeroMemory(response_, sizeof(response_));
+	}
+
+	// Copies as much of a response of the given size as fits. Like the real
+	// drivers, the header of a truncated response still reports the full
+	// size.
+	DWORD CopyTo(DWORD responseSize, void* outputBuffer, DWORD outputBufferSize, DWORD* bytesReturned) const {
+		DWORD copied = std::min(responseSize, outputBufferSize);
+		memcpy(outputBuffer, response_, copied);
+		*bytesReturned = copied;
+		return ERROR_SUCCESS;
+	}
+
+	DWORD BuildDeviceDescriptor(STORAGE_BUS_TYPE busType, std::string_view vendorId, std::string_view productId,
+		std::string_view productRevision, std::string_view serialNumber) {
+		STORAGE_DEVICE_DESCRIPTOR* descriptor = (STORAGE_DEVICE_DESCRIPTOR*)response_;
+		DWORD size = sizeof(STORAGE_DEVICE_DESCRIPTOR);
+		descriptor->Version = sizeof(STORAGE_DEVICE_DESCRIPTOR);
+		descriptor->BusType = busType;
+		descriptor->CommandQueueing = true;
+		descriptor->VendorIdOffset = AppendString(&size, vendorId);
+		descriptor->ProductIdOffset = AppendString(&size, productId);
+		descriptor->ProductRevisionOffset = AppendString(&size, productRevision);
+		descriptor->SerialNumberOffset = AppendString(&size, serialNumber);
+		descriptor->Size = size;
+		return size;
+	}
+
+	// The transfer limits default to what the GCE drivers report.
+	DWORD BuildAdapterDescriptor(STORAGE_BUS_TYPE busType, DWORD maximumTransferLength = 0x20000,
+		DWORD maximumPhysicalPages = 0x21, DWORD alignmentMask = 0x3) {
+		STORAGE_ADAPTER_DESCRIPTOR* descriptor = (STORAGE_ADAPTER_DESCRIPTOR*)response_;
+		descriptor->Version = sizeof(STORAGE_ADAPTER_DESCRIPTOR);
+		descriptor->Size = sizeof(STORAGE_ADAPTER_DESCRIPTOR);
+		descriptor->MaximumTransferLength = maximumTransferLength;
+		descriptor->MaximumPhysicalPages = maximumPhysicalPages;
+		descriptor->AlignmentMask = alignmentMask;
+		descriptor->CommandQueueing = true;
+		descriptor->BusType = (BYTE)busType;
+		return descriptor->Size;
+	}
+
+	// The single SCSI name string identifier StorNVMe reports for an NVMe
+	// namespace. pciVendorId is four hex digits.
+	DWORD BuildNvmeDeviceIdDescriptor(std::string_view pciVendorId, std::string_view modelNumber,
+		DWORD namespaceId, std::string_view serialNumber) {
+		NvmeV1BasedScsiNameString nameString;
+		CopyPadded(nameString.PciVendorId, sizeof(nameString.PciVendorId), pciVendorId);
+		CopyPadded(nameString.ModelNumber, sizeof(nameString.ModelNumber), modelNumber);
+		char namespaceIdText[5];
+		snprintf(namespaceIdText, sizeof(namespaceIdText), "%04u", (unsigned int)namespaceId);
+		CopyPadded(nameString.NamespaceId, sizeof(nameString.NamespaceId), namespaceIdText);
+		CopyPadded(nameString.SerialNumber, sizeof(nameString.SerialNumber), serialNumber);
+
+		STORAGE_DEVICE_ID_DESCRIPTOR* descriptor = (STORAGE_DEVICE_ID_DESCRIPTOR*)response_;
+		STORAGE_IDENTIFIER* identifier = (STORAGE_IDENTIFIER*)descriptor->Identifiers;
+		identifier->CodeSet = STORAGE_IDENTIFIER_CODE_SET::StorageIdCodeSetAscii;
+		identifier->Type = STORAGE_IDENTIFIER_TYPE::StorageIdTypeScsiNameString;
+		identifier->Association = STORAGE_ASSOCIATION_TYPE::StorageIdAssocDevice;
+		identifier->IdentifierSize = sizeof(nameString);
+		identifier->NextOffset = (WORD)AlignUp(FIELD_OFFSET(STORAGE_IDENTIFIER, Identifier) + identifier->IdentifierSize);
+		memcpy(identifier->Identifier, &nameString, sizeof(nameString));
+
+		descriptor->Version = sizeof(STORAGE_DEVICE_ID_DESCRIPTOR);
+		descriptor->NumberOfIdentifiers = 1;
+		descriptor->Size = FIELD_OFFSET(STORAGE_DEVICE_ID_DESCRIPTOR, Identifiers) + identifier->NextOffset;
+		return descriptor->Size;
+	}
+
+	// Converts a SCSI Device Identification VPD page (0x83) into one
+	// identifier per designation descriptor, as storport does. Returns 0 if
+	// the page is malformed.
+	DWORD BuildDeviceIdDescriptorFromVpd(const BYTE* page, size_t pageSize) {
+		if (pageSize < VpdPageHeaderSize || page[1] != DeviceIdentificationVpdPage) {
+			return 0;
+		}
+		size_t pageEnd = std::min(pageSize, VpdPageHeaderSize + (((size_t)page[2] << 8) | page[3]));
+
+		STORAGE_DEVICE_ID_DESCRIPTOR* descriptor = (STORAGE_DEVICE_ID_DESCRIPTOR*)response_;
+		DWORD size = FIELD_OFFSET(STORAGE_DEVICE_ID_DESCRIPTOR, Identifiers);
+		DWORD count = 0;
+		for (size_t offset = VpdPageHeaderSize; offset + 4 <= pageEnd;) {
+			const BYTE* designator = page + offset;
+			size_t length = designator[3];
+			if (offset + 4 + length > pageEnd) {
+				return 0;
+			}
+			offset += 4 + length;
+
+			DWORD identifierSize = (DWORD)AlignUp(FIELD_OFFSET(STORAGE_IDENTIFIER, Identifier) + (DWORD)length);
+			if (size + identifierSize > Capacity) {
+				break;
+			}
+
+			STORAGE_IDENTIFIER* identifier = (STORAGE_IDENTIFIER*)(response_ + size);
+			identifier->CodeSet = (STORAGE_IDENTIFIER_CODE_SET)(designator[0] & 0x0F);
+			identifier->Type = (STORAGE_IDENTIFIER_TYPE)(designator[1] & 0x0F);
+			identifier->Association = (STORAGE_ASSOCIATION_TYPE)((designator[1] >> 4) & 0x03);
+			identifier->IdentifierSize = (WORD)length;
+			identifier->NextOffset = (WORD)identifierSize;
+			memcpy(identifier->Identifier, designator + 4, length);
+			size += identifierSize;
+			count++;
+		}
+
+		descriptor->Version = sizeof(STORAGE_DEVICE_ID_DESCRIPTOR);
+		descriptor->NumberOfIdentifiers = count;
+		descriptor->Size = size;
+		return size;
+	}
+
+	// Where the payload of a protocol-specific response goes.
+	BYTE* GetProtocolDataPayload() {
+		return response_ + FIELD_OFFSET(STORAGE_PROTOCOL_DATA_DESCRIPTOR, ProtocolSpecificData) + sizeof(STORAGE_PROTOCOL_SPECIFIC_DATA);
+	}
+
+	// Fills in the descriptor in front of a payload written to
+	// GetProtocolDataPayload().
+	DWORD BuildProtocolDataDescriptor(const STORAGE_PROTOCOL_SPECIFIC_DATA& request, DWORD payloadSize) {
+		STORAGE_PROTOCOL_DATA_DESCRIPTOR* descriptor = (STORAGE_PROTOCOL_DATA_DESCRIPTOR*)response_;
+		descriptor->ProtocolSpecificData = request;
+		descriptor->ProtocolSpecificData.ProtocolDataOffset = sizeof(STORAGE_PROTOCOL_SPECIFIC_DATA);
+		descriptor->ProtocolSpecificData.ProtocolDataLength = payloadSize;
+
+		// The driver reports the size of the descriptor alone, not including
+		// the payload that follows it.
+		descriptor->Version = sizeof(STORAGE_PROTOCOL_DATA_DESCRIPTOR);
+		descriptor->Size = sizeof(STORAGE_PROTOCOL_DATA_DESCRIPTOR);
+		return sizeof(STORAGE_PROTOCOL_DATA_DESCRIPTOR) + payloadSize;
+	}
+
+	static void CopyPadded(void* destination, size_t size, std::string_view value) {
+		memset(destination, ' ', size);
+		memcpy(destination, value.data(), std::min(size, value.size()));
+	}
+
+private:
+	static constexpr size_t VpdPageHeaderSize = 4;
+	static constexpr BYTE DeviceIdentificationVpdPage = 0x83;
+
+	alignas(8) BYTE response_[Capacity];
+
+	DWORD AppendString(DWORD* size, std::string_view value) {
+		DWORD offset = *size;
+		size_t length = std::min<size_t>(value.size(), Capacity - offset - 1);
+		memcpy(response_ + offset, value.data(), length);
+		response_[offset + length] = 0;
+		*size += (DWORD)length + 1;
+		return offset;
+	}
+
+	static DWORD AlignUp(DWORD value) {
+		return (value + 3) & ~3u;
+	}
+};
@@ -0,0 +1,306 @@
+/* Copyright 2022 Google LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#pragma once
+
+// The storage query and NVMe types used by StorageDevice. On Windows these
+// come from the SDK. Everywhere else we define the subset we use with the same
+// names, values and layouts as the SDK, so that the device name parsing code
+// and the simulated device backend can be built and run on a Linux box.
+
+#ifdef _WIN32
+
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#include <winioctl.h>
+#include <nvme.h>
+
+#else
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+typedef uint8_t BYTE;
+typedef uint8_t UCHAR;
+typedef uint8_t BOOLEAN;
+typedef uint16_t WORD;
+typedef uint16_t USHORT;
+typedef uint32_t DWORD;
+typedef uint32_t ULONG;
+typedef uint64_t ULONGLONG;
+typedef int BOOL;
+typedef wchar_t WCHAR;
+typedef const wchar_t* LPCWSTR;
+
+#define FIELD_OFFSET(type, field) ((ULONG)offsetof(type, field))
+#define ZeroMemory(destination, length) memset((destination), 0, (length))
+
+#define ERROR_SUCCESS               0L
+#define ERROR_INVALID_FUNCTION      1L
+#define ERROR_FILE_NOT_FOUND        2L
+#define ERROR_ACCESS_DENIED         5L
+#define ERROR_GEN_FAILURE           31L
+#define ERROR_NOT_SUPPORTED         50L
+#define ERROR_INVALID_PARAMETER     87L
+#define ERROR_INSUFFICIENT_BUFFER   122L
+#define ERROR_MORE_DATA             234L
+#define ERROR_OPERATION_ABORTED     995L
+#define ERROR_IO_PENDING            997L
+#define ERROR_TIMEOUT               1460L
+
+typedef enum _STORAGE_BUS_TYPE {
+	BusTypeUnknown = 0x00,
+	BusTypeScsi,
+	BusTypeAtapi,
+	BusTypeAta,
+	BusType1394,
+	BusTypeSsa,
+	BusTypeFibre,
+	BusTypeUsb,
+	BusTypeRAID,
+	BusTypeiScsi,
+	BusTypeSas,
+	BusTypeSata,
+	BusTypeSd,
+	BusTypeMmc,
+	BusTypeVirtual,
+	BusTypeFileBackedVirtual,
+	BusTypeSpaces,
+	BusTypeNvme,
+	BusTypeSCM,
+	BusTypeUfs,
+	BusTypeMax,
+	BusTypeMaxReserved = 0x7F
+} STORAGE_BUS_TYPE;
+
+typedef enum _STORAGE_PROPERTY_ID {
+	StorageDeviceProperty = 0,
+	StorageAdapterProperty = 1,
+	StorageDeviceIdProperty = 2,
+	StorageDeviceUniqueIdProperty = 3,
+	StorageAccessAlignmentProperty = 6,
+	StorageAdapterProtocolSpecificProperty = 49,
+	StorageDeviceProtocolSpecificProperty = 50
+} STORAGE_PROPERTY_ID;
+
+typedef enum _STORAGE_QUERY_TYPE {
+	PropertyStandardQuery = 0,
+	PropertyExistsQuery,
+	PropertyMaskQuery,
+	PropertyQueryMaxDefined
+} STORAGE_QUERY_TYPE;
+
+typedef struct _STORAGE_PROPERTY_QUERY {
+	STORAGE_PROPERTY_ID PropertyId;
+	STORAGE_QUERY_TYPE QueryType;
+	BYTE AdditionalParameters[1];
+} STORAGE_PROPERTY_QUERY, *PSTORAGE_PROPERTY_QUERY;
+
+typedef struct _STORAGE_DESCRIPTOR_HEADER {
+	DWORD Version;
+	DWORD Size;
+} STORAGE_DESCRIPTOR_HEADER;
+
+typedef struct _STORAGE_DEVICE_DESCRIPTOR {
+	DWORD Version;
+	DWORD Size;
+	BYTE DeviceType;
+	BYTE DeviceTypeModifier;
+	BOOLEAN RemovableMedia;
+	BOOLEAN CommandQueueing;
+	DWORD VendorIdOffset;
+	DWORD ProductIdOffset;
+	DWORD ProductRevisionOffset;
+	DWORD SerialNumberOffset;
+	STORAGE_BUS_TYPE BusType;
+	DWORD RawPropertiesLength;
+	BYTE RawDeviceProperties[1];
+} STORAGE_DEVICE_DESCRIPTOR;
+
+typedef struct _STORAGE_ADAPTER_DESCRIPTOR {
+	DWORD Version;
+	DWORD Size;
+	DWORD MaximumTransferLength;
+	DWORD MaximumPhysicalPages;
+	DWORD AlignmentMask;
+	BOOLEAN AdapterUsesPio;
+	BOOLEAN AdapterScansDown;
+	BOOLEAN CommandQueueing;
+	BOOLEAN AcceleratedTransfer;
+	BYTE BusType;
+	WORD BusMajorVersion;
+	WORD BusMinorVersion;
+	BYTE SrbType;
+	BYTE AddressType;
+} STORAGE_ADAPTER_DESCRIPTOR;
+
+typedef enum _STORAGE_IDENTIFIER_CODE_SET {
+	StorageIdCodeSetReserved = 0,
+	StorageIdCodeSetBinary = 1,
+	StorageIdCodeSetAscii = 2,
+	StorageIdCodeSetUtf8 = 3
+} STORAGE_IDENTIFIER_CODE_SET;
+
+typedef enum _STORAGE_IDENTIFIER_TYPE {
+	StorageIdTypeVendorSpecific = 0,
+	StorageIdTypeVendorId = 1,
+	StorageIdTypeEUI64 = 2,
+	StorageIdTypeFCPHName = 3,
+	StorageIdTypePortRelative = 4,
+	StorageIdTypeTargetPortGroup = 5,
+	StorageIdTypeLogicalUnitGroup = 6,
+	StorageIdTypeMD5LogicalUnitIdentifier = 7,
+	StorageIdTypeScsiNameString = 8
+} STORAGE_IDENTIFIER_TYPE;
+
+typedef enum _STORAGE_ASSOCIATION_TYPE {
+	StorageIdAssocDevice = 0,
+	StorageIdAssocPort = 1,
+	StorageIdAssocTarget = 2
+} STORAGE_ASSOCIATION_TYPE;
+
+typedef struct _STORAGE_IDENTIFIER {
+	STORAGE_IDENTIFIER_CODE_SET CodeSet;
+	STORAGE_IDENTIFIER_TYPE Type;
+	WORD IdentifierSize;
+	WORD NextOffset;
+	STORAGE_ASSOCIATION_TYPE Association;
+	BYTE Identifier[1];
+} STORAGE_IDENTIFIER;
+
+typedef struct _STORAGE_DEVICE_ID_DESCRIPTOR {
+	DWORD Version;
+	DWORD Size;
+	DWORD NumberOfIdentifiers;
+	BYTE Identifiers[1];
+} STORAGE_DEVICE_ID_DESCRIPTOR;
+
+typedef enum _STORAGE_PROTOCOL_TYPE {
+	ProtocolTypeUnknown = 0x00,
+	ProtocolTypeScsi,
+	ProtocolTypeAta,
+	ProtocolTypeNvme,
+	ProtocolTypeSd,
+	ProtocolTypeUfs,
+	ProtocolTypeProprietary = 0x7E,
+	ProtocolTypeMaxReserved = 0x7F
+} STORAGE_PROTOCOL_TYPE;
+
+typedef enum _STORAGE_PROTOCOL_NVME_DATA_TYPE {
+	NVMeDataTypeUnknown = 0,
+	NVMeDataTypeIdentify,
+	NVMeDataTypeLogPage,
+	NVMeDataTypeFeature
+} STORAGE_PROTOCOL_NVME_DATA_TYPE;
+
+typedef struct _STORAGE_PROTOCOL_SPECIFIC_DATA {
+	STORAGE_PROTOCOL_TYPE ProtocolType;
+	DWORD DataType;
+	DWORD ProtocolDataRequestValue;
+	DWORD ProtocolDataRequestSubValue;
+	DWORD ProtocolDataOffset;
+	DWORD ProtocolDataLength;
+	DWORD FixedProtocolReturnData;
+	DWORD ProtocolDataRequestSubValue2;
+	DWORD ProtocolDataRequestSubValue3;
+	DWORD ProtocolDataRequestSubValue4;
+} STORAGE_PROTOCOL_SPECIFIC_DATA;
+
+typedef struct _STORAGE_PROTOCOL_DATA_DESCRIPTOR {
+	DWORD Version;
+	DWORD Size;
+	STORAGE_PROTOCOL_SPECIFIC_DATA ProtocolSpecificData;
+} STORAGE_PROTOCOL_DATA_DESCRIPTOR;
+
+#define NVME_MAX_LOG_SIZE 0x1000
+
+typedef enum {
+	NVME_IDENTIFY_CNS_SPECIFIC_NAMESPACE = 0x0,
+	NVME_IDENTIFY_CNS_CONTROLLER = 0x1,
+	NVME_IDENTIFY_CNS_ACTIVE_NAMESPACES = 0x2
+} NVME_IDENTIFY_CNS_CODES;
+
+// Only the fields we read are named; everything else is kept as reserved
+// space so that the offsets and the overall size match the SDK definition.
+typedef struct {
+	ULONGLONG NSZE;
+	ULONGLONG NCAP;
+	ULONGLONG NUSE;
+	UCHAR NSFEAT;
+	UCHAR NLBAF;
+	UCHAR FLBAS;
+	UCHAR Reserved0[357];
+	UCHAR VS[3712];
+} NVME_IDENTIFY_NAMESPACE_DATA;
+
+typedef struct {
+	USHORT VID;
+	USHORT SSVID;
+	UCHAR SN[20];
+	UCHAR MN[40];
+	UCHAR FR[8];
+	UCHAR RAB;
+	UCHAR IEEE[3];
+	UCHAR CMIC;
+	UCHAR MDTS;
+	USHORT CNTLID;
+	ULONG VER;
+	UCHAR Reserved0[432];
+	ULONG NN;
+	UCHAR Reserved1[2552];
+	UCHAR VS[1024];
+} NVME_IDENTIFY_CONTROLLER_DATA;
+
+typedef enum {
+	NVME_LOG_PAGE_HEALTH_INFO = 0x02
+} NVME_LOG_PAGES;
+
+// The SMART / Health Information log page. The 128-bit counters are
+// little-endian byte arrays, as in the SDK.
+typedef struct {
+	union {
+		UCHAR AsUchar;
+	} CriticalWarning;
+	UCHAR Temperature[2];
+	UCHAR AvailableSpare;
+	UCHAR AvailableSpareThreshold;
+	UCHAR PercentageUsed;
+	UCHAR Reserved0[26];
+	UCHAR DataUnitRead[16];
+	UCHAR DataUnitWritten[16];
+	UCHAR HostReadCommands[16];
+	UCHAR HostWrittenCommands[16];
+	UCHAR ControllerBusyTime[16];
+	UCHAR PowerCycle[16];
+	UCHAR PowerOnHours[16];
+	UCHAR UnsafeShutdowns[16];
+	UCHAR MediaErrors[16];
+	UCHAR ErrorInfoLogEntryCount[16];
+	UCHAR Reserved1[320];
+} NVME_HEALTH_INFO_LOG;
+
+static_assert(sizeof(STORAGE_PROPERTY_QUERY) == 12, "STORAGE_PROPERTY_QUERY layout must match the Windows SDK");
+static_assert(sizeof(STORAGE_PROTOCOL_DATA_DESCRIPTOR) == 48, "STORAGE_PROTOCOL_DATA_DESCRIPTOR layout must match the Windows SDK");
+static_assert(offsetof(STORAGE_IDENTIFIER, Identifier) == 16, "STORAGE_IDENTIFIER layout must match the Windows SDK");
+static_assert(sizeof(NVME_IDENTIFY_NAMESPACE_DATA) == NVME_MAX_LOG_SIZE, "NVME_IDENTIFY_NAMESPACE_DATA must be 4096 bytes");
+static_assert(offsetof(NVME_IDENTIFY_NAMESPACE_DATA, VS) == 384, "NVME_IDENTIFY_NAMESPACE_DATA layout must match the NVMe specification");
+static_assert(sizeof(NVME_IDENTIFY_CONTROLLER_DATA) == NVME_MAX_LOG_SIZE, "NVME_IDENTIFY_CONTROLLER_DATA must be 4096 bytes");
+static_assert(offsetof(NVME_IDENTIFY_CONTROLLER_DATA, NN) == 516, "NVME_IDENTIFY_CONTROLLER_DATA layout must match the NVMe specification");
+static_assert(sizeof(NVME_HEALTH_INFO_LOG) == 512, "NVME_HEALTH_INFO_LOG must be 512 bytes");
+static_assert(offsetof(NVME_HEALTH_INFO_LOG, MediaErrors) == 160, "NVME_HEALTH_INFO_LOG layout must match the NVMe specification");
+
+#endif
@@ -0,0 +1,75 @@
+/* Copyright 2022 Google LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#pragma once
+
+#include <algorithm>
+#include <filesystem>
+#include <stdexcept>
+#include <string>
+#include <system_error>
+#include <vector>
+#include "DeviceEnumerator.h"
+#include "OperationMetrics.h"
+#include "PhaseTimings.h"
+
+// Lists the disks under /sys/block that are backed by a device (NVMe
+// namespaces, SCSI and virtio disks), skipping loop, RAM and device-mapper
+// devices. DeviceIds are the /dev paths of the disks.
+class SysBlockDeviceEnumerator : public DeviceEnumerator {
+public:
+	SysBlockDeviceEnumerator(std::filesystem::path sysBlock = "/sys/block", std::filesystem::path dev = "/dev")
+		: sysBlock_(std::move(sysBlock)), dev_(std::move(dev))
+	{
+	}
+
+	const char* GetName() const override {
+		return "sysfs";
+	}
+
+	std::vector<std::wstring> EnumerateDeviceIds() override {
+		PhaseTimings::Scope phase("sysfs enumerate");
+		OperationMetrics::Scope metrics(DeviceOperation::Enumerate);
+
+		std::error_code err;
+		std::filesystem::directory_iterator it(sysBlock_, err);
+		if (err) {
+			throw std::runtime_error("Failed to list " + sysBlock_.string() + ": " + err.message());
+		}
+
+		std::vector<std::string> names;
+		for (const std::filesystem::directory_entry& entry : it) {
+			// Only disks with a parent device have a "device" link.
+			if (std::filesystem::exists(entry.path() / "device", err)) {
+				names.push_back(entry.path().filename().string());
+			}
+		}
+
+		// Shorter names first, so sdb comes before sdaa and nvme0n2 before
+		// nvme0n10.
+		std::sort(names.begin(), names.end(), [](const std::string& a, const std::string& b) {
+			return a.size() != b.size() ? a.size() < b.size() : a < b;
+		});
+
+		std::vector<std::wstring> deviceIds;
+		for (const std::string& name : names) {
+			deviceIds.push_back((dev_ / name).wstring());
+		}
+		return deviceIds;
+	}
+
+private:
+	std::filesystem::path sysBlock_;
+	std::filesystem::path dev_;
+};
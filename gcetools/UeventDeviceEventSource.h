@@ -0,0 +1,215 @@
+/* Copyright 2022 Google LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#pragma once
+
+#ifdef __linux__
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <system_error>
+#include "DeviceEvents.h"
+
+#include <linux/netlink.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+// Reports disks arriving and going away from the uevents on a
+// NETLINK_KOBJECT_UEVENT socket, without needing libudev. When udevd is
+// running, its own events are used, since they are sent once the /dev node
+// exists; otherwise the kernel's are. Only whole block devices are reported,
+// as <dev>/<name>.
+class UeventDeviceEventSource : public DeviceEventSource {
+public:
+	UeventDeviceEventSource(const std::filesystem::path& dev = "/dev")
+		: dev_(dev)
+	{
+		std::error_code err;
+		udevEvents_ = std::filesystem::exists("/run/udev/control", err);
+
+		socket_ = socket(AF_NETLINK, SOCK_DGRAM | SOCK_CLOEXEC, NETLINK_KOBJECT_UEVENT);
+		if (socket_ < 0) {
+			throw std::runtime_error("Failed to open a uevent socket: " + std::string(strerror(errno)));
+		}
+		int passCredentials = 1;
+		setsockopt(socket_, SOL_SOCKET, SO_PASSCRED, &passCredentials, sizeof(passCredentials));
+
+		sockaddr_nl address = {};
+		address.nl_family = AF_NETLINK;
+		address.nl_groups = udevEvents_ ? UdevGroup : KernelGroup;
+		if (bind(socket_, (const sockaddr*)&address, sizeof(address)) != 0) {
+			int bindError = errno;
+			close(socket_);
+			throw std::runtime_error("Failed to listen for uevents: " + std::string(strerror(bindError)));
+		}
+
+		stopEvent_ = eventfd(0, EFD_CLOEXEC);
+		if (stopEvent_ < 0) {
+			int eventError = errno;
+			close(socket_);
+			throw std::runtime_error("Failed to create an eventfd: " + std::string(strerror(eventError)));
+		}
+	}
+	UeventDeviceEventSource(const UeventDeviceEventSource&) = delete;
+	UeventDeviceEventSource& operator=(const UeventDeviceEventSource&) = delete;
+	~UeventDeviceEventSource() {
+		close(stopEvent_);
+		close(socket_);
+	}
+
+	bool Wait(DeviceEvent& event) override {
+		for (;;) {
+			pollfd fds[2] = { { socket_, POLLIN, 0 }, { stopEvent_, POLLIN, 0 } };
+			if (poll(fds, 2, -1) < 0) {
+				if (errno == EINTR) {
+					continue;
+				}
+				return false;
+			}
+			if (fds[1].revents != 0) {
+				return false;
+			}
+			if (ReceiveEvent(event)) {
+				return true;
+			}
+		}
+	}
+
+	void Stop() override {
+		uint64_t one = 1;
+		ssize_t written = write(stopEvent_, &one, sizeof(one));
+		(void)written;
+	}
+
+	// Parses one uevent message, in the kernel's format ("add@<devpath>"
+	// followed by KEY=VALUE strings) or udev's (a "libudev" header pointing
+	// at the KEY=VALUE strings). Returns false unless it is about a whole
+	// block device.
+	static bool ParseEvent(const char* message, size_t size, DeviceEventKind& kind, std::string& name) {
+		std::string_view properties(message, size);
+		if (properties.starts_with(std::string_view("libudev\0", 8))) {
+			if (size < UdevPropertiesLengthOffset + sizeof(uint32_t)) {
+				return false;
+			}
+			uint32_t offset;
+			uint32_t length;
+			memcpy(&offset, message + UdevPropertiesOffsetOffset, sizeof(offset));
+			memcpy(&length, message + UdevPropertiesLengthOffset, sizeof(length));
+			if (offset > size || length > size - offset) {
+				return false;
+			}
+			properties = std::string_view(message + offset, length);
+		}
+
+		std::string_view action;
+		std::string_view subsystem;
+		std::string_view deviceType;
+		std::string_view deviceName;
+		while (!properties.empty()) {
+			std::string_view property = properties.substr(0, properties.find('\0'));
+			properties.remove_prefix(std::min(properties.size(), property.size() + 1));
+			if (property.starts_with("ACTION=")) {
+				action = property.substr(7);
+			}
+			else if (property.starts_with("SUBSYSTEM=")) {
+				subsystem = property.substr(10);
+			}
+			else if (property.starts_with("DEVTYPE=")) {
+				deviceType = property.substr(8);
+			}
+			else if (property.starts_with("DEVNAME=")) {
+				deviceName = property.substr(8);
+			}
+		}
+
+		if (subsystem != "block" || deviceType != "disk" || deviceName.empty()) {
+			return false;
+		}
+		if (action == "add") {
+			kind = DeviceEventKind::Arrived;
+		}
+		else if (action == "remove") {
+			kind = DeviceEventKind::Removed;
+		}
+		else if (action == "change") {
+			kind = DeviceEventKind::Changed;
+		}
+		else {
+			return false;
+		}
+		// udev gives the full path, the kernel the name under /dev.
+		name = std::filesystem::path(deviceName).filename().string();
+		return true;
+	}
+
+private:
+	static constexpr uint32_t KernelGroup = 1;
+	static constexpr uint32_t UdevGroup = 2;
+	// Fields of udev's monitor header, after the "libudev\0" prefix, magic
+	// and header size.
+	static constexpr size_t UdevPropertiesOffsetOffset = 16;
+	static constexpr size_t UdevPropertiesLengthOffset = 20;
+	static constexpr size_t MaxMessageSize = 8192;
+
+	std::filesystem::path dev_;
+	bool udevEvents_ = false;
+	int socket_ = -1;
+	int stopEvent_ = -1;
+	char message_[MaxMessageSize];
+
+	// Only the kernel and root (udevd) are believed.
+	bool ReceiveEvent(DeviceEvent& event) {
+		sockaddr_nl sender = {};
+		iovec buffer = { message_, sizeof(message_) - 1 };
+		alignas(cmsghdr) char control[CMSG_SPACE(sizeof(ucred))];
+		msghdr header = {};
+		header.msg_name = &sender;
+		header.msg_namelen = sizeof(sender);
+		header.msg_iov = &buffer;
+		header.msg_iovlen = 1;
+		header.msg_control = control;
+		header.msg_controllen = sizeof(control);
+		ssize_t size = recvmsg(socket_, &header, 0);
+		if (size <= 0 || (header.msg_flags & MSG_TRUNC) != 0) {
+			return false;
+		}
+
+		cmsghdr* credentials = CMSG_FIRSTHDR(&header);
+		if (credentials == nullptr || credentials->cmsg_type != SCM_CREDENTIALS ||
+			((const ucred*)CMSG_DATA(credentials))->uid != 0) {
+			return false;
+		}
+		if (udevEvents_ ? sender.nl_pid == 0 : sender.nl_pid != 0) {
+			return false;
+		}
+
+		std::string name;
+		if (!ParseEvent(message_, (size_t)size, event.Kind, name)) {
+			return false;
+		}
+		event.DeviceId = (dev_ / name).wstring();
+		event.Time = DeviceEvent::Clock::now();
+		return true;
+	}
+};
+
+#endif
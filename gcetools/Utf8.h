@@ -0,0 +1,100 @@
+/* Copyright 2022 Google LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <string_view>
+
+// Conversions between DeviceIds (wide strings, UTF-16 on Windows and UTF-32
+// elsewhere) and the UTF-8 used on the wire and in files.
+
+inline void AppendUtf8(std::string& out, std::wstring_view value) {
+	for (size_t i = 0; i < value.size(); i++) {
+		uint32_t c = (uint32_t)value[i];
+		if (sizeof(wchar_t) == 2 && c >= 0xD800 && c <= 0xDBFF && i + 1 < value.size()) {
+			uint32_t low = (uint32_t)value[i + 1];
+			if (low >= 0xDC00 && low <= 0xDFFF) {
+				c = 0x10000 + ((c - 0xD800) << 10) + (low - 0xDC00);
+				i++;
+			}
+		}
+
+		if (c < 0x80) {
+			out += (char)c;
+		}
+		else if (c < 0x800) {
+			out += (char)(0xC0 | (c >> 6));
+			out += (char)(0x80 | (c & 0x3F));
+		}
+		else if (c < 0x10000) {
+			out += (char)(0xE0 | (c >> 12));
+			out += (char)(0x80 | ((c >> 6) & 0x3F));
+			out += (char)(0x80 | (c & 0x3F));
+		}
+		else {
+			out += (char)(0xF0 | (c >> 18));
+			out += (char)(0x80 | ((c >> 12) & 0x3F));
+			out += (char)(0x80 | ((c >> 6) & 0x3F));
+			out += (char)(0x80 | (c & 0x3F));
+		}
+	}
+}
+
+inline std::string ToUtf8(std::wstring_view value) {
+	std::string out;
+	out.reserve(value.size());
+	AppendUtf8(out, value);
+	return out;
+}
+
+// Malformed sequences are replaced with U+FFFD.
+inline std::wstring FromUtf8(std::string_view value) {
+	std::wstring out;
+	out.reserve(value.size());
+	for (size_t i = 0; i < value.size();) {
+		uint8_t lead = (uint8_t)value[i];
+		size_t length = lead < 0x80 ? 1 : (lead >> 5) == 0x6 ? 2 : (lead >> 4) == 0xE ? 3 : (lead >> 3) == 0x1E ? 4 : 0;
+		if (length == 0 || i + length > value.size()) {
+			out += (wchar_t)0xFFFD;
+			i++;
+			continue;
+		}
+
+		uint32_t c = length == 1 ? lead : lead & (0x7F >> length);
+		bool valid = true;
+		for (size_t j = 1; j < length; j++) {
+			uint8_t continuation = (uint8_t)value[i + j];
+			valid = valid && (continuation & 0xC0) == 0x80;
+			c = (c << 6) | (continuation & 0x3F);
+		}
+		if (!valid) {
+			out += (wchar_t)0xFFFD;
+			i++;
+			continue;
+		}
+		i += length;
+
+		if (sizeof(wchar_t) == 2 && c >= 0x10000) {
+			c -= 0x10000;
+			out += (wchar_t)(0xD800 + (c >> 10));
+			out += (wchar_t)(0xDC00 + (c & 0x3FF));
+		}
+		else {
+			out += (wchar_t)c;
+		}
+	}
+	return out;
+}
@@ -0,0 +1,318 @@
+/* Copyright 2022 Google LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#pragma once
+
+#include <algorithm>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <iterator>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <system_error>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+#include "DeviceBackend.h"
+#include "PhaseTimings.h"
+#include "StorageTypes.h"
+#include "Utf8.h"
+
+// A volume a disk's partitions (or the whole disk) hold, and where it is
+// mounted.
+struct DiskVolume {
+	// \\?\Volume{GUID}\ on Windows; the block device (/dev/sda1,
+	// /dev/mapper/vg-data) on Linux.
+	std::string Volume;
+	ULONGLONG Length = 0;
+	// Empty if the volume is not mounted, or its file system is unknown.
+	std::string FileSystem;
+	// Drive letters and mounted folders (C:\, D:\data\), or mount points.
+	std::vector<std::string> MountPoints;
+};
+
+// Every volume on the machine, read once, so that mapping many disks to
+// their volumes does not ask the OS about each one.
+class VolumeCatalog {
+public:
+	virtual ~VolumeCatalog() {
+	}
+
+	// The volumes on the given partition of a disk, or with a null
+	// partition, the volumes that take up the disk itself rather than one
+	// of its partitions.
+	virtual std::vector<DiskVolume> FindVolumes(const DevicePartitionLayout& disk, const DevicePartition* partition) const = 0;
+};
+
+// Volumes as Linux exports them: the block devices stacked on a partition
+// (device-mapper, md) are its holders in sysfs, and the topmost ones are its
+// volumes; a partition with no holders is a volume itself. Mounts are matched
+// to volumes by device number, from mountinfo. Reads only files, so it works
+// against a fixture tree too.
+class SysfsVolumeCatalog : public VolumeCatalog {
+public:
+	SysfsVolumeCatalog(std::filesystem::path sysfsRoot = "/sys",
+		const std::filesystem::path& mountInfo = "/proc/self/mountinfo", std::filesystem::path dev = "/dev")
+		: sysBlock_(std::move(sysfsRoot) / "block"), dev_(std::move(dev))
+	{
+		PhaseTimings::Scope phase("mountinfo read");
+		std::ifstream in(mountInfo);
+		std::string line;
+		while (std::getline(in, line)) {
+			ParseMountInfoLine(line);
+		}
+	}
+
+	std::vector<DiskVolume> FindVolumes(const DevicePartitionLayout& disk, const DevicePartition* partition) const override {
+		std::vector<DiskVolume> volumes;
+		if (disk.Device.empty() || (partition != nullptr && partition->Device.empty())) {
+			return volumes;
+		}
+		std::filesystem::path block = sysBlock_ / disk.Device;
+		if (partition != nullptr) {
+			CollectVolumes(block / partition->Device, partition->Device, /*isVolume=*/ true, 0, volumes);
+		}
+		else {
+			// A partitioned disk only holds a volume itself if something is
+			// stacked on it directly.
+			CollectVolumes(block, disk.Device, /*isVolume=*/ disk.Partitions.empty(), 0, volumes);
+		}
+		return volumes;
+	}
+
+private:
+	// Stacks deeper than this are assumed to be loops.
+	static constexpr int MaxHolderDepth = 8;
+	static constexpr ULONGLONG SectorSize = 512;
+
+	struct Mount {
+		std::string FileSystem;
+		std::vector<std::string> MountPoints;
+	};
+
+	std::filesystem::path sysBlock_;
+	std::filesystem::path dev_;
+	// Keyed by device number ("8:1").
+	std::unordered_map<std::string, Mount> mounts_;
+
+	// <id> <parent> <major:minor> <root> <mount point> <options> [<tag>...] - <fs type> <source> <super options>
+	void ParseMountInfoLine(std::string_view line) {
+		std::vector<std::string_view> fields;
+		while (!line.empty()) {
+			size_t end = line.find(' ');
+			fields.push_back(line.substr(0, end));
+			line.remove_prefix(end == std::string_view::npos ? line.size() : end + 1);
+		}
+		size_t separator = 6;
+		while (separator < fields.size() && fields[separator] != "-") {
+			separator++;
+		}
+		if (separator + 1 >= fields.size()) {
+			return;
+		}
+		Mount& mount = mounts_[std::string(fields[2])];
+		mount.FileSystem = fields[separator + 1];
+		mount.MountPoints.push_back(Unescape(fields[4]));
+	}
+
+	// Spaces, tabs, newlines and backslashes in mount points are written as
+	// octal escapes (\040).
+	static std::string Unescape(std::string_view value) {
+		std::string unescaped;
+		for (size_t i = 0; i < value.size(); i++) {
+			if (value[i] == '\\' && value.size() - i > 3) {
+				unescaped.push_back((char)strtoul(std::string(value.substr(i + 1, 3)).c_str(), nullptr, 8));
+				i += 3;
+			}
+			else {
+				unescaped.push_back(value[i]);
+			}
+		}
+		return unescaped;
+	}
+
+	void CollectVolumes(const std::filesystem::path& block, const std::string& name, bool isVolume, int depth,
+		std::vector<DiskVolume>& volumes) const {
+		std::vector<std::string> holders;
+		std::error_code err;
+		for (const std::filesystem::directory_entry& entry : std::filesystem::directory_iterator(block / "holders", err)) {
+			holders.push_back(entry.path().filename().string());
+		}
+		if (holders.empty() || depth == MaxHolderDepth) {
+			if (isVolume) {
+				volumes.push_back(ReadVolume(block, name));
+			}
+			return;
+		}
+		std::sort(holders.begin(), holders.end());
+		for (const std::string& holder : holders) {
+			CollectVolumes(sysBlock_ / holder, holder, /*isVolume=*/ true, depth + 1, volumes);
+		}
+	}
+
+	// Device-mapper volumes are named by their /dev/mapper link.
+	DiskVolume ReadVolume(const std::filesystem::path& block, const std::string& name) const {
+		DiskVolume volume;
+		std::string mapperName;
+		volume.Volume = (ReadAttribute(block / "dm" / "name", mapperName) ? dev_ / "mapper" / mapperName : dev_ / name).string();
+		std::string size;
+		if (ReadAttribute(block / "size", size)) {
+			volume.Length = strtoull(size.c_str(), nullptr, 10) * SectorSize;
+		}
+		std::string deviceNumber;
+		if (ReadAttribute(block / "dev", deviceNumber)) {
+			auto mount = mounts_.find(deviceNumber);
+			if (mount != mounts_.end()) {
+				volume.FileSystem = mount->second.FileSystem;
+				volume.MountPoints = mount->second.MountPoints;
+			}
+		}
+		return volume;
+	}
+
+	static bool ReadAttribute(const std::filesystem::path& path, std::string& value) {
+		std::ifstream in(path, std::ios::binary);
+		if (!in) {
+			return false;
+		}
+		value.assign(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+		value.erase(value.find_last_not_of(" \n") + 1);
+		return !value.empty();
+	}
+};
+
+#ifdef _WIN32
+
+// Volumes as Windows exports them: every volume's extents say which disks,
+// and where on them, it lies, so a volume belongs to the partition its extent
+// starts in. Enumerated once, with the mount manager's names for each.
+class Win32VolumeCatalog : public VolumeCatalog {
+public:
+	Win32VolumeCatalog() {
+		PhaseTimings::Scope phase("volume enumerate");
+		wchar_t volumeName[MAX_PATH];
+		HANDLE find = FindFirstVolumeW(volumeName, MAX_PATH);
+		if (find == INVALID_HANDLE_VALUE) {
+			return;
+		}
+		do {
+			ReadVolume(volumeName);
+		} while (FindNextVolumeW(find, volumeName, MAX_PATH));
+		FindVolumeClose(find);
+	}
+
+	std::vector<DiskVolume> FindVolumes(const DevicePartitionLayout& disk, const DevicePartition* partition) const override {
+		std::vector<DiskVolume> volumes;
+		for (const CatalogedVolume& cataloged : volumes_) {
+			for (const Extent& extent : cataloged.Extents) {
+				if (extent.DiskNumber != disk.DiskNumber) {
+					continue;
+				}
+				if (partition != nullptr ? Contains(*partition, extent.Offset) : !IsInAnyPartition(disk, extent.Offset)) {
+					volumes.push_back(cataloged.Volume);
+					break;
+				}
+			}
+		}
+		return volumes;
+	}
+
+private:
+	struct Extent {
+		DWORD DiskNumber;
+		ULONGLONG Offset;
+	};
+
+	struct CatalogedVolume {
+		DiskVolume Volume;
+		std::vector<Extent> Extents;
+	};
+
+	std::vector<CatalogedVolume> volumes_;
+
+	static bool Contains(const DevicePartition& partition, ULONGLONG offset) {
+		return offset >= partition.Offset && offset - partition.Offset < partition.Length;
+	}
+
+	static bool IsInAnyPartition(const DevicePartitionLayout& disk, ULONGLONG offset) {
+		for (const DevicePartition& partition : disk.Partitions) {
+			if (Contains(partition, offset)) {
+				return true;
+			}
+		}
+		return false;
+	}
+
+	// volumeName is \\?\Volume{GUID}\; the volume is opened without the
+	// trailing backslash. Volumes that cannot be opened (CD-ROM drives with
+	// no media) are skipped.
+	void ReadVolume(LPCWSTR volumeName) {
+		std::wstring devicePath = volumeName;
+		devicePath.pop_back();
+		HANDLE hVolume = CreateFileW(devicePath.c_str(), 0, FILE_SHARE_READ | FILE_SHARE_WRITE, nullptr, OPEN_EXISTING, 0, nullptr);
+		if (hVolume == INVALID_HANDLE_VALUE) {
+			return;
+		}
+		std::vector<BYTE> buffer(sizeof(VOLUME_DISK_EXTENTS) + 4 * sizeof(DISK_EXTENT));
+		DWORD written = 0;
+		BOOL ok;
+		while (!(ok = DeviceIoControl(hVolume, IOCTL_VOLUME_GET_VOLUME_DISK_EXTENTS, nullptr, 0, buffer.data(), (DWORD)buffer.size(), &written, nullptr)) &&
+			GetLastError() == ERROR_MORE_DATA) {
+			buffer.resize(buffer.size() * 2);
+		}
+		CloseHandle(hVolume);
+		if (!ok) {
+			return;
+		}
+
+		CatalogedVolume cataloged;
+		cataloged.Volume.Volume = ToUtf8(volumeName);
+		const VOLUME_DISK_EXTENTS* extents = (const VOLUME_DISK_EXTENTS*)buffer.data();
+		for (DWORD i = 0; i < extents->NumberOfDiskExtents; i++) {
+			const DISK_EXTENT& extent = extents->Extents[i];
+			cataloged.Extents.push_back(Extent{ extent.DiskNumber, (ULONGLONG)extent.StartingOffset.QuadPart });
+			cataloged.Volume.Length += (ULONGLONG)extent.ExtentLength.QuadPart;
+		}
+
+		std::vector<wchar_t> paths(MAX_PATH);
+		DWORD pathsLength = 0;
+		while (!GetVolumePathNamesForVolumeNameW(volumeName, paths.data(), (DWORD)paths.size(), &pathsLength) &&
+			GetLastError() == ERROR_MORE_DATA) {
+			paths.resize(pathsLength);
+		}
+		for (const wchar_t* path = paths.data(); *path != L'\0'; path += wcslen(path) + 1) {
+			cataloged.Volume.MountPoints.push_back(ToUtf8(path));
+		}
+
+		wchar_t fileSystem[MAX_PATH + 1];
+		if (!cataloged.Volume.MountPoints.empty() &&
+			GetVolumeInformationW(volumeName, nullptr, 0, nullptr, nullptr, nullptr, fileSystem, MAX_PATH + 1)) {
+			cataloged.Volume.FileSystem = ToUtf8(fileSystem);
+		}
+		volumes_.push_back(std::move(cataloged));
+	}
+};
+
+#endif
+
+// The volumes of the disks attached to this machine.
+inline std::unique_ptr<VolumeCatalog> CreateVolumeCatalog() {
+#ifdef _WIN32
+	return std::make_unique<Win32VolumeCatalog>();
+#else
+	return std::make_unique<SysfsVolumeCatalog>();
+#endif
+}
@@ -0,0 +1,258 @@
+/* Copyright 2022 Google LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#pragma once
+
+#ifdef _WIN32
+
+#include <algorithm>
+#include <cstring>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include "DeviceBackend.h"
+#include "PhaseTimings.h"
+#include "Utf8.h"
+
+#include <ntddscsi.h>
+
+// Issues queries to a device through a handle opened with CreateFile. The
+// handle is opened for overlapped I/O so that a request, whether a property
+// query or one of the disk driver's control codes, can be abandoned at the
+// deadline: it is cancelled, and if the driver does not complete it even
+// then, its buffers are leaked rather than freed under the pending request.
+// Otherwise the event and buffers of each query are reused by the next, so a
+// handle kept open for sampling does not allocate per query.
+class Win32DeviceBackend : public DeviceBackend {
+public:
+	Win32DeviceBackend(LPCWSTR deviceNamespace) {
+		hDevice_ = OpenDevice(deviceNamespace);
+	}
+	~Win32DeviceBackend() {
+		CloseHandle(hDevice_);
+	}
+
+	DWORD QueryProperty(const void* inputBuffer, DWORD inputBufferSize,
+		void* outputBuffer, DWORD outputBufferSize, DWORD* bytesReturned) override {
+		return Issue(IOCTL_STORAGE_QUERY_PROPERTY, inputBuffer, inputBufferSize, outputBuffer, outputBufferSize, bytesReturned);
+	}
+
+	// The port driver reports the adapter's port number (as in \\.\ScsiN:),
+	// StorNVMe included. The adapter's NUMA node and queues are not exposed
+	// through the disk.
+	bool GetQueueTopology(DeviceQueueTopology& topology) override {
+		SCSI_ADDRESS address = {};
+		if (IssueControl(IOCTL_SCSI_GET_ADDRESS, &address, sizeof(address)) != ERROR_SUCCESS) {
+			return false;
+		}
+		topology.Adapter = "Scsi" + std::to_string(address.PortNumber);
+		return true;
+	}
+
+	// The partition table comes from the disk driver, which grows it to
+	// fit; unused MBR slots are skipped.
+	bool GetPartitionLayout(DevicePartitionLayout& layout) override {
+		PhaseTimings::Scope phase("drive layout");
+		GET_LENGTH_INFORMATION length = {};
+		STORAGE_DEVICE_NUMBER deviceNumber = {};
+		if (IssueControl(IOCTL_DISK_GET_LENGTH_INFO, &length, sizeof(length)) != ERROR_SUCCESS ||
+			IssueControl(IOCTL_STORAGE_GET_DEVICE_NUMBER, &deviceNumber, sizeof(deviceNumber)) != ERROR_SUCCESS) {
+			return false;
+		}
+		layout.Length = (ULONGLONG)length.Length.QuadPart;
+		layout.DiskNumber = deviceNumber.DeviceNumber;
+
+		std::vector<BYTE> buffer(sizeof(DRIVE_LAYOUT_INFORMATION_EX) + 16 * sizeof(PARTITION_INFORMATION_EX));
+		DWORD err;
+		while ((err = IssueControl(IOCTL_DISK_GET_DRIVE_LAYOUT_EX, buffer.data(), (DWORD)buffer.size())) == ERROR_INSUFFICIENT_BUFFER) {
+			buffer.resize(buffer.size() * 2);
+		}
+		if (err != ERROR_SUCCESS) {
+			return false;
+		}
+		const DRIVE_LAYOUT_INFORMATION_EX* driveLayout = (const DRIVE_LAYOUT_INFORMATION_EX*)buffer.data();
+		for (DWORD i = 0; i < driveLayout->PartitionCount; i++) {
+			const PARTITION_INFORMATION_EX& entry = driveLayout->PartitionEntry[i];
+			if (entry.PartitionNumber == 0 || entry.PartitionLength.QuadPart == 0) {
+				continue;
+			}
+			DevicePartition partition;
+			partition.Number = entry.PartitionNumber;
+			partition.Offset = (ULONGLONG)entry.StartingOffset.QuadPart;
+			partition.Length = (ULONGLONG)entry.PartitionLength.QuadPart;
+			layout.Partitions.push_back(partition);
+		}
+		return true;
+	}
+
+	// The disk's device object (\Device\HarddiskN\DRm) is numbered afresh
+	// each time a disk is attached, and the numbers start again each boot,
+	// which the kernel's BootId counts.
+	bool GetAttachId(std::string& attachId) override {
+		STORAGE_DEVICE_NUMBER deviceNumber = {};
+		if (IssueControl(IOCTL_STORAGE_GET_DEVICE_NUMBER, &deviceNumber, sizeof(deviceNumber)) != ERROR_SUCCESS) {
+			return false;
+		}
+		std::wstring dosName = L"PhysicalDrive" + std::to_wstring(deviceNumber.DeviceNumber);
+		wchar_t target[MAX_PATH];
+		if (QueryDosDeviceW(dosName.c_str(), target, MAX_PATH) == 0) {
+			return false;
+		}
+
+		static const DWORD bootId = ReadBootId();
+		attachId = std::to_string(bootId);
+		attachId.push_back('/');
+		AppendUtf8(attachId, target);
+		return true;
+	}
+
+private:
+	// How long a cancelled query is given to complete before it is abandoned.
+	static constexpr DWORD CancelGraceMs = 100;
+
+	// A request handed to the driver, with buffers of its own so that it can
+	// outlive the caller's if it has to be abandoned.
+	struct PendingQuery {
+		PendingQuery() {
+			Overlapped.hEvent = CreateEventW(nullptr, /*bManualReset=*/ TRUE, /*bInitialState=*/ FALSE, nullptr);
+		}
+		~PendingQuery() {
+			if (Overlapped.hEvent != nullptr) {
+				CloseHandle(Overlapped.hEvent);
+			}
+		}
+
+		// Readies the query for a new request, keeping its event and the
+		// capacity of its buffers.
+		void Prepare(const void* input, DWORD inputSize, DWORD outputSize) {
+			HANDLE hEvent = Overlapped.hEvent;
+			Overlapped = {};
+			Overlapped.hEvent = hEvent;
+			ResetEvent(hEvent);
+			Input.assign((const BYTE*)input, (const BYTE*)input + inputSize);
+			Output.resize(outputSize);
+		}
+
+		OVERLAPPED Overlapped = {};
+		std::vector<BYTE> Input;
+		std::vector<BYTE> Output;
+	};
+
+	HANDLE hDevice_;
+	bool abandoned_ = false;
+	// The last query to complete, ready to be reused.
+	std::unique_ptr<PendingQuery> idleQuery_;
+
+	// Issues a control code that takes no input.
+	DWORD IssueControl(DWORD controlCode, void* output, DWORD outputSize) {
+		DWORD written = 0;
+		return Issue(controlCode, nullptr, 0, output, outputSize, &written);
+	}
+
+	// Issues a request and waits for it until the deadline, at which it is
+	// cancelled. A response that did not fit still comes with the bytes
+	// that did.
+	DWORD Issue(DWORD controlCode, const void* inputBuffer, DWORD inputBufferSize,
+		void* outputBuffer, DWORD outputBufferSize, DWORD* bytesReturned) {
+		*bytesReturned = 0;
+		if (abandoned_) {
+			// An earlier request never completed; the device is not answering.
+			return ERROR_TIMEOUT;
+		}
+
+		std::unique_ptr<PendingQuery> query = std::move(idleQuery_);
+		if (!query) {
+			query = std::make_unique<PendingQuery>();
+			if (query->Overlapped.hEvent == nullptr) {
+				return GetLastError();
+			}
+		}
+		query->Prepare(inputBuffer, inputBufferSize, outputBufferSize);
+
+		BOOL ok = DeviceIoControl(hDevice_,
+			/*dwIoControlCode=*/ controlCode,
+			/*lpInBuffer=*/ query->Input.data(),
+			/*nInBufferSize=*/ inputBufferSize,
+			/*lpOutBuffer=*/ query->Output.data(),
+			/*nOutBufferSize=*/ outputBufferSize,
+			/*lpBytesReturned=*/ nullptr,
+			/*lpOverlapped=*/ &query->Overlapped);
+		DWORD err = ok ? ERROR_SUCCESS : GetLastError();
+		if (err != ERROR_SUCCESS && err != ERROR_IO_PENDING && err != ERROR_MORE_DATA) {
+			idleQuery_ = std::move(query);
+			return err;
+		}
+
+		if (err == ERROR_IO_PENDING && !WaitForQuery(*query)) {
+			CancelIoEx(hDevice_, &query->Overlapped);
+			if (WaitForSingleObject(query->Overlapped.hEvent, CancelGraceMs) != WAIT_OBJECT_0) {
+				// The driver still owns the buffers and the event.
+				query.release();
+				abandoned_ = true;
+				return ERROR_TIMEOUT;
+			}
+		}
+
+		DWORD written = 0;
+		err = GetOverlappedResult(hDevice_, &query->Overlapped, &written, /*bWait=*/ FALSE) ? ERROR_SUCCESS : GetLastError();
+		if (err == ERROR_SUCCESS || err == ERROR_MORE_DATA) {
+			written = std::min(written, outputBufferSize);
+			memcpy(outputBuffer, query->Output.data(), written);
+			*bytesReturned = written;
+		}
+		idleQuery_ = std::move(query);
+		return err == ERROR_OPERATION_ABORTED ? ERROR_TIMEOUT : err;
+	}
+
+	// 0 if the registry does not say.
+	static DWORD ReadBootId() {
+		DWORD bootId = 0;
+		DWORD size = sizeof(bootId);
+		RegGetValueW(HKEY_LOCAL_MACHINE, L"SYSTEM\\CurrentControlSet\\Control\\Session Manager\\Memory Management\\PrefetchParameters",
+			L"BootId", RRF_RT_REG_DWORD, nullptr, &bootId, &size);
+		return bootId;
+	}
+
+	// Returns false if the deadline passed first.
+	bool WaitForQuery(const PendingQuery& query) const {
+		DWORD timeoutMs = HasDeadline() ? (DWORD)std::min<long long>(GetTimeRemaining().count(), INFINITE - 1) : INFINITE;
+		return WaitForSingleObject(query.Overlapped.hEvent, timeoutMs) == WAIT_OBJECT_0;
+	}
+
+	HANDLE OpenDevice(LPCWSTR deviceNamespace) {
+		HANDLE hDevice = CreateFile(deviceNamespace,
+			/*dwDesiredAccess=*/ GENERIC_READ | GENERIC_WRITE,
+			/*dwShareMode=*/ FILE_SHARE_READ,
+			/*lpSecurityAttributes=*/ 0,
+			/*dwCreationDisposition=*/ OPEN_EXISTING,
+			/*dwFlagsAndAttributes=*/ FILE_FLAG_OVERLAPPED,
+			/*hTemplateFile=*/ 0);
+
+		if (hDevice == INVALID_HANDLE_VALUE) {
+			DWORD err = GetLastError();
+
+			switch (err) {
+			case ERROR_ACCESS_DENIED:
+				throw std::runtime_error("Access denied while attempting to get device handle. Did you run as administrator?");
+			default:
+				throw std::runtime_error("Failed to get device handle. Error code: " + std::to_string(err));
+			}
+		}
+
+		return hDevice;
+	}
+};
+
+#endif
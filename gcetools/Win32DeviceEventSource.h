@@ -0,0 +1,107 @@
+/* Copyright 2022 Google LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#pragma once
+
+#ifdef _WIN32
+
+#include <cwctype>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+#include "DeviceEvents.h"
+#include "PhysicalDriveEnumerator.h"
+#include "StorageTypes.h"
+
+#include <cfgmgr32.h>
+
+#pragma comment(lib, "cfgmgr32.lib")
+
+// Reports disks arriving and going away through device interface
+// notifications for GUID_DEVINTERFACE_DISK. An arriving interface is opened to
+// learn its \\.\PHYSICALDRIVE number; a departing one can no longer be opened,
+// so the number each interface had is remembered from its arrival, or from
+// the enumeration when the source was created.
+class Win32DeviceEventSource : public DeviceEventQueue {
+public:
+	Win32DeviceEventSource() {
+		for (const auto& [devicePath, deviceNumber] : PhysicalDriveEnumerator::EnumerateDiskInterfaces()) {
+			deviceNumbers_[Normalize(devicePath.c_str())] = deviceNumber;
+		}
+
+		CM_NOTIFY_FILTER filter = {};
+		filter.cbSize = sizeof(filter);
+		filter.FilterType = CM_NOTIFY_FILTER_TYPE_DEVICEINTERFACE;
+		filter.u.DeviceInterface.ClassGuid = PhysicalDriveEnumerator::DiskInterfaceGuid;
+		CONFIGRET result = CM_Register_Notification(&filter, this, &Win32DeviceEventSource::OnNotification, &notification_);
+		if (result != CR_SUCCESS) {
+			throw std::runtime_error("CM_Register_Notification failed. Error code: " + std::to_string(result));
+		}
+	}
+	Win32DeviceEventSource(const Win32DeviceEventSource&) = delete;
+	Win32DeviceEventSource& operator=(const Win32DeviceEventSource&) = delete;
+	~Win32DeviceEventSource() {
+		// Waits for any notification callback in progress.
+		CM_Unregister_Notification(notification_);
+	}
+
+private:
+	HCMNOTIFICATION notification_ = nullptr;
+	std::mutex mutex_;
+	// Keyed by lower-cased device interface path, since notifications and
+	// SetupAPI do not agree on its case.
+	std::unordered_map<std::wstring, DWORD> deviceNumbers_;
+
+	static std::wstring Normalize(LPCWSTR devicePath) {
+		std::wstring normalized = devicePath;
+		for (wchar_t& c : normalized) {
+			c = (wchar_t)std::towlower(c);
+		}
+		return normalized;
+	}
+
+	// Runs on a system thread pool thread, one notification at a time.
+	static DWORD CALLBACK OnNotification(HCMNOTIFICATION notification, PVOID context, CM_NOTIFY_ACTION action,
+		PCM_NOTIFY_EVENT_DATA eventData, DWORD eventDataSize) {
+		Win32DeviceEventSource* source = (Win32DeviceEventSource*)context;
+		LPCWSTR devicePath = eventData->u.DeviceInterface.SymbolicLink;
+		if (action == CM_NOTIFY_ACTION_DEVICEINTERFACEARRIVAL) {
+			DWORD deviceNumber;
+			if (PhysicalDriveEnumerator::GetDeviceNumber(devicePath, &deviceNumber)) {
+				{
+					std::lock_guard<std::mutex> lock(source->mutex_);
+					source->deviceNumbers_[Normalize(devicePath)] = deviceNumber;
+				}
+				source->Push(DeviceEventKind::Arrived, PhysicalDriveEnumerator::GetDeviceId(deviceNumber));
+			}
+		}
+		else if (action == CM_NOTIFY_ACTION_DEVICEINTERFACEREMOVAL) {
+			DWORD deviceNumber;
+			{
+				std::lock_guard<std::mutex> lock(source->mutex_);
+				auto it = source->deviceNumbers_.find(Normalize(devicePath));
+				if (it == source->deviceNumbers_.end()) {
+					return ERROR_SUCCESS;
+				}
+				deviceNumber = it->second;
+				source->deviceNumbers_.erase(it);
+			}
+			source->Push(DeviceEventKind::Removed, PhysicalDriveEnumerator::GetDeviceId(deviceNumber));
+		}
+		return ERROR_SUCCESS;
+	}
+};
+
+#endif
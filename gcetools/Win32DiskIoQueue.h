@@ -0,0 +1,139 @@
+/* Copyright 2022 Google LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#pragma once
+
+#ifdef _WIN32
+
+#include <filesystem>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include "DiskIoQueue.h"
+
+#include <windows.h>
+#include <winioctl.h>
+
+// Reads and writes a disk (\\.\PHYSICALDRIVEn) or file opened without
+// buffering, with overlapped requests completed through an I/O completion
+// port.
+class Win32DiskIoQueue : public DiskIoQueue {
+public:
+	Win32DiskIoQueue(const std::filesystem::path& path, size_t queueDepth, size_t blockSize, bool write)
+		: DiskIoQueue(queueDepth, blockSize), overlapped_(queueDepth)
+	{
+		hFile_ = CreateFileW(path.c_str(),
+			/*dwDesiredAccess=*/ GENERIC_READ | (write ? GENERIC_WRITE : 0),
+			/*dwShareMode=*/ FILE_SHARE_READ | FILE_SHARE_WRITE,
+			/*lpSecurityAttributes=*/ 0,
+			/*dwCreationDisposition=*/ OPEN_EXISTING,
+			/*dwFlagsAndAttributes=*/ FILE_FLAG_NO_BUFFERING | FILE_FLAG_WRITE_THROUGH | FILE_FLAG_OVERLAPPED,
+			/*hTemplateFile=*/ 0);
+		if (hFile_ == INVALID_HANDLE_VALUE) {
+			DWORD err = GetLastError();
+			if (err == ERROR_ACCESS_DENIED) {
+				throw std::runtime_error("Access denied while attempting to open " + path.string() + ". Did you run as administrator?");
+			}
+			throw std::runtime_error("Failed to open " + path.string() + ". Error code: " + std::to_string(err));
+		}
+
+		port_ = CreateIoCompletionPort(hFile_, nullptr, /*CompletionKey=*/ 0, /*NumberOfConcurrentThreads=*/ 1);
+		if (port_ == nullptr) {
+			DWORD err = GetLastError();
+			CloseHandle(hFile_);
+			throw std::runtime_error("Failed to create an I/O completion port. Error code: " + std::to_string(err));
+		}
+	}
+	~Win32DiskIoQueue() {
+		// Closing the handle cancels whatever is still outstanding, but the
+		// buffers must outlive the requests.
+		CancelIoEx(hFile_, nullptr);
+		for (; outstanding_ > 0; outstanding_--) {
+			DWORD transferred;
+			ULONG_PTR key;
+			OVERLAPPED* overlapped;
+			if (!GetQueuedCompletionStatus(port_, &transferred, &key, &overlapped, INFINITE) && overlapped == nullptr) {
+				break;
+			}
+		}
+		CloseHandle(port_);
+		CloseHandle(hFile_);
+	}
+
+	uint64_t GetSize() override {
+		GET_LENGTH_INFORMATION length = {};
+		DWORD bytesReturned = 0;
+		OVERLAPPED overlapped = {};
+		overlapped.hEvent = CreateEventW(nullptr, /*bManualReset=*/ TRUE, /*bInitialState=*/ FALSE, nullptr);
+		// Setting the low bit of the event keeps the completion off the port.
+		overlapped.hEvent = (HANDLE)((ULONG_PTR)overlapped.hEvent | 1);
+		BOOL ok = DeviceIoControl(hFile_, IOCTL_DISK_GET_LENGTH_INFO, nullptr, 0, &length, sizeof(length), &bytesReturned, &overlapped);
+		if (!ok && GetLastError() == ERROR_IO_PENDING) {
+			ok = GetOverlappedResult(hFile_, &overlapped, &bytesReturned, /*bWait=*/ TRUE);
+		}
+		CloseHandle((HANDLE)((ULONG_PTR)overlapped.hEvent & ~(ULONG_PTR)1));
+		if (ok) {
+			return (uint64_t)length.Length.QuadPart;
+		}
+
+		// Not a disk.
+		LARGE_INTEGER size = {};
+		if (!GetFileSizeEx(hFile_, &size)) {
+			throw std::runtime_error("Failed to get the size of the disk. Error code: " + std::to_string(GetLastError()));
+		}
+		return (uint64_t)size.QuadPart;
+	}
+
+	bool IsUnbuffered() const override {
+		return true;
+	}
+
+	void Submit(size_t buffer, bool write, uint64_t offset) override {
+		OVERLAPPED& overlapped = overlapped_[buffer];
+		overlapped = {};
+		overlapped.Offset = (DWORD)offset;
+		overlapped.OffsetHigh = (DWORD)(offset >> 32);
+		BOOL ok = write
+			? WriteFile(hFile_, GetBuffer(buffer), (DWORD)blockSize_, nullptr, &overlapped)
+			: ReadFile(hFile_, GetBuffer(buffer), (DWORD)blockSize_, nullptr, &overlapped);
+		// Requests that complete at once are still queued to the port.
+		if (!ok && GetLastError() != ERROR_IO_PENDING) {
+			throw std::runtime_error(std::string(write ? "Write" : "Read") + " failed. Error code: " + std::to_string(GetLastError()));
+		}
+		outstanding_++;
+	}
+
+	size_t WaitForCompletion() override {
+		DWORD transferred = 0;
+		ULONG_PTR key = 0;
+		OVERLAPPED* overlapped = nullptr;
+		BOOL ok = GetQueuedCompletionStatus(port_, &transferred, &key, &overlapped, INFINITE);
+		if (overlapped == nullptr) {
+			throw std::runtime_error("Failed to wait for I/O. Error code: " + std::to_string(GetLastError()));
+		}
+		outstanding_--;
+		if (!ok || transferred != blockSize_) {
+			throw std::runtime_error("I/O failed. Error code: " + std::to_string(ok ? ERROR_HANDLE_EOF : GetLastError()));
+		}
+		return overlapped - overlapped_.data();
+	}
+
+private:
+	HANDLE hFile_;
+	HANDLE port_;
+	std::vector<OVERLAPPED> overlapped_;
+	size_t outstanding_ = 0;
+};
+
+#endif
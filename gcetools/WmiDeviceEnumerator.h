@@ -0,0 +1,227 @@
+/* Copyright 2022 Google LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#pragma once
+
+#ifdef _WIN32
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include "DeviceEnumerator.h"
+#include "OperationMetrics.h"
+#include "PhaseTimings.h"
+#include "StorageTypes.h"
+
+#include <comdef.h>
+#include <Wbemidl.h>
+
+#pragma comment(lib, "wbemuuid.lib")
+
+// Lists every Win32_DiskDrive through WMI. Setting up COM and connecting to
+// WMI dominates a cold start, so this is only the fallback enumerator.
+class WmiDeviceEnumerator : public DeviceEnumerator {
+public:
+	const char* GetName() const override {
+		return "WMI";
+	}
+
+	std::vector<std::wstring> EnumerateDeviceIds() override {
+		HRESULT hres;
+		std::vector<std::wstring> devices;
+
+		PhaseTimings::Scope phase("COM init");
+		OperationMetrics::Scope metrics(DeviceOperation::ComInit);
+
+		// Step 1: --------------------------------------------------
+		// Initialize COM. ------------------------------------------
+
+		hres = CoInitializeEx(0, COINIT_MULTITHREADED);
+		if (FAILED(hres))
+		{
+			std::cerr << "Failed to initialize COM library. Error code = 0x"
+				<< std::hex << hres << std::endl;
+			metrics.Fail();
+			return devices;//return 1;                  // Program has failed.
+		}
+
+		// Step 2: --------------------------------------------------
+		// Set general COM security levels --------------------------
+
+		hres = CoInitializeSecurity(
+			NULL,
+			-1,                          // COM authentication
+			NULL,                        // Authentication services
+			NULL,                        // Reserved
+			RPC_C_AUTHN_LEVEL_DEFAULT,   // Default authentication
+			RPC_C_IMP_LEVEL_IMPERSONATE, // Default Impersonation
+			NULL,                        // Authentication info
+			EOAC_NONE,                   // Additional capabilities
+			NULL                         // Reserved
+		);
+
+
+		if (FAILED(hres))
+		{
+			std::cerr << "Failed to initialize security. Error code = 0x"
+				<< std::hex << hres << std::endl;
+			CoUninitialize();
+			metrics.Fail();
+			return devices;//return 1;                    // Program has failed.
+		}
+
+		phase.Next("WMI connect");
+		metrics.Next(DeviceOperation::WmiConnect);
+
+		// Step 3: ---------------------------------------------------
+		// Obtain the initial locator to WMI -------------------------
+
+		IWbemLocator* pLoc = NULL;
+
+		hres = CoCreateInstance(
+			CLSID_WbemLocator,
+			0,
+			CLSCTX_INPROC_SERVER,
+			IID_IWbemLocator, (LPVOID*)&pLoc);
+
+		if (FAILED(hres))
+		{
+			std::cerr << "Failed to create IWbemLocator object."
+				<< " Err code = 0x"
+				<< std::hex << hres << std::endl;
+			CoUninitialize();
+			metrics.Fail();
+			return devices;//return 1;                 // Program has failed.
+		}
+
+		// Step 4: -----------------------------------------------------
+		// Connect to WMI through the IWbemLocator::ConnectServer method
+
+		IWbemServices* pSvc = NULL;
+
+		// Connect to the root\cimv2 namespace with
+		// the current user and obtain pointer pSvc
+		// to make IWbemServices calls.
+		hres = pLoc->ConnectServer(
+			_bstr_t(L"ROOT\\CIMV2"), // Object path of WMI namespace
+			NULL,                    // User name. NULL = current user
+			NULL,                    // User password. NULL = current
+			0,                       // Locale. NULL indicates current
+			NULL,                    // Security flags.
+			0,                       // Authority (for example, Kerberos)
+			0,                       // Context object
+			&pSvc                    // pointer to IWbemServices proxy
+		);
+
+		if (FAILED(hres))
+		{
+			std::cerr << "Could not connect. Error code = 0x"
+				<< std::hex << hres << std::endl;
+			pLoc->Release();
+			CoUninitialize();
+			metrics.Fail();
+			return devices;//return 1;                // Program has failed.
+		}
+
+		// Step 5: --------------------------------------------------
+		// Set security levels on the proxy -------------------------
+
+		hres = CoSetProxyBlanket(
+			pSvc,                        // Indicates the proxy to set
+			RPC_C_AUTHN_WINNT,           // RPC_C_AUTHN_xxx
+			RPC_C_AUTHZ_NONE,            // RPC_C_AUTHZ_xxx
+			NULL,                        // Server principal name
+			RPC_C_AUTHN_LEVEL_CALL,      // RPC_C_AUTHN_LEVEL_xxx
+			RPC_C_IMP_LEVEL_IMPERSONATE, // RPC_C_IMP_LEVEL_xxx
+			NULL,                        // client identity
+			EOAC_NONE                    // proxy capabilities
+		);
+
+		if (FAILED(hres))
+		{
+			std::cerr << "Could not set proxy blanket. Error code = 0x"
+				<< std::hex << hres << std::endl;
+			pSvc->Release();
+			pLoc->Release();
+			CoUninitialize();
+			metrics.Fail();
+			return devices;//return 1;               // Program has failed.
+		}
+
+		phase.Next("WMI query");
+		metrics.Next(DeviceOperation::WmiQuery);
+
+		// Step 6: --------------------------------------------------
+		// Use the IWbemServices pointer to make requests of WMI ----
+
+		// For example, get the name of the operating system
+		IEnumWbemClassObject* pEnumerator = NULL;
+		hres = pSvc->ExecQuery(
+			bstr_t("WQL"),
+			bstr_t("SELECT * FROM Win32_DiskDrive"),
+			WBEM_FLAG_FORWARD_ONLY | WBEM_FLAG_RETURN_IMMEDIATELY,
+			NULL,
+			&pEnumerator);
+
+		if (FAILED(hres))
+		{
+			std::cerr << "Query for operating system name failed."
+				<< " Error code = 0x"
+				<< std::hex << hres << std::endl;
+			pSvc->Release();
+			pLoc->Release();
+			CoUninitialize();
+			metrics.Fail();
+			return devices;//return 1;               // Program has failed.
+		}
+
+		// Step 7: -------------------------------------------------
+		// Get the data from the query in step 6 -------------------
+
+		IWbemClassObject* pclsObj = NULL;
+		ULONG uReturn = 0;
+
+		while (pEnumerator)
+		{
+			HRESULT hr = pEnumerator->Next(WBEM_INFINITE, 1,
+				&pclsObj, &uReturn);
+
+			if (0 == uReturn)
+			{
+				break;
+			}
+
+			VARIANT vtProp;
+
+			VariantInit(&vtProp);
+			// Get the value of the Name property
+			hr = pclsObj->Get(L"DeviceID", 0, &vtProp, 0, 0);
+			devices.emplace_back(vtProp.bstrVal);
+			VariantClear(&vtProp);
+
+			pclsObj->Release();
+		}
+
+		// Cleanup
+		// ========
+
+		pSvc->Release();
+		pLoc->Release();
+		pEnumerator->Release();
+		CoUninitialize();
+		return devices;
+	}
+};
+
+#endif
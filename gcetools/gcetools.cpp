@@ -12,208 +12,1353 @@
  * See the License for the specific language governing permissions and
  * limitations under the License.
  */
+#define _WIN32_DCOM
 #include "gcetools.h"
+#include "DeviceEnumerator.h"
+#include "DeviceEvents.h"
+#include "DeviceNameCache.h"
+#include "DeviceResolver.h"
+#include "DeviceTrace.h"
+#include "DeviceTraceRecorder.h"
+#include "DeviceTraceReplay.h"
+#include "DeviceWatcher.h"
+#include "DiskLayout.h"
+#include "DiskMapService.h"
+#include "DiskProbe.h"
+#include "DiskSnapshot.h"
+#include "DiskSnapshotDiff.h"
+#include "DiskTopology.h"
 #include "GoogleStorageDevice.h"
+#include "LinuxDeviceBackend.h"
+#include "LocalSocket.h"
+#include "NvmeHealthCollector.h"
+#include "OperationMetrics.h"
+#include "PhaseTimings.h"
+#include "PhysicalDriveEnumerator.h"
+#include "ResolutionWriter.h"
+#include "SimulatedDeviceBackend.h"
+#include "SimulatedHotplug.h"
+#include "SimulatedLinuxDevices.h"
 #include "StorageDevice.h"
+#include "SysBlockDeviceEnumerator.h"
+#include "UeventDeviceEventSource.h"
+#include "Utf8.h"
+#include "VolumeCatalog.h"
+#include "Win32DeviceBackend.h"
+#include "Win32DeviceEventSource.h"
+#include "WmiDeviceEnumerator.h"
 
-#define _WIN32_DCOM
-#include <comdef.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <iostream>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+#ifdef _WIN32
 #include <fileapi.h>
 #include <nvme.h>
-#include <vector>
-#include <Wbemidl.h>
 #include <windows.h>
 #include <winioctl.h>
 #include <winnt.h>
-#include <iostream>
-
-#pragma comment(lib, "wbemuuid.lib")
+#else
+#include <unistd.h>
+#endif
 
 const char* PhysicalDrivePrefix = "\\\\.\\PHYSICALDRIVE";
 
-int main()
+// Names are looked up by probing \\.\PHYSICALDRIVE0 upwards, which is far
+// cheaper than enumerating the disks through WMI. Windows numbers disks from
+// 0 with few gaps, and a GCE VM has at most 128 persistent disks plus its
+// local SSDs.
+const unsigned int MaxPhysicalDriveProbe = 256;
+
+int main(int argc, char* argv[])
 {
-    std::vector<BSTR> deviceIds = GetAllPhysicalDeviceIds();
-    
-    for (int i = 0; i < deviceIds.size(); i++) {
-        GoogleStorageDevice device(deviceIds[i]);
-        std::cout << device.GetDeviceName() << std::endl;
-    }
-    
-    return 0;   // Program successfully completed.
-}
-
-std::vector<BSTR> GetAllPhysicalDeviceIds() {
-    HRESULT hres;
-    std::vector<BSTR> devices;
-
-    // Step 1: --------------------------------------------------
-    // Initialize COM. ------------------------------------------
-
-    hres = CoInitializeEx(0, COINIT_MULTITHREADED);
-    if (FAILED(hres))
-    {
-        std::cout << "Failed to initialize COM library. Error code = 0x"
-            << std::hex << hres << std::endl;
-        return devices;//return 1;                  // Program has failed.
-    }
-
-    // Step 2: --------------------------------------------------
-    // Set general COM security levels --------------------------
-
-    hres = CoInitializeSecurity(
-        NULL,
-        -1,                          // COM authentication
-        NULL,                        // Authentication services
-        NULL,                        // Reserved
-        RPC_C_AUTHN_LEVEL_DEFAULT,   // Default authentication
-        RPC_C_IMP_LEVEL_IMPERSONATE, // Default Impersonation
-        NULL,                        // Authentication info
-        EOAC_NONE,                   // Additional capabilities
-        NULL                         // Reserved
-    );
-
-
-    if (FAILED(hres))
-    {
-        std::cout << "Failed to initialize security. Error code = 0x"
-            << std::hex << hres << std::endl;
-        CoUninitialize();
-        return devices;//return 1;                    // Program has failed.
-    }
-
-    // Step 3: ---------------------------------------------------
-    // Obtain the initial locator to WMI -------------------------
-
-    IWbemLocator* pLoc = NULL;
-
-    hres = CoCreateInstance(
-        CLSID_WbemLocator,
-        0,
-        CLSCTX_INPROC_SERVER,
-        IID_IWbemLocator, (LPVOID*)&pLoc);
-
-    if (FAILED(hres))
-    {
-        std::cout << "Failed to create IWbemLocator object."
-            << " Err code = 0x"
-            << std::hex << hres << std::endl;
-        CoUninitialize();
-        return devices;//return 1;                 // Program has failed.
-    }
-
-    // Step 4: -----------------------------------------------------
-    // Connect to WMI through the IWbemLocator::ConnectServer method
-
-    IWbemServices* pSvc = NULL;
-
-    // Connect to the root\cimv2 namespace with
-    // the current user and obtain pointer pSvc
-    // to make IWbemServices calls.
-    hres = pLoc->ConnectServer(
-        _bstr_t(L"ROOT\\CIMV2"), // Object path of WMI namespace
-        NULL,                    // User name. NULL = current user
-        NULL,                    // User password. NULL = current
-        0,                       // Locale. NULL indicates current
-        NULL,                    // Security flags.
-        0,                       // Authority (for example, Kerberos)
-        0,                       // Context object
-        &pSvc                    // pointer to IWbemServices proxy
-    );
-
-    if (FAILED(hres))
-    {
-        std::cout << "Could not connect. Error code = 0x"
-            << std::hex << hres << std::endl;
-        pLoc->Release();
-        CoUninitialize();
-        return devices;//return 1;                // Program has failed.
-    }
-
-    std::cout << "Connected to ROOT\\CIMV2 WMI namespace" << std::endl;
-
-
-    // Step 5: --------------------------------------------------
-    // Set security levels on the proxy -------------------------
-
-    hres = CoSetProxyBlanket(
-        pSvc,                        // Indicates the proxy to set
-        RPC_C_AUTHN_WINNT,           // RPC_C_AUTHN_xxx
-        RPC_C_AUTHZ_NONE,            // RPC_C_AUTHZ_xxx
-        NULL,                        // Server principal name
-        RPC_C_AUTHN_LEVEL_CALL,      // RPC_C_AUTHN_LEVEL_xxx
-        RPC_C_IMP_LEVEL_IMPERSONATE, // RPC_C_IMP_LEVEL_xxx
-        NULL,                        // client identity
-        EOAC_NONE                    // proxy capabilities
-    );
-
-    if (FAILED(hres))
-    {
-        std::cout << "Could not set proxy blanket. Error code = 0x"
-            << std::hex << hres << std::endl;
-        pSvc->Release();
-        pLoc->Release();
-        CoUninitialize();
-        return devices;//return 1;               // Program has failed.
-    }
-
-    // Step 6: --------------------------------------------------
-    // Use the IWbemServices pointer to make requests of WMI ----
-
-    // For example, get the name of the operating system
-    IEnumWbemClassObject* pEnumerator = NULL;
-    hres = pSvc->ExecQuery(
-        bstr_t("WQL"),
-        bstr_t("SELECT * FROM Win32_DiskDrive"),
-        WBEM_FLAG_FORWARD_ONLY | WBEM_FLAG_RETURN_IMMEDIATELY,
-        NULL,
-        &pEnumerator);
-
-    if (FAILED(hres))
-    {
-        std::cout << "Query for operating system name failed."
-            << " Error code = 0x"
-            << std::hex << hres << std::endl;
-        pSvc->Release();
-        pLoc->Release();
-        CoUninitialize();
-        return devices;//return 1;               // Program has failed.
-    }
-
-    // Step 7: -------------------------------------------------
-    // Get the data from the query in step 6 -------------------
-
-    IWbemClassObject* pclsObj = NULL;
-    ULONG uReturn = 0;
-
-    while (pEnumerator)
-    {
-        HRESULT hr = pEnumerator->Next(WBEM_INFINITE, 1,
-            &pclsObj, &uReturn);
-
-        if (0 == uReturn)
-        {
-            break;
+    GceToolsOptions options;
+    if (!ParseOptions(argc, argv, &options)) {
+        PrintUsage();
+        return 1;
+    }
+
+    PhaseTimings::SetEnabled(options.PrintTiming);
+    OperationMetrics::SetEnabled(options.Metrics != MetricsFormat::None);
+
+    // Prints the metrics however main() returns.
+    struct MetricsOnExit {
+        MetricsFormat Format;
+        ~MetricsOnExit() {
+            PrintMetrics(Format);
+        }
+    } metricsOnExit{ options.Metrics };
+
+    if (!options.DiffBefore.empty()) {
+        return DiffSnapshots(options);
+    }
+
+    std::unique_ptr<DeviceEnumerator> enumerator;
+    DeviceBackendFactory backendFactory;
+
+    // Disks are looked up by name by probing \\.\PHYSICALDRIVEn, except
+    // through the Linux backend where listing /sys/block is cheap.
+    bool probePhysicalDrives = true;
+
+    // Set when watching simulated disks being attached and detached.
+    SimulatedHotplug* hotplug = nullptr;
+
+    // The volumes of the disks being mapped, where there are any to read.
+    std::function<std::unique_ptr<VolumeCatalog>()> createVolumeCatalog = [] {
+        return std::unique_ptr<VolumeCatalog>();
+    };
+
+    if (options.SimulatedDeviceCount > 0) {
+        auto simulatedDevices = std::make_unique<SimulatedDeviceSet>(options.SimulatedDeviceCount, options.SimulatedLatency,
+            options.SimulatedNamespaceCount);
+        for (size_t index : options.SimulatedSlowDevices) {
+            if (index < options.SimulatedDeviceCount) {
+                simulatedDevices->SetDiskLatency(index, options.SimulatedSlowLatency);
+            }
+        }
+        for (size_t index : options.SimulatedHungDevices) {
+            if (index < options.SimulatedDeviceCount) {
+                simulatedDevices->SetDiskLatency(index, SimulatedDisk::HungLatency);
+            }
+        }
+#ifdef __linux__
+        if (options.SimulateLinux) {
+            auto linuxDevices = std::make_unique<SimulatedLinuxDeviceSet>(*simulatedDevices, options.SimulatedLatency);
+            backendFactory = linuxDevices->GetBackendFactory(options.UseSysfs);
+            createVolumeCatalog = [root = linuxDevices->GetSysfsRoot(), mountInfo = linuxDevices->GetMountInfoPath()] {
+                return std::make_unique<SysfsVolumeCatalog>(root, mountInfo);
+            };
+            enumerator = std::move(linuxDevices);
+            probePhysicalDrives = false;
+        }
+        else
+#endif
+        if (options.SimulatedHotplugCount > 0) {
+            auto hotplugDevices = std::make_unique<SimulatedHotplug>(*simulatedDevices, options.SimulatedLatency);
+            hotplug = hotplugDevices.get();
+            backendFactory = hotplugDevices->GetBackendFactory();
+            enumerator = std::move(hotplugDevices);
+        }
+        else {
+            backendFactory = simulatedDevices->GetBackendFactory();
+            enumerator = std::move(simulatedDevices);
+        }
+    }
+    else if (!options.ReplayTrace.empty()) {
+        DeviceTrace trace;
+        try {
+            trace = DeviceTrace::Load(options.ReplayTrace);
+            if (options.SynthesizedDeviceCount > 0) {
+                trace = DeviceTraceReplay::Synthesize(trace, options.SynthesizedDeviceCount);
+            }
+        }
+        catch (const std::exception& e) {
+            std::cerr << e.what() << std::endl;
+            return 1;
+        }
+        auto replay = std::make_unique<DeviceTraceReplay>(std::move(trace));
+        backendFactory = replay->GetBackendFactory(options.ReplayLatency);
+        enumerator = std::move(replay);
+        probePhysicalDrives = false;
+    }
+    else {
+        enumerator = CreateDeviceEnumerator(options.Enumerator);
+        backendFactory = CreateDeviceBackendFactory(options.UseSysfs);
+        createVolumeCatalog = CreateVolumeCatalog;
+#ifdef __linux__
+        probePhysicalDrives = false;
+#endif
+    }
+
+    if (options.ListDevices) {
+        return ListDevices(*enumerator, options);
+    }
+
+    if (!backendFactory) {
+        std::cerr << "Only simulated devices can be resolved on this platform. Use --simulate." << std::endl;
+        return 1;
+    }
+
+    std::unique_ptr<DeviceTraceRecorder> recorder;
+    if (!options.RecordTrace.empty()) {
+        recorder = std::make_unique<DeviceTraceRecorder>();
+        backendFactory = recorder->Wrap(std::move(backendFactory));
+    }
+
+    // The CLI resolves through the same context the gcetools_api library
+    // hands out, for a single run.
+    GceToolsContext context(std::move(enumerator), std::move(backendFactory), options.ThreadCount);
+
+    if (options.Topology) {
+        return PrintTopology(context.GetBackendFactory(),
+            options.TargetDeviceIds.empty() ? context.GetEnumerator().EnumerateDeviceIds() : options.TargetDeviceIds, options);
+    }
+
+    if (!options.Snapshot.empty()) {
+        return WriteSnapshot(context.GetBackendFactory(),
+            options.TargetDeviceIds.empty() ? context.GetEnumerator().EnumerateDeviceIds() : options.TargetDeviceIds, options);
+    }
+
+    if (options.Volumes) {
+        return PrintVolumes(context.GetEnumerator(), context.GetBackendFactory(), createVolumeCatalog, options);
+    }
+
+    if (options.Health) {
+        return SampleHealth(context.GetBackendFactory(),
+            options.TargetDeviceIds.empty() ? context.GetEnumerator().EnumerateDeviceIds() : options.TargetDeviceIds, options);
+    }
+
+    DeviceResolver& resolver = context.GetResolver();
+    resolver.SetNvmeBatching(options.BatchNvme);
+    resolver.SetDeviceTimeout(options.DeviceTimeout);
+    resolver.SetReadDetails(options.Format != OutputFormat::Names);
+
+    if (!options.ProbeName.empty() || !options.ProbePath.empty()) {
+        std::vector<std::wstring> candidates;
+        if (!options.ProbeName.empty()) {
+            candidates = probePhysicalDrives ? GetPhysicalDriveProbeIds() : context.GetEnumerator().EnumerateDeviceIds();
+        }
+        return ProbeDisk(resolver, candidates, context.GetBackendFactory(), createVolumeCatalog, options);
+    }
+
+    if (options.Serve || options.LoadTestRequests > 0) {
+        DiskMapService service(context.GetEnumerator(), resolver);
+        if (!options.Serve) {
+            return RunLoadTest(service, options);
+        }
+
+        // Only real devices come and go. Subscribed before the devices are
+        // enumerated, so that no change is missed in between; without events,
+        // clients keep the index current with REFRESH.
+        std::unique_ptr<DeviceEventSource> platformEvents;
+        if (options.SimulatedDeviceCount == 0 && options.ReplayTrace.empty()) {
+            try {
+                platformEvents = CreatePlatformEventSource();
+            }
+            catch (const std::exception& e) {
+                std::cerr << "Not following device changes: " << e.what() << std::endl;
+            }
+        }
+        return ServeDiskMap(service, platformEvents.get(), options);
+    }
+
+    if (options.Watch) {
+        // Subscribed before the devices are enumerated, so that no change is
+        // missed in between.
+        std::unique_ptr<DeviceEventSource> platformEvents;
+        try {
+            if (hotplug == nullptr) {
+                platformEvents = CreatePlatformEventSource();
+                if (!platformEvents) {
+                    std::cerr << "Only simulated devices can be watched on this platform. Use --simulated-hotplug." << std::endl;
+                    return 1;
+                }
+            }
+        }
+        catch (const std::exception& e) {
+            std::cerr << e.what() << std::endl;
+            return 1;
+        }
+        if (hotplug != nullptr) {
+            hotplug->Start(options.SimulatedHotplugCount, options.SimulatedHotplugInterval);
+        }
+        return WatchDevices(context.GetEnumerator(), resolver, hotplug != nullptr ? hotplug->GetEvents() : *platformEvents, options);
+    }
+
+    auto start = std::chrono::steady_clock::now();
+
+    if (!options.CacheFile.empty()) {
+        if (options.InvalidateCache) {
+            DeviceNameCache::Invalidate(options.CacheFile);
+        }
+        context.SetNameCache(std::make_unique<DeviceNameCache>(options.CacheFile));
+    }
+
+    size_t resolvedCount = 0;
+    int result = 0;
+    std::vector<std::wstring> deviceIds;
+    if (!options.TargetNames.empty()) {
+        deviceIds = probePhysicalDrives ? GetPhysicalDriveProbeIds() : context.GetEnumerator().EnumerateDeviceIds();
+        result = FindDevicesByName(resolver, deviceIds, options.TargetNames, &resolvedCount) ? 0 : 1;
+    }
+    else {
+        // Named devices are opened directly, without enumerating anything.
+        // Records are written as devices resolve, through one buffer, and
+        // stdout is flushed once at the end. Structured records carry their
+        // own errors. A device that failed or timed out makes the run exit
+        // 1, so a script can tell it apart from a disk that is not a Google
+        // disk, which also has no name.
+        deviceIds = options.TargetDeviceIds.empty() ? context.GetEnumerator().EnumerateDeviceIds() : options.TargetDeviceIds;
+        ResolutionWriter writer(std::cout, options.Format);
+        resolver.Resolve(deviceIds, [&writer, &options, &result](const DeviceResolution& resolution) {
+            if (!resolution.Error.empty()) {
+                if (options.Format == OutputFormat::Names) {
+                    std::cerr << "Failed to resolve device: " << resolution.Error << std::endl;
+                }
+                result = 1;
+            }
+            writer.Write(resolution);
+        });
+        writer.Finish();
+        resolvedCount = deviceIds.size();
+    }
+
+    if (context.GetNameCache() != nullptr) {
+        context.GetNameCache()->Save();
+    }
+
+    if (recorder) {
+        try {
+            recorder->Save(options.RecordTrace, deviceIds);
+        }
+        catch (const std::exception& e) {
+            std::cerr << e.what() << std::endl;
+            result = 1;
+        }
+    }
+
+    if (options.PrintTiming) {
+        std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+        std::cerr << "Resolved " << resolvedCount << " devices in " << elapsed.count()
+            << " ms using " << options.ThreadCount << " threads and "
+            << StorageDevice::GetIoctlCount() << " driver queries" << std::endl;
+        PhaseTimings::Print(std::cerr);
+    }
+
+    return result;
+}
+
+bool ParseOptions(int argc, char* argv[], GceToolsOptions* options) {
+    for (int i = 1; i < argc; i++) {
+        const char* arg = argv[i];
+        const char* value = i + 1 < argc ? argv[i + 1] : nullptr;
+
+        if (strcmp(arg, "--threads") == 0 && value != nullptr) {
+            options->ThreadCount = (unsigned int)std::strtoul(value, nullptr, 10);
+            if (options->ThreadCount == 0) {
+                return false;
+            }
+            i++;
+        }
+        else if (strcmp(arg, "--simulate") == 0 && value != nullptr) {
+            options->SimulatedDeviceCount = std::strtoul(value, nullptr, 10);
+            i++;
+        }
+        else if (strcmp(arg, "--simulated-latency-us") == 0 && value != nullptr) {
+            options->SimulatedLatency = std::chrono::microseconds(std::strtoul(value, nullptr, 10));
+            i++;
+        }
+        else if (strcmp(arg, "--simulated-namespaces") == 0 && value != nullptr) {
+            options->SimulatedNamespaceCount = std::strtoul(value, nullptr, 10);
+            if (options->SimulatedNamespaceCount == 0) {
+                return false;
+            }
+            i++;
+        }
+#ifdef __linux__
+        else if (strcmp(arg, "--simulate-linux") == 0) {
+            options->SimulateLinux = true;
+        }
+        else if (strcmp(arg, "--no-sysfs") == 0) {
+            options->UseSysfs = false;
+        }
+#endif
+        else if (strcmp(arg, "--simulated-slow") == 0 && value != nullptr) {
+            if (!ParseIndexList(value, &options->SimulatedSlowDevices)) {
+                return false;
+            }
+            i++;
+        }
+        else if (strcmp(arg, "--simulated-slow-latency-us") == 0 && value != nullptr) {
+            options->SimulatedSlowLatency = std::chrono::microseconds(std::strtoul(value, nullptr, 10));
+            i++;
+        }
+        else if (strcmp(arg, "--simulated-hung") == 0 && value != nullptr) {
+            if (!ParseIndexList(value, &options->SimulatedHungDevices)) {
+                return false;
+            }
+            i++;
+        }
+        else if (strcmp(arg, "--device-timeout-ms") == 0 && value != nullptr) {
+            options->DeviceTimeout = std::chrono::milliseconds(std::strtoul(value, nullptr, 10));
+            i++;
+        }
+        else if (strcmp(arg, "--batch-nvme") == 0) {
+            options->BatchNvme = true;
+        }
+        else if (strcmp(arg, "--record-trace") == 0 && value != nullptr) {
+            options->RecordTrace = value;
+            i++;
+        }
+        else if (strcmp(arg, "--replay-trace") == 0 && value != nullptr) {
+            options->ReplayTrace = value;
+            i++;
+        }
+        else if (strcmp(arg, "--replay-latency") == 0) {
+            options->ReplayLatency = true;
+        }
+        else if (strcmp(arg, "--synthesize") == 0 && value != nullptr) {
+            options->SynthesizedDeviceCount = std::strtoul(value, nullptr, 10);
+            if (options->SynthesizedDeviceCount == 0) {
+                return false;
+            }
+            i++;
+        }
+        else if (strcmp(arg, "--timing") == 0) {
+            options->PrintTiming = true;
+        }
+        else if (strcmp(arg, "--metrics") == 0 && value != nullptr) {
+            if (strcmp(value, "json") == 0) {
+                options->Metrics = MetricsFormat::Json;
+            }
+            else if (strcmp(value, "prometheus") == 0) {
+                options->Metrics = MetricsFormat::Prometheus;
+            }
+            else {
+                return false;
+            }
+            i++;
+        }
+        else if (strcmp(arg, "--format") == 0 && value != nullptr) {
+            if (strcmp(value, "names") == 0) {
+                options->Format = OutputFormat::Names;
+            }
+            else if (strcmp(value, "jsonl") == 0) {
+                options->Format = OutputFormat::JsonLines;
+            }
+            else if (strcmp(value, "csv") == 0) {
+                options->Format = OutputFormat::Csv;
+            }
+            else {
+                return false;
+            }
+            i++;
+        }
+        else if (strcmp(arg, "--cache-file") == 0 && value != nullptr) {
+            options->CacheFile = value;
+            i++;
+        }
+        else if (strcmp(arg, "--invalidate-cache") == 0) {
+            options->InvalidateCache = true;
+        }
+        else if (strcmp(arg, "--enumerator") == 0 && value != nullptr) {
+            if (strcmp(value, "auto") == 0) {
+                options->Enumerator = EnumeratorKind::Auto;
+            }
+            else if (strcmp(value, "direct") == 0) {
+                options->Enumerator = EnumeratorKind::Direct;
+            }
+#ifdef _WIN32
+            else if (strcmp(value, "wmi") == 0) {
+                options->Enumerator = EnumeratorKind::Wmi;
+            }
+#endif
+            else {
+                return false;
+            }
+            i++;
+        }
+        else if (strcmp(arg, "--list-devices") == 0) {
+            options->ListDevices = true;
+        }
+        else if (strcmp(arg, "--device") == 0 && value != nullptr) {
+            AddTargets(value, options, /*names=*/ false);
+            i++;
+        }
+        else if (strcmp(arg, "--name") == 0 && value != nullptr) {
+            AddTargets(value, options, /*names=*/ true);
+            i++;
+        }
+        else if (strcmp(arg, "--serve") == 0) {
+            options->Serve = true;
+        }
+        else if (strcmp(arg, "--endpoint") == 0 && value != nullptr) {
+            options->Endpoint = value;
+            i++;
+        }
+        else if (strcmp(arg, "--load-test") == 0 && value != nullptr) {
+            options->LoadTestRequests = std::strtoul(value, nullptr, 10);
+            if (options->LoadTestRequests == 0) {
+                return false;
+            }
+            i++;
+        }
+        else if (strcmp(arg, "--load-test-clients") == 0 && value != nullptr) {
+            options->LoadTestClients = (unsigned int)std::strtoul(value, nullptr, 10);
+            if (options->LoadTestClients == 0) {
+                return false;
+            }
+            i++;
+        }
+        else if (strcmp(arg, "--watch") == 0) {
+            options->Watch = true;
+        }
+        else if (strcmp(arg, "--simulated-hotplug") == 0 && value != nullptr) {
+            options->SimulatedHotplugCount = std::strtoul(value, nullptr, 10);
+            if (options->SimulatedHotplugCount == 0) {
+                return false;
+            }
+            i++;
+        }
+        else if (strcmp(arg, "--simulated-hotplug-interval-ms") == 0 && value != nullptr) {
+            options->SimulatedHotplugInterval = std::chrono::milliseconds(std::strtoul(value, nullptr, 10));
+            i++;
+        }
+        else if (strcmp(arg, "--topology") == 0) {
+            options->Topology = true;
+        }
+        else if (strcmp(arg, "--volumes") == 0) {
+            options->Volumes = true;
+        }
+        else if (strcmp(arg, "--snapshot") == 0 && value != nullptr) {
+            options->Snapshot = value;
+            i++;
+        }
+        else if (strcmp(arg, "--snapshot-host") == 0 && value != nullptr) {
+            options->SnapshotHost = value;
+            i++;
+        }
+        else if (strcmp(arg, "--diff-snapshots") == 0 && i + 2 < argc) {
+            options->DiffBefore = argv[i + 1];
+            options->DiffAfter = argv[i + 2];
+            i += 2;
+        }
+        else if (strcmp(arg, "--health") == 0) {
+            options->Health = true;
+        }
+        else if (strcmp(arg, "--health-interval-ms") == 0 && value != nullptr) {
+            options->HealthInterval = std::chrono::milliseconds(std::strtoul(value, nullptr, 10));
+            if (options->HealthInterval.count() == 0) {
+                return false;
+            }
+            i++;
+        }
+        else if (strcmp(arg, "--health-samples") == 0 && value != nullptr) {
+            options->HealthSampleCount = std::strtoul(value, nullptr, 10);
+            i++;
+        }
+        else if (strcmp(arg, "--probe") == 0 && value != nullptr) {
+            options->ProbeName = value;
+            i++;
+        }
+        else if (strcmp(arg, "--probe-path") == 0 && value != nullptr) {
+            options->ProbePath = value;
+            i++;
+        }
+        else if (strcmp(arg, "--probe-block-size") == 0 && value != nullptr) {
+            options->Probe.BlockSize = std::strtoul(value, nullptr, 10);
+            if (options->Probe.BlockSize == 0 || options->Probe.BlockSize % 512 != 0) {
+                return false;
+            }
+            i++;
+        }
+        else if (strcmp(arg, "--probe-queue-depth") == 0 && value != nullptr) {
+            options->Probe.QueueDepth = std::strtoul(value, nullptr, 10);
+            if (options->Probe.QueueDepth == 0) {
+                return false;
+            }
+            i++;
+        }
+        else if (strcmp(arg, "--probe-threads") == 0 && value != nullptr) {
+            options->Probe.ThreadCount = (unsigned int)std::strtoul(value, nullptr, 10);
+            if (options->Probe.ThreadCount == 0) {
+                return false;
+            }
+            i++;
+        }
+        else if (strcmp(arg, "--probe-read-pct") == 0 && value != nullptr) {
+            options->Probe.ReadPercent = (unsigned int)std::strtoul(value, nullptr, 10);
+            if (options->Probe.ReadPercent > 100) {
+                return false;
+            }
+            i++;
+        }
+        else if (strcmp(arg, "--probe-allow-writes") == 0) {
+            options->ProbeAllowWrites = true;
+        }
+        else if (strcmp(arg, "--probe-force") == 0) {
+            options->ProbeForce = true;
+        }
+        else if (strcmp(arg, "--probe-sequential") == 0) {
+            options->Probe.Sequential = true;
+        }
+        else if (strcmp(arg, "--probe-seconds") == 0 && value != nullptr) {
+            options->Probe.Duration = std::chrono::seconds(std::strtoul(value, nullptr, 10));
+            if (options->Probe.Duration.count() == 0) {
+                return false;
+            }
+            i++;
+        }
+        else if (strcmp(arg, "--probe-size") == 0 && value != nullptr) {
+            options->Probe.Size = std::strtoull(value, nullptr, 10);
+            i++;
+        }
+        else {
+            return false;
+        }
+    }
+
+    if (!options->TargetDeviceIds.empty() && !options->TargetNames.empty()) {
+        return false;
+    }
+    if (!options->ProbeName.empty() && !options->ProbePath.empty()) {
+        return false;
+    }
+    // Only writes can be forced.
+    if (options->ProbeForce && !options->ProbeAllowWrites) {
+        return false;
+    }
+
+    // Traces are replayed instead of simulated devices, synthesized from a
+    // replayed trace, and only recorded by runs that finish.
+    if ((!options->ReplayTrace.empty() && options->SimulatedDeviceCount > 0) ||
+        ((options->SynthesizedDeviceCount > 0 || options->ReplayLatency) && options->ReplayTrace.empty()) ||
+        (!options->RecordTrace.empty() && (options->Serve || options->LoadTestRequests > 0 || options->Health || options->Watch))) {
+        return false;
+    }
+
+    // Simulated devices only change when hot-plugged, which is only done
+    // while watching them, and through the Windows backend. Watching covers
+    // every device, so none can be named.
+    if ((options->SimulatedHotplugCount > 0 &&
+            (!options->Watch || options->SimulatedDeviceCount == 0 || options->SimulateLinux)) ||
+        (options->Watch && (!options->ReplayTrace.empty() || !options->TargetDeviceIds.empty() || !options->TargetNames.empty() ||
+            (options->SimulatedDeviceCount > 0 && options->SimulatedHotplugCount == 0)))) {
+        return false;
+    }
+
+    // Records are only written in place of the names printed by default.
+    if (options->Format != OutputFormat::Names &&
+        (!options->TargetNames.empty() || options->ListDevices || options->Serve || options->LoadTestRequests > 0 ||
+            options->Health || options->Watch || options->Topology || options->Volumes || !options->Snapshot.empty() ||
+            !options->DiffBefore.empty() || !options->ProbeName.empty() || !options->ProbePath.empty())) {
+        return false;
+    }
+
+    // A host name only goes into a snapshot being written.
+    if (!options->SnapshotHost.empty() && options->Snapshot.empty()) {
+        return false;
+    }
+
+    // There is nothing to invalidate without a cache.
+    return !options->InvalidateCache || !options->CacheFile.empty();
+}
+
+// Adds a comma-separated list of targets. A device is either a full DeviceId
+// or just the number of a \\.\PHYSICALDRIVE.
+void AddTargets(const char* list, GceToolsOptions* options, bool names) {
+    std::string_view remaining = list;
+    while (!remaining.empty()) {
+        std::string_view target = remaining.substr(0, remaining.find(','));
+        remaining.remove_prefix(std::min(remaining.size(), target.size() + 1));
+        if (target.empty()) {
+            continue;
+        }
+
+        if (names) {
+            options->TargetNames.emplace_back(target);
+        }
+        else if (std::all_of(target.begin(), target.end(), [](char c) { return c >= '0' && c <= '9'; })) {
+            options->TargetDeviceIds.push_back(FromUtf8(std::string(PhysicalDrivePrefix).append(target)));
+        }
+        else {
+            options->TargetDeviceIds.push_back(FromUtf8(target));
+        }
+    }
+}
+
+bool ParseIndexList(const char* list, std::vector<size_t>* indices) {
+    std::string_view remaining = list;
+    while (!remaining.empty()) {
+        std::string_view index = remaining.substr(0, remaining.find(','));
+        remaining.remove_prefix(std::min(remaining.size(), index.size() + 1));
+        if (index.empty() || !std::all_of(index.begin(), index.end(), [](char c) { return c >= '0' && c <= '9'; })) {
+            return false;
+        }
+        indices->push_back(std::strtoul(std::string(index).c_str(), nullptr, 10));
+    }
+    return true;
+}
+
+void PrintUsage() {
+    std::cerr << "Usage: gcetools [options]" << std::endl
+        << "Prints the name of each Google Compute Engine disk attached to this machine, in DeviceId order." << std::endl
+        << std::endl
+        << "Options:" << std::endl
+        << "  --threads N                Resolve up to N devices concurrently (default "
+        << DeviceResolver::DefaultThreadCount << ")." << std::endl
+        << "  --simulate N               Resolve N simulated devices instead of the attached devices." << std::endl
+        << "  --simulated-latency-us N   Delay each simulated handle open and driver query by N microseconds." << std::endl
+        << "  --simulated-namespaces N   Attach the simulated NVMe disks as N namespaces per controller." << std::endl
+#ifdef __linux__
+        << "  --simulate-linux           Resolve the simulated devices through the Linux backend, against a" << std::endl
+        << "                             generated sysfs tree and simulated NVMe and SCSI passthrough." << std::endl
+        << "  --no-sysfs                 Query every device through NVMe or SCSI passthrough instead of" << std::endl
+        << "                             reading what /sys/block already exports." << std::endl
+#endif
+        << "  --simulated-slow N[,N...]  Make these simulated devices take --simulated-slow-latency-us" << std::endl
+        << "                             (default 5 s) to open and to answer each query." << std::endl
+        << "  --simulated-hung N[,N...]  Make these simulated devices never answer a query." << std::endl
+        << "  --device-timeout-ms N      Report a device as timed out if it is not resolved within N ms" << std::endl
+        << "                             (default " << DeviceResolver::DefaultDeviceTimeout.count() << "; 0 waits for as long as it takes)." << std::endl
+        << "  --batch-nvme               Read all of an NVMe controller's namespaces through its first disk," << std::endl
+        << "                             instead of identifying each namespace through its own disk." << std::endl
+        << "  --record-trace PATH        Record every device opened and every driver query made to PATH." << std::endl
+        << "  --replay-trace PATH        Resolve the devices recorded in PATH instead of the attached devices." << std::endl
+        << "  --replay-latency           Take as long as each recorded open and driver query did." << std::endl
+        << "  --synthesize N             Replay N copies of the recorded devices, each with its own name" << std::endl
+        << "                             and serial number." << std::endl
+        << "  --timing                   Print the time taken, driver queries issued and time spent in" << std::endl
+        << "                             each phase (COM init, enumeration, opens, queries) to stderr." << std::endl
+        << "  --metrics FORMAT           Print the count, errors and latency histogram of every enumeration" << std::endl
+        << "                             step, device open and driver query to stderr on exit, as json or" << std::endl
+        << "                             prometheus text. --serve also answers METRICS requests with them." << std::endl
+        << "  --format FORMAT            Print names (default), or a record per device with its bus, name," << std::endl
+        << "                             error, resolve time and every identifier in its device ID" << std::endl
+        << "                             descriptor, as jsonl (a JSON object per line) or csv." << std::endl
+        << "  --cache-file PATH          Remember device names in PATH, so later runs only read each" << std::endl
+        << "                             device's identifiers to find its name." << std::endl
+        << "  --invalidate-cache         Delete the cache file first, so every device is resolved again." << std::endl
+        << "  --enumerator KIND          How to list the attached devices: auto (default), direct or wmi." << std::endl
+        << "                             direct uses SetupAPI on Windows and /sys/block elsewhere; auto" << std::endl
+        << "                             falls back to WMI if direct enumeration fails." << std::endl
+        << "  --list-devices             Print the DeviceIds of the attached devices without resolving them." << std::endl
+        << "  --device N[,N...]          Resolve only these devices, given as DeviceIds or \\\\.\\PHYSICALDRIVE" << std::endl
+        << "                             numbers, without enumerating the attached devices." << std::endl
+        << "  --name NAME[,NAME...]      Print the DeviceId of each named disk, stopping as soon as every" << std::endl
+        << "                             one has been found." << std::endl
+        << "  --serve                    Keep running and answer name and device lookups on the endpoint." << std::endl
+        << "  --endpoint PATH            Serve on PATH instead of " << DefaultLocalEndpoint.string() << "." << std::endl
+        << "  --load-test N              Serve on a private endpoint, issue N lookups against it and" << std::endl
+        << "                             print the latency percentiles." << std::endl
+        << "  --load-test-clients N      Issue the load test lookups from N concurrent clients (default 64)." << std::endl
+        << "  --watch                    Keep running and print a line for each disk added, removed or" << std::endl
+        << "                             renamed, starting with every disk attached. Only the disks the OS" << std::endl
+        << "                             reports a change to are resolved again." << std::endl
+        << "  --simulated-hotplug N      Watch the simulated devices while N disks are detached, attached" << std::endl
+        << "                             and swapped, then stop." << std::endl
+        << "  --simulated-hotplug-interval-ms N" << std::endl
+        << "                             Make a hotplug change every N ms (default 100)." << std::endl
+        << "  --topology                 Print each disk's controller, adapter, transfer limits, NUMA node" << std::endl
+        << "                             and hardware queue CPUs as a JSON object per line." << std::endl
+        << "  --snapshot PATH            Write each disk's DeviceId, name, bus, serial number, namespace" << std::endl
+        << "                             and descriptor strings to a binary snapshot at PATH instead of" << std::endl
+        << "                             printing names." << std::endl
+        << "  --snapshot-host NAME       Record the snapshot as taken on NAME (default: this host name)." << std::endl
+        << "  --diff-snapshots BEFORE AFTER" << std::endl
+        << "                             Print the disks added, removed, renamed, moved or changed between" << std::endl
+        << "                             two snapshots, or between each pair of snapshots with the same" << std::endl
+        << "                             file name in two directories, diffing pairs on every core." << std::endl
+        << "  --volumes                  Print each disk's size, partitions, and the volumes on them with" << std::endl
+        << "                             their sizes, file systems and mount points (drive letters and" << std::endl
+        << "                             mounted folders on Windows), as a JSON object per line." << std::endl
+        << "  --health                   Print the change in each NVMe disk's SMART / Health counters" << std::endl
+        << "                             every interval, with the throughput, IOPS, temperature and wear." << std::endl
+        << "  --health-interval-ms N     Sample every N ms (default 1000)." << std::endl
+        << "  --health-samples N         Stop after printing N samples (default 0, which runs until stopped)." << std::endl
+        << "  --probe NAME               Measure the IOPS, throughput and latency of the disk named NAME." << std::endl
+        << "  --probe-path PATH          Measure the disk or file at PATH instead." << std::endl
+        << "  --probe-block-size N       Read or write N bytes per request (default 4096)." << std::endl
+        << "  --probe-queue-depth N      Keep N requests outstanding per thread (default 32)." << std::endl
+        << "  --probe-threads N          Issue requests from N threads (default 1)." << std::endl
+        << "  --probe-read-pct N         Make N% of requests reads (default 100). The rest are writes," << std::endl
+        << "                             which DESTROY the data on the probed part of the disk." << std::endl
+        << "  --probe-allow-writes       Allow the writes --probe-read-pct asks for. Disks with partitions or" << std::endl
+        << "                             volumes are still refused." << std::endl
+        << "  --probe-force              Write even to a disk with partitions or volumes." << std::endl
+        << "  --probe-sequential         Walk the disk in order instead of at random offsets." << std::endl
+        << "  --probe-seconds N          Probe for N seconds (default 10)." << std::endl
+        << "  --probe-size N             Only use the first N bytes of the disk (default all of it)." << std::endl;
+}
+
+int ListDevices(DeviceEnumerator& enumerator, const GceToolsOptions& options) {
+    auto start = std::chrono::steady_clock::now();
+    std::vector<std::wstring> deviceIds;
+    try {
+        deviceIds = enumerator.EnumerateDeviceIds();
+    }
+    catch (const std::exception& e) {
+        std::cerr << "Failed to enumerate devices: " << e.what() << std::endl;
+        return 1;
+    }
+
+    for (const std::wstring& deviceId : deviceIds) {
+        std::cout << ToUtf8(deviceId) << std::endl;
+    }
+
+    if (options.PrintTiming) {
+        std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+        std::cerr << "Enumerated " << deviceIds.size() << " devices in " << elapsed.count()
+            << " ms using " << enumerator.GetName() << std::endl;
+        PhaseTimings::Print(std::cerr);
+    }
+    return 0;
+}
+
+std::string GetHostName() {
+#ifdef _WIN32
+    char name[MAX_COMPUTERNAME_LENGTH + 1];
+    DWORD size = sizeof(name);
+    return GetComputerNameA(name, &size) ? std::string(name, size) : std::string();
+#else
+    char name[256] = {};
+    return gethostname(name, sizeof(name) - 1) == 0 ? std::string(name) : std::string();
+#endif
+}
+
+std::vector<std::wstring> GetPhysicalDriveProbeIds() {
+    std::vector<std::wstring> deviceIds;
+    for (unsigned int i = 0; i < MaxPhysicalDriveProbe; i++) {
+        deviceIds.push_back(FromUtf8(PhysicalDrivePrefix + std::to_string(i)));
+    }
+    return deviceIds;
+}
+
+bool FindDevicesByName(DeviceResolver& resolver, const std::vector<std::wstring>& candidates,
+    const std::vector<std::string>& names, size_t* resolvedCount) {
+    std::vector<std::wstring> found;
+    bool foundAll = SearchDevicesByName(resolver, candidates, names, &found, resolvedCount);
+    for (size_t i = 0; i < names.size(); i++) {
+        if (found[i].empty()) {
+            std::cerr << "No disk named " << names[i] << std::endl;
+        }
+        std::cout << ToUtf8(found[i]) << std::endl;
+    }
+    return foundAll;
+}
+
+// Finds the DeviceId of each named disk, resolving candidates only until
+// every one has been found. Names that were not found are left empty.
+bool SearchDevicesByName(DeviceResolver& resolver, const std::vector<std::wstring>& candidates,
+    const std::vector<std::string>& names, std::vector<std::wstring>* found, size_t* resolvedCount) {
+    found->assign(names.size(), std::wstring());
+    size_t remaining = names.size();
+    *resolvedCount = 0;
+    resolver.ResolveUntil(candidates, [&](const DeviceResolution& resolution) {
+        // Most probes miss, so failures are expected and not reported.
+        (*resolvedCount)++;
+        for (size_t i = 0; i < names.size(); i++) {
+            if ((*found)[i].empty() && names[i] == resolution.Name) {
+                (*found)[i] = resolution.DeviceId;
+                remaining--;
+            }
+        }
+        return remaining > 0;
+    });
+    return remaining == 0;
+}
+
+int ProbeDisk(DeviceResolver& resolver, const std::vector<std::wstring>& candidates, const DeviceBackendFactory& backendFactory,
+    const std::function<std::unique_ptr<VolumeCatalog>()>& createVolumeCatalog, const GceToolsOptions& options) {
+    std::filesystem::path target = options.ProbePath;
+    if (target.empty()) {
+        std::vector<std::wstring> found;
+        size_t resolvedCount = 0;
+        if (!SearchDevicesByName(resolver, candidates, { options.ProbeName }, &found, &resolvedCount)) {
+            std::cerr << "No disk named " << options.ProbeName << std::endl;
+            return 1;
+        }
+        target = found[0];
+    }
+
+    const DiskProbeOptions& probe = options.Probe;
+    if (probe.ReadPercent < 100 && !CheckProbeWrites(target.wstring(), backendFactory, createVolumeCatalog, options)) {
+        return 1;
+    }
+
+    DiskProbeResult result;
+    try {
+        result = DiskProbe::Run(DiskProbe::GetQueueFactory(target), probe);
+    }
+    catch (const std::exception& e) {
+        std::cerr << "Failed to probe " << target.string() << ": " << e.what() << std::endl;
+        return 1;
+    }
+    if (!result.Unbuffered) {
+        std::cerr << "Warning: " << target.string() << " does not support unbuffered I/O, so the OS cache was measured too." << std::endl;
+    }
+
+    auto latency = [&result](double p) {
+        return std::chrono::duration<double, std::micro>(result.GetLatency(p)).count();
+    };
+    double mib = 1024.0 * 1024.0;
+    std::cout << "Probed " << target.string() << " for " << result.Elapsed.count() * 1000 << " ms: "
+        << probe.BlockSize << "-byte " << (probe.Sequential ? "sequential" : "random") << " requests, "
+        << probe.ReadPercent << "% reads, queue depth " << probe.QueueDepth << " on " << probe.ThreadCount << " threads" << std::endl
+        << "IOPS: " << (uint64_t)result.GetIops(result.Reads + result.Writes) << " (read "
+        << (uint64_t)result.GetIops(result.Reads) << ", write " << (uint64_t)result.GetIops(result.Writes) << ")" << std::endl
+        << "Throughput: " << result.GetIops(result.Reads + result.Writes) * probe.BlockSize / mib << " MiB/s (read "
+        << result.GetIops(result.Reads) * probe.BlockSize / mib << ", write "
+        << result.GetIops(result.Writes) * probe.BlockSize / mib << ")" << std::endl
+        << "Latency: p50 " << latency(0.50) << " us, p90 " << latency(0.90) << " us, p99 " << latency(0.99)
+        << " us, p99.9 " << latency(0.999) << " us, max " << latency(1.0) << " us" << std::endl;
+    return 0;
+}
+
+// Writes destroy whatever is on the probed part of the disk, so they are
+// only made when asked for, and, unless forced, only to a scratch file or to
+// a disk with neither partitions nor volumes. A disk whose layout cannot be
+// read is refused too.
+bool CheckProbeWrites(const std::wstring& deviceId, const DeviceBackendFactory& backendFactory,
+    const std::function<std::unique_ptr<VolumeCatalog>()>& createVolumeCatalog, const GceToolsOptions& options) {
+    std::string target = ToUtf8(deviceId);
+    if (!options.ProbeAllowWrites) {
+        std::cerr << "Refusing to write to " << target << ", which would destroy its data, without --probe-allow-writes." << std::endl;
+        return false;
+    }
+    std::error_code err;
+    if (options.ProbeForce || std::filesystem::is_regular_file(deviceId, err)) {
+        return true;
+    }
+
+    std::string reason;
+    try {
+        std::unique_ptr<VolumeCatalog> catalog = createVolumeCatalog();
+        std::unique_ptr<DeviceBackend> backend = backendFactory(deviceId);
+        if (options.DeviceTimeout.count() > 0) {
+            backend->SetDeadline(std::chrono::steady_clock::now() + options.DeviceTimeout);
+        }
+        DevicePartitionLayout layout;
+        if (!backend->GetPartitionLayout(layout)) {
+            reason = "its partition table could not be read";
+        }
+        else if (!layout.Partitions.empty()) {
+            reason = "it has " + std::to_string(layout.Partitions.size()) + " partition(s)";
+        }
+        else if (catalog != nullptr) {
+            std::vector<DiskVolume> volumes = catalog->FindVolumes(layout, nullptr);
+            if (!volumes.empty()) {
+                reason = "it holds the volume " + volumes[0].Volume;
+                if (!volumes[0].MountPoints.empty()) {
+                    reason += ", mounted at " + volumes[0].MountPoints[0];
+                }
+            }
+        }
+    }
+    catch (const std::exception& e) {
+        reason = std::string("it could not be checked: ") + e.what();
+    }
+    if (reason.empty()) {
+        return true;
+    }
+    std::cerr << "Refusing to write to " << target << ": " << reason << ". Pass --probe-force to write anyway." << std::endl;
+    return false;
+}
+
+void PrintMetrics(MetricsFormat format) {
+    std::string metrics;
+    if (format == MetricsFormat::Json) {
+        OperationMetrics::AppendJson(metrics);
+        metrics.push_back('\n');
+    }
+    else if (format == MetricsFormat::Prometheus) {
+        OperationMetrics::AppendPrometheus(metrics);
+    }
+    std::cerr << metrics << std::flush;
+}
+
+// Returns nullptr where the OS reports no disk arrivals and removals. Throws
+// if they could not be subscribed.
+std::unique_ptr<DeviceEventSource> CreatePlatformEventSource() {
+#ifdef _WIN32
+    return std::make_unique<Win32DeviceEventSource>();
+#elif defined(__linux__)
+    return std::make_unique<UeventDeviceEventSource>();
+#else
+    return nullptr;
+#endif
+}
+
+int ServeDiskMap(DiskMapService& service, DeviceEventSource* events, const GceToolsOptions& options) {
+    size_t deviceCount = service.Refresh();
+    std::unique_ptr<LocalListener> listener;
+    try {
+        listener = std::make_unique<LocalListener>(options.Endpoint);
+    }
+    catch (const std::exception& e) {
+        std::cerr << e.what() << std::endl;
+        return 1;
+    }
+    std::cerr << "Serving " << deviceCount << " devices on " << listener->GetEndpoint().string() << std::endl;
+
+    std::thread follower;
+    if (events != nullptr) {
+        follower = std::thread(&DiskMapService::Follow, &service, std::ref(*events));
+    }
+    service.Serve(*listener);
+    if (events != nullptr) {
+        events->Stop();
+        follower.join();
+    }
+    return 0;
+}
+
+int RunLoadTest(DiskMapService& service, const GceToolsOptions& options) {
+    service.Refresh();
+    auto entries = service.GetIndex().GetEntries();
+    if (entries.empty()) {
+        std::cerr << "No devices to look up." << std::endl;
+        return 1;
+    }
+
+    // A private endpoint, so the load test can run next to a real service.
+    auto suffix = std::to_string(std::chrono::steady_clock::now().time_since_epoch().count());
+#ifdef _WIN32
+    std::filesystem::path endpoint = L"\\\\.\\pipe\\gcetools-load-test-" + std::wstring(suffix.begin(), suffix.end());
+#else
+    std::filesystem::path endpoint = std::filesystem::temp_directory_path() / ("gcetools-load-test-" + suffix + ".sock");
+#endif
+    LocalListener listener(endpoint);
+    std::thread server(&DiskMapService::Serve, &service, std::ref(listener));
+
+    using Clock = std::chrono::steady_clock;
+    unsigned int clientCount = (unsigned int)std::min<size_t>(options.LoadTestClients, options.LoadTestRequests);
+    std::vector<std::vector<Clock::duration>> latencies(clientCount);
+    std::atomic<size_t> failures = 0;
+
+    auto start = Clock::now();
+    std::vector<std::thread> clients;
+    for (unsigned int client = 0; client < clientCount; client++) {
+        clients.emplace_back([&, client]() {
+            try {
+                auto connection = ConnectLocal(endpoint);
+                std::string request;
+                std::string response;
+                // Spread the requests evenly, alternating between the two
+                // kinds of lookup.
+                for (size_t i = client; i < options.LoadTestRequests; i += clientCount) {
+                    const auto& [deviceId, name] = entries[i % entries.size()];
+                    bool byName = (i / entries.size()) % 2 == 1 && !name.empty();
+                    request = byName ? "DEVICE " + name + "\n" : "NAME " + deviceId + "\n";
+
+                    auto requestStart = Clock::now();
+                    if (!connection->Write(request) || !connection->ReadLine(response)) {
+                        failures++;
+                        return;
+                    }
+                    latencies[client].push_back(Clock::now() - requestStart);
+                    if (response.compare(0, 3, "OK ") != 0) {
+                        failures++;
+                    }
+                }
+            }
+            catch (const std::exception& e) {
+                std::cerr << e.what() << std::endl;
+                failures++;
+            }
+        });
+    }
+    for (std::thread& client : clients) {
+        client.join();
+    }
+    std::chrono::duration<double> elapsed = Clock::now() - start;
+
+    service.Stop();
+    server.join();
+
+    std::vector<Clock::duration> all;
+    for (const auto& clientLatencies : latencies) {
+        all.insert(all.end(), clientLatencies.begin(), clientLatencies.end());
+    }
+    if (all.empty()) {
+        std::cerr << "No lookups completed." << std::endl;
+        return 1;
+    }
+    std::sort(all.begin(), all.end());
+    auto percentile = [&all](double p) {
+        size_t index = std::min(all.size() - 1, (size_t)(p * all.size()));
+        return std::chrono::duration<double, std::micro>(all[index]).count();
+    };
+
+    std::cout << "Completed " << all.size() << " lookups of " << entries.size() << " devices from "
+        << clientCount << " clients in " << elapsed.count() * 1000 << " ms ("
+        << (size_t)(all.size() / elapsed.count()) << " lookups/s)" << std::endl
+        << "Latency: p50 " << percentile(0.50) << " us, p99 " << percentile(0.99)
+        << " us, max " << percentile(1.0) << " us" << std::endl;
+    if (failures > 0) {
+        std::cout << failures << " lookups failed" << std::endl;
+        return 1;
+    }
+    return 0;
+}
+
+int PrintTopology(const DeviceBackendFactory& backendFactory, const std::vector<std::wstring>& deviceIds,
+    const GceToolsOptions& options) {
+    int result = 0;
+    std::string record;
+    for (const std::wstring& deviceId : deviceIds) {
+        record.clear();
+        try {
+            std::unique_ptr<DeviceBackend> backend = backendFactory(deviceId);
+            if (options.DeviceTimeout.count() > 0) {
+                backend->SetDeadline(std::chrono::steady_clock::now() + options.DeviceTimeout);
+            }
+            GoogleStorageDevice device(std::move(backend));
+            DiskTopology::Read(device, deviceId).AppendJson(record);
+        }
+        catch (const std::exception& e) {
+            DiskTopology::AppendErrorJson(record, deviceId, e.what());
+            result = 1;
         }
+        std::cout << record << std::endl;
+    }
+    return result;
+}
 
-        VARIANT vtProp;
+// Every volume is read once, before the disks, so each disk costs only its
+// own queries.
+int PrintVolumes(DeviceEnumerator& enumerator, const DeviceBackendFactory& backendFactory,
+    const std::function<std::unique_ptr<VolumeCatalog>()>& createVolumeCatalog, const GceToolsOptions& options) {
+    auto start = std::chrono::steady_clock::now();
+    std::vector<std::wstring> deviceIds = options.TargetDeviceIds;
+    std::unique_ptr<VolumeCatalog> catalog;
+    try {
+        if (deviceIds.empty()) {
+            deviceIds = enumerator.EnumerateDeviceIds();
+        }
+        catalog = createVolumeCatalog();
+    }
+    catch (const std::exception& e) {
+        std::cerr << "Failed to enumerate devices: " << e.what() << std::endl;
+        return 1;
+    }
 
-        VariantInit(&vtProp);
-        // Get the value of the Name property
-        hr = pclsObj->Get(L"DeviceID", 0, &vtProp, 0, 0);
-        std::wcout << vtProp.bstrVal << std::endl;
-        devices.emplace_back(SysAllocString(vtProp.bstrVal));
-        VariantClear(&vtProp);
+    int result = 0;
+    std::string record;
+    for (const std::wstring& deviceId : deviceIds) {
+        record.clear();
+        try {
+            std::unique_ptr<DeviceBackend> backend = backendFactory(deviceId);
+            if (options.DeviceTimeout.count() > 0) {
+                backend->SetDeadline(std::chrono::steady_clock::now() + options.DeviceTimeout);
+            }
+            GoogleStorageDevice device(std::move(backend));
+            DiskLayout::Read(device, deviceId, catalog.get()).AppendJson(record);
+        }
+        catch (const std::exception& e) {
+            DiskLayout::AppendErrorJson(record, deviceId, e.what());
+            result = 1;
+        }
+        std::cout << record << std::endl;
+    }
 
-        pclsObj->Release();
+    if (options.PrintTiming) {
+        std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+        std::cerr << "Mapped " << deviceIds.size() << " disks to their volumes in " << elapsed.count() << " ms" << std::endl;
+        PhaseTimings::Print(std::cerr);
     }
+    return result;
+}
 
-    // Cleanup
-    // ========
+int WriteSnapshot(const DeviceBackendFactory& backendFactory, const std::vector<std::wstring>& deviceIds,
+    const GceToolsOptions& options) {
+    auto start = std::chrono::steady_clock::now();
+    std::vector<DiskSnapshotEntry> entries;
+    for (const std::wstring& deviceId : deviceIds) {
+        try {
+            std::unique_ptr<DeviceBackend> backend = backendFactory(deviceId);
+            if (options.DeviceTimeout.count() > 0) {
+                backend->SetDeadline(std::chrono::steady_clock::now() + options.DeviceTimeout);
+            }
+            GoogleStorageDevice device(std::move(backend));
+            entries.push_back(DiskSnapshotEntry::Read(device, deviceId));
+        }
+        catch (const std::exception& e) {
+            entries.push_back(DiskSnapshotEntry::FromError(deviceId, e.what()));
+        }
+    }
+
+    uint64_t createdTime = (uint64_t)std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::system_clock::now().time_since_epoch()).count();
+    try {
+        DiskSnapshot::Save(options.Snapshot, DiskSnapshot::Serialize(
+            options.SnapshotHost.empty() ? GetHostName() : options.SnapshotHost, createdTime, entries));
+    }
+    catch (const std::exception& e) {
+        std::cerr << e.what() << std::endl;
+        return 1;
+    }
+
+    if (options.PrintTiming) {
+        std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+        std::cerr << "Wrote a snapshot of " << entries.size() << " disks in " << elapsed.count() << " ms" << std::endl;
+        PhaseTimings::Print(std::cerr);
+    }
+    return 0;
+}
+
+// Each pair's lines are formatted by whichever thread diffs it, and printed
+// in order once every pair is done.
+int DiffSnapshots(const GceToolsOptions& options) {
+    auto start = std::chrono::steady_clock::now();
+    int result = 0;
+    std::vector<std::pair<std::filesystem::path, std::filesystem::path>> pairs;
+    std::error_code err;
+    if (std::filesystem::is_directory(options.DiffBefore, err) && std::filesystem::is_directory(options.DiffAfter, err)) {
+        for (const std::filesystem::directory_entry& entry : std::filesystem::directory_iterator(options.DiffBefore, err)) {
+            if (!entry.is_regular_file(err)) {
+                continue;
+            }
+            std::filesystem::path after = options.DiffAfter / entry.path().filename();
+            if (std::filesystem::is_regular_file(after, err)) {
+                pairs.emplace_back(entry.path(), after);
+            }
+            else {
+                std::cerr << "No snapshot to compare with " << entry.path().string() << std::endl;
+                result = 1;
+            }
+        }
+        std::sort(pairs.begin(), pairs.end());
+    }
+    else {
+        pairs.emplace_back(options.DiffBefore, options.DiffAfter);
+    }
+
+    std::vector<std::string> outputs(pairs.size());
+    std::vector<std::string> errors(pairs.size());
+    std::atomic<size_t> diskCount{ 0 };
+    unsigned int threadCount = std::max(std::thread::hardware_concurrency(), 1u);
+    DiskSnapshotDiff::DiffAll(pairs.size(), threadCount,
+        [&](size_t index, DiskSnapshot& before, DiskSnapshot& after) {
+            for (auto [snapshot, path] : { std::pair(&before, &pairs[index].first), std::pair(&after, &pairs[index].second) }) {
+                if (!snapshot->Open(*path)) {
+                    errors[index] = "Not a valid disk snapshot: " + path->string();
+                    return false;
+                }
+            }
+            return true;
+        },
+        [&](size_t index, const DiskSnapshot& /*before*/, const DiskSnapshot& after, const std::vector<DiskDifference>& differences) {
+            diskCount += after.GetRecordCount();
+            std::string& out = outputs[index];
+            for (const DiskDifference& difference : differences) {
+                out.append(after.GetHost()).push_back('\t');
+                switch (difference.Kind) {
+                case DiskDifferenceKind::Added:
+                    out.append("add\t").append(difference.DeviceId).append("\t").append(difference.Name);
+                    break;
+                case DiskDifferenceKind::Removed:
+                    out.append("remove\t").append(difference.DeviceId).append("\t").append(difference.OldName);
+                    break;
+                case DiskDifferenceKind::Renamed:
+                    out.append("rename\t").append(difference.DeviceId).append("\t").append(difference.OldName)
+                        .append("\t").append(difference.Name);
+                    break;
+                case DiskDifferenceKind::Moved:
+                    out.append("move\t").append(difference.OldDeviceId).append("\t").append(difference.DeviceId)
+                        .append("\t").append(difference.Name);
+                    break;
+                case DiskDifferenceKind::Changed:
+                    out.append("change\t").append(difference.DeviceId).append("\t").append(difference.Name);
+                    break;
+                }
+                out.push_back('\n');
+            }
+        });
+
+    for (size_t i = 0; i < pairs.size(); i++) {
+        if (!errors[i].empty()) {
+            std::cerr << errors[i] << std::endl;
+            result = 1;
+        }
+        std::cout << outputs[i];
+    }
+    std::cout.flush();
+
+    if (options.PrintTiming) {
+        std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+        std::cerr << "Diffed " << pairs.size() << " snapshot pairs (" << diskCount << " disks) in " << elapsed.count()
+            << " ms using " << threadCount << " threads" << std::endl;
+    }
+    return result;
+}
+
+int WatchDevices(DeviceEnumerator& enumerator, DeviceResolver& resolver, DeviceEventSource& events,
+    const GceToolsOptions& options) {
+    DeviceWatcher watcher(enumerator, resolver, events);
+    try {
+        watcher.Run([](const DeviceChange& change) {
+            switch (change.Kind) {
+            case DeviceChangeKind::Added:
+                std::cout << "add\t" << ToUtf8(change.DeviceId) << "\t" << change.Name << std::endl;
+                break;
+            case DeviceChangeKind::Removed:
+                std::cout << "remove\t" << ToUtf8(change.DeviceId) << "\t" << change.OldName << std::endl;
+                break;
+            case DeviceChangeKind::Renamed:
+                std::cout << "rename\t" << ToUtf8(change.DeviceId) << "\t" << change.OldName << "\t" << change.Name << std::endl;
+                break;
+            }
+        });
+    }
+    catch (const std::exception& e) {
+        std::cerr << "Failed to enumerate devices: " << e.what() << std::endl;
+        return 1;
+    }
 
-    pSvc->Release();
-    pLoc->Release();
-    pEnumerator->Release();
-    CoUninitialize();
-    return devices;
+    // Only reached once the event source stops, which only simulated
+    // hotplugging does.
+    std::vector<DeviceEvent::Clock::duration> latencies = watcher.GetLatencies();
+    if (options.PrintTiming && !latencies.empty()) {
+        std::sort(latencies.begin(), latencies.end());
+        auto percentile = [&latencies](double p) {
+            size_t index = std::min(latencies.size() - 1, (size_t)(p * latencies.size()));
+            return std::chrono::duration<double, std::micro>(latencies[index]).count();
+        };
+        std::cerr << "Reported " << latencies.size() << " changes. Event to output latency: p50 " << percentile(0.50)
+            << " us, p99 " << percentile(0.99) << " us, max " << percentile(1.0) << " us" << std::endl;
+        PhaseTimings::Print(std::cerr);
+    }
+    return 0;
+}
+
+int SampleHealth(const DeviceBackendFactory& backendFactory, const std::vector<std::wstring>& deviceIds,
+    const GceToolsOptions& options) {
+    NvmeHealthCollector collector(backendFactory, deviceIds);
+    if (collector.GetDiskCount() == 0) {
+        std::cerr << "No NVMe disks to sample." << std::endl;
+        return 1;
+    }
+
+    // The first sample only reads the counters the next one is compared
+    // against. Samples are taken on a fixed schedule, so the time spent
+    // sampling does not stretch the interval.
+    using Clock = std::chrono::steady_clock;
+    std::string records;
+    Clock::duration sampling{ 0 };
+    size_t timedSamples = 0;
+    auto next = Clock::now();
+    for (size_t sample = 0;; sample++) {
+        auto sampleStart = Clock::now();
+        records.clear();
+        collector.Sample(records);
+        if (sample > 0) {
+            sampling += Clock::now() - sampleStart;
+            timedSamples++;
+        }
+        std::cout << records << std::flush;
+        // A sample count of 0 samples until stopped.
+        if (options.HealthSampleCount != 0 && sample == options.HealthSampleCount) {
+            break;
+        }
+
+        next += options.HealthInterval;
+        std::this_thread::sleep_until(next);
+    }
+
+    if (options.PrintTiming && timedSamples > 0) {
+        std::chrono::duration<double, std::micro> perSample = sampling / timedSamples;
+        std::cerr << "Sampled " << collector.GetDiskCount() << " NVMe disks " << timedSamples
+            << " times, taking " << perSample.count() << " us per sample" << std::endl;
+        PhaseTimings::Print(std::cerr);
+    }
+    return 0;
 }
@@ -12,8 +12,164 @@
  * See the License for the specific language governing permissions and
  * limitations under the License.
  */
+#pragma once
+
+#include <chrono>
+#include <filesystem>
+#include <functional>
 #include <memory>
+#include <string>
 #include <vector>
-#include <WTypes.h>
+#include "DeviceEnumerator.h"
+#include "DeviceEvents.h"
+#include "DeviceResolver.h"
+#include "DiskProbe.h"
+#include "DiskMapService.h"
+#include "GceToolsContext.h"
+#include "LocalSocket.h"
+#include "ResolutionWriter.h"
+#include "StorageTypes.h"
+#include "VolumeCatalog.h"
+
+enum class MetricsFormat {
+    None,
+    Json,
+    Prometheus,
+};
+
+struct GceToolsOptions {
+    // Number of devices resolved concurrently.
+    unsigned int ThreadCount = DeviceResolver::DefaultThreadCount;
+    // When non-zero, resolve this many simulated devices instead of the
+    // devices attached to the machine.
+    size_t SimulatedDeviceCount = 0;
+    // Latency of each simulated handle open and driver query.
+    std::chrono::microseconds SimulatedLatency{ 0 };
+    // Number of namespaces on each simulated NVMe controller.
+    size_t SimulatedNamespaceCount = 1;
+    // Simulated devices that take SimulatedSlowLatency to open and to answer
+    // each query, and simulated devices that never answer a query.
+    std::vector<size_t> SimulatedSlowDevices;
+    std::chrono::microseconds SimulatedSlowLatency = std::chrono::seconds(5);
+    std::vector<size_t> SimulatedHungDevices;
+    // Resolve the simulated devices through the Linux backend, against a
+    // generated sysfs tree and simulated passthrough ioctls.
+    bool SimulateLinux = false;
+    // On Linux, read what the kernel exports under /sys/block instead of
+    // querying the device where possible.
+    bool UseSysfs = true;
+    // Read each NVMe controller's namespaces once, through one of its disks.
+    bool BatchNvme = false;
+    // When set, every device opened and every driver query made is recorded
+    // to this file, for replaying with ReplayTrace.
+    std::filesystem::path RecordTrace;
+    // When set, resolve the devices recorded in this trace instead of the
+    // devices attached to the machine, optionally taking as long as each
+    // recorded open and query did.
+    std::filesystem::path ReplayTrace;
+    bool ReplayLatency = false;
+    // When non-zero, replay this many copies of the devices in ReplayTrace.
+    size_t SynthesizedDeviceCount = 0;
+    // How long each device is given to be opened and queried before it is
+    // reported as timed out. 0 waits for as long as it takes.
+    std::chrono::milliseconds DeviceTimeout = DeviceResolver::DefaultDeviceTimeout;
+    // Print how long resolving the devices took, and the time spent in each
+    // phase, to stderr.
+    bool PrintTiming = false;
+    // Record the count, errors and latency histogram of every enumeration
+    // step, device open and driver query, and print them to stderr in this
+    // format on exit. The service also answers METRICS requests with them.
+    MetricsFormat Metrics = MetricsFormat::None;
+    // How resolved devices are printed: just their names, or a record per
+    // device with its bus, identifiers and resolve time.
+    OutputFormat Format = OutputFormat::Names;
+    EnumeratorKind Enumerator = EnumeratorKind::Auto;
+    // Print the DeviceIds found by the enumerator instead of resolving them.
+    bool ListDevices = false;
+    // When set, device names are cached in this file across runs.
+    std::filesystem::path CacheFile;
+    // Delete the cache file before resolving devices.
+    bool InvalidateCache = false;
+    // Keep running and answer lookups on Endpoint instead of printing names.
+    bool Serve = false;
+    std::filesystem::path Endpoint = DefaultLocalEndpoint;
+    // When non-zero, serve the devices on a private endpoint and measure
+    // this many lookups issued by LoadTestClients concurrent clients.
+    size_t LoadTestRequests = 0;
+    unsigned int LoadTestClients = 64;
+    // Sample the SMART / Health log of every NVMe disk every
+    // HealthInterval instead of printing names, HealthSampleCount times or,
+    // if 0, until stopped.
+    bool Health = false;
+    std::chrono::milliseconds HealthInterval{ 1000 };
+    size_t HealthSampleCount = 0;
+    // Measure the IOPS, throughput and latency of the disk with this name,
+    // or of the disk or file at this path, instead of printing names.
+    std::string ProbeName;
+    std::filesystem::path ProbePath;
+    DiskProbeOptions Probe;
+    // Probes only write (ReadPercent below 100) with ProbeAllowWrites, and
+    // then only to a disk with no partitions or volumes, unless forced.
+    bool ProbeAllowWrites = false;
+    bool ProbeForce = false;
+    // Keep running and print each disk added, removed or renamed, resolving
+    // only the disks the OS reports a change to.
+    bool Watch = false;
+    // When non-zero, watch the simulated devices while this many disks are
+    // attached, detached and swapped, one every SimulatedHotplugInterval.
+    size_t SimulatedHotplugCount = 0;
+    std::chrono::milliseconds SimulatedHotplugInterval{ 100 };
+    // Print each disk's controller, transfer limits and queue layout as a
+    // JSON object per line instead of its name.
+    bool Topology = false;
+    // Print each disk's partitions, volumes and mount points as a JSON
+    // object per line instead of its name.
+    bool Volumes = false;
+    // When set, write a snapshot of the disks to this file instead of
+    // printing their names, recorded as taken on SnapshotHost (this
+    // machine's host name by default).
+    std::filesystem::path Snapshot;
+    std::string SnapshotHost;
+    // When set, print what changed between the disk snapshots in
+    // DiffBefore and DiffAfter, or between each pair of snapshots with the
+    // same file name in two directories, instead of resolving any disks.
+    std::filesystem::path DiffBefore;
+    std::filesystem::path DiffAfter;
+    // When set, only these devices are resolved, without enumerating the
+    // devices attached to the machine.
+    std::vector<std::wstring> TargetDeviceIds;
+    // When set, print the DeviceId of each of these disks instead, probing
+    // devices only until every one has been found.
+    std::vector<std::string> TargetNames;
+};
 
-std::vector<BSTR> GetAllPhysicalDeviceIds();
+bool ParseOptions(int argc, char* argv[], GceToolsOptions* options);
+void PrintUsage();
+void PrintMetrics(MetricsFormat format);
+int ListDevices(DeviceEnumerator& enumerator, const GceToolsOptions& options);
+std::unique_ptr<DeviceEventSource> CreatePlatformEventSource();
+int ServeDiskMap(DiskMapService& service, DeviceEventSource* events, const GceToolsOptions& options);
+int RunLoadTest(DiskMapService& service, const GceToolsOptions& options);
+int PrintTopology(const DeviceBackendFactory& backendFactory, const std::vector<std::wstring>& deviceIds,
+    const GceToolsOptions& options);
+int PrintVolumes(DeviceEnumerator& enumerator, const DeviceBackendFactory& backendFactory,
+    const std::function<std::unique_ptr<VolumeCatalog>()>& createVolumeCatalog, const GceToolsOptions& options);
+int WriteSnapshot(const DeviceBackendFactory& backendFactory, const std::vector<std::wstring>& deviceIds,
+    const GceToolsOptions& options);
+int DiffSnapshots(const GceToolsOptions& options);
+int WatchDevices(DeviceEnumerator& enumerator, DeviceResolver& resolver, DeviceEventSource& events,
+    const GceToolsOptions& options);
+int SampleHealth(const DeviceBackendFactory& backendFactory, const std::vector<std::wstring>& deviceIds,
+    const GceToolsOptions& options);
+int ProbeDisk(DeviceResolver& resolver, const std::vector<std::wstring>& candidates, const DeviceBackendFactory& backendFactory,
+    const std::function<std::unique_ptr<VolumeCatalog>()>& createVolumeCatalog, const GceToolsOptions& options);
+bool CheckProbeWrites(const std::wstring& deviceId, const DeviceBackendFactory& backendFactory,
+    const std::function<std::unique_ptr<VolumeCatalog>()>& createVolumeCatalog, const GceToolsOptions& options);
+bool FindDevicesByName(DeviceResolver& resolver, const std::vector<std::wstring>& candidates,
+    const std::vector<std::string>& names, size_t* resolvedCount);
+bool SearchDevicesByName(DeviceResolver& resolver, const std::vector<std::wstring>& candidates,
+    const std::vector<std::string>& names, std::vector<std::wstring>* found, size_t* resolvedCount);
+std::vector<std::wstring> GetPhysicalDriveProbeIds();
+std::string GetHostName();
+void AddTargets(const char* list, GceToolsOptions* options, bool names);
+bool ParseIndexList(const char* list, std::vector<size_t>* indices);
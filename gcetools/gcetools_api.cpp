@@ -0,0 +1,216 @@
+/* Copyright 2022 Google LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#define _WIN32_DCOM
+#define GCETOOLS_API_EXPORTS
+#include "gcetools_api.h"
+#include "DeviceNameCache.h"
+#include "DeviceResolver.h"
+#include "GceToolsContext.h"
+#include "SimulatedDeviceBackend.h"
+#include "Utf8.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// Every name resolved is remembered for the life of the context, so only
+// the first call pays for a full identify of each disk.
+struct gcetools_context {
+    gcetools_context(std::unique_ptr<DeviceEnumerator> enumerator, DeviceBackendFactory backendFactory,
+        unsigned int threadCount)
+        : Context(std::move(enumerator), std::move(backendFactory), threadCount)
+    {
+        Context.SetNameCache(std::make_unique<DeviceNameCache>());
+    }
+
+    std::mutex Mutex;
+    GceToolsContext Context;
+    // Reused by every call, so resolving the same disks again does not
+    // allocate once they have grown.
+    std::vector<std::wstring> DeviceIds;
+};
+
+namespace {
+
+// Copies value into a NUL-terminated field, truncating it if it does not
+// fit. Returns false if it was truncated.
+template<size_t N>
+bool CopyField(std::string_view value, char (&field)[N]) {
+    size_t length = std::min(value.size(), N - 1);
+    memcpy(field, value.data(), length);
+    field[length] = '\0';
+    return length == value.size();
+}
+
+void CopyResolution(const DeviceResolution& resolution, gcetools_disk* disk) {
+    disk->status = resolution.TimedOut ? GCETOOLS_TIMED_OUT : resolution.Error.empty() ? GCETOOLS_OK : GCETOOLS_DEVICE_FAILED;
+    CopyField(resolution.Error, disk->error);
+    if (!CopyField(ToUtf8(resolution.DeviceId), disk->device_id) || !CopyField(resolution.Name, disk->name)) {
+        disk->status = GCETOOLS_BUFFER_TOO_SMALL;
+    }
+}
+
+// Resolves context->DeviceIds into disks.
+void ResolveDeviceIds(gcetools_context* context, gcetools_disk* disks) {
+    const std::vector<std::wstring>& deviceIds = context->DeviceIds;
+    size_t index = 0;
+    context->Context.GetResolver().Resolve(deviceIds, [&](const DeviceResolution& resolution) {
+        CopyResolution(resolution, &disks[index++]);
+    });
+}
+
+}
+
+uint32_t gcetools_api_version(void) {
+    return GCETOOLS_API_VERSION;
+}
+
+void gcetools_init_options(gcetools_options* options) {
+    if (options == nullptr) {
+        return;
+    }
+    *options = gcetools_options();
+    options->size = sizeof(gcetools_options);
+    options->thread_count = DeviceResolver::DefaultThreadCount;
+    options->device_timeout_ms = (uint32_t)DeviceResolver::DefaultDeviceTimeout.count();
+}
+
+gcetools_status gcetools_open(const gcetools_options* options, gcetools_context** context) {
+    if (context == nullptr) {
+        return GCETOOLS_INVALID_ARGUMENT;
+    }
+    *context = nullptr;
+
+    gcetools_options defaults;
+    gcetools_init_options(&defaults);
+    if (options == nullptr) {
+        options = &defaults;
+    }
+    else if (options->size != sizeof(gcetools_options)) {
+        return GCETOOLS_VERSION_MISMATCH;
+    }
+
+    try {
+        std::unique_ptr<DeviceEnumerator> enumerator;
+        DeviceBackendFactory backendFactory;
+        if (options->simulated_device_count > 0) {
+            auto simulatedDevices = std::make_unique<SimulatedDeviceSet>(options->simulated_device_count,
+                std::chrono::microseconds(options->simulated_latency_us));
+            backendFactory = simulatedDevices->GetBackendFactory();
+            enumerator = std::move(simulatedDevices);
+        }
+        else {
+            enumerator = CreateDeviceEnumerator(EnumeratorKind::Auto);
+            backendFactory = CreateDeviceBackendFactory();
+            if (!backendFactory) {
+                return GCETOOLS_NOT_SUPPORTED;
+            }
+        }
+
+        auto created = std::make_unique<gcetools_context>(std::move(enumerator), std::move(backendFactory),
+            std::max(options->thread_count, 1u));
+        DeviceResolver& resolver = created->Context.GetResolver();
+        resolver.SetDeviceTimeout(std::chrono::milliseconds(options->device_timeout_ms));
+        resolver.SetNvmeBatching((options->flags & GCETOOLS_FLAG_BATCH_NVME) != 0);
+        *context = created.release();
+        return GCETOOLS_OK;
+    }
+    catch (const std::exception&) {
+        return GCETOOLS_INTERNAL_ERROR;
+    }
+}
+
+void gcetools_close(gcetools_context* context) {
+    delete context;
+}
+
+gcetools_status gcetools_resolve(gcetools_context* context, const char* const* device_ids, size_t count,
+    gcetools_disk* disks) {
+    if (context == nullptr || (count > 0 && (device_ids == nullptr || disks == nullptr))) {
+        return GCETOOLS_INVALID_ARGUMENT;
+    }
+
+    try {
+        std::lock_guard<std::mutex> lock(context->Mutex);
+        context->DeviceIds.resize(count);
+        for (size_t i = 0; i < count; i++) {
+            if (device_ids[i] == nullptr) {
+                return GCETOOLS_INVALID_ARGUMENT;
+            }
+            context->DeviceIds[i] = FromUtf8(device_ids[i]);
+        }
+        ResolveDeviceIds(context, disks);
+        return GCETOOLS_OK;
+    }
+    catch (const std::exception&) {
+        return GCETOOLS_INTERNAL_ERROR;
+    }
+}
+
+gcetools_status gcetools_resolve_all(gcetools_context* context, gcetools_disk* disks, size_t capacity,
+    size_t* count) {
+    if (context == nullptr || count == nullptr || (capacity > 0 && disks == nullptr)) {
+        return GCETOOLS_INVALID_ARGUMENT;
+    }
+    *count = 0;
+
+    try {
+        std::lock_guard<std::mutex> lock(context->Mutex);
+        try {
+            context->DeviceIds = context->Context.GetEnumerator().EnumerateDeviceIds();
+        }
+        catch (const std::exception&) {
+            return GCETOOLS_ENUMERATION_FAILED;
+        }
+        *count = context->DeviceIds.size();
+        if (context->DeviceIds.size() > capacity) {
+            return GCETOOLS_BUFFER_TOO_SMALL;
+        }
+        ResolveDeviceIds(context, disks);
+        return GCETOOLS_OK;
+    }
+    catch (const std::exception&) {
+        return GCETOOLS_INTERNAL_ERROR;
+    }
+}
+
+const char* gcetools_status_message(gcetools_status status) {
+    switch (status) {
+    case GCETOOLS_OK:
+        return "OK";
+    case GCETOOLS_INVALID_ARGUMENT:
+        return "Invalid argument";
+    case GCETOOLS_VERSION_MISMATCH:
+        return "The caller was built against an incompatible version of gcetools_api";
+    case GCETOOLS_ENUMERATION_FAILED:
+        return "Failed to enumerate devices";
+    case GCETOOLS_BUFFER_TOO_SMALL:
+        return "Buffer too small";
+    case GCETOOLS_DEVICE_FAILED:
+        return "Failed to resolve device";
+    case GCETOOLS_TIMED_OUT:
+        return "Timed out";
+    case GCETOOLS_NOT_SUPPORTED:
+        return "Only simulated devices can be resolved on this platform";
+    default:
+        return "Internal error";
+    }
+}
@@ -0,0 +1,134 @@
+/* Copyright 2022 Google LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * The C interface of the gcetools_api shared library, for resolving GCE disk
+ * names in-process instead of running gcetools for every lookup.
+ *
+ * Open one context and keep it: it holds the enumerator, the resolver and
+ * the names already resolved, so a disk seen before costs one driver query.
+ * Results are written into arrays the caller provides, and nothing the
+ * library allocates is ever handed back, so the library and its caller can
+ * use different runtimes. Every string is UTF-8 and NUL-terminated.
+ *
+ * A context may be used from several threads; its calls are serialized.
+ * Separate contexts are independent.
+ */
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#if defined(_WIN32)
+#if defined(GCETOOLS_API_EXPORTS)
+#define GCETOOLS_API __declspec(dllexport)
+#else
+#define GCETOOLS_API __declspec(dllimport)
+#endif
+#else
+#define GCETOOLS_API __attribute__((visibility("default")))
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Bumped whenever a struct or function changes incompatibly. */
+#define GCETOOLS_API_VERSION 1
+
+#define GCETOOLS_MAX_DEVICE_ID 256
+#define GCETOOLS_MAX_NAME 256
+#define GCETOOLS_MAX_ERROR 256
+
+/* Returned by every call, and reported for each disk. */
+typedef int32_t gcetools_status;
+#define GCETOOLS_OK 0
+#define GCETOOLS_INVALID_ARGUMENT 1
+/* The caller was built against a newer, incompatible version. */
+#define GCETOOLS_VERSION_MISMATCH 2
+/* The attached disks could not be listed. */
+#define GCETOOLS_ENUMERATION_FAILED 3
+/* The array, or a disk's fields, are too small for the result. */
+#define GCETOOLS_BUFFER_TOO_SMALL 4
+/* A disk could not be opened or queried; see its error. */
+#define GCETOOLS_DEVICE_FAILED 5
+/* A disk did not answer before its deadline. */
+#define GCETOOLS_TIMED_OUT 6
+/* Only simulated disks can be resolved on this platform. */
+#define GCETOOLS_NOT_SUPPORTED 7
+#define GCETOOLS_INTERNAL_ERROR 8
+
+/* Read all of an NVMe controller's namespaces through its first disk. */
+#define GCETOOLS_FLAG_BATCH_NVME 0x1
+
+typedef struct gcetools_options {
+	/* sizeof(gcetools_options), set by gcetools_init_options. */
+	uint32_t size;
+	/* Number of disks resolved concurrently. */
+	uint32_t thread_count;
+	/* How long each disk is given to be opened and queried. 0 waits for as
+	 * long as it takes. */
+	uint32_t device_timeout_ms;
+	/* When non-zero, resolve this many simulated disks, each taking
+	 * simulated_latency_us per handle open and driver query, instead of the
+	 * attached disks. */
+	uint32_t simulated_device_count;
+	uint32_t simulated_latency_us;
+	/* GCETOOLS_FLAG_* */
+	uint32_t flags;
+} gcetools_options;
+
+typedef struct gcetools_disk {
+	/* GCETOOLS_OK, or why the disk has no name. A disk that is not a GCE
+	 * disk is GCETOOLS_OK with an empty name. */
+	gcetools_status status;
+	char device_id[GCETOOLS_MAX_DEVICE_ID];
+	char name[GCETOOLS_MAX_NAME];
+	/* Empty unless status is GCETOOLS_DEVICE_FAILED or GCETOOLS_TIMED_OUT. */
+	char error[GCETOOLS_MAX_ERROR];
+} gcetools_disk;
+
+typedef struct gcetools_context gcetools_context;
+
+/* The GCETOOLS_API_VERSION the library was built with. */
+GCETOOLS_API uint32_t gcetools_api_version(void);
+
+/* Fills options with the defaults the gcetools CLI uses. */
+GCETOOLS_API void gcetools_init_options(gcetools_options* options);
+
+/* Creates a context. options may be null, for the defaults. */
+GCETOOLS_API gcetools_status gcetools_open(const gcetools_options* options, gcetools_context** context);
+
+GCETOOLS_API void gcetools_close(gcetools_context* context);
+
+/* Resolves count disks, given by DeviceId, into disks[0..count), in order.
+ * Returns GCETOOLS_OK once every disk has a result, even if some of them
+ * failed; each disk's status says which. */
+GCETOOLS_API gcetools_status gcetools_resolve(gcetools_context* context, const char* const* device_ids, size_t count,
+	gcetools_disk* disks);
+
+/* Lists the attached disks and resolves each of them into disks, in
+ * DeviceId order, setting *count to the number of disks. If there are more
+ * than capacity, nothing is resolved, *count is set to the number needed
+ * and GCETOOLS_BUFFER_TOO_SMALL is returned. */
+GCETOOLS_API gcetools_status gcetools_resolve_all(gcetools_context* context, gcetools_disk* disks, size_t capacity,
+	size_t* count);
+
+/* A static description of a status, never null. */
+GCETOOLS_API const char* gcetools_status_message(gcetools_status status);
+
+#ifdef __cplusplus
+}
+#endif
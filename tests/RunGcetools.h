@@ -0,0 +1,69 @@
+/* Copyright 2022 Google LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#pragma once
+
+#include <gtest/gtest.h>
+
+#include <chrono>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+#ifdef _WIN32
+#define popen _popen
+#define pclose _pclose
+#else
+#include <sys/wait.h>
+#endif
+
+struct GcetoolsRun {
+	// What gcetools printed to stdout, split at each newline.
+	std::vector<std::string> Lines;
+	// -1 if gcetools could not be run or did not exit normally.
+	int ExitCode = -1;
+	std::chrono::milliseconds Elapsed{ 0 };
+};
+
+// Runs the gcetools executable under test with arguments, and returns what it
+// printed, how it exited and how long it took.
+inline GcetoolsRun RunGcetools(const std::string& arguments) {
+	std::string command = "\"" GCETOOLS_EXECUTABLE "\" " + arguments;
+	GcetoolsRun run;
+	auto start = std::chrono::steady_clock::now();
+	FILE* output = popen(command.c_str(), "r");
+	if (output == nullptr) {
+		ADD_FAILURE() << "Failed to run " << command;
+		return run;
+	}
+	std::string text;
+	char buffer[4096];
+	size_t read;
+	while ((read = fread(buffer, 1, sizeof(buffer), output)) > 0) {
+		text.append(buffer, read);
+	}
+	int status = pclose(output);
+	run.Elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start);
+#ifdef _WIN32
+	run.ExitCode = status;
+#else
+	if (status != -1 && WIFEXITED(status)) {
+		run.ExitCode = WEXITSTATUS(status);
+	}
+#endif
+	for (size_t lineStart = 0, lineEnd; (lineEnd = text.find('\n', lineStart)) != std::string::npos; lineStart = lineEnd + 1) {
+		run.Lines.push_back(text.substr(lineStart, lineEnd - lineStart));
+	}
+	return run;
+}
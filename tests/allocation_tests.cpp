@@ -0,0 +1,88 @@
+/* Copyright 2022 Google LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include <gtest/gtest.h>
+
+#include <chrono>
+#include <cstdlib>
+#include <memory>
+#include <new>
+#include <string>
+#include "GoogleStorageDevice.h"
+#include "SimulatedDeviceBackend.h"
+
+// Counts every allocation made on the calling thread, so that the name path
+// can be held to making none once its buffers have warmed up.
+namespace {
+thread_local size_t allocationCount = 0;
+}
+
+// Kept out of line: once inlined, GCC pairs malloc() and free() with the
+// operators they are called through and warns that they do not match.
+#if defined(__GNUC__)
+#define GCETOOLS_NOINLINE __attribute__((noinline))
+#else
+#define GCETOOLS_NOINLINE
+#endif
+
+GCETOOLS_NOINLINE void* operator new(size_t size) {
+	allocationCount++;
+	void* memory = malloc(size == 0 ? 1 : size);
+	if (memory == nullptr) {
+		throw std::bad_alloc();
+	}
+	return memory;
+}
+
+GCETOOLS_NOINLINE void operator delete(void* memory) noexcept {
+	free(memory);
+}
+
+GCETOOLS_NOINLINE void operator delete(void* memory, size_t) noexcept {
+	free(memory);
+}
+
+namespace {
+
+constexpr int Lookups = 1000;
+
+// Names disk index of a simulated set repeatedly, after one warm-up lookup,
+// and returns how many allocations the later lookups made.
+size_t CountAllocationsPerName(size_t index, std::string& name) {
+	SimulatedDeviceSet devices(2, std::chrono::microseconds(0));
+	const SimulatedDisk& disk = devices.GetDisks()[index];
+	GoogleStorageDevice device(std::make_unique<SimulatedDeviceBackend>(disk, devices.GetControllers()[index]));
+	device.GetDeviceName(name);
+	EXPECT_EQ(name, disk.Name);
+
+	size_t before = allocationCount;
+	for (int i = 0; i < Lookups; i++) {
+		device.GetDeviceName(name);
+	}
+	size_t allocations = allocationCount - before;
+	EXPECT_EQ(name, disk.Name);
+	return allocations;
+}
+
+TEST(AllocationTest, NvmeNameAllocatesNothingOnceWarm) {
+	std::string name;
+	EXPECT_EQ(CountAllocationsPerName(0, name), 0u);
+}
+
+TEST(AllocationTest, ScsiNameAllocatesNothingOnceWarm) {
+	std::string name;
+	EXPECT_EQ(CountAllocationsPerName(1, name), 0u);
+}
+
+}  // namespace
@@ -0,0 +1,129 @@
+/* Copyright 2022 Google LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include <gtest/gtest.h>
+
+#include <algorithm>
+#include <chrono>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include "GoogleStorageDevice.h"
+#include "SimulatedDeviceBackend.h"
+#include "StorageIdentifiers.h"
+
+namespace {
+
+constexpr size_t NvmeDisk = 0;
+constexpr size_t ScsiDisk = 1;
+constexpr DWORD IdentifiersOffset = FIELD_OFFSET(STORAGE_DEVICE_ID_DESCRIPTOR, Identifiers);
+
+// A simulated disk whose device ID descriptor comes back cut short: claiming
+// to be claimedSize bytes, and with only writtenSize bytes written, as a
+// misbehaving driver's can. Every other query is answered in full.
+class TruncatedDeviceIdBackend : public DeviceBackend {
+public:
+	TruncatedDeviceIdBackend(size_t index, DWORD claimedSize, DWORD writtenSize)
+		: claimedSize_(claimedSize), writtenSize_(writtenSize)
+	{
+		static const SimulatedDeviceSet devices(2, std::chrono::microseconds(0));
+		disk_ = std::make_unique<SimulatedDeviceBackend>(devices.GetDisks()[index], devices.GetControllers()[index]);
+	}
+
+	DWORD QueryProperty(const void* inputBuffer, DWORD inputBufferSize,
+		void* outputBuffer, DWORD outputBufferSize, DWORD* bytesReturned) override {
+		DWORD err = disk_->QueryProperty(inputBuffer, inputBufferSize, outputBuffer, outputBufferSize, bytesReturned);
+		if (err == ERROR_SUCCESS && ((const STORAGE_PROPERTY_QUERY*)inputBuffer)->PropertyId == STORAGE_PROPERTY_ID::StorageDeviceIdProperty) {
+			STORAGE_DESCRIPTOR_HEADER* header = (STORAGE_DESCRIPTOR_HEADER*)outputBuffer;
+			header->Size = std::min(header->Size, claimedSize_);
+			*bytesReturned = std::min(*bytesReturned, writtenSize_);
+		}
+		return err;
+	}
+
+private:
+	std::unique_ptr<DeviceBackend> disk_;
+	DWORD claimedSize_;
+	DWORD writtenSize_;
+};
+
+// Sizes around the end of the header and of Identifiers' offset, and one
+// that cuts the first identifier short.
+const DWORD TruncatedSizes[] = { 0, 4, sizeof(STORAGE_DESCRIPTOR_HEADER), IdentifiersOffset - 1, IdentifiersOffset,
+	IdentifiersOffset + 1, IdentifiersOffset + FIELD_OFFSET(STORAGE_IDENTIFIER, Identifier) + 4 };
+
+// Reads the identity and the name through a descriptor cut to claimedSize
+// and writtenSize bytes, which must neither crash nor read past what was
+// written.
+void CheckTruncatedDescriptor(size_t index, DWORD claimedSize, DWORD writtenSize) {
+	SCOPED_TRACE("disk " + std::to_string(index) + ", claimed " + std::to_string(claimedSize) +
+		", written " + std::to_string(writtenSize));
+	GoogleStorageDevice device(std::make_unique<TruncatedDeviceIdBackend>(index, claimedSize, writtenSize));
+
+	std::string identity;
+	DWORD identifierCount = 0;
+	device.GetDeviceIdentity(identity, &identifierCount);
+	DWORD size = std::min(claimedSize, writtenSize);
+	EXPECT_EQ(identity.size(), size > IdentifiersOffset ? size - IdentifiersOffset : 0);
+	if (identity.empty()) {
+		EXPECT_EQ(identifierCount, 0u);
+	}
+	VisitStorageIdentifiers((const BYTE*)identity.data(), identity.size(), identifierCount,
+		[&identity](const StorageIdentifierView& identifier) {
+			EXPECT_GE(identifier.Value.data(), identity.data());
+			EXPECT_LE(identifier.Value.data() + identifier.Value.size(), identity.data() + identity.size());
+			return true;
+		});
+
+	// The NVMe name needs the SCSI name string, which is missing.
+	std::string name;
+	try {
+		device.GetDeviceName(name);
+	}
+	catch (const std::runtime_error&) {
+	}
+	EXPECT_EQ(name, "");
+}
+
+TEST(DeviceIdentityTest, UndersizedDescriptors) {
+	for (size_t index : { NvmeDisk, ScsiDisk }) {
+		for (DWORD claimedSize : TruncatedSizes) {
+			CheckTruncatedDescriptor(index, claimedSize, UINT32_MAX);
+		}
+	}
+}
+
+TEST(DeviceIdentityTest, TruncatedDescriptors) {
+	for (size_t index : { NvmeDisk, ScsiDisk }) {
+		for (DWORD writtenSize : TruncatedSizes) {
+			CheckTruncatedDescriptor(index, UINT32_MAX, writtenSize);
+		}
+	}
+}
+
+TEST(DeviceIdentityTest, WholeDescriptors) {
+	for (size_t index : { NvmeDisk, ScsiDisk }) {
+		GoogleStorageDevice device(std::make_unique<TruncatedDeviceIdBackend>(index, UINT32_MAX, UINT32_MAX));
+		std::string identity;
+		DWORD identifierCount = 0;
+		device.GetDeviceIdentity(identity, &identifierCount);
+		EXPECT_FALSE(identity.empty());
+		EXPECT_GT(identifierCount, 0u);
+		std::string name;
+		device.GetDeviceName(name);
+		EXPECT_EQ(name, "persistent-disk-" + std::to_string(index));
+	}
+}
+
+}
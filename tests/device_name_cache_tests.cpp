@@ -0,0 +1,188 @@
+/* Copyright 2022 Google LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include <gtest/gtest.h>
+
+#include <atomic>
+#include <chrono>
+#include <filesystem>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include "DeviceNameCache.h"
+#include "DeviceResolver.h"
+#include "SimulatedDeviceBackend.h"
+
+namespace {
+
+const std::wstring DeviceId = L"\\\\.\\PHYSICALDRIVE0";
+
+// One slot holding whichever disk was attached last, as a VM's does when a
+// disk is detached and another attached in its place.
+class DiskSlot {
+public:
+	void Attach(const SimulatedDisk& disk) {
+		std::lock_guard<std::mutex> lock(mutex_);
+		disk_ = disk;
+		controller_ = std::make_shared<const SimulatedController>(1, disk);
+	}
+
+	DeviceBackendFactory GetBackendFactory() {
+		return [this](const std::wstring&) -> std::unique_ptr<DeviceBackend> {
+			std::lock_guard<std::mutex> lock(mutex_);
+			return std::make_unique<SimulatedDeviceBackend>(disk_, controller_);
+		};
+	}
+
+private:
+	std::mutex mutex_;
+	SimulatedDisk disk_;
+	std::shared_ptr<const SimulatedController> controller_;
+};
+
+SimulatedDisk MakeNvmeDisk(const std::string& name, uint64_t attachSequence) {
+	return SimulatedDisk{ STORAGE_BUS_TYPE::BusTypeNvme, name, 1, "sim-0", std::chrono::microseconds(0), attachSequence };
+}
+
+// Resolves the slot's disk and returns its name, and how many driver queries
+// that took.
+std::string Resolve(DeviceResolver& resolver, uint64_t* queries) {
+	uint64_t before = StorageDevice::GetIoctlCount();
+	DeviceResolution resolution = resolver.ResolveOne(DeviceId);
+	*queries = StorageDevice::GetIoctlCount() - before;
+	EXPECT_EQ(resolution.Error, "");
+	return resolution.Name;
+}
+
+TEST(DeviceNameCacheTest, HitsForTheSameAttach) {
+	DiskSlot slot;
+	slot.Attach(MakeNvmeDisk("disk-a", 1));
+	DeviceNameCache cache;
+	DeviceResolver resolver(slot.GetBackendFactory());
+	resolver.SetNameCache(&cache);
+
+	uint64_t coldQueries = 0;
+	uint64_t warmQueries = 0;
+	EXPECT_EQ(Resolve(resolver, &coldQueries), "disk-a");
+	EXPECT_EQ(Resolve(resolver, &warmQueries), "disk-a");
+	EXPECT_LT(warmQueries, coldQueries);
+}
+
+TEST(DeviceNameCacheTest, ReattachedDiskWithTheSameIdentifiersIsResolvedAgain) {
+	DiskSlot slot;
+	slot.Attach(MakeNvmeDisk("disk-a", 1));
+	DeviceNameCache cache;
+	DeviceResolver resolver(slot.GetBackendFactory());
+	resolver.SetNameCache(&cache);
+
+	uint64_t queries = 0;
+	EXPECT_EQ(Resolve(resolver, &queries), "disk-a");
+	// Same controller serial number and namespace ID, attached anew.
+	slot.Attach(MakeNvmeDisk("disk-b", 2));
+	EXPECT_EQ(Resolve(resolver, &queries), "disk-b");
+}
+
+TEST(DeviceNameCacheTest, SavedNamesAreFoundByTheNextRun) {
+	std::filesystem::path path = std::filesystem::temp_directory_path() /
+		("gcetools-name-cache-" + std::to_string(std::chrono::steady_clock::now().time_since_epoch().count()));
+	DiskSlot slot;
+	slot.Attach(MakeNvmeDisk("disk-a", 1));
+	uint64_t coldQueries = 0;
+	uint64_t warmQueries = 0;
+	{
+		DeviceNameCache cache(path);
+		DeviceResolver resolver(slot.GetBackendFactory());
+		resolver.SetNameCache(&cache);
+		EXPECT_EQ(Resolve(resolver, &coldQueries), "disk-a");
+		cache.Save();
+	}
+	{
+		DeviceNameCache cache(path);
+		DeviceResolver resolver(slot.GetBackendFactory());
+		resolver.SetNameCache(&cache);
+		EXPECT_EQ(Resolve(resolver, &warmQueries), "disk-a");
+	}
+	EXPECT_LT(warmQueries, coldQueries);
+	DeviceNameCache::Invalidate(path);
+}
+
+// A long-running service saves more than once. Entries it never looked up
+// are only in the file, so the file must be mapped again after each save.
+TEST(DeviceNameCacheTest, SavingTwiceKeepsEntriesNeverLookedUp) {
+	std::filesystem::path path = std::filesystem::temp_directory_path() /
+		("gcetools-name-cache-" + std::to_string(std::chrono::steady_clock::now().time_since_epoch().count()));
+	{
+		DeviceNameCache cache(path);
+		cache.Insert("key-a", "disk-a");
+		cache.Insert("key-b", "disk-b");
+		cache.Save();
+	}
+	{
+		DeviceNameCache cache(path);
+		std::string name;
+		EXPECT_TRUE(cache.Lookup("key-a", name));
+		cache.Insert("key-c", "disk-c");
+		cache.Save();
+		cache.Insert("key-d", "disk-d");
+		cache.Save();
+		EXPECT_TRUE(cache.Lookup("key-b", name));
+		EXPECT_EQ(name, "disk-b");
+	}
+
+	DeviceNameCache cache(path);
+	for (const char* key : { "key-a", "key-b", "key-c", "key-d" }) {
+		std::string name;
+		EXPECT_TRUE(cache.Lookup(key, name)) << key;
+	}
+	DeviceNameCache::Invalidate(path);
+}
+
+// Save() unmaps the file that lookups read, so it must not do so under them.
+TEST(DeviceNameCacheTest, LookupsRaceSave) {
+	std::filesystem::path path = std::filesystem::temp_directory_path() /
+		("gcetools-name-cache-" + std::to_string(std::chrono::steady_clock::now().time_since_epoch().count()));
+	constexpr int Keys = 256;
+	{
+		DeviceNameCache cache(path);
+		for (int i = 0; i < Keys; i++) {
+			cache.Insert("key-" + std::to_string(i), "disk-" + std::to_string(i));
+		}
+		cache.Save();
+	}
+
+	DeviceNameCache cache(path);
+	std::atomic<bool> saved = false;
+	std::vector<std::thread> readers;
+	for (int reader = 0; reader < 4; reader++) {
+		readers.emplace_back([&cache, &saved]() {
+			std::string name;
+			for (int i = 0; !saved || i < Keys; i++) {
+				if (cache.Lookup("key-" + std::to_string(i % Keys), name)) {
+					EXPECT_EQ(name, "disk-" + std::to_string(i % Keys));
+				}
+			}
+		});
+	}
+	cache.Insert("key-new", "disk-new");
+	cache.Save();
+	saved = true;
+	for (std::thread& reader : readers) {
+		reader.join();
+	}
+	DeviceNameCache::Invalidate(path);
+}
+
+}
@@ -0,0 +1,115 @@
+/* Copyright 2022 Google LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include <gtest/gtest.h>
+
+#include <string>
+#include <vector>
+#include "RunGcetools.h"
+
+namespace {
+
+constexpr int DeviceTimeoutMs = 1000;
+// What the rest of a run may take on top of the hung disk's timeout, on a
+// slow machine.
+constexpr int SlackMs = 1000;
+
+// Makes the second disk slow, but well within its deadline.
+const std::string SlowDisk = "--simulated-slow 2 --simulated-slow-latency-us 50000";
+
+// Runs gcetools against four simulated disks, the first of which never
+// answers a query.
+GcetoolsRun RunWithHungDisk(const std::string& arguments) {
+	return RunGcetools("--simulate 4 --simulated-hung 0 --device-timeout-ms " + std::to_string(DeviceTimeoutMs) + " " + arguments);
+}
+
+// Every disk gets a record, the hung one an error, and the run is held up by
+// no more than the hung disk's timeout.
+void CheckBoundedByTimeout(const std::string& arguments) {
+	SCOPED_TRACE(arguments);
+	GcetoolsRun run = RunWithHungDisk(arguments);
+	ASSERT_EQ(run.Lines.size(), 4u);
+	size_t errors = 0;
+	for (const std::string& line : run.Lines) {
+		errors += line.find("\"error\":") != std::string::npos;
+	}
+	EXPECT_EQ(errors, 1u);
+	EXPECT_EQ(run.ExitCode, 1);
+	EXPECT_LT(run.Elapsed.count(), DeviceTimeoutMs + SlackMs);
+}
+
+// The disks that answer are named, the ones that time out leave an empty
+// line, the run exits 1 because of them, and is held up by no more than one
+// timeout while the workers stuck on them are abandoned.
+void CheckNames(const std::string& arguments, const std::vector<std::string>& expected) {
+	SCOPED_TRACE(arguments);
+	GcetoolsRun run = RunWithHungDisk(arguments);
+	EXPECT_EQ(run.Lines, expected);
+	EXPECT_EQ(run.ExitCode, 1);
+	EXPECT_LT(run.Elapsed.count(), DeviceTimeoutMs + SlackMs);
+}
+
+TEST(DeviceTimeoutTest, NamesSkipHungDisk) {
+	CheckNames(SlowDisk, { "", "persistent-disk-1", "persistent-disk-2", "persistent-disk-3" });
+}
+
+// Slow disks default to 5 s per query, far past the deadline.
+TEST(DeviceTimeoutTest, NamesSkipDiskSlowerThanItsDeadline) {
+	CheckNames("--simulated-slow 1", { "", "", "persistent-disk-2", "persistent-disk-3" });
+}
+
+TEST(DeviceTimeoutTest, JsonLinesMarkHungDiskTimedOut) {
+	GcetoolsRun run = RunWithHungDisk(SlowDisk + " --format jsonl");
+	ASSERT_EQ(run.Lines.size(), 4u);
+	EXPECT_EQ(run.Lines[0].rfind(R"({"device":"\\\\.\\PHYSICALDRIVE0","bus":null,"name":"","error":"Timed out after 1000 ms.","timed_out":true,)", 0), 0u)
+		<< run.Lines[0];
+	for (size_t i = 1; i < run.Lines.size(); i++) {
+		EXPECT_NE(run.Lines[i].find(R"("name":"persistent-disk-)" + std::to_string(i) + R"(","error":null,"timed_out":false,)"), std::string::npos)
+			<< run.Lines[i];
+	}
+	EXPECT_EQ(run.ExitCode, 1);
+	EXPECT_LT(run.Elapsed.count(), DeviceTimeoutMs + SlackMs);
+}
+
+TEST(DeviceTimeoutTest, HealthyDisksExitZero) {
+	GcetoolsRun run = RunGcetools("--simulate 4 --device-timeout-ms " + std::to_string(DeviceTimeoutMs) + " " + SlowDisk);
+	std::vector<std::string> expected = { "persistent-disk-0", "persistent-disk-1", "persistent-disk-2", "persistent-disk-3" };
+	EXPECT_EQ(run.Lines, expected);
+	EXPECT_EQ(run.ExitCode, 0);
+}
+
+TEST(DeviceTimeoutTest, TopologySkipsHungDisk) {
+	CheckBoundedByTimeout("--topology");
+}
+
+TEST(DeviceTimeoutTest, VolumesSkipHungDisk) {
+	CheckBoundedByTimeout("--volumes");
+}
+
+#ifdef __linux__
+// Listed as sda, sdb, nvme0n1 and nvme1n1, the hung NVMe disk third.
+TEST(DeviceTimeoutTest, LinuxNamesSkipHungDisk) {
+	CheckNames("--simulate-linux " + SlowDisk, { "persistent-disk-1", "persistent-disk-3", "", "persistent-disk-2" });
+}
+
+TEST(DeviceTimeoutTest, LinuxTopologySkipsHungDisk) {
+	CheckBoundedByTimeout("--topology --simulate-linux");
+}
+
+TEST(DeviceTimeoutTest, LinuxVolumesSkipHungDisk) {
+	CheckBoundedByTimeout("--volumes --simulate-linux");
+}
+#endif
+
+}
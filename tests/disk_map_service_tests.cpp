@@ -0,0 +1,207 @@
+/* Copyright 2022 Google LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include <gtest/gtest.h>
+
+#include <algorithm>
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+#include "DeviceEvents.h"
+#include "DeviceResolver.h"
+#include "DiskMapService.h"
+#include "SimulatedDeviceBackend.h"
+#include "Utf8.h"
+
+namespace {
+
+// Lists the first count of a set of simulated disks, so disks can be
+// attached and detached by changing count. Every DeviceId opened is
+// remembered.
+class AttachedDisks : public DeviceEnumerator {
+public:
+	explicit AttachedDisks(size_t count) : devices_(4, std::chrono::microseconds(0)), count_(count) {
+	}
+
+	const char* GetName() const override {
+		return "Attached";
+	}
+
+	std::vector<std::wstring> EnumerateDeviceIds() override {
+		std::lock_guard<std::mutex> lock(mutex_);
+		std::vector<std::wstring> deviceIds = devices_.GetDeviceIds();
+		deviceIds.resize(count_);
+		return deviceIds;
+	}
+
+	void SetCount(size_t count) {
+		std::lock_guard<std::mutex> lock(mutex_);
+		count_ = count;
+	}
+
+	std::wstring GetDeviceId(size_t index) const {
+		return devices_.GetDeviceIds()[index];
+	}
+
+	DeviceBackendFactory GetBackendFactory() {
+		return [this, factory = devices_.GetBackendFactory()](const std::wstring& deviceId) {
+			{
+				std::lock_guard<std::mutex> lock(mutex_);
+				opened_.push_back(deviceId);
+			}
+			return factory(deviceId);
+		};
+	}
+
+	std::vector<std::wstring> GetOpened() {
+		std::lock_guard<std::mutex> lock(mutex_);
+		return opened_;
+	}
+
+private:
+	SimulatedDeviceSet devices_;
+	std::mutex mutex_;
+	size_t count_;
+	std::vector<std::wstring> opened_;
+};
+
+// Reports a fixed list of events, then stops.
+class ScriptedEvents : public DeviceEventSource {
+public:
+	void Add(DeviceEventKind kind, std::wstring deviceId) {
+		events_.push_back(DeviceEvent{ kind, std::move(deviceId), DeviceEvent::Clock::now() });
+	}
+
+	bool Wait(DeviceEvent& event) override {
+		if (next_ == events_.size()) {
+			return false;
+		}
+		event = events_[next_++];
+		return true;
+	}
+
+	void Stop() override {
+	}
+
+private:
+	std::vector<DeviceEvent> events_;
+	size_t next_ = 0;
+};
+
+TEST(DiskMapServiceTest, FollowsDisksAttachedAndDetached) {
+	AttachedDisks disks(3);
+	DeviceResolver resolver(disks.GetBackendFactory());
+	DiskMapService service(disks, resolver);
+
+	ScriptedEvents events;
+	events.Add(DeviceEventKind::Arrived, disks.GetDeviceId(0));
+	events.Add(DeviceEventKind::Arrived, disks.GetDeviceId(1));
+	events.Add(DeviceEventKind::Arrived, disks.GetDeviceId(2));
+	events.Add(DeviceEventKind::Removed, disks.GetDeviceId(0));
+	service.Follow(events);
+
+	std::string deviceId;
+	EXPECT_TRUE(service.GetIndex().FindDevice("persistent-disk-2", deviceId));
+	EXPECT_EQ(deviceId, ToUtf8(disks.GetDeviceId(2)));
+	EXPECT_FALSE(service.GetIndex().FindDevice("persistent-disk-0", deviceId));
+	EXPECT_TRUE(service.GetIndex().FindDevice("persistent-disk-1", deviceId));
+}
+
+std::string Request(DiskMapService& service, std::string_view request) {
+	std::string response;
+	service.HandleRequest(request, response);
+	return response;
+}
+
+TEST(DiskMapServiceTest, AnswersLookups) {
+	AttachedDisks disks(2);
+	DeviceResolver resolver(disks.GetBackendFactory());
+	DiskMapService service(disks, resolver);
+	std::string deviceId0 = ToUtf8(disks.GetDeviceId(0));
+	std::string deviceId1 = ToUtf8(disks.GetDeviceId(1));
+
+	EXPECT_EQ(Request(service, "REFRESH"), "OK 2\n");
+	EXPECT_EQ(Request(service, "NAME " + deviceId0), "OK persistent-disk-0\n");
+	EXPECT_EQ(Request(service, "NAME " + deviceId0 + "\r"), "OK persistent-disk-0\n");
+	EXPECT_EQ(Request(service, "DEVICE persistent-disk-1"), "OK " + deviceId1 + "\n");
+	EXPECT_EQ(Request(service, "NAME " + ToUtf8(disks.GetDeviceId(2))), "NOTFOUND\n");
+	EXPECT_EQ(Request(service, "DEVICE persistent-disk-2"), "NOTFOUND\n");
+
+	std::string list = Request(service, "LIST");
+	EXPECT_EQ(list.substr(0, list.find('\n') + 1), "OK 2\n");
+	EXPECT_NE(list.find(deviceId0 + "\tpersistent-disk-0\n"), std::string::npos);
+	EXPECT_NE(list.find(deviceId1 + "\tpersistent-disk-1\n"), std::string::npos);
+}
+
+TEST(DiskMapServiceTest, RefreshOnlyOpensEnumeratedDevices) {
+	AttachedDisks disks(2);
+	DeviceResolver resolver(disks.GetBackendFactory());
+	DiskMapService service(disks, resolver);
+
+	EXPECT_EQ(Request(service, "REFRESH /etc/passwd"), "NOTFOUND\n");
+	// Attached, but not yet listed.
+	EXPECT_EQ(Request(service, "REFRESH " + ToUtf8(disks.GetDeviceId(2))), "NOTFOUND\n");
+	EXPECT_TRUE(disks.GetOpened().empty());
+
+	disks.SetCount(3);
+	EXPECT_EQ(Request(service, "REFRESH " + ToUtf8(disks.GetDeviceId(2))), "OK persistent-disk-2\n");
+	EXPECT_EQ(disks.GetOpened(), std::vector<std::wstring>{ disks.GetDeviceId(2) });
+}
+
+// Removals come from device events or a full REFRESH, never from a client.
+TEST(DiskMapServiceTest, ClientsCannotRemoveDevices) {
+	AttachedDisks disks(2);
+	DeviceResolver resolver(disks.GetBackendFactory());
+	DiskMapService service(disks, resolver);
+	std::string deviceId0 = ToUtf8(disks.GetDeviceId(0));
+
+	EXPECT_EQ(Request(service, "REFRESH"), "OK 2\n");
+	EXPECT_EQ(Request(service, "REMOVE " + deviceId0), "ERROR Unknown request\n");
+	EXPECT_EQ(Request(service, "NAME " + deviceId0), "OK persistent-disk-0\n");
+
+	disks.SetCount(1);
+	EXPECT_EQ(Request(service, "REFRESH"), "OK 1\n");
+	EXPECT_EQ(Request(service, "NAME " + ToUtf8(disks.GetDeviceId(1))), "NOTFOUND\n");
+}
+
+TEST(DiskMapServiceTest, CountsMetricsLines) {
+	AttachedDisks disks(1);
+	DeviceResolver resolver(disks.GetBackendFactory());
+	DiskMapService service(disks, resolver);
+
+	for (std::string_view request : { "METRICS", "METRICS json", "METRICS prometheus" }) {
+		std::string response = Request(service, request);
+		ASSERT_EQ(response.compare(0, 3, "OK "), 0) << request;
+		size_t header = response.find('\n');
+		size_t count = std::stoul(response.substr(3, header - 3));
+		EXPECT_EQ((size_t)std::count(response.begin() + header + 1, response.end(), '\n'), count) << request;
+	}
+	EXPECT_EQ(Request(service, "METRICS xml"), "ERROR Unknown request\n");
+}
+
+TEST(DiskMapServiceTest, RejectsUnknownRequests) {
+	AttachedDisks disks(1);
+	DeviceResolver resolver(disks.GetBackendFactory());
+	DiskMapService service(disks, resolver);
+
+	for (std::string_view request : { "", "GET persistent-disk-0", "NAME", "DEVICE", "LIST all", "name persistent-disk-0" }) {
+		EXPECT_EQ(Request(service, request), "ERROR Unknown request\n") << request;
+	}
+}
+
+}
@@ -0,0 +1,208 @@
+/* Copyright 2022 Google LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include <gtest/gtest.h>
+
+#include <algorithm>
+#include <cstring>
+#include <iterator>
+#include <memory>
+#include <random>
+#include <string>
+#include <string_view>
+#include <vector>
+#include "NvmeVendorMetadata.h"
+
+namespace {
+
+// The size of the VS section of the Identify Namespace data.
+constexpr size_t VendorSpecificSize = 3712;
+
+// Characters the metadata is made of, weighted towards the ones the parser
+// acts on.
+constexpr std::string_view JsonAlphabet = "{}[]{}[]\"\"\"\\\\,,::  \t\n01-.aztrue";
+
+bool IsWithin(std::string_view view, std::string_view input) {
+	return view.empty() || (view.data() >= input.data() && view.data() + view.size() <= input.data() + input.size());
+}
+
+// Each input is copied to a buffer of exactly its size, so a read past the
+// end is caught by a sanitizer build.
+void CheckViewsWithinInput(const std::string& text) {
+	std::unique_ptr<char[]> buffer = std::make_unique<char[]>(text.size());
+	memcpy(buffer.get(), text.data(), text.size());
+	std::string_view input(buffer.get(), text.size());
+
+	NvmeVendorMetadata metadata;
+	NvmeVendorMetadataParser::Parse(input, metadata);
+	ASSERT_LE(metadata.FieldCount, NvmeVendorMetadata::MaxFields);
+	EXPECT_TRUE(IsWithin(metadata.DeviceName, input));
+	EXPECT_TRUE(IsWithin(metadata.DiskType, input));
+	for (size_t i = 0; i < metadata.FieldCount; i++) {
+		EXPECT_TRUE(IsWithin(metadata.Fields[i].Key, input)) << text;
+		EXPECT_TRUE(IsWithin(metadata.Fields[i].Value, input)) << text;
+	}
+}
+
+TEST(NvmeVendorMetadataTest, RandomInputsAreReadInBounds) {
+	std::mt19937 random(5);
+	std::uniform_int_distribution<size_t> length(0, 96);
+	std::uniform_int_distribution<size_t> character(0, JsonAlphabet.size() - 1);
+	for (int i = 0; i < 200000; i++) {
+		std::string text(length(random), ' ');
+		for (char& c : text) {
+			c = JsonAlphabet[character(random)];
+		}
+		// Most random text fails at the first byte, so half start as an
+		// object would.
+		if (i % 2 == 0 && !text.empty()) {
+			text[0] = '{';
+		}
+		CheckViewsWithinInput(text);
+		if (HasFatalFailure()) {
+			return;
+		}
+	}
+}
+
+// A string's contents as they appear between the quotes, with quotes and
+// backslashes escaped.
+std::string RandomStringContents(std::mt19937& random) {
+	static constexpr std::string_view Pieces[] = { "a", "z", "-", "_", " ", "0", "\\\"", "\\\\", "\\n", "\\u00e9" };
+	std::uniform_int_distribution<size_t> count(0, 12);
+	std::uniform_int_distribution<size_t> piece(0, std::size(Pieces) - 1);
+	std::string contents;
+	for (size_t i = count(random); i > 0; i--) {
+		contents += Pieces[piece(random)];
+	}
+	return contents;
+}
+
+std::string RandomWhitespace(std::mt19937& random) {
+	static constexpr std::string_view Whitespace[] = { "", "", " ", "\t", "\r\n  " };
+	return std::string(Whitespace[std::uniform_int_distribution<size_t>(0, std::size(Whitespace) - 1)(random)]);
+}
+
+struct ExpectedField {
+	std::string Key;
+	std::string Value;
+};
+
+// A value of any kind, and the raw text Parse() returns for it.
+ExpectedField RandomValue(std::mt19937& random) {
+	std::string contents = RandomStringContents(random);
+	switch (std::uniform_int_distribution<int>(0, 4)(random)) {
+	case 0:
+		return { "\"" + contents + "\"", contents };
+	case 1:
+		return { "-12.5e3", "-12.5e3" };
+	case 2:
+		return { "true", "true" };
+	case 3:
+		return { "{\"a\": [1, \"" + contents + "\"], \"b\": {}}", "{\"a\": [1, \"" + contents + "\"], \"b\": {}}" };
+	default:
+		return { "[\"}\", \"" + contents + "\"]", "[\"}\", \"" + contents + "\"]" };
+	}
+}
+
+TEST(NvmeVendorMetadataTest, GeneratedObjectsRoundTrip) {
+	std::mt19937 random(5);
+	std::uniform_int_distribution<size_t> fieldCount(0, NvmeVendorMetadata::MaxFields);
+	for (int i = 0; i < 20000; i++) {
+		std::vector<ExpectedField> expected;
+		std::string text = RandomWhitespace(random) + "{";
+		for (size_t field = fieldCount(random); field > 0; field--) {
+			std::string key = RandomStringContents(random) + std::to_string(field);
+			ExpectedField value = RandomValue(random);
+			if (!expected.empty()) {
+				text += ",";
+			}
+			text += RandomWhitespace(random) + "\"" + key + "\"" + RandomWhitespace(random) + ":" +
+				RandomWhitespace(random) + value.Key + RandomWhitespace(random);
+			expected.push_back({ key, value.Value });
+		}
+		text += "}";
+		// The rest of the VS section is zeroed.
+		text.resize(std::max(text.size(), VendorSpecificSize), '\0');
+		std::string_view input(text.data(), NvmeVendorMetadataParser::BoundedLength(text.data(), text.size()));
+
+		NvmeVendorMetadata metadata;
+		ASSERT_TRUE(NvmeVendorMetadataParser::Parse(input, metadata)) << input;
+		ASSERT_EQ(metadata.FieldCount, expected.size()) << input;
+		for (size_t field = 0; field < expected.size(); field++) {
+			EXPECT_EQ(metadata.Fields[field].Key, expected[field].Key) << input;
+			EXPECT_EQ(metadata.Fields[field].Value, expected[field].Value) << input;
+			EXPECT_EQ(metadata.Find(expected[field].Key).data(), metadata.Fields[field].Value.data()) << input;
+		}
+		if (HasFailure()) {
+			return;
+		}
+	}
+}
+
+TEST(NvmeVendorMetadataTest, ReadsTheNameAndDiskType) {
+	std::string_view text = "{\"device_name\":\"persistent-disk-0\",\"disk_type\":\"PERSISTENT\",\"zone\":\"us-central1-a\"}";
+	NvmeVendorMetadata metadata;
+	ASSERT_TRUE(NvmeVendorMetadataParser::Parse(text, metadata));
+	EXPECT_EQ(metadata.DeviceName, "persistent-disk-0");
+	EXPECT_EQ(metadata.DiskType, "PERSISTENT");
+	EXPECT_EQ(metadata.Find("zone"), "us-central1-a");
+	EXPECT_EQ(metadata.Find("missing"), "");
+}
+
+// The old find-based extraction returned a substring from wherever its
+// search for the missing key left off.
+TEST(NvmeVendorMetadataTest, MissingNameIsEmpty) {
+	NvmeVendorMetadata metadata;
+	ASSERT_TRUE(NvmeVendorMetadataParser::Parse("{\"disk_type\":\"PERSISTENT\"}", metadata));
+	EXPECT_EQ(metadata.DeviceName, "");
+	ASSERT_TRUE(NvmeVendorMetadataParser::Parse("{}", metadata));
+	EXPECT_EQ(metadata.FieldCount, 0u);
+}
+
+TEST(NvmeVendorMetadataTest, RejectsMalformedObjects) {
+	for (std::string_view text : { "", "\"device_name\"", "{", "{\"device_name\"", "{\"device_name\":",
+		"{\"device_name\":\"disk", "{\"device_name\":\"disk\"", "{\"device_name\":\"disk\",}", "{\"a\":}",
+		"{\"a\":[1}", "{\"a\" \"b\"}", "{a:1}", "{\"a\":\"\\" }) {
+		NvmeVendorMetadata metadata;
+		EXPECT_FALSE(NvmeVendorMetadataParser::Parse(text, metadata)) << text;
+	}
+}
+
+TEST(NvmeVendorMetadataTest, RejectsMoreThanMaxFields) {
+	std::string text = "{";
+	for (size_t i = 0; i <= NvmeVendorMetadata::MaxFields; i++) {
+		text += (i == 0 ? "\"" : ",\"") + std::to_string(i) + "\":" + std::to_string(i);
+	}
+	text += "}";
+	NvmeVendorMetadata metadata;
+	EXPECT_FALSE(NvmeVendorMetadataParser::Parse(text, metadata));
+	EXPECT_EQ(metadata.FieldCount, NvmeVendorMetadata::MaxFields);
+}
+
+// Lengths either side of the 16 bytes scanned at a time.
+TEST(NvmeVendorMetadataTest, BoundedLengthStopsAtTheEnd) {
+	for (size_t size = 0; size < 48; size++) {
+		std::unique_ptr<char[]> buffer = std::make_unique<char[]>(size);
+		memset(buffer.get(), 'a', size);
+		EXPECT_EQ(NvmeVendorMetadataParser::BoundedLength(buffer.get(), size), size);
+		for (size_t nul = 0; nul < size; nul++) {
+			buffer[nul] = '\0';
+			EXPECT_EQ(NvmeVendorMetadataParser::BoundedLength(buffer.get(), size), nul);
+			buffer[nul] = 'a';
+		}
+	}
+}
+
+}
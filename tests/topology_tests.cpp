@@ -0,0 +1,54 @@
+/* Copyright 2022 Google LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include <gtest/gtest.h>
+
+#include <string>
+#include <vector>
+#include "RunGcetools.h"
+
+namespace {
+
+// The Windows backend reports the adapter's limits, and has no queues to
+// report.
+TEST(TopologyTest, ReportsAdapterLimits) {
+	std::vector<std::string> expected = {
+		R"({"device":"\\\\.\\PHYSICALDRIVE0","name":"persistent-disk-0","bus":"nvme","controller":"1AE0:nvme_card-pd:sim-0","adapter":null,"max_transfer_bytes":131072,"max_physical_pages":33,"alignment_mask":3,"numa_node":null,"queue_count":null,"queue_cpus":null})",
+		R"({"device":"\\\\.\\PHYSICALDRIVE1","name":"persistent-disk-1","bus":"scsi","controller":null,"adapter":null,"max_transfer_bytes":131072,"max_physical_pages":33,"alignment_mask":3,"numa_node":null,"queue_count":null,"queue_cpus":null})",
+		R"({"device":"\\\\.\\PHYSICALDRIVE2","name":"persistent-disk-2","bus":"nvme","controller":"1AE0:nvme_card-pd:sim-2","adapter":null,"max_transfer_bytes":131072,"max_physical_pages":33,"alignment_mask":3,"numa_node":null,"queue_count":null,"queue_cpus":null})",
+		R"({"device":"\\\\.\\PHYSICALDRIVE3","name":"persistent-disk-3","bus":"scsi","controller":null,"adapter":null,"max_transfer_bytes":131072,"max_physical_pages":33,"alignment_mask":3,"numa_node":null,"queue_count":null,"queue_cpus":null})",
+	};
+	GcetoolsRun run = RunGcetools("--simulate 4 --topology");
+	EXPECT_EQ(run.ExitCode, 0);
+	EXPECT_EQ(run.Lines, expected);
+}
+
+#ifdef __linux__
+// Read from the simulated sysfs tree: the NVMe disks' four queues over 16
+// CPUs, the SCSI disks' one, and the NUMA node of the second NVMe
+// controller.
+TEST(TopologyTest, ReadsLinuxQueuesFromSysfs) {
+	std::vector<std::string> expected = {
+		R"({"device":"/dev/sda","name":"persistent-disk-1","bus":"scsi","controller":null,"adapter":"host0","max_transfer_bytes":524288,"max_physical_pages":33,"alignment_mask":3,"numa_node":0,"queue_count":1,"queue_cpus":["0-15"]})",
+		R"({"device":"/dev/sdb","name":"persistent-disk-3","bus":"scsi","controller":null,"adapter":"host0","max_transfer_bytes":524288,"max_physical_pages":33,"alignment_mask":3,"numa_node":0,"queue_count":1,"queue_cpus":["0-15"]})",
+		R"({"device":"/dev/nvme0n1","name":"persistent-disk-0","bus":"nvme","controller":"1AE0:nvme_card-pd:sim-0","adapter":"nvme0","max_transfer_bytes":2097152,"max_physical_pages":33,"alignment_mask":3,"numa_node":0,"queue_count":4,"queue_cpus":["0-3","4-7","8-11","12-15"]})",
+		R"({"device":"/dev/nvme1n1","name":"persistent-disk-2","bus":"nvme","controller":"1AE0:nvme_card-pd:sim-2","adapter":"nvme1","max_transfer_bytes":2097152,"max_physical_pages":33,"alignment_mask":3,"numa_node":1,"queue_count":4,"queue_cpus":["0-3","4-7","8-11","12-15"]})",
+	};
+	GcetoolsRun run = RunGcetools("--simulate 4 --topology --simulate-linux");
+	EXPECT_EQ(run.ExitCode, 0);
+	EXPECT_EQ(run.Lines, expected);
+}
+#endif
+
+}
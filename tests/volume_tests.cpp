@@ -0,0 +1,53 @@
+/* Copyright 2022 Google LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include <gtest/gtest.h>
+
+#include <string>
+#include <vector>
+#include "RunGcetools.h"
+
+namespace {
+
+// Simulated Windows disks have no partition table or volumes to read.
+TEST(VolumeTest, UnreadableLayoutsAreNull) {
+	std::vector<std::string> expected = {
+		R"({"device":"\\\\.\\PHYSICALDRIVE0","name":"persistent-disk-0","size_bytes":null,"partitions":null,"volumes":null})",
+		R"({"device":"\\\\.\\PHYSICALDRIVE1","name":"persistent-disk-1","size_bytes":null,"partitions":null,"volumes":null})",
+		R"({"device":"\\\\.\\PHYSICALDRIVE2","name":"persistent-disk-2","size_bytes":null,"partitions":null,"volumes":null})",
+		R"({"device":"\\\\.\\PHYSICALDRIVE3","name":"persistent-disk-3","size_bytes":null,"partitions":null,"volumes":null})",
+	};
+	GcetoolsRun run = RunGcetools("--simulate 4 --volumes");
+	EXPECT_EQ(run.ExitCode, 0);
+	EXPECT_EQ(run.Lines, expected);
+}
+
+#ifdef __linux__
+// Read from the simulated sysfs tree and mountinfo: a mounted and an
+// unformatted partition, a file system on the whole disk, a root partition,
+// and a logical volume whose mount point has an escaped space.
+TEST(VolumeTest, ReadsLinuxVolumesFromSysfsAndMountInfo) {
+	std::vector<std::string> expected = {
+		R"({"device":"/dev/sda","name":"persistent-disk-1","size_bytes":107374182400,"partitions":[{"number":1,"offset_bytes":1048576,"size_bytes":536870912,"volumes":[{"volume":"/dev/sda1","size_bytes":536870912,"file_system":"xfs","mount_points":["/mnt/disks/persistent-disk-1"]}]},{"number":2,"offset_bytes":537919488,"size_bytes":106835214336,"volumes":[{"volume":"/dev/sda2","size_bytes":106835214336,"file_system":null,"mount_points":[]}]}],"volumes":[]})",
+		R"({"device":"/dev/sdb","name":"persistent-disk-3","size_bytes":107374182400,"partitions":[],"volumes":[{"volume":"/dev/sdb","size_bytes":107374182400,"file_system":"ext4","mount_points":["/mnt/disks/persistent-disk-3"]}]})",
+		R"({"device":"/dev/nvme0n1","name":"persistent-disk-0","size_bytes":107374182400,"partitions":[{"number":1,"offset_bytes":1048576,"size_bytes":107372085248,"volumes":[{"volume":"/dev/nvme0n1p1","size_bytes":107372085248,"file_system":"ext4","mount_points":["/"]}]}],"volumes":[]})",
+		R"({"device":"/dev/nvme1n1","name":"persistent-disk-2","size_bytes":107374182400,"partitions":[{"number":1,"offset_bytes":1048576,"size_bytes":107372085248,"volumes":[{"volume":"/dev/mapper/vg2-data","size_bytes":107371036672,"file_system":"ext4","mount_points":["/mnt/disks/persistent-disk-2 data"]}]}],"volumes":[]})",
+	};
+	GcetoolsRun run = RunGcetools("--simulate 4 --volumes --simulate-linux");
+	EXPECT_EQ(run.ExitCode, 0);
+	EXPECT_EQ(run.Lines, expected);
+}
+#endif
+
+}